@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+//-----------------------------------------------------------
+// The source of all audio endpoint devices that the device
+// manager works with. The devices themselves are regular
+// IMMDevice objects (and everything that they activate, such
+// as IAudioEndpointVolume, goes through those objects), which
+// means that a backend only has to provide the enumerator's
+// side of things. The real backend talks to the Windows
+// audio service, while the simulated one fakes any number of
+// devices for deterministic load testing.
+//-----------------------------------------------------------
+class AudioBackend
+{
+public:
+    virtual ~AudioBackend() = default;
+
+    // Starts or stops delivering device notifications (added, removed, state changes, etc) to the client.
+    // NOTE: Unregistering waits for any notification that's currently executing the client.
+    virtual HRESULT registerNotificationClient(IMMNotificationClient* pClient) noexcept = 0;
+    virtual HRESULT unregisterNotificationClient(IMMNotificationClient* pClient) noexcept = 0;
+
+    // Retrieves all playback devices that are in any of the given states, in their enumeration order.
+    virtual HRESULT enumerateDevices(DWORD dwStateMask, std::vector<wil::com_ptr_nothrow<IMMDevice>>& devices) = 0;
+
+    // Retrieves a single device by its ID (regardless of its state or data flow direction).
+    virtual HRESULT getDevice(LPCWSTR pwstrId, wil::com_ptr_nothrow<IMMDevice>& pDevice) noexcept = 0;
+};
@@ -31,29 +31,34 @@ AudioDevice::AudioDevice(
     hr = pEndpoint->GetId(&pwszID);
     THROW_IF_COM_FAILED(hr, "Unable to retrieve audio endpoint ID.");
 
-    // Open device property storage.
-    wil::com_ptr_nothrow<IPropertyStore> pProps;
-    hr = pEndpoint->OpenPropertyStore(STGM_READ, &pProps);
-    THROW_IF_COM_FAILED(hr, "Unable to open device property storage.");
-
-    // Get the endpoint's friendy-name property.
-    // NOTE: Multiple endpoints can have identical names (but IDs will always differ).
-    wil::unique_prop_variant varName;
-    hr = pProps->GetValue(PKEY_Device_FriendlyName, &varName);
-    THROW_IF_COM_FAILED(hr, "Unable to get name of audio endpoint.");
+    // Get the endpoint's current state (active, unplugged, etc).
+    // NOTE: The name is only read when it's first needed, since opening the property store is by far the slowest
+    // part of listing a device, and the devices are linked by their IDs (which lets startup link them right away).
+    DWORD dwState;
+    hr = pEndpoint->GetState(&dwState);
+    THROW_IF_COM_FAILED(hr, "Unable to get state of audio endpoint.");
 
     m_iItemOffset = itemOffset;
     m_pEndpoint = std::move(pEndpoint);
     m_wsId = pwszID.get();
-    m_wsName = varName.pwszVal;
+    m_bNameLoaded = false;
+    m_dwState = dwState;
 }
 
 AudioDevice::~AudioDevice()
 {
 }
 
-wil::com_ptr_nothrow<IAudioEndpointVolume> AudioDevice::activateAudioEndpointVolume()
+wil::com_ptr_nothrow<IAudioEndpointVolume> AudioDevice::getAudioEndpointVolume() const
 {
+    // Re-use the interface if we've already activated it.
+    // NOTE: Activation is a round-trip into the audio service, so caching it makes re-linking
+    // (such as when switching between slave devices) nearly instant. The cache is only dropped
+    // when the device changes state, since that's when the old interface stops working.
+    if (m_pEndptVol) {
+        return m_pEndptVol;
+    }
+
     HRESULT hr;
 
     // Create a COM object for the device, with the "endpoint volume" interface.
@@ -62,30 +67,109 @@ wil::com_ptr_nothrow<IAudioEndpointVolume> AudioDevice::activateAudioEndpointVol
         CLSCTX_ALL, NULL, (void**)& pEndptVol);
     THROW_IF_COM_FAILED(hr, "Unable to open device endpoint volume control.");
 
+    m_pEndptVol = pEndptVol;
+
     return pEndptVol;
 }
 
-const size_t AudioDevice::getItemOffset()
+void AudioDevice::takeAudioEndpointVolume(
+    AudioDevice& other) noexcept
+{
+    // Take over another (older) object's cached interface for the same, unchanged device.
+    if (other.m_wsId == m_wsId) {
+        m_pEndptVol = std::move(other.m_pEndptVol);
+    }
+}
+
+void AudioDevice::invalidateAudioEndpointVolume() noexcept
+{
+    m_pEndptVol = nullptr;
+}
+
+AudioSessionList& AudioDevice::getAudioSessions(
+    std::function<void()> changedCallback) const
+{
+    // Enumerate the device's sessions the first time that they're needed, and keep them afterwards.
+    // NOTE: The list updates itself via notifications, so it's never enumerated again. The callback is
+    // only used by the first call (which creates the list), and is executed whenever the sessions change.
+    if (!m_pSessions) {
+        m_pSessions = std::make_unique<AudioSessionList>(m_pEndpoint.get(), std::move(changedCallback));
+    }
+
+    return *m_pSessions;
+}
+
+AudioSessionList* AudioDevice::getCachedAudioSessions() const noexcept
+{
+    return m_pSessions.get();
+}
+
+void AudioDevice::takeAudioSessions(
+    AudioDevice& other) noexcept
+{
+    // Take over another (older) object's session list for the same, unchanged device.
+    if (other.m_wsId == m_wsId) {
+        m_pSessions = std::move(other.m_pSessions);
+    }
+}
+
+size_t AudioDevice::getItemOffset() const noexcept
 {
     return m_iItemOffset;
 }
 
-const wstring& AudioDevice::getId()
+const wstring& AudioDevice::getId() const noexcept
 {
     return m_wsId;
 }
 
-const LPWSTR AudioDevice::getIdMS()
+LPCWSTR AudioDevice::getIdMS() const noexcept
+{
+    return m_wsId.c_str();
+}
+
+void AudioDevice::_loadName() const noexcept
 {
-    return (LPWSTR)m_wsId.c_str();
+    HRESULT hr;
+
+    // Get the endpoint's friendy-name property (from the device property storage).
+    // NOTE: Multiple endpoints can have identical names (but IDs will always differ).
+    // NOTE: If the name can't be read, we display the ID instead, since it's still unique.
+    m_bNameLoaded = true;
+    wil::com_ptr_nothrow<IPropertyStore> pProps;
+    hr = m_pEndpoint->OpenPropertyStore(STGM_READ, &pProps);
+    if (SUCCEEDED(hr)) {
+        wil::unique_prop_variant varName;
+        hr = pProps->GetValue(PKEY_Device_FriendlyName, &varName);
+        if (SUCCEEDED(hr) && varName.vt == VT_LPWSTR && varName.pwszVal != nullptr) {
+            try {
+                m_wsName = varName.pwszVal;
+                return;
+            }
+            catch (...) {}
+        }
+    }
+    try {
+        m_wsName = m_wsId;
+    }
+    catch (...) {}
 }
 
-const wstring& AudioDevice::getName()
+const wstring& AudioDevice::getName() const noexcept
 {
+    if (!m_bNameLoaded) {
+        this->_loadName();
+    }
+
     return m_wsName;
 }
 
-const LPWSTR AudioDevice::getNameMS()
+LPCWSTR AudioDevice::getNameMS() const noexcept
+{
+    return this->getName().c_str();
+}
+
+DWORD AudioDevice::getState() const noexcept
 {
-    return (LPWSTR)m_wsName.c_str();
+    return m_dwState;
 }
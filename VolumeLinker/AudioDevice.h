@@ -20,23 +20,43 @@
 #pragma once
 
 #include "framework.h"
+#include "AudioSessionList.h"
 
 using std::wstring;
 
+// A single audio endpoint device. The class is move-only, since copying it would duplicate
+// its strings and COM reference for no reason. Always pass it around by reference instead.
 class AudioDevice
 {
 private:
     size_t m_iItemOffset;
     wil::com_ptr_nothrow<IMMDevice> m_pEndpoint;
     wstring m_wsId;
-    wstring m_wsName;
+    mutable wstring m_wsName; // Lazily read on first use.
+    mutable bool m_bNameLoaded;
+    DWORD m_dwState;
+    mutable wil::com_ptr_nothrow<IAudioEndpointVolume> m_pEndptVol; // Lazily activated on first use.
+    mutable std::unique_ptr<AudioSessionList> m_pSessions; // Lazily enumerated on first use.
+
+    void _loadName() const noexcept;
+
 public:
     AudioDevice(size_t itemOffset, wil::com_ptr_nothrow<IMMDevice> pEndpoint);
     ~AudioDevice();
-    wil::com_ptr_nothrow<IAudioEndpointVolume> activateAudioEndpointVolume();
-    const size_t getItemOffset();
-    const wstring& getId();
-    const LPWSTR getIdMS();
-    const wstring& getName();
-    const LPWSTR getNameMS();
+    AudioDevice(const AudioDevice&) = delete;
+    AudioDevice& operator=(const AudioDevice&) = delete;
+    AudioDevice(AudioDevice&&) noexcept = default;
+    AudioDevice& operator=(AudioDevice&&) noexcept = default;
+    wil::com_ptr_nothrow<IAudioEndpointVolume> getAudioEndpointVolume() const;
+    void takeAudioEndpointVolume(AudioDevice& other) noexcept;
+    void invalidateAudioEndpointVolume() noexcept;
+    AudioSessionList& getAudioSessions(std::function<void()> changedCallback) const;
+    AudioSessionList* getCachedAudioSessions() const noexcept;
+    void takeAudioSessions(AudioDevice& other) noexcept;
+    size_t getItemOffset() const noexcept;
+    const wstring& getId() const noexcept;
+    LPCWSTR getIdMS() const noexcept;
+    const wstring& getName() const noexcept;
+    LPCWSTR getNameMS() const noexcept;
+    DWORD getState() const noexcept;
 };
@@ -18,324 +18,1920 @@
  */
 
 #include "AudioDeviceManager.h"
+#include "WasapiAudioBackend.h"
 #include "helpers.h"
 
 using std::move;
 
+// The device states that we list in the GUI (all playback devices except ones that are disabled/not present).
+static const DWORD LISTED_DEVICE_STATES = DEVICE_STATE_ACTIVE | DEVICE_STATE_UNPLUGGED;
+
+// Sort order of the device list: By name in ascending order (case INSENSITIVE).
+static bool deviceNameLess(
+    const AudioDevice& a,
+    const AudioDevice& b)
+{
+    // NOTE: This requires that "_wsetlocale" has been executed to set the program's
+    // locale, otherwise it uses the "C" (ANSI) basic locale by default and can't
+    // achieve a case-insensitive comparison of international letters.
+    return _wcsicmp(a.getName().c_str(), b.getName().c_str()) < 0; // Case Insensitive (Microsoft implementation).
+}
+
 AudioDeviceManager::AudioDeviceManager(
-    GUID processGUID)
+    GUID processGUID,
+    std::function<void()> deviceChangeCallback,
+    std::shared_ptr<AudioBackend> pBackend) :
+    m_pBackend(std::move(pBackend)),
+    m_deviceChangeCallback(std::move(deviceChangeCallback))
+{
+    HRESULT hr;
+
+    // Save the GUID that we will identify our COM calls with.
+    if (processGUID == GUID_NULL) {
+        throw std::runtime_error("Invalid process GUID given to AudioDeviceManager.");
+    }
+    m_processGUID = processGUID;
+
+    // Generate a second GUID, which marks the master changes that we make on behalf of a slave (bidirectional mode).
+    // NOTE: Its first field is replaced by a sequence number whenever it's used, so only the rest of it identifies us.
+    hr = CoCreateGuid(&m_reflectGUID);
+    THROW_IF_COM_FAILED(hr, "Unable to generate bidirectional event context GUID.");
+    m_reflectSequence = 0;
+
+    // At the moment we don't have any dialog handle that we're attached to.
+    m_hDialog = NULL;
+    m_hMuteCheckbox = NULL;
+    m_hVolumeSlider = NULL;
+    m_uRefreshMessage = 0;
+    m_dialogState = 0;
+    m_bDialogRefreshPending = false;
+    m_pEventStream = nullptr;
+
+    m_bDeviceNotificationsRegistered = false;
+    m_bDeviceListSorted = false;
+
+    // Volume differences smaller than this are considered "unchanged" when syncing to the slaves.
+    m_fVolumeEpsilon = DEFAULT_VOLUME_EPSILON;
+
+    // Slave volume changes are applied instantly, unless ramping is enabled.
+    m_dwRampTime = 0;
+
+    // The link only syncs from the master to the slaves, unless bidirectional mode is enabled.
+    m_bBidirectional = false;
+
+    // Only the master's volume scalar is synced, unless channel-sync mode is enabled.
+    m_bChannelSync = false;
+
+    // There is no link at the beginning, but there's always at least one (unlinked) link group.
+    m_pDialogGroup = nullptr;
+    this->addLinkGroup();
+    m_pDialogGroup = m_groups.front().get();
+
+    // Register a callback lambda which queues all device changes for our class instance.
+    m_deviceNotificationClient.registerCallback(
+        [this](LPCWSTR pwstrDeviceId, bool bStateChanged) -> void {
+            this->_onDeviceCallback(pwstrDeviceId, bStateChanged);
+        });
+
+    // Use the real audio devices, unless we've been given another backend (such as a simulated one).
+    if (!m_pBackend) {
+        m_pBackend = std::make_shared<WasapiAudioBackend>();
+    }
+
+    // Listen for devices being added, removed, plugged in or unplugged, so that we can keep the list up to date.
+    // NOTE: We register BEFORE enumerating, so that we can't miss any change that happens in between. Any
+    // notifications about devices that we've already enumerated in their latest state are simply harmless.
+    hr = m_pBackend->registerNotificationClient(
+        (IMMNotificationClient*)& m_deviceNotificationClient);
+    THROW_IF_COM_FAILED(hr, "Unable to register audio device notification callback.");
+    m_bDeviceNotificationsRegistered = true;
+
+    try {
+        // Get all audio-rendering devices (except ones that are disabled/not present).
+        // NOTE: It's okay if there aren't any devices yet, since they're added as soon as they appear.
+        vector<wil::com_ptr_nothrow<IMMDevice>> endpoints;
+        hr = m_pBackend->enumerateDevices(LISTED_DEVICE_STATES, endpoints);
+        THROW_IF_COM_FAILED(hr, "Unable to enumerate audio devices.");
+        size_t collectionCount = endpoints.size();
+        m_audioDevices.reserve(collectionCount);
+
+        for (size_t i = 0; i < collectionCount; ++i) {
+            // Save device to vector (constructed in place, since devices are move-only).
+            m_audioDevices.emplace_back(i, move(endpoints[i]));
+        }
+        m_nextItemOffset = collectionCount;
+
+        // NOTE: The devices stay in their enumeration order (without reading their names) until sortDeviceList()
+        // is called, which is only done when the list is displayed for the first time.
+        this->_rebuildDeviceIdxs();
+
+        // Validate collection sizes.
+        if (collectionCount != m_audioDevices.size()) {
+            throw std::runtime_error("Unable to retrieve all audio device information.");
+        }
+    }
+    catch (...) {
+        // NOTE: The destructor won't run if we throw, so we must unregister our notifications manually.
+        m_pBackend->unregisterNotificationClient(
+            (IMMNotificationClient*)& m_deviceNotificationClient);
+        m_bDeviceNotificationsRegistered = false;
+        throw;
+    }
+}
+
+AudioDeviceManager::~AudioDeviceManager()
+{
+    // Ensure that any callback-link between devices is unloaded first, before regular destruction.
+    this->unlinkAllDevices();
+
+    // Stop listening for device changes, since the audio service must never call us after we're gone.
+    if (m_bDeviceNotificationsRegistered) {
+        m_pBackend->unregisterNotificationClient(
+            (IMMNotificationClient*)& m_deviceNotificationClient);
+        m_bDeviceNotificationsRegistered = false;
+    }
+
+    // Remove ourselves as callback from the inner AudioEndpointVolumeCallback and AudioDeviceNotificationClient classes.
+    // NOTE: Probably completely pointless since those objects and their references to us
+    // would get destroyed in reverse creation-order and properly release anyway.
+    for (auto& group : m_groups) {
+        group->callback.unregisterCallback();
+    }
+    m_deviceNotificationClient.unregisterCallback();
+
+    // Release all devices (and their session lists) while the rest of our class still exists, since the
+    // session lists keep notifying us until they've unregistered themselves.
+    m_deviceIdxs.clear();
+    m_audioDevices.clear();
+}
+
+const vector<AudioDevice>& AudioDeviceManager::getAudioDevices() const noexcept
+{
+    return m_audioDevices;
+}
+
+bool AudioDeviceManager::sortDeviceList()
+{
+    // Sort the devices by name (which reads all of their names), unless they've already been sorted.
+    // NOTE: The sort is stable, so that devices with identical names keep their order (exactly like when
+    // they're inserted later). The linked devices keep syncing, since links only refer to device IDs.
+    if (m_bDeviceListSorted) {
+        return false;
+    }
+    std::stable_sort(m_audioDevices.begin(), m_audioDevices.end(), deviceNameLess);
+    m_bDeviceListSorted = true;
+    this->_rebuildDeviceIdxs();
+    for (auto& pGroup : m_groups) {
+        this->_updateLinkIdxs(*pGroup);
+    }
+
+    return true;
+}
+
+const AudioDevice& AudioDeviceManager::getDevice(
+    ptrdiff_t idx) const
+{
+    if (idx < 0) {
+        throw std::runtime_error("Negative device number requested.");
+    }
+
+    try {
+        return m_audioDevices.at(static_cast<size_t>(idx));
+    }
+    catch (const std::out_of_range&) {
+        throw std::runtime_error("Invalid device number requested.");
+    }
+}
+
+size_t AudioDeviceManager::getLinkGroupCount() const noexcept
+{
+    return m_groups.size();
+}
+
+size_t AudioDeviceManager::addLinkGroup()
+{
+    // Create an unlinked group, with its own callback object for its master device.
+    auto group = std::make_unique<LinkGroup>();
+    group->groupIdx = m_groups.size();
+    group->bLinkActive = false;
+    group->iMasterDeviceIdx = -1;
+    group->pMasterEndptVol = nullptr;
+    group->bMasterMuted = false;
+    group->bCallbackRegistered = false;
+    group->pendingReflectSequence = 0;
+    group->bSessionCallbackRegistered = false;
+
+    // Bind the group's master callback to our volume handler for this group.
+    // NOTE: The groups are never moved in memory (only their pointers are), so the callback can keep its pointer.
+    LinkGroup* pGroup = group.get();
+    group->callback.registerCallback(this, pGroup);
+
+    // The same for the group's master session (if the master is a program's session instead of the whole device).
+    // NOTE: The end of the session is reported by the device's session list, which reconnects the link.
+    group->sessionCallback.registerCallback(
+        [this, pGroup](float fVolume, BOOL bMuted, LPCGUID pEventContext, LONGLONG notifyTime) -> void {
+            this->_onSessionVolumeCallback(*pGroup, fVolume, bMuted, pEventContext, notifyTime);
+        },
+        nullptr);
+
+    m_groups.push_back(move(group));
+
+    return m_groups.size() - 1;
+}
+
+void AudioDeviceManager::removeLinkGroup(
+    size_t groupIdx) noexcept
+{
+    // NOTE: The last remaining group can't be removed, but it's still unlinked.
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr) {
+        return;
+    }
+    this->unlinkDevices(groupIdx);
+    if (m_groups.size() <= 1) {
+        return;
+    }
+
+    // Make the dialog display another group if it's displaying the one that we're removing.
+    if (m_pDialogGroup == pGroup) {
+        m_pDialogGroup = m_groups[(groupIdx == 0) ? 1 : 0].get();
+    }
+    m_groups.erase(m_groups.begin() + groupIdx);
+    for (size_t i = groupIdx; i < m_groups.size(); ++i) {
+        m_groups[i]->groupIdx = i;
+    }
+}
+
+void AudioDeviceManager::setDialogLinkGroup(
+    size_t groupIdx) noexcept
+{
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr) {
+        return;
+    }
+    m_pDialogGroup = pGroup;
+
+    // Display the group's current master volume right away (if it's linked).
+    BOOL bMuted;
+    float fMasterVolume;
+    if (this->_getMasterState(*pGroup, fMasterVolume, bMuted)) {
+        this->_updateDialog(*pGroup, fMasterVolume, bMuted);
+    }
+}
+
+LinkGroup* AudioDeviceManager::_getGroup(
+    size_t groupIdx) const noexcept
+{
+    return (groupIdx < m_groups.size()) ? m_groups[groupIdx].get() : nullptr;
+}
+
+LinkGroup* AudioDeviceManager::_findSlaveGroup(
+    std::wstring_view deviceId) const noexcept
+{
+    // Find the active group which has the given device as one of its slaves.
+    for (auto& group : m_groups) {
+        if (group->bLinkActive &&
+            std::find(group->slaveDeviceIds.begin(), group->slaveDeviceIds.end(), deviceId) != group->slaveDeviceIds.end()) {
+            return group.get();
+        }
+    }
+
+    return nullptr;
+}
+
+bool AudioDeviceManager::isLinkActive(
+    size_t groupIdx) noexcept
+{
+    // NOTE: The link stays active while its devices are temporarily missing (such as an unplugged
+    // USB headset), and is automatically reconnected as soon as they're available again.
+    auto pGroup = this->_getGroup(groupIdx);
+    return pGroup != nullptr && pGroup->bLinkActive;
+}
+
+ptrdiff_t AudioDeviceManager::findDeviceIdx(
+    std::wstring_view deviceId) const noexcept
+{
+    // NOTE: The index map supports "heterogeneous" lookups, so this never has to allocate any string.
+    auto it = m_deviceIdxs.find(deviceId);
+    if (it == m_deviceIdxs.end()) {
+        return -1;
+    }
+
+    return static_cast<ptrdiff_t>(it->second);
+}
+
+void AudioDeviceManager::_rebuildDeviceIdxs()
+{
+    m_deviceIdxs.clear();
+    m_deviceIdxs.reserve(m_audioDevices.size());
+    for (size_t i = 0; i < m_audioDevices.size(); ++i) {
+        m_deviceIdxs.emplace(m_audioDevices[i].getId(), i);
+    }
+}
+
+void AudioDeviceManager::_eraseDevice(
+    size_t idx)
+{
+    // Remove the device from the list and the index map, and then move all later devices up by one position.
+    auto it = m_deviceIdxs.find(std::wstring_view(m_audioDevices[idx].getId()));
+    if (it != m_deviceIdxs.end()) {
+        m_deviceIdxs.erase(it);
+    }
+    m_audioDevices.erase(m_audioDevices.begin() + idx);
+    for (auto& entry : m_deviceIdxs) {
+        if (entry.second > idx) {
+            --entry.second;
+        }
+    }
+}
+
+void AudioDeviceManager::linkDevices(
+    size_t groupIdx,
+    ptrdiff_t masterIdx,
+    const vector<ptrdiff_t>& slaveIdxs)
+{
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr) {
+        throw std::runtime_error("Invalid link group requested.");
+    }
+    auto& group = *pGroup;
+
+    // Ensure that any existing link is broken first.
+    this->unlinkDevices(groupIdx);
+
+    // We need at least one slave device to link to.
+    if (slaveIdxs.empty()) {
+        throw std::runtime_error("No slave devices selected.");
+    }
+
+    // Build the list of unique slave devices (in the given order), while validating the indices.
+    // NOTE: Retrieving the devices throws if the indices are invalid, negative, etc.
+    vector<wstring> slaveDeviceIds;
+    for (auto slaveIdx : slaveIdxs) {
+        // Don't allow circular links between the same device.
+        if (slaveIdx == masterIdx) {
+            throw std::runtime_error("Cannot link device to itself.");
+        }
+
+        auto& slaveDevice = this->getDevice(slaveIdx);
+        if (std::find(slaveDeviceIds.begin(), slaveDeviceIds.end(), slaveDevice.getId()) == slaveDeviceIds.end()) {
+            slaveDeviceIds.push_back(slaveDevice.getId());
+        }
+    }
+    auto& masterDevice = this->getDevice(masterIdx);
+
+    // Every device can only be part of one link group, since a device that's synced by two groups
+    // would make them fight each other (or even sync in a circle).
+    for (auto& otherGroup : m_groups) {
+        if (otherGroup.get() == pGroup || !otherGroup->bLinkActive) {
+            continue;
+        }
+        auto isInGroup = [&otherGroup](const wstring& deviceId) -> bool {
+            return otherGroup->masterDeviceId == deviceId ||
+                std::find(otherGroup->slaveDeviceIds.begin(), otherGroup->slaveDeviceIds.end(), deviceId) != otherGroup->slaveDeviceIds.end();
+        };
+        if (isInGroup(masterDevice.getId()) ||
+            std::any_of(slaveDeviceIds.begin(), slaveDeviceIds.end(), isInGroup)) {
+            throw std::runtime_error("A selected device is already part of another link.");
+        }
+    }
+
+    // The same goes for the links of our other instances (such as on other users' accounts), so we claim every
+    // device for the whole machine (throws if another instance has already claimed any of them).
+    // NOTE: The claims are released when the group is unlinked (or when the program exits, even if it crashes).
+    vector<DeviceClaim> deviceClaims;
+    deviceClaims.reserve(slaveDeviceIds.size() + 1);
+    deviceClaims.emplace_back(masterDevice.getId());
+    for (auto& slaveDeviceId : slaveDeviceIds) {
+        deviceClaims.emplace_back(slaveDeviceId);
+    }
+    group.deviceClaims = std::move(deviceClaims);
+
+    // Remember which devices are linked. We identify them by their IDs, since their positions
+    // in the device list change whenever other devices are added or removed.
+    {
+        auto lock = m_linkLock.lock_exclusive();
+        group.bLinkActive = true;
+        group.masterDeviceId = masterDevice.getId();
+        group.slaveDeviceIds = move(slaveDeviceIds);
+    }
+
+    // Connect to all of the devices (throws if there are any problems establishing the link).
+    try {
+        this->_connectLink(group);
+    }
+    catch (...) {
+        this->unlinkDevices(groupIdx);
+        throw;
+    }
+
+    this->_updateLinkIdxs(group);
+}
+
+void AudioDeviceManager::linkDevices(
+    size_t groupIdx,
+    const wstring& masterDeviceId,
+    const vector<wstring>& slaveDeviceIds)
+{
+    // Look up the devices in our own list. Callers on other threads identify the devices by their IDs, since
+    // their own copy of the list may be behind ours, which means that their positions may no longer match.
+    // NOTE: Devices that have gone missing in the meantime are skipped, exactly like unselected devices.
+    auto masterIdx = this->findDeviceIdx(masterDeviceId);
+    if (masterIdx < 0) {
+        this->unlinkDevices(groupIdx);
+        throw std::runtime_error("The selected master device is no longer available.");
+    }
+    vector<ptrdiff_t> slaveIdxs;
+    for (auto& slaveDeviceId : slaveDeviceIds) {
+        auto slaveIdx = this->findDeviceIdx(slaveDeviceId);
+        if (slaveIdx >= 0) {
+            slaveIdxs.push_back(slaveIdx);
+        }
+    }
+
+    this->linkDevices(groupIdx, masterIdx, slaveIdxs);
+}
+
+void AudioDeviceManager::_connectLink(
+    LinkGroup& group)
+{
+    HRESULT hr;
+
+    // Connect to the "endpoint volume control" interface of the master device.
+    // NOTE: Without a master, the link can't do anything, and stays disconnected until the master returns.
+    auto masterIdx = this->findDeviceIdx(group.masterDeviceId);
+    if (masterIdx < 0) {
+        throw std::runtime_error("Master device is not available. Link could not be established.");
+    }
+    auto& masterDevice = m_audioDevices[static_cast<size_t>(masterIdx)];
+    if (group.masterSessionName.empty()) {
+        group.pMasterEndptVol = masterDevice.getAudioEndpointVolume();
+    }
+    else {
+        // NOTE: A program's session only exists while the program is running, so a missing session is okay. The link
+        // stays active (but disconnected), and the device's session list reconnects it as soon as the session appears.
+        this->_connectMasterSession(group, masterDevice);
+        if (!group.pMasterSessionVol) {
+            return;
+        }
+    }
+
+    // Get the master's current volume and mute-state.
+    // NOTE: If the (possibly cached) interface doesn't work, we'll make sure that it's activated again next time.
+    BOOL bMuted;
+    float fMasterVolume;
+    if (!this->_getMasterState(group, fMasterVolume, bMuted)) {
+        masterDevice.invalidateAudioEndpointVolume();
+        throw std::runtime_error("Failed to retrieve master device's volume state. Link could not be established.");
+    }
+    group.bMasterMuted = (bMuted != FALSE);
+
+    // Connect all slave devices that are currently available, and hand each of them the master's state.
+    // NOTE: Every slave's worker applies the state on its own thread, so all slaves are synced in parallel,
+    // instead of one after another behind the slowest one. Any missing slaves are connected individually
+    // whenever they appear.
+    // NOTE: A single slave is never fatal for the link. A slave whose writes fail is still connected, and its
+    // worker keeps recovering it (with backoff) while the link shows it as degraded. Only a slave that can't
+    // even be activated is left out, and it's connected again as soon as the device changes state.
+    vector<std::unique_ptr<SlaveLink>> slaves;
+    for (auto& slaveDeviceId : group.slaveDeviceIds) {
+        auto slaveIdx = this->findDeviceIdx(slaveDeviceId);
+        if (slaveIdx >= 0) {
+            try {
+                slaves.push_back(this->_connectSlave(group, slaveIdx, fMasterVolume, bMuted));
+            }
+            catch (...) {}
+        }
+    }
+
+    // In bidirectional mode, the slaves' own changes are written to the master by a worker of its own,
+    // so that the audio service's notification thread never has to wait for the master device.
+    std::unique_ptr<SlaveVolumeWorker> masterWorker;
+    if (m_bBidirectional) {
+        LinkGroup* pGroup = &group;
+        try {
+            masterWorker = std::make_unique<SlaveVolumeWorker>(
+                [this, pGroup](float fVolume, BOOL bMuted, LONGLONG, const ChannelVolumes&) -> bool {
+                    return this->_setMasterVolumeFromSlave(*pGroup, fVolume, bMuted);
+                },
+                nullptr);
+        }
+        catch (...) {
+            throw std::runtime_error("Unable to start master device worker. Link could not be established.");
+        }
+    }
+
+    {
+        auto lock = m_linkLock.lock_exclusive();
+        group.slaves = move(slaves);
+        group.masterWorker = move(masterWorker);
+    }
+
+    // Register our callback to get volume/mute change notifications for the master device (or session).
+    if (group.pMasterSession) {
+        hr = group.pMasterSession->RegisterAudioSessionNotification(&group.sessionCallback);
+        THROW_IF_COM_FAILED(hr, "Unable to register master audio session callback.");
+        group.bSessionCallbackRegistered = true;
+    }
+    else {
+        hr = group.pMasterEndptVol->RegisterControlChangeNotify(
+            (IAudioEndpointVolumeCallback*)& group.callback);
+        THROW_IF_COM_FAILED(hr, "Unable to register master audio endpoint volume callback.");
+        group.bCallbackRegistered = true;
+    }
+
+    // Listen for the slaves' own volume changes too (only does anything in bidirectional mode).
+    for (auto& slave : group.slaves) {
+        this->_registerSlaveCallback(*slave);
+    }
+
+    // The master may have changed between the initial state that we posted and the callback registration,
+    // so we'll queue its current state too. The workers take care of applying it.
+    // NOTE: This is also what applies the master's channel balance to the slaves (channel-sync mode).
+    if (this->_getMasterState(group, fMasterVolume, bMuted)) {
+        ChannelVolumes channels;
+        this->_readMasterChannels(group, channels);
+        for (auto& slave : group.slaves) {
+            slave->worker->post(fMasterVolume, bMuted, 0, &channels);
+        }
+    }
+
+    // Lastly, update the GUI immediately to display the master device's volume/mute state.
+    this->_updateDialog(group, fMasterVolume, bMuted);
+}
+
+std::unique_ptr<SlaveLink> AudioDeviceManager::_connectSlave(
+    LinkGroup& group,
+    ptrdiff_t slaveIdx,
+    float fMasterVolume,
+    BOOL bMuted)
+{
+    // Connect to the "endpoint volume control" interface of the slave device.
+    auto& slaveDevice = m_audioDevices.at(static_cast<size_t>(slaveIdx));
+    auto slave = std::make_unique<SlaveLink>();
+    slave->pGroup = &group;
+    slave->deviceId = slaveDevice.getId();
+    slave->pEndptVol = slaveDevice.getAudioEndpointVolume();
+    slave->pWriteEndptVol = slave->pEndptVol;
+    auto curveIt = m_slaveCurves.find(std::wstring_view(slave->deviceId));
+    if (curveIt != m_slaveCurves.end()) {
+        slave->curve = curveIt->second;
+    }
+    slave->state = {};
+    slave->bStateStale = false;
+
+    // Prepare the slave's channel mapping (only used in channel-sync mode).
+    // NOTE: A slave whose channels can't be counted is simply synced without any channel balance.
+    UINT nChannels = 0;
+    if (!slave->pEndptVol || FAILED(slave->pEndptVol->GetChannelCount(&nChannels))) {
+        nChannels = 0;
+    }
+    slave->nChannels = (nChannels < MAX_SYNC_CHANNELS) ? nChannels : MAX_SYNC_CHANNELS;
+    auto channelIt = m_slaveChannels.find(std::wstring_view(slave->deviceId));
+    for (size_t i = 0; i < MAX_SYNC_CHANNELS; ++i) {
+        slave->aiChannelSources[i] = CHANNEL_SOURCE_DEFAULT;
+        slave->afChannelTrims[i] = 1.0f;
+        if (channelIt != m_slaveChannels.end()) {
+            auto& settings = channelIt->second;
+            if (i < settings.sources.size()) {
+                slave->aiChannelSources[i] = settings.sources[i];
+            }
+            if (i < settings.trims.size() && settings.trims[i] >= 0.0f) {
+                slave->afChannelTrims[i] = settings.trims[i];
+            }
+        }
+    }
+    slave->ownSequence = m_reflectSequence.load(std::memory_order_relaxed); // Older master changes are never skipped.
+    slave->bCallbackRegistered = false;
+
+    // Start the background worker which applies the master's changes to the slave device.
+    try {
+        SlaveLink* pSlave = slave.get();
+        pSlave->worker = std::make_unique<SlaveVolumeWorker>(
+            [this, pSlave](float fVolume, BOOL bMuted, LONGLONG notifyTime, const ChannelVolumes& channels) -> bool {
+                return this->_setSlaveVolume(*pSlave, fVolume, bMuted, notifyTime, &channels);
+            },
+            [this, pSlave]() -> bool {
+                return this->_recoverSlave(*pSlave);
+            },
+            [this]() -> void {
+                this->_onSlaveHealthChanged();
+            });
+        pSlave->worker->setRampTime(m_dwRampTime);
+
+        // Prepare the slave's own volume callback (it's only registered with the device in bidirectional mode).
+        pSlave->callback.registerCallback(this, pSlave);
+    }
+    catch (...) {
+        throw std::runtime_error("Unable to start slave device worker. Link could not be established.");
+    }
+
+    // Let the worker apply the master's volume right away, without making the caller wait for the device.
+    // NOTE: Any newer state simply replaces this one in the worker's mailbox, so it can never overwrite anything.
+    slave->worker->post(fMasterVolume, bMuted);
+
+    return slave;
+}
+
+void AudioDeviceManager::_registerSlaveCallback(
+    SlaveLink& slave) noexcept
+{
+    if (!m_bBidirectional || slave.bCallbackRegistered || !slave.pEndptVol) {
+        return;
+    }
+
+    // NOTE: If this fails, the slave still receives all master changes. It just can't change the master itself.
+    HRESULT hr = slave.pEndptVol->RegisterControlChangeNotify(
+        (IAudioEndpointVolumeCallback*)& slave.callback);
+    slave.bCallbackRegistered = SUCCEEDED(hr);
+}
+
+void AudioDeviceManager::_releaseSlaves(
+    vector<std::unique_ptr<SlaveLink>>& slaves) noexcept
+{
+    // NOTE: This must be called while we're NOT holding the link lock, since unregistering a callback waits
+    // for any notification that's currently executing it, and the slave callbacks need the (shared) lock.
+
+    // Unregister the slaves' own callbacks, so that the audio service never calls them after they're gone.
+    for (auto& slave : slaves) {
+        if (slave->bCallbackRegistered && slave->pEndptVol) {
+            slave->pEndptVol->UnregisterControlChangeNotify(
+                (IAudioEndpointVolumeCallback*)& slave->callback);
+        }
+        slave->bCallbackRegistered = false;
+    }
+
+    // Stop all slave workers (waits for any slave volume changes that they're currently applying).
+    // NOTE: All workers are told to stop before we wait for any of them, which means that we
+    // only have to wait for the slowest device, instead of for every device in sequence.
+    for (auto& slave : slaves) {
+        if (slave->worker) {
+            slave->worker->requestStop();
+        }
+    }
+
+    // Release all slaves (joins their workers first, and then releases their COM resources).
+    slaves.clear();
+}
+
+void AudioDeviceManager::_reconnectSlave(
+    LinkGroup& group,
+    const wstring& deviceId) noexcept
+{
+    // Remove the slave's old connection (if any), since its endpoint is no longer usable after a state change.
+    vector<std::unique_ptr<SlaveLink>> oldSlaves;
+    try {
+        auto lock = m_linkLock.lock_exclusive();
+        auto it = std::find_if(group.slaves.begin(), group.slaves.end(), [&deviceId](std::unique_ptr<SlaveLink>& slave) -> bool
+            {
+                return slave->deviceId == deviceId;
+            });
+        if (it != group.slaves.end()) {
+            oldSlaves.push_back(move(*it));
+            group.slaves.erase(it);
+        }
+    }
+    catch (...) {
+        return;
+    }
+    this->_releaseSlaves(oldSlaves); // Joins the old worker (outside of the lock).
+
+    // Without a connected master, there's nothing to sync from. All slaves are connected when it returns.
+    if (!this->_isMasterConnected(group)) {
+        return;
+    }
+
+    // Do nothing if the slave device is currently missing (it's connected again when it returns).
+    auto slaveIdx = this->findDeviceIdx(deviceId);
+    if (slaveIdx < 0) {
+        return;
+    }
+
+    // Get the master device's current volume and mute-state.
+    BOOL bMuted;
+    float fMasterVolume;
+    if (!this->_getMasterState(group, fMasterVolume, bMuted)) {
+        return;
+    }
+
+    // Connect the slave (its worker syncs it, and recovers it if the sync fails), and then add it to the link.
+    // NOTE: This only fails if the device can't even be activated, in which case we'll simply try again
+    // the next time that the device changes state.
+    try {
+        auto slave = this->_connectSlave(group, slaveIdx, fMasterVolume, bMuted);
+        SlaveLink* pSlave = slave.get();
+        {
+            auto lock = m_linkLock.lock_exclusive();
+            group.slaves.push_back(move(slave));
+        }
+        this->_registerSlaveCallback(*pSlave);
+
+        // The master may have changed while we were connecting (before the slave could receive callbacks).
+        if (this->_getMasterState(group, fMasterVolume, bMuted)) {
+            ChannelVolumes channels;
+            this->_readMasterChannels(group, channels);
+            pSlave->worker->post(fMasterVolume, bMuted, 0, &channels);
+        }
+    }
+    catch (...) {}
+}
+
+void AudioDeviceManager::_rebindSlave(
+    const wstring& deviceId) noexcept
+{
+    // NOTE: This is executed by the engine thread, after a slave worker has recovered the device's endpoint.
+    // The worker only replaced the interface that it writes through, so everything else still uses the old one,
+    // which stopped working when the endpoint was invalidated. So we activate a new interface for the device's
+    // cache, and move the slave (and its own bidirectional callback) onto it.
+    auto idx = this->findDeviceIdx(deviceId);
+    auto pGroup = this->_findSlaveGroup(deviceId);
+    if (idx < 0 || pGroup == nullptr) {
+        return;
+    }
+    auto it = std::find_if(pGroup->slaves.begin(), pGroup->slaves.end(), [&deviceId](const std::unique_ptr<SlaveLink>& slave) -> bool
+        {
+            return slave->deviceId == deviceId;
+        });
+    if (it == pGroup->slaves.end()) {
+        return;
+    }
+    auto& slave = **it;
+
+    auto& device = m_audioDevices[static_cast<size_t>(idx)];
+    device.invalidateAudioEndpointVolume();
+    wil::com_ptr_nothrow<IAudioEndpointVolume> pEndptVol;
+    try {
+        pEndptVol = device.getAudioEndpointVolume();
+    }
+    catch (...) {
+        return;
+    }
+
+    // NOTE: Unregistering from the dead interface may fail, which is fine, since it can't notify us anymore anyway.
+    if (slave.bCallbackRegistered && slave.pEndptVol) {
+        slave.pEndptVol->UnregisterControlChangeNotify(
+            (IAudioEndpointVolumeCallback*)& slave.callback);
+    }
+    slave.bCallbackRegistered = false;
+    slave.pEndptVol = std::move(pEndptVol);
+    this->_registerSlaveCallback(slave);
+}
+
+void AudioDeviceManager::_reconnectLink(
+    LinkGroup& group) noexcept
+{
+    // Tear down all connections (their endpoints may be unusable now), and connect everything that's available again.
+    // NOTE: If this fails (such as when the master is missing), the link simply stays disconnected until the next change.
+    this->_disconnectLink(group);
+    try {
+        this->_connectLink(group);
+    }
+    catch (...) {
+        this->_disconnectLink(group);
+    }
+}
+
+void AudioDeviceManager::unlinkDevices(
+    size_t groupIdx) noexcept
+{
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr) {
+        return;
+    }
+    auto& group = *pGroup;
+
+    // Forget the linked devices, which makes any in-flight volume callbacks ignore the devices.
+    {
+        auto lock = m_linkLock.lock_exclusive();
+        group.bLinkActive = false;
+        group.masterDeviceId.clear();
+        group.slaveDeviceIds.clear();
+    }
+
+    // Disconnect from all devices, and only then let other instances link them.
+    this->_disconnectLink(group);
+    this->_updateLinkIdxs(group);
+    group.deviceClaims.clear();
+}
+
+void AudioDeviceManager::unlinkAllDevices() noexcept
+{
+    for (size_t i = 0; i < m_groups.size(); ++i) {
+        this->unlinkDevices(i);
+    }
+}
+
+void AudioDeviceManager::_connectMasterSession(
+    LinkGroup& group,
+    const AudioDevice& masterDevice)
+{
+    // Find the program's session in the device's session list.
+    // NOTE: The list is created the first time, and from then on, it's kept up to date by the audio service's
+    // notifications. It reports every created or ended session to us as a "sessions changed" device change.
+    wstring deviceId = masterDevice.getId();
+    auto& sessions = masterDevice.getAudioSessions(
+        [this, deviceId]() -> void {
+            this->_onDeviceCallback(deviceId.c_str(), false, true);
+        });
+    sessions.update();
+
+    auto pSession = sessions.findSession(group.masterSessionName);
+    if (pSession == nullptr) {
+        return;
+    }
+    group.pMasterSession = pSession->pControl;
+    group.pMasterSessionVol = pSession->pSimpleVolume;
+}
+
+bool AudioDeviceManager::_isMasterConnected(
+    const LinkGroup& group) noexcept
+{
+    return group.pMasterSessionVol || group.pMasterEndptVol;
+}
+
+bool AudioDeviceManager::_getMasterState(
+    const LinkGroup& group,
+    float& fVolume,
+    BOOL& bMuted) noexcept
+{
+    // Read the current volume and mute-state of the master session (if any), or else of the master device.
+    if (group.pMasterSessionVol) {
+        return SUCCEEDED(group.pMasterSessionVol->GetMute(&bMuted)) &&
+            SUCCEEDED(group.pMasterSessionVol->GetMasterVolume(&fVolume));
+    }
+    if (group.pMasterEndptVol) {
+        return SUCCEEDED(group.pMasterEndptVol->GetMute(&bMuted)) &&
+            SUCCEEDED(group.pMasterEndptVol->GetMasterVolumeLevelScalar(&fVolume));
+    }
+
+    return false;
+}
+
+HRESULT AudioDeviceManager::_setMasterLevel(
+    LinkGroup& group,
+    float fVolume,
+    LPCGUID pEventContext) noexcept
+{
+    if (group.pMasterSessionVol) {
+        return group.pMasterSessionVol->SetMasterVolume(fVolume, pEventContext);
+    }
+    if (group.pMasterEndptVol) {
+        return group.pMasterEndptVol->SetMasterVolumeLevelScalar(fVolume, pEventContext);
+    }
+
+    return E_POINTER;
+}
+
+HRESULT AudioDeviceManager::_setMasterMuteState(
+    LinkGroup& group,
+    BOOL bMuted,
+    LPCGUID pEventContext) noexcept
+{
+    if (group.pMasterSessionVol) {
+        return group.pMasterSessionVol->SetMute(bMuted, pEventContext);
+    }
+    if (group.pMasterEndptVol) {
+        return group.pMasterEndptVol->SetMute(bMuted, pEventContext);
+    }
+
+    return E_POINTER;
+}
+
+void AudioDeviceManager::_disconnectLink(
+    LinkGroup& group) noexcept
+{
+    // Unregister the master device's callback.
+    if (group.bCallbackRegistered && group.pMasterEndptVol) {
+        // NOTE: Ignoring HRESULT since the only possible error is that the pointer is NULL.
+        group.pMasterEndptVol->UnregisterControlChangeNotify(
+            (IAudioEndpointVolumeCallback*)& group.callback);
+    }
+    group.bCallbackRegistered = false;
+    if (group.bSessionCallbackRegistered && group.pMasterSession) {
+        group.pMasterSession->UnregisterAudioSessionNotification(&group.sessionCallback);
+    }
+    group.bSessionCallbackRegistered = false;
+
+    // Take the slaves (and the master worker) away from any in-flight volume callbacks.
+    vector<std::unique_ptr<SlaveLink>> slaves;
+    std::unique_ptr<SlaveVolumeWorker> masterWorker;
+    {
+        auto lock = m_linkLock.lock_exclusive();
+        slaves = move(group.slaves);
+        group.slaves.clear();
+        masterWorker = move(group.masterWorker);
+    }
+
+    // Stop and release all slaves, and then the master worker (which the slave callbacks were feeding).
+    // NOTE: We do this outside of the lock, so that volume callbacks are never blocked by it.
+    this->_releaseSlaves(slaves);
+    masterWorker.reset();
+
+    // Clear the master device pointers (releases the old COM resources).
+    group.pMasterEndptVol = nullptr;
+    group.pMasterSession = nullptr;
+    group.pMasterSessionVol = nullptr;
+}
+
+void AudioDeviceManager::_updateLinkIdxs(
+    LinkGroup& group)
 {
-    HRESULT hr;
+    // Find the current list positions of all linked devices that are available right now.
+    group.iMasterDeviceIdx = -1;
+    group.slaveDeviceIdxs.clear();
+    if (!group.bLinkActive) {
+        return;
+    }
 
-    // The exit code from the class will always be zero (no error) unless the callback failed.
-    m_exitCode = 0;
+    group.iMasterDeviceIdx = this->findDeviceIdx(group.masterDeviceId);
+    for (auto& slaveDeviceId : group.slaveDeviceIds) {
+        auto slaveIdx = this->findDeviceIdx(slaveDeviceId);
+        if (slaveIdx >= 0) {
+            group.slaveDeviceIdxs.push_back(slaveIdx);
+        }
+    }
+}
 
-    // Save the GUID that we will identify our COM calls with.
-    if (processGUID == GUID_NULL) {
-        throw std::runtime_error("Invalid process GUID given to AudioDeviceManager.");
+vector<DeviceListChange> AudioDeviceManager::processDeviceChanges()
+{
+    // Take all pending device changes (leaving the list empty for new notifications).
+    vector<PendingDeviceChange> pendingChanges;
+    {
+        auto lock = m_pendingDeviceLock.lock_exclusive();
+        pendingChanges.swap(m_pendingDeviceChanges);
     }
-    m_processGUID = processGUID;
 
-    // At the moment we don't have any dialog handle that we're attached to.
-    m_hDialog = NULL;
-    m_iMuteCheckboxID = 0;
-    m_iVolumeSliderID = 0;
-
-    // Get enumerator for audio endpoint devices.
-    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator),
-        NULL, CLSCTX_INPROC_SERVER,
-        __uuidof(IMMDeviceEnumerator),
-        (void**)& m_pEnumerator);
-    THROW_IF_COM_FAILED(hr, "Unable to create audio device enumerator.");
-
-    // Get all audio-rendering devices (except ones that are disabled/not present).
-    hr = m_pEnumerator->EnumAudioEndpoints(
-        eRender, DEVICE_STATE_ACTIVE | DEVICE_STATE_UNPLUGGED, &m_pCollection);
-    THROW_IF_COM_FAILED(hr, "Unable to enumerate audio devices.");
-
-    // Count the discovered devices.
-    UINT count;
-    hr = m_pCollection->GetCount(&count);
-    THROW_IF_COM_FAILED(hr, "Unable to count audio devices in collection.");
-    m_collectionCount = static_cast<size_t>(count);
-    if (m_collectionCount == 0) {
-        throw std::runtime_error("No audio devices found.");
-    }
-
-    for (size_t i = 0; i < m_collectionCount; ++i) {
-        // Get pointer to endpoint number i.
-        wil::com_ptr_nothrow<IMMDevice> pEndpoint;
-        hr = m_pCollection->Item(static_cast<UINT>(i), &pEndpoint);
-        THROW_IF_COM_FAILED(hr, "Unable to retrieve an audio endpoint.");
-
-        // Save device to vector.
-        AudioDevice device(i, move(pEndpoint));
-        m_audioDevices.push_back(move(device));
-    }
-
-    // Sort the devices by name in ascending order (case SENSITIVE).
-    std::sort(m_audioDevices.begin(), m_audioDevices.end(), [](AudioDevice& a, AudioDevice& b) -> bool
+    // Update our device list, and remember which devices have been affected.
+    vector<DeviceListChange> changes;
+    vector<wstring> affectedIds;
+    vector<wstring> sessionChangedIds;
+    vector<wstring> recoveredIds;
+    for (auto& pending : pendingChanges) {
+        // A recovery alone doesn't change anything about the device itself, so there's nothing to re-read.
+        if (pending.bRecovered && !pending.bStateChanged && !pending.bSessionsChanged) {
+            recoveredIds.push_back(pending.deviceId);
+        }
+        else if (this->_refreshDevice(pending, changes)) {
+            affectedIds.push_back(pending.deviceId);
+        }
+        else if (pending.bSessionsChanged) {
+            sessionChangedIds.push_back(pending.deviceId);
+        }
+    }
+
+    // Apply the created and ended sessions to the (unchanged) devices' session lists.
+    for (auto& deviceId : sessionChangedIds) {
+        auto idx = this->findDeviceIdx(deviceId);
+        auto pSessions = (idx >= 0) ? m_audioDevices[static_cast<size_t>(idx)].getCachedAudioSessions() : nullptr;
+        if (pSessions != nullptr) {
+            pSessions->update();
+        }
+    }
+
+    // Re-activate the linked devices that have appeared, disappeared or changed state, in every link group.
+    // NOTE: A master change reconnects the whole link, but slaves are reconnected individually,
+    // so that all other slaves keep syncing without any interruption.
+    for (auto& pGroup : m_groups) {
+        auto& group = *pGroup;
+        if (!group.bLinkActive || (affectedIds.empty() && sessionChangedIds.empty())) {
+            continue;
+        }
+
+        bool masterChanged = false;
+        vector<wstring> changedSlaveIds;
+        for (auto& deviceId : affectedIds) {
+            if (deviceId == group.masterDeviceId) {
+                masterChanged = true;
+            }
+            else if (std::find(group.slaveDeviceIds.begin(), group.slaveDeviceIds.end(), deviceId) != group.slaveDeviceIds.end()) {
+                changedSlaveIds.push_back(deviceId);
+            }
+        }
+
+        // A master session is reconnected when it has ended, or when it appears for the first time.
+        if (!masterChanged && !group.masterSessionName.empty() &&
+            std::find(sessionChangedIds.begin(), sessionChangedIds.end(), group.masterDeviceId) != sessionChangedIds.end()) {
+            AudioSessionState state;
+            masterChanged = !group.pMasterSession ||
+                FAILED(group.pMasterSession->GetState(&state)) || state == AudioSessionStateExpired;
+        }
+
+        if (masterChanged) {
+            this->_reconnectLink(group);
+        }
+        else {
+            for (auto& slaveDeviceId : changedSlaveIds) {
+                this->_reconnectSlave(group, slaveDeviceId);
+            }
+        }
+    }
+
+    // Move the recovered slaves onto new interfaces (slaves which have been reconnected above already have them).
+    for (auto& deviceId : recoveredIds) {
+        this->_rebindSlave(deviceId);
+    }
+
+    // The list positions of the linked devices may have moved, even in groups which weren't affected.
+    for (auto& pGroup : m_groups) {
+        this->_updateLinkIdxs(*pGroup);
+    }
+
+    return changes;
+}
+
+void AudioDeviceManager::_insertDevice(
+    AudioDevice device,
+    vector<DeviceListChange>& changes)
+{
+    // Insert the device at its sorted position (after any devices with identical names), or at the end if the
+    // list hasn't been sorted yet.
+    auto it = !m_bDeviceListSorted ? m_audioDevices.end() :
+        std::find_if(m_audioDevices.begin(), m_audioDevices.end(), [&device](const AudioDevice& other) -> bool
         {
-            // NOTE: This requires that "_wsetlocale" has been executed to set the program's
-            // locale, otherwise it uses the "C" (ANSI) basic locale by default and can't
-            // achieve a case-insensitive comparison of international letters.
-            return _wcsicmp(a.getName().c_str(), b.getName().c_str()) < 0; // Case Insensitive (Microsoft implementation).
+            return deviceNameLess(device, other);
         });
+    auto idx = static_cast<ptrdiff_t>(it - m_audioDevices.begin());
+    wstring name = device.getName();
+    wstring deviceId = device.getId();
+    m_audioDevices.insert(it, move(device));
 
-    // Validate collection sizes.
-    if (m_collectionCount != m_audioDevices.size()) {
-        throw std::runtime_error("Unable to retrieve all audio device information.");
+    // Move all later devices down by one position in the index map, and then add the new device.
+    for (auto& entry : m_deviceIdxs) {
+        if (entry.second >= static_cast<size_t>(idx)) {
+            ++entry.second;
+        }
     }
+    m_deviceIdxs.emplace(deviceId, static_cast<size_t>(idx));
 
-    // There is no link at the beginning.
-    m_bLinkActive = false;
-    m_iMasterDeviceIdx = -1;
-    m_iSlaveDeviceIdx = -1;
-    m_pMasterEndptVol = nullptr;
-    m_pSlaveEndptVol = nullptr;
+    changes.push_back({ DeviceListChange::Type::Added, idx, move(name), move(deviceId) });
+}
 
-    // Register a callback lambda which calls our class instance's volume callback.
-    m_endpointVolumeCallback.registerCallback(
-        [this](const PAUDIO_VOLUME_NOTIFICATION_DATA& pNotify) -> void {
-            this->_onVolumeCallback(pNotify);
-        });
+bool AudioDeviceManager::_refreshDevice(
+    const PendingDeviceChange& pending,
+    vector<DeviceListChange>& changes)
+{
+    HRESULT hr;
+
+    // Look up the device's current state. It's considered missing if it no longer exists,
+    // or if it isn't a playback device, or if it's in a state that we don't list.
+    wil::com_ptr_nothrow<IMMDevice> pEndpoint;
+    bool isAvailable = false;
+    hr = m_pBackend->getDevice(pending.deviceId.c_str(), pEndpoint);
+    if (SUCCEEDED(hr)) {
+        auto pEndpointInfo = pEndpoint.try_query<IMMEndpoint>();
+        EDataFlow dataFlow;
+        DWORD dwState;
+        isAvailable = pEndpointInfo &&
+            SUCCEEDED(pEndpointInfo->GetDataFlow(&dataFlow)) && dataFlow == eRender &&
+            SUCCEEDED(pEndpoint->GetState(&dwState)) && (dwState & LISTED_DEVICE_STATES) != 0;
+    }
+
+    // Remove devices that have gone missing.
+    auto idx = this->findDeviceIdx(pending.deviceId);
+    if (!isAvailable) {
+        if (idx < 0) {
+            return false;
+        }
+
+        this->_eraseDevice(static_cast<size_t>(idx));
+        changes.push_back({ DeviceListChange::Type::Removed, idx, wstring(), wstring() });
+        return true;
+    }
+
+    // Read the device's current information (throws if the device disappeared again in the meantime).
+    // NOTE: If we fail, we'll keep our old information, and will retry whenever the device changes again.
+    // NOTE: Any state change drops the device's cached volume interface, since it's replaced by a new object.
+    try {
+        if (idx < 0) {
+            // New device: Insert it at its sorted position.
+            AudioDevice device(m_nextItemOffset++, move(pEndpoint));
+            this->_insertDevice(move(device), changes);
+            return true;
+        }
+
+        // Known device: Refresh our information. If the name changed, it also needs to move to its new sorted position.
+        auto& oldDevice = m_audioDevices[static_cast<size_t>(idx)];
+        AudioDevice device(oldDevice.getItemOffset(), move(pEndpoint));
+        // NOTE: Names don't affect the position in an unsorted list, so they aren't even read then.
+        bool isRenamed = m_bDeviceListSorted && device.getName() != oldDevice.getName();
+        bool isStateChanged = pending.bStateChanged || device.getState() != oldDevice.getState();
+        if (!isStateChanged) {
+            // The device's endpoint is still the same, so we can keep using its cached volume interface.
+            device.takeAudioEndpointVolume(oldDevice);
+            device.takeAudioSessions(oldDevice);
+        }
+        if (isRenamed) {
+            this->_eraseDevice(static_cast<size_t>(idx));
+            changes.push_back({ DeviceListChange::Type::Removed, idx, wstring(), wstring() });
+            this->_insertDevice(move(device), changes);
+        }
+        else {
+            oldDevice = move(device);
+        }
+
+        return isStateChanged;
+    }
+    catch (...) {}
+
+    return false;
 }
 
-AudioDeviceManager::~AudioDeviceManager()
+ptrdiff_t AudioDeviceManager::getMasterDeviceIdx(
+    size_t groupIdx) noexcept
 {
-    // Ensure that any callback-link between devices is unloaded first, before regular destruction.
-    this->unlinkDevices();
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? pGroup->iMasterDeviceIdx : -1;
+}
 
-    // Remove ourselves as callback from the inner AudioEndpointVolumeCallback class.
-    // NOTE: Probably completely pointless since that object and its reference to us
-    // would get destroyed in reverse creation-order and properly release anyway.
-    m_endpointVolumeCallback.unregisterCallback();
+const vector<ptrdiff_t>& AudioDeviceManager::getSlaveDeviceIdxs(
+    size_t groupIdx) noexcept
+{
+    static const vector<ptrdiff_t> noSlaveIdxs;
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? pGroup->slaveDeviceIdxs : noSlaveIdxs;
 }
 
-int AudioDeviceManager::getExitCode() noexcept
+const wstring& AudioDeviceManager::getMasterDeviceId(
+    size_t groupIdx) noexcept
 {
-    return m_exitCode;
+    static const wstring noDeviceId;
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? pGroup->masterDeviceId : noDeviceId;
 }
 
-const vector<AudioDevice>& AudioDeviceManager::getAudioDevices()
+const vector<wstring>& AudioDeviceManager::getSlaveDeviceIds(
+    size_t groupIdx) noexcept
 {
-    return m_audioDevices;
+    static const vector<wstring> noDeviceIds;
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? pGroup->slaveDeviceIds : noDeviceIds;
 }
 
-const AudioDevice& AudioDeviceManager::getDevice(
-    ptrdiff_t idx)
+void AudioDeviceManager::setMasterSession(
+    size_t groupIdx,
+    const wstring& processName) noexcept
 {
-    if (idx < 0) {
-        throw std::runtime_error("Negative device number requested.");
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr || pGroup->masterSessionName == processName) {
+        return;
     }
 
     try {
-        return m_audioDevices.at(static_cast<size_t>(idx));
+        pGroup->masterSessionName = processName;
     }
-    catch (const std::out_of_range&) {
-        throw std::runtime_error("Invalid device number requested.");
+    catch (...) {
+        return;
+    }
+
+    // Reconnect the link if it's active, which switches it over to the new master right away.
+    if (pGroup->bLinkActive) {
+        this->_reconnectLink(*pGroup);
     }
 }
 
-bool AudioDeviceManager::isLinkActive() noexcept
+float AudioDeviceManager::getVolumeEpsilon() noexcept
 {
-    return m_bLinkActive;
+    return m_fVolumeEpsilon.load(std::memory_order_relaxed);
 }
 
-void AudioDeviceManager::linkDevices(
-    ptrdiff_t masterIdx,
-    ptrdiff_t slaveIdx)
+void AudioDeviceManager::setVolumeEpsilon(
+    float fEpsilon) noexcept
 {
-    HRESULT hr;
+    // Only accept sane values. Anything above 1% would make the slave visibly lag behind.
+    if (!(fEpsilon >= 0.0f) || fEpsilon > MAX_VOLUME_EPSILON) {
+        fEpsilon = DEFAULT_VOLUME_EPSILON;
+    }
 
-    // Ensure that any existing link is broken first.
-    this->unlinkDevices();
+    m_fVolumeEpsilon.store(fEpsilon, std::memory_order_relaxed);
+}
 
-    // Don't allow circular links between the same device.
-    if (masterIdx == slaveIdx) {
-        throw std::runtime_error("Cannot link device to itself.");
-    }
+void AudioDeviceManager::setRampTime(
+    DWORD dwRampTime) noexcept
+{
+    // Anything longer than a couple of seconds would make the slaves audibly lag behind the master.
+    m_dwRampTime = (dwRampTime > MAX_RAMP_TIME) ? MAX_RAMP_TIME : dwRampTime;
 
-    // Retrieve the devices (throws if the indices are invalid, negative, etc).
-    AudioDevice masterDevice = this->getDevice(masterIdx);
-    AudioDevice slaveDevice = this->getDevice(slaveIdx);
+    // Update the slaves that are already linked (only the engine thread changes the workers, so no lock is needed).
+    for (const auto& group : m_groups) {
+        for (const auto& slave : group->slaves) {
+            if (slave->worker) {
+                slave->worker->setRampTime(m_dwRampTime);
+            }
+        }
+    }
+}
 
-    // Connect to the "endpoint volume control" interfaces for both devices.
-    m_pMasterEndptVol = masterDevice.activateAudioEndpointVolume();
-    m_pSlaveEndptVol = slaveDevice.activateAudioEndpointVolume();
+void AudioDeviceManager::setSlaveCurve(
+    const wstring& deviceId,
+    const VolumeCurveSettings& settings)
+{
+    // Build the curve's lookup table (throws if out of memory).
+    VolumeCurve curve(settings);
+    if (curve.isIdentity()) {
+        auto it = m_slaveCurves.find(std::wstring_view(deviceId));
+        if (it != m_slaveCurves.end()) {
+            m_slaveCurves.erase(it);
+        }
+    }
+    else {
+        m_slaveCurves.insert_or_assign(deviceId, move(curve));
+    }
 
-    // Register our callback to get volume/mute change notifications for the master device.
-    hr = m_pMasterEndptVol->RegisterControlChangeNotify(
-        (IAudioEndpointVolumeCallback*)& m_endpointVolumeCallback);
-    THROW_IF_COM_FAILED(hr, "Unable to register master audio endpoint volume callback.");
+    // NOTE: A connected slave keeps its curve, so it must be reconnected to use the new one.
+    auto pGroup = this->_findSlaveGroup(deviceId);
+    if (pGroup != nullptr) {
+        this->_reconnectSlave(*pGroup, deviceId);
+    }
+}
 
-    // Signal the fact that the link is now active (since the callback registration succeeded).
-    m_bLinkActive = true;
-    m_iMasterDeviceIdx = masterIdx;
-    m_iSlaveDeviceIdx = slaveIdx;
+void AudioDeviceManager::clearSlaveCurves() noexcept
+{
+    m_slaveCurves.clear();
 
-    // Get the master device's current volume and mute-state.
-    BOOL bMuted;
-    float fMasterVolume;
-    hr = m_pMasterEndptVol->GetMute(&bMuted);
-    if (FAILED(hr)) {
-        this->unlinkDevices();
-        throw std::runtime_error("Failed to retrieve master device's volume state. Link could not be established.");
+    // NOTE: A connected slave keeps its curve (its worker maps every write through it without any lock),
+    // so the slaves which are still using a curve must be reconnected to go back to a 1:1 copy.
+    for (auto& pGroup : m_groups) {
+        auto& group = *pGroup;
+        vector<wstring> curvedSlaveIds;
+        try {
+            for (auto& slave : group.slaves) {
+                if (!slave->curve.isIdentity()) {
+                    curvedSlaveIds.push_back(slave->deviceId);
+                }
+            }
+        }
+        catch (...) {}
+        for (auto& deviceId : curvedSlaveIds) {
+            this->_reconnectSlave(group, deviceId);
+        }
     }
-    hr = m_pMasterEndptVol->GetMasterVolumeLevelScalar(&fMasterVolume);
-    if (FAILED(hr)) {
-        this->unlinkDevices();
-        throw std::runtime_error("Failed to retrieve master device's mute state. Link could not be established.");
+}
+
+bool AudioDeviceManager::isChannelSync() noexcept
+{
+    return m_bChannelSync;
+}
+
+void AudioDeviceManager::setChannelSync(
+    bool bChannelSync) noexcept
+{
+    if (m_bChannelSync == bChannelSync) {
+        return;
     }
+    m_bChannelSync = bChannelSync;
+
+    // Reconnect all active links, which applies (or stops applying) the master's channel balance right away.
+    this->_reconnectAllLinks();
+}
+
+void AudioDeviceManager::setSlaveChannels(
+    const wstring& deviceId,
+    const SlaveChannelSettings& settings)
+{
+    m_slaveChannels.insert_or_assign(deviceId, settings);
 
-    // Apply the same volume to the slave-device immediately.
-    bool success = this->_setSlaveVolume(fMasterVolume, bMuted);
-    if (!success) {
-        this->unlinkDevices();
-        throw std::runtime_error("Failed to sync master volume to slave device. Link could not be established.");
+    // NOTE: A connected slave keeps its channel mapping, so it must be reconnected to use the new one.
+    auto pGroup = this->_findSlaveGroup(deviceId);
+    if (pGroup != nullptr) {
+        this->_reconnectSlave(*pGroup, deviceId);
     }
+}
 
-    // Lastly, update the GUI immediately to display the master device's volume/mute state.
-    this->_updateDialog(fMasterVolume, bMuted);
+bool AudioDeviceManager::isBidirectional() noexcept
+{
+    return m_bBidirectional;
 }
 
-void AudioDeviceManager::unlinkDevices() noexcept
+void AudioDeviceManager::setBidirectional(
+    bool bBidirectional) noexcept
 {
-    // Unregister the master device's callback.
-    if (m_bLinkActive && m_pMasterEndptVol) {
-        // NOTE: Ignoring HRESULT since the only possible error is that the pointer is NULL.
-        m_pMasterEndptVol->UnregisterControlChangeNotify(
-            (IAudioEndpointVolumeCallback*)& m_endpointVolumeCallback);
+    if (m_bBidirectional == bBidirectional) {
+        return;
     }
+    m_bBidirectional = bBidirectional;
+
+    // Reconnect all active links, which registers or unregisters the slave callbacks (and the master workers).
+    this->_reconnectAllLinks();
+}
 
-    // Clear all device pointers (releases the old COM resources).
-    m_bLinkActive = false;
-    m_iMasterDeviceIdx = -1;
-    m_iSlaveDeviceIdx = -1;
-    m_pMasterEndptVol = nullptr;
-    m_pSlaveEndptVol = nullptr;
+void AudioDeviceManager::_reconnectAllLinks() noexcept
+{
+    for (auto& pGroup : m_groups) {
+        if (pGroup->bLinkActive) {
+            this->_reconnectLink(*pGroup);
+        }
+    }
 }
 
-ptrdiff_t AudioDeviceManager::getMasterDeviceIdx() noexcept
+GUID AudioDeviceManager::_makeReflectContext(
+    uint32_t sequence) noexcept
 {
-    return m_iMasterDeviceIdx;
+    GUID eventContext = m_reflectGUID;
+    eventContext.Data1 = static_cast<unsigned long>(sequence);
+    return eventContext;
 }
 
-ptrdiff_t AudioDeviceManager::getSlaveDeviceIdx() noexcept
+bool AudioDeviceManager::_readReflectContext(
+    const GUID& eventContext,
+    uint32_t& sequence) noexcept
 {
-    return m_iSlaveDeviceIdx;
+    // Everything except the first field must match our bidirectional GUID.
+    const size_t offset = sizeof(eventContext.Data1);
+    if (memcmp(reinterpret_cast<const BYTE*>(&eventContext) + offset,
+        reinterpret_cast<const BYTE*>(&m_reflectGUID) + offset, sizeof(GUID) - offset) != 0) {
+        return false;
+    }
+
+    sequence = static_cast<uint32_t>(eventContext.Data1);
+    return true;
 }
 
 void AudioDeviceManager::setDialog(
     HWND hDlg,
     ptrdiff_t muteCheckboxID,
-    ptrdiff_t volumeSliderID)
+    ptrdiff_t volumeSliderID,
+    UINT refreshMessage)
 {
+    // NOTE: The control handles are looked up once here, instead of for every volume change.
     m_hDialog = hDlg;
-    m_iMuteCheckboxID = muteCheckboxID;
-    m_iVolumeSliderID = volumeSliderID;
+    m_hMuteCheckbox = (hDlg != NULL) ? GetDlgItem(hDlg, static_cast<int>(muteCheckboxID)) : NULL;
+    m_hVolumeSlider = (hDlg != NULL) ? GetDlgItem(hDlg, static_cast<int>(volumeSliderID)) : NULL;
+    m_uRefreshMessage = refreshMessage;
 }
 
 void AudioDeviceManager::_updateDialog(
+    LinkGroup& group,
     float fMasterVolume,
-    BOOL bMuted)
+    BOOL bMuted) noexcept
 {
-    if (m_hDialog == NULL) {
+    // NOTE: The dialog only displays the link group that's currently selected in it.
+    if (m_hDialog == NULL || m_uRefreshMessage == 0 || &group != m_pDialogGroup.load(std::memory_order_acquire)) {
         return;
     }
 
-    PostMessage(GetDlgItem(m_hDialog, static_cast<int>(m_iMuteCheckboxID)),
-        BM_SETCHECK, (bMuted) ? BST_CHECKED : BST_UNCHECKED, 0);
+    // Store the newest state, which replaces any state that the dialog hasn't displayed yet.
+    uint32_t volumeBits;
+    memcpy(&volumeBits, &fMasterVolume, sizeof(volumeBits));
+    m_dialogState.store((bMuted ? (1ULL << 32) : 0) | static_cast<uint64_t>(volumeBits), std::memory_order_release);
+
+    // Only post a refresh message if there isn't one waiting already. That way, a storm of volume
+    // notifications never floods the GUI thread with stale positions. It just displays the newest.
+    if (!m_bDialogRefreshPending.exchange(true, std::memory_order_acq_rel)) {
+        if (!PostMessage(m_hDialog, m_uRefreshMessage, 0, 0)) {
+            m_bDialogRefreshPending = false;
+        }
+    }
+}
+
+void AudioDeviceManager::processDialogRefresh(
+    bool bDisplay) noexcept
+{
+    // NOTE: This is executed by the GUI thread, when it receives the refresh message. It's the only method
+    // which runs outside of the audio engine's thread, so it must only touch the atomic dialog state.
+    // NOTE: We clear the "pending" flag BEFORE reading the state, so that any newer state
+    // which arrives while we're updating the controls is guaranteed to post a new message.
+    m_bDialogRefreshPending.store(false, std::memory_order_release);
+    uint64_t state = m_dialogState.load(std::memory_order_acquire);
+
+    // Don't display a late state if the link has been broken (or another group was selected) in the meantime.
+    // NOTE: Only the GUI knows whether the displayed group is linked, since the groups themselves belong to the
+    // engine thread. Switching groups always posts the newly selected group's state, which replaces the late one.
+    if (!bDisplay) {
+        return;
+    }
+
+    uint32_t volumeBits = static_cast<uint32_t>(state & 0xFFFFFFFFULL);
+    float fMasterVolume;
+    memcpy(&fMasterVolume, &volumeBits, sizeof(fMasterVolume));
+    BOOL bMuted = (state & (1ULL << 32)) ? TRUE : FALSE;
+
+    if (m_hMuteCheckbox != NULL) {
+        SendMessage(m_hMuteCheckbox, BM_SETCHECK, (bMuted) ? BST_CHECKED : BST_UNCHECKED, 0);
+    }
 
     // Calculate slider position (while rounding halves up).
     ptrdiff_t sliderVolume = static_cast<ptrdiff_t>((static_cast<double>(MAX_VOL) * fMasterVolume) + 0.5);
     if (sliderVolume < 0) { sliderVolume = 0; }
     else if (sliderVolume > MAX_VOL) { sliderVolume = MAX_VOL; }
 
-    PostMessage(GetDlgItem(m_hDialog, static_cast<int>(m_iVolumeSliderID)),
-        TBM_SETPOS, TRUE, static_cast<LPARAM>(static_cast<UINT32>(sliderVolume)));
+    if (m_hVolumeSlider != NULL) {
+        SendMessage(m_hVolumeSlider, TBM_SETPOS, TRUE, static_cast<LPARAM>(static_cast<UINT32>(sliderVolume)));
+    }
 }
 
 bool AudioDeviceManager::setMasterVolume(
+    size_t groupIdx,
     float fVolume) noexcept
 {
     // If we don't have any device, automatically return true.
-    if (!m_pMasterEndptVol) {
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr || !this->_isMasterConnected(*pGroup)) {
         return true;
     }
+    auto& group = *pGroup;
 
     // Attempt to set the volume, and only return true if successful.
     // NOTE: Will also propagate to slave device, via the master device's callback.
     HRESULT hr;
-    hr = m_pMasterEndptVol->SetMasterVolumeLevelScalar(fVolume, &m_processGUID);
+    hr = this->_setMasterLevel(group, fVolume, &m_processGUID);
     if (FAILED(hr)) { return false; }
 
     return true;
 }
 
 bool AudioDeviceManager::setMasterMute(
+    size_t groupIdx,
     BOOL bMuted) noexcept
 {
     // If we don't have any device, automatically return true.
-    if (!m_pMasterEndptVol) {
+    auto pGroup = this->_getGroup(groupIdx);
+    if (pGroup == nullptr || !this->_isMasterConnected(*pGroup)) {
         return true;
     }
+    auto& group = *pGroup;
 
     // Attempt to set the mute-state, and only return true if successful.
     // NOTE: Will also propagate to slave device, via the master device's callback.
     HRESULT hr;
-    hr = m_pMasterEndptVol->SetMute(bMuted, &m_processGUID);
+    hr = this->_setMasterMuteState(group, bMuted, &m_processGUID);
     if (FAILED(hr)) { return false; }
+    group.bMasterMuted = (bMuted != FALSE);
+
+    return true;
+}
+
+size_t AudioDeviceManager::getDegradedSlaveCount() noexcept
+{
+    // Count the slaves whose workers are currently recovering from a failure.
+    size_t nDegraded = 0;
+    for (auto& group : m_groups) {
+        for (auto& slave : group->slaves) {
+            if (slave->worker && slave->worker->getHealth() != WorkerHealth::Healthy) {
+                ++nDegraded;
+            }
+        }
+    }
+
+    return nDegraded;
+}
+
+std::wstring AudioDeviceManager::getDiagnosticsReport()
+{
+    wchar_t buffer[128];
+    swprintf_s(buffer, L"Slaves currently recovering from a failure: %zu\r\n", this->getDegradedSlaveCount());
+    return m_latencyStats.formatReport() + buffer;
+}
+
+LatencyStats::Report AudioDeviceManager::getLatencyReport()
+{
+    return m_latencyStats.getReport();
+}
+
+IAudioEndpointVolumeCallback* AudioDeviceManager::getMasterCallback(
+    size_t groupIdx) noexcept
+{
+    // NOTE: This is the exact callback object that the group's master device notifies, which
+    // lets the benchmark feed synthetic notifications through the real propagation path.
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? &pGroup->callback : nullptr;
+}
+
+void AudioDeviceManager::setEventStream(
+    VolumeEventStream* pEventStream) noexcept
+{
+    // NOTE: Taking the link lock waits for every volume callback that may still be using the previous stream.
+    auto lock = m_linkLock.lock_exclusive();
+    m_pEventStream.store(pEventStream, std::memory_order_release);
+}
+
+bool AudioDeviceManager::getMasterState(
+    size_t groupIdx,
+    float& fVolume,
+    BOOL& bMuted) noexcept
+{
+    // Read the linked master's current volume and mute-state (fails if the group isn't linked, or if the
+    // master is currently missing).
+    auto pGroup = this->_getGroup(groupIdx);
+    return pGroup != nullptr && pGroup->bLinkActive && this->_getMasterState(*pGroup, fVolume, bMuted);
+}
+
+bool AudioDeviceManager::isMasterMuted(
+    size_t groupIdx) noexcept
+{
+    // NOTE: This is tracked in memory (updated by our own changes and by every volume notification),
+    // so that the GUI never has to ask the audio service (or read a checkbox) to know the mute-state.
+    auto pGroup = this->_getGroup(groupIdx);
+    return (pGroup != nullptr) ? pGroup->bMasterMuted.load() : false;
+}
+
+void AudioDeviceManager::_readMasterChannels(
+    LinkGroup& group,
+    ChannelVolumes& channels) noexcept
+{
+    // Read the master's current channel levels (channel-sync mode only). Without them, nChannels is 0.
+    // NOTE: A master session only has a single volume, so its balance is never synced.
+    channels.nChannels = 0;
+    if (!m_bChannelSync || !group.pMasterEndptVol) {
+        return;
+    }
+
+    UINT nChannels;
+    if (FAILED(group.pMasterEndptVol->GetChannelCount(&nChannels))) {
+        return;
+    }
+    if (nChannels > MAX_SYNC_CHANNELS) {
+        nChannels = MAX_SYNC_CHANNELS;
+    }
+    for (UINT i = 0; i < nChannels; ++i) {
+        if (FAILED(group.pMasterEndptVol->GetChannelVolumeLevelScalar(i, &channels.afLevels[i]))) {
+            return;
+        }
+    }
+    channels.nChannels = nChannels;
+}
+
+bool AudioDeviceManager::_getChannelRatios(
+    const SlaveLink& slave,
+    const ChannelVolumes& channels,
+    float* afRatios) noexcept
+{
+    // Translate the master's channel levels into the balance for every slave channel, as levels relative to
+    // the loudest slave channel (which always plays at the slave's volume). Returns false if there's no balance.
+    // NOTE: A silent master has no balance at all, in which case the slave simply keeps its previous balance.
+    const UINT nMasterChannels = channels.nChannels;
+    const UINT nSlaveChannels = slave.nChannels;
+    if (nMasterChannels == 0 || nSlaveChannels == 0) {
+        return false;
+    }
+    float fMasterMax = 0.0f;
+    float fMasterSum = 0.0f;
+    for (UINT i = 0; i < nMasterChannels; ++i) {
+        fMasterMax = (channels.afLevels[i] > fMasterMax) ? channels.afLevels[i] : fMasterMax;
+        fMasterSum += channels.afLevels[i];
+    }
+    if (!(fMasterMax > 0.0f)) {
+        return false;
+    }
+    const float fMasterAverage = fMasterSum / static_cast<float>(nMasterChannels);
+
+    // Mirror the channels in order. By default, a stereo master is spread onto 5.1 and 7.1 slaves (left/right
+    // onto every side, and their average onto center and LFE), and any other extra slave channels repeat the
+    // master's channels from the beginning.
+    float fSlaveMax = 0.0f;
+    for (UINT i = 0; i < nSlaveChannels; ++i) {
+        int source = slave.aiChannelSources[i];
+        if (source == CHANNEL_SOURCE_DEFAULT) {
+            if (nMasterChannels == 2 && (nSlaveChannels == 6 || nSlaveChannels == 8)) {
+                source = (i == 2 || i == 3) ? CHANNEL_SOURCE_AVERAGE : static_cast<int>(i % 2);
+            }
+            else {
+                source = static_cast<int>(i % nMasterChannels);
+            }
+        }
+        float fLevel = (source >= 0 && static_cast<UINT>(source) < nMasterChannels) ?
+            channels.afLevels[source] : fMasterAverage;
+
+        afRatios[i] = (fLevel / fMasterMax) * slave.afChannelTrims[i];
+        fSlaveMax = (afRatios[i] > fSlaveMax) ? afRatios[i] : fSlaveMax;
+    }
+    if (!(fSlaveMax > 0.0f)) {
+        return false;
+    }
+    for (UINT i = 0; i < nSlaveChannels; ++i) {
+        afRatios[i] /= fSlaveMax;
+    }
 
     return true;
 }
 
 bool AudioDeviceManager::_setSlaveVolume(
+    SlaveLink& slave,
     float fVolume,
-    BOOL bMuted) noexcept
+    BOOL bMuted,
+    LONGLONG notifyTime,
+    const ChannelVolumes* pChannels) noexcept
 {
     // If we don't have any device, automatically return true.
-    if (!m_pSlaveEndptVol) {
+    if (!slave.pWriteEndptVol) {
+        return true;
+    }
+
+    // Translate the master's volume into this slave's volume.
+    // NOTE: This is only a table lookup, since all of the curve math was done when the link was connected.
+    fVolume = slave.curve.map(fVolume);
+
+    // Forget what we've applied if the slave has been changed by someone else since then (bidirectional mode).
+    if (slave.bStateStale.exchange(false, std::memory_order_acq_rel)) {
+        slave.state.bKnown = false;
+    }
+
+    // Only send the values that differ from what we've last applied to the slave device.
+    // NOTE: This skips the useless writes caused by echo-notifications of our own master changes,
+    // as well as the "other half" of every plain volume change or plain mute toggle.
+    // NOTE: Exact 0% and 100% targets are always applied, so that tiny differences below the
+    // epsilon can never leave the slave device stuck just short of silence or full volume.
+    const bool bKnown = slave.state.bKnown;
+    const float fEpsilon = m_fVolumeEpsilon.load(std::memory_order_relaxed);
+    const bool volumeChanged = !bKnown ||
+        (fVolume != slave.state.fVolume &&
+            (fabsf(fVolume - slave.state.fVolume) > fEpsilon || fVolume == 0.0f || fVolume == 1.0f));
+    const bool muteChanged = !bKnown || (bMuted ? TRUE : FALSE) != slave.state.bMuted;
+
+    // Find the slave channels whose balance differs from what we've last applied (channel-sync mode only).
+    // NOTE: Changing the slave's volume keeps its balance, so plain volume changes never touch any channel.
+    const bool bChannelsKnown = bKnown && slave.state.bChannelsKnown;
+    float afChannelRatios[MAX_SYNC_CHANNELS];
+    bool channelsChanged = false;
+    if (pChannels != nullptr && this->_getChannelRatios(slave, *pChannels, afChannelRatios)) {
+        for (UINT i = 0; i < slave.nChannels; ++i) {
+            if (!bChannelsKnown || fabsf(afChannelRatios[i] - slave.state.afChannelRatios[i]) > fEpsilon) {
+                channelsChanged = true;
+                break;
+            }
+        }
+    }
+
+    if (!volumeChanged && !muteChanged && !channelsChanged) {
+        if (notifyTime != 0) { m_latencyStats.recordSkipped(); }
         return true;
     }
 
 #ifdef _DEBUG
-    OutputDebugStringA(std::string("SetSlave:" + std::to_string(fVolume) + " " + (bMuted ? "M" : "_") + "\n").c_str());
+    OutputDebugStringA(std::string("SetSlave:" + std::to_string(fVolume) + " " + (bMuted ? "M" : "_") +
+        (volumeChanged ? " V" : "") + (muteChanged ? " T" : "") + "\n").c_str());
 #endif
 
-    // Attempt to set the volume and mute-state, and only return true if both succeeded.
-    HRESULT hr;
-    hr = m_pSlaveEndptVol->SetMasterVolumeLevelScalar(fVolume, &m_processGUID);
-    if (FAILED(hr)) { return false; }
-    hr = m_pSlaveEndptVol->SetMute(bMuted, &m_processGUID);
-    if (FAILED(hr)) { return false; }
+    // Attempt to set the volume and/or mute-state, and only return true if all writes succeeded.
+    // NOTE: If anything fails, we forget the cached state, so that the next attempt re-sends everything.
+    // NOTE: Every failure (including an invalidated endpoint) makes the worker recover the slave, which
+    // re-activates its endpoint until the device works again. If the device has really been removed or
+    // unplugged, the device notifications replace the whole slave as soon as it's available again.
+    HRESULT hr = S_OK;
+    slave.state.bKnown = false;
+    slave.state.bChannelsKnown = false;
+    if (volumeChanged) {
+        hr = slave.pWriteEndptVol->SetMasterVolumeLevelScalar(fVolume, &m_processGUID);
+        if (SUCCEEDED(hr)) { slave.state.fVolume = fVolume; }
+    }
+    if (muteChanged && SUCCEEDED(hr)) {
+        hr = slave.pWriteEndptVol->SetMute(bMuted, &m_processGUID);
+        if (SUCCEEDED(hr)) { slave.state.bMuted = (bMuted ? TRUE : FALSE); }
+    }
+    if (channelsChanged && SUCCEEDED(hr)) {
+        // Only write the channels whose balance has actually changed.
+        for (UINT i = 0; i < slave.nChannels && SUCCEEDED(hr); ++i) {
+            if (bChannelsKnown && fabsf(afChannelRatios[i] - slave.state.afChannelRatios[i]) <= fEpsilon) {
+                continue;
+            }
+            float fLevel = slave.state.fVolume * afChannelRatios[i];
+            hr = slave.pWriteEndptVol->SetChannelVolumeLevelScalar(i, (fLevel < 1.0f) ? fLevel : 1.0f, &m_processGUID);
+            if (SUCCEEDED(hr)) { slave.state.afChannelRatios[i] = afChannelRatios[i]; }
+        }
+    }
+    if (FAILED(hr)) {
+        if (notifyTime != 0) { m_latencyStats.recordFailed(); }
+        return false;
+    }
+    slave.state.bKnown = true;
+    slave.state.bChannelsKnown = channelsChanged || bChannelsKnown;
+
+    // Measure how long it took from the master's notification until the slave device had the new state.
+    // NOTE: The initial link sync has no notification time, so it's never counted in the statistics.
+    if (notifyTime != 0) { m_latencyStats.recordLatency(notifyTime); }
+
+    return true;
+}
+
+bool AudioDeviceManager::_setMasterVolumeFromSlave(
+    LinkGroup& group,
+    float fVolume,
+    BOOL bMuted) noexcept
+{
+    // NOTE: This is executed by the master worker thread, whenever a slave has been changed by someone else.
+    if (!this->_isMasterConnected(group)) {
+        return true;
+    }
+
+    // Tag the writes with the sequence number of the slave change, which lets the master's callback skip
+    // every slave that has changed on its own since then (including the slave that this change came from).
+    // NOTE: If the worker coalesced several slave changes, this is the number of the newest one.
+    GUID eventContext = this->_makeReflectContext(group.pendingReflectSequence.load(std::memory_order_acquire));
+
+    // NOTE: The mute-state is only written if it differs, since most slave changes only affect the volume.
+    // NOTE: Failures are ignored (the worker keeps running), since the slave already has the new state, and
+    // the master simply catches up with the next change. A missing master reconnects the whole link anyway.
+    this->_setMasterLevel(group, fVolume, &eventContext);
+    if ((bMuted != FALSE) != group.bMasterMuted.load()) {
+        this->_setMasterMuteState(group, bMuted, &eventContext);
+    }
+
+    return true;
+}
+
+bool AudioDeviceManager::_recoverSlave(
+    SlaveLink& slave) noexcept
+{
+    // NOTE: This is executed by the slave worker thread, after it has failed to apply a volume (and waited a
+    // little while). Such failures are usually transient, such as a driver reset, which invalidates the
+    // endpoint interface even though the device itself stays present. So we simply activate a brand new
+    // interface for the same device, without involving the engine thread, the other slaves or COM itself.
+    // The worker then resyncs the newest master state, and keeps retrying (with backoff) if this fails.
+    // NOTE: Everything else about the slave (its own bidirectional callback, and the device's cached interface)
+    // is moved onto a new interface by the engine thread, which we queue like any other device change.
+    wil::com_ptr_nothrow<IMMDevice> pDevice;
+    DWORD dwState;
+    if (FAILED(m_pBackend->getDevice(slave.deviceId.c_str(), pDevice)) ||
+        FAILED(pDevice->GetState(&dwState)) || dwState != DEVICE_STATE_ACTIVE) {
+        return false;
+    }
+
+    wil::com_ptr_nothrow<IAudioEndpointVolume> pEndptVol;
+    HRESULT hr = pDevice->Activate(__uuidof(IAudioEndpointVolume),
+        CLSCTX_ALL, NULL, (void**)& pEndptVol);
+    if (FAILED(hr)) {
+        return false;
+    }
+
+    // We know nothing about the new interface's state, so the resync re-sends everything.
+    slave.pWriteEndptVol = std::move(pEndptVol);
+    slave.state = {};
+    m_latencyStats.recordRecovered();
+    try {
+        this->_onDeviceCallback(slave.deviceId.c_str(), false, false, true);
+    }
+    catch (...) {}
+
+#ifdef _DEBUG
+    OutputDebugStringW(L"RecoveredSlave:");
+    OutputDebugStringW(slave.deviceId.c_str());
+    OutputDebugStringW(L"\n");
+#endif
 
     return true;
 }
 
+void AudioDeviceManager::_onSlaveHealthChanged() noexcept
+{
+    // NOTE: This is executed by a slave worker thread, whenever it starts or finishes recovering its device.
+    // We simply tell the dialog, so that it can display the link's health without ever polling for it.
+    if (m_hDialog != NULL && m_uRefreshMessage != 0) {
+        PostMessage(m_hDialog, m_uRefreshMessage, DIALOG_REFRESH_HEALTH, 0);
+    }
+}
+
 void AudioDeviceManager::_onVolumeCallback(
-    const PAUDIO_VOLUME_NOTIFICATION_DATA& pNotify)
+    LinkGroup& group,
+    const VolumeNotification& notification,
+    LONGLONG notifyTime) noexcept
 {
+    // NOTE: This is executed by the audio service's notification thread, once per master volume change, which can
+    // mean thousands of times per second. Everything here works on the stack (or on preallocated memory), and
+    // never allocates, throws or blocks on anything slower than the shared link lock.
+    m_latencyStats.recordEvent();
+
+    // Prevent the link from being torn down while we're looking at it.
+    auto lock = m_linkLock.lock_shared();
+
     // Do nothing if the callback was somehow triggered while we don't have any linked master/slave devices.
-    if (!m_bLinkActive || !m_pMasterEndptVol || !m_pSlaveEndptVol) {
+    if (!group.bLinkActive || group.slaves.empty()) {
+        m_latencyStats.recordDropped();
         return;
     }
 
+    // Remember the master's latest mute-state.
+    group.bMasterMuted = (notification.bMuted != FALSE);
+
+    // Tell the event stream's subscribers (if any) about the change.
+    // NOTE: This only copies the state into their queues, so a slow subscriber can never delay the slaves.
+    auto pEventStream = m_pEventStream.load(std::memory_order_acquire);
+    if (pEventStream != nullptr) {
+        pEventStream->publish(group.groupIdx.load(std::memory_order_relaxed), notification.fMasterVolume, notification.bMuted,
+            notification.channels.nChannels, notification.channels.afLevels, notifyTime);
+    }
+
     // Update dialog if the volume event wasn't sent by our own program...
-    if (pNotify->guidEventContext != m_processGUID) {
-        this->_updateDialog(pNotify->fMasterVolume, pNotify->bMuted);
-    }
-
-    // Sync the volume to the slave device (regardless of who changed the master device's volume)...
-    bool success = this->_setSlaveVolume(pNotify->fMasterVolume, pNotify->bMuted);
-    if (!success && m_hDialog != NULL) {
-        // Quit the whole program (close the main dialog) if slave volume failed.
-        // NOTE: Posting a WM_CLOSE is the correct way to "close a window". However, it doesn't support
-        // signaling that there was an error. So we'll transmit that by setting our class "exit code" value.
-        m_exitCode = 1;
-        MessageBoxW(m_hDialog, L"Failed to sync master volume to slave device in callback. The program will now exit.",
-            L"Fatal Error", MB_OK);
-        PostMessage(m_hDialog, WM_CLOSE, 0, 0);
+    if (notification.guidEventContext != m_processGUID) {
+        this->_updateDialog(group, notification.fMasterVolume, notification.bMuted);
+    }
+
+    // Only hand the master's channel levels over to the slaves in channel-sync mode.
+    const ChannelVolumes* pChannels = m_bChannelSync.load(std::memory_order_relaxed) ? &notification.channels : nullptr;
+
+    // Detect whether we've changed the master on behalf of a slave (bidirectional mode).
+    uint32_t reflectSequence = 0;
+    bool isReflected = this->_readReflectContext(notification.guidEventContext, reflectSequence);
+
+    // Hand the volume over to every slave worker (regardless of who changed the master device's volume)...
+    // NOTE: This returns immediately. If several changes arrive while a worker is busy talking to its
+    // slave device, they replace each other in its mailbox and only the newest one is applied.
+    for (auto& slave : group.slaves) {
+        // Never echo a slave's own change back to it, and never overwrite a slave with an older state than
+        // its own latest change, since that would make two devices "fight" while their knobs are being turned.
+        // NOTE: The sequence numbers are compared with wrap-around, so they keep working after overflowing.
+        if (isReflected &&
+            static_cast<int32_t>(slave->ownSequence.load(std::memory_order_relaxed) - reflectSequence) >= 0) {
+            continue;
+        }
+
+        if (slave->worker->post(notification.fMasterVolume, notification.bMuted, notifyTime, pChannels)) {
+            m_latencyStats.recordCoalesced();
+        }
+    }
+}
+
+void AudioDeviceManager::_onSessionVolumeCallback(
+    LinkGroup& group,
+    float fVolume,
+    BOOL bMuted,
+    LPCGUID pEventContext,
+    LONGLONG notifyTime) noexcept
+{
+    // NOTE: This is executed by the audio service's notification thread, whenever the master session has changed.
+    // We simply describe the change like an endpoint notification (without any channels), which means that sessions
+    // get exactly the same echo suppression, coalescing and statistics as master devices.
+    VolumeNotification notification = {};
+    notification.guidEventContext = (pEventContext != NULL) ? *pEventContext : GUID_NULL;
+    notification.bMuted = (bMuted ? TRUE : FALSE);
+    notification.fMasterVolume = fVolume;
+    notification.channels.nChannels = 0;
+    this->_onVolumeCallback(group, notification, notifyTime);
+}
+
+void AudioDeviceManager::_onVolumeCallback(
+    SlaveLink& slave,
+    const VolumeNotification& notification,
+    LONGLONG) noexcept
+{
+    // NOTE: This is executed by the audio service's notification thread, whenever a slave has changed
+    // (bidirectional mode only). Every write that we make to a slave is tagged with our process GUID,
+    // so those echoes are ignored here, which is what stops the devices from bouncing states back and forth.
+    if (notification.guidEventContext == m_processGUID) {
         return;
     }
+    LinkGroup& group = *slave.pGroup;
+    SlaveLink* pSlave = &slave;
+
+    // Prevent the link from being torn down while we're looking at it.
+    auto lock = m_linkLock.lock_shared();
+
+    // Ignore late notifications from slaves that aren't linked anymore.
+    if (!group.bLinkActive || !group.masterWorker ||
+        std::find_if(group.slaves.begin(), group.slaves.end(), [pSlave](const std::unique_ptr<SlaveLink>& other) -> bool
+            {
+                return other.get() == pSlave;
+            }) == group.slaves.end()) {
+        return;
+    }
+
+    // The slave's worker no longer knows the slave's real state, so it must not skip its next write.
+    pSlave->bStateStale.store(true, std::memory_order_release);
+
+    // A slave whose curve can't be translated back (because it falls somewhere) is never synced back to the master.
+    if (!pSlave->curve.isInvertible()) {
+        return;
+    }
+
+    // Number this change, and remember it as the slave's own latest change.
+    uint32_t sequence = m_reflectSequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    pSlave->ownSequence.store(sequence, std::memory_order_relaxed);
+
+    // Sync the change to the master (translated back through the slave's curve). Its callback then syncs it to
+    // all of the other slaves.
+    group.pendingReflectSequence.store(sequence, std::memory_order_release);
+    group.masterWorker->post(pSlave->curve.unmap(notification.fMasterVolume), notification.bMuted);
+}
+
+void AudioDeviceManager::_onDeviceCallback(
+    LPCWSTR pwstrDeviceId,
+    bool bStateChanged,
+    bool bSessionsChanged,
+    bool bRecovered)
+{
+    // NOTE: This is executed by the audio service's notification thread, which must never be
+    // blocked, and which isn't allowed to use the device enumerator. So we only queue the device
+    // here, and let the audio engine's thread (which owns the device list) process it via processDeviceChanges().
+    // NOTE: Devices that are already queued aren't queued again, since all changes for a device
+    // are handled by re-reading its current state anyway.
+    bool wasEmpty;
+    {
+        auto lock = m_pendingDeviceLock.lock_exclusive();
+        wasEmpty = m_pendingDeviceChanges.empty();
+        auto it = std::find_if(m_pendingDeviceChanges.begin(), m_pendingDeviceChanges.end(), [pwstrDeviceId](PendingDeviceChange& pending) -> bool
+            {
+                return pending.deviceId == pwstrDeviceId;
+            });
+        if (it != m_pendingDeviceChanges.end()) {
+            it->bStateChanged = it->bStateChanged || bStateChanged;
+            it->bSessionsChanged = it->bSessionsChanged || bSessionsChanged;
+            it->bRecovered = it->bRecovered || bRecovered;
+        }
+        else {
+            m_pendingDeviceChanges.push_back({ wstring(pwstrDeviceId), bStateChanged, bSessionsChanged, bRecovered });
+        }
+    }
+
+    // Wake up the owner, unless a wake-up is already pending (the queue wasn't empty).
+    if (wasEmpty && m_deviceChangeCallback) {
+        m_deviceChangeCallback();
+    }
 }
@@ -20,46 +20,242 @@
 #pragma once
 
 #include "framework.h"
+#include "AudioBackend.h"
 #include "AudioDevice.h"
 #include "AudioEndpointVolumeCallback.h"
+#include "AudioDeviceNotificationClient.h"
+#include "SlaveVolumeWorker.h"
+#include "LatencyStats.h"
+#include "VolumeCurve.h"
+#include "DeviceClaim.h"
+#include "VolumeEventStream.h"
 
 using std::vector;
+using std::wstring;
+
+// Last volume/mute state that was successfully applied to a slave device.
+struct SlaveVolumeState
+{
+    bool bKnown; // False if we don't know the slave's state (nothing applied yet, or last write failed).
+    float fVolume;
+    BOOL bMuted;
+    bool bChannelsKnown; // False if we don't know the slave's channel balance (always false unless bKnown).
+    float afChannelRatios[MAX_SYNC_CHANNELS]; // Level of each channel relative to the loudest one.
+};
+
+// The dialog's refresh message carries this WPARAM when a slave has started (or finished) recovering from a failure,
+// instead of a new master volume.
+static const WPARAM DIALOG_REFRESH_HEALTH = 1;
+
+// Special master channel numbers for the slave channel mapping.
+static const int CHANNEL_SOURCE_DEFAULT = -1; // Automatic mapping (such as a stereo master onto a 5.1 slave).
+static const int CHANNEL_SOURCE_AVERAGE = -2; // Average of all master channels (such as for center and LFE).
+
+// User settings for mirroring the master's channel balance onto a slave device.
+struct SlaveChannelSettings
+{
+    vector<int> sources; // Master channel (or CHANNEL_SOURCE_*) for each slave channel. Missing = default.
+    vector<float> trims; // Relative level of each slave channel. Missing = 1.0.
+};
+
+// NOTE: The volume callbacks are bound to the manager's handlers at compile time, so these are declared up front.
+class AudioDeviceManager;
+struct LinkGroup;
+
+// A single linked slave device. Every slave has its own worker thread, which means that
+// the volume is fanned out to all slaves in parallel, and that a slow device never delays
+// any of the others.
+struct SlaveLink
+{
+    wstring deviceId;
+    wil::com_ptr_nothrow<IAudioEndpointVolume> pEndptVol;
+    wil::com_ptr_nothrow<IAudioEndpointVolume> pWriteEndptVol; // What the writes go through. Replaced by the worker when it recovers the slave.
+    VolumeCurve curve; // Translates the master's volume into this slave's volume.
+    UINT nChannels; // Number of slave channels that are synced in channel-sync mode (at most MAX_SYNC_CHANNELS).
+    int aiChannelSources[MAX_SYNC_CHANNELS]; // Master channel that each slave channel mirrors.
+    float afChannelTrims[MAX_SYNC_CHANNELS]; // Relative level of each slave channel.
+    SlaveVolumeState state; // Only accessed by whichever thread is currently syncing this slave. Holds curve-mapped volumes.
+    std::atomic<bool> bStateStale; // Set when someone else has changed the slave, which means that "state" can't be trusted.
+    std::atomic<uint32_t> ownSequence; // Sequence number of the slave's own latest change (bidirectional mode).
+    LinkGroup* pGroup; // The group that the slave belongs to (groups are never moved in memory).
+    AudioEndpointVolumeCallback<AudioDeviceManager, SlaveLink> callback; // Receives the slave's own volume changes (bidirectional mode).
+    bool bCallbackRegistered;
+    std::unique_ptr<SlaveVolumeWorker> worker; // NOTE: Declared last, so it's destroyed (stopped) first.
+};
+
+// A single master device and the slave devices that it's linked to. Every group has its own master callback,
+// which means that any number of groups sync independently of each other, all within the same process.
+struct LinkGroup
+{
+    std::atomic<size_t> groupIdx; // The group's position in the manager's list (kept up to date for the volume callbacks).
+    bool bLinkActive;
+    wstring masterDeviceId; // The link is remembered by device IDs, so that it survives hot-plugging.
+    vector<wstring> slaveDeviceIds;
+    ptrdiff_t iMasterDeviceIdx;
+    vector<ptrdiff_t> slaveDeviceIdxs;
+    wil::com_ptr_nothrow<IAudioEndpointVolume> pMasterEndptVol;
+    std::atomic<bool> bMasterMuted; // Latest known mute-state of the master device.
+    bool bCallbackRegistered;
+    vector<std::unique_ptr<SlaveLink>> slaves;
+    std::unique_ptr<SlaveVolumeWorker> masterWorker; // Applies slave changes to the master device (bidirectional mode).
+    std::atomic<uint32_t> pendingReflectSequence; // Sequence number of the slave change that the master worker applies next.
+    AudioEndpointVolumeCallback<AudioDeviceManager, LinkGroup> callback; // Receives the master device's volume changes.
+    wstring masterSessionName; // If set, the master is this program's audio session on the master device (such as "game.exe").
+    wil::com_ptr_nothrow<IAudioSessionControl2> pMasterSession;
+    wil::com_ptr_nothrow<ISimpleAudioVolume> pMasterSessionVol; // Used instead of pMasterEndptVol while a session is the master.
+    AudioSessionEventsCallback sessionCallback; // Receives the master session's volume changes.
+    bool bSessionCallbackRegistered;
+    vector<DeviceClaim> deviceClaims; // Machine-wide claims of the linked devices (held while the link is active).
+};
+
+// A single change to the device list, which lets the GUI mirror the list without rebuilding it.
+// NOTE: The changes must be applied in the given order, since every index refers to the list
+// as it looks after all of the earlier changes have been applied.
+// NOTE: A resync marker means that every earlier change is obsolete, and that the changes which
+// follow it turn the list that the GUI has handed to AudioEngine::requestDeviceListResync() into
+// the engine's list.
+struct DeviceListChange
+{
+    enum class Type { Added, Removed, Resync };
+    Type type;
+    ptrdiff_t idx;
+    wstring name; // Name of the added device (empty for removals).
+    wstring deviceId; // ID of the added device (empty for removals).
+};
+
+// Hash for device IDs, which allows looking them up via "std::wstring_view" without creating temporary strings.
+struct DeviceIdHash
+{
+    using is_transparent = void;
+
+    size_t operator()(std::wstring_view deviceId) const noexcept
+    {
+        return std::hash<std::wstring_view>{}(deviceId);
+    }
+};
+
+// A device which has reported changes that haven't been processed yet.
+struct PendingDeviceChange
+{
+    wstring deviceId;
+    bool bStateChanged; // False if only the device's properties (such as its name) have changed.
+    bool bSessionsChanged; // True if the device's audio sessions have changed (such as when a program starts playing).
+    bool bRecovered; // True if a slave worker has re-opened the device (so its link must move to a new interface too).
+};
 
 class AudioDeviceManager
 {
 private:
-    int m_exitCode;
     GUID m_processGUID;
     HWND m_hDialog;
-    ptrdiff_t m_iMuteCheckboxID;
-    ptrdiff_t m_iVolumeSliderID;
-    wil::com_ptr_nothrow<IMMDeviceEnumerator> m_pEnumerator;
-    wil::com_ptr_nothrow<IMMDeviceCollection> m_pCollection;
-    size_t m_collectionCount;
+    HWND m_hMuteCheckbox;
+    HWND m_hVolumeSlider;
+    UINT m_uRefreshMessage;
+    std::atomic<uint64_t> m_dialogState; // Newest master volume/mute-state to display in the dialog.
+    std::atomic<bool> m_bDialogRefreshPending; // Whether a refresh message has been posted but not handled yet.
+    std::shared_ptr<AudioBackend> m_pBackend; // NOTE: Declared before the devices, so that it outlives them.
+    size_t m_nextItemOffset;
     std::vector<AudioDevice> m_audioDevices;
-    bool m_bLinkActive;
-    ptrdiff_t m_iMasterDeviceIdx;
-    ptrdiff_t m_iSlaveDeviceIdx;
-    wil::com_ptr_nothrow<IAudioEndpointVolume> m_pMasterEndptVol;
-    wil::com_ptr_nothrow<IAudioEndpointVolume> m_pSlaveEndptVol;
-    AudioEndpointVolumeCallback m_endpointVolumeCallback;
+    std::unordered_map<wstring, size_t, DeviceIdHash, std::equal_to<>> m_deviceIdxs; // Device ID -> offset in m_audioDevices.
+    bool m_bDeviceListSorted; // False until sortDeviceList(), which means that the devices are in enumeration order.
+    vector<std::unique_ptr<LinkGroup>> m_groups; // Always contains at least one group. Only changed by the engine thread.
+    std::atomic<LinkGroup*> m_pDialogGroup; // The group whose master volume is displayed in the dialog.
+    wil::srwlock m_linkLock; // Protects the link state of all groups against concurrent volume callbacks.
+    std::atomic<float> m_fVolumeEpsilon;
+    DWORD m_dwRampTime; // Duration of the slave volume ramps (in milliseconds), or 0 to apply every change instantly.
+    std::unordered_map<wstring, VolumeCurve, DeviceIdHash, std::equal_to<>> m_slaveCurves; // Slave device ID -> volume curve.
+    std::atomic<bool> m_bChannelSync; // Whether the master's channel balance is mirrored onto the slaves.
+    std::unordered_map<wstring, SlaveChannelSettings, DeviceIdHash, std::equal_to<>> m_slaveChannels; // Slave device ID -> channel settings.
+    bool m_bBidirectional; // Whether the slaves' own volume changes are synced back to the master (and the other slaves).
+    GUID m_reflectGUID; // Event context for master changes made on behalf of a slave (carries a sequence number).
+    std::atomic<uint32_t> m_reflectSequence; // Sequence number of the newest slave change.
+    LatencyStats m_latencyStats;
+    std::atomic<VolumeEventStream*> m_pEventStream; // Receives every master volume change (or NULL).
+    AudioDeviceNotificationClient m_deviceNotificationClient;
+    bool m_bDeviceNotificationsRegistered;
+    vector<PendingDeviceChange> m_pendingDeviceChanges; // Devices that have changed since the last processDeviceChanges().
+    wil::srwlock m_pendingDeviceLock; // Protects the pending device list against concurrent device notifications.
+    std::function<void()> m_deviceChangeCallback; // Tells the owner that processDeviceChanges() has work to do.
+
+    void _rebuildDeviceIdxs();
+    void _eraseDevice(size_t idx);
+    void _insertDevice(AudioDevice device, vector<DeviceListChange>& changes);
+    bool _refreshDevice(const PendingDeviceChange& pending, vector<DeviceListChange>& changes);
+    LinkGroup* _getGroup(size_t groupIdx) const noexcept;
+    LinkGroup* _findSlaveGroup(std::wstring_view deviceId) const noexcept;
+    void _updateLinkIdxs(LinkGroup& group);
+    void _connectLink(LinkGroup& group);
+    void _connectMasterSession(LinkGroup& group, const AudioDevice& masterDevice);
+    bool _isMasterConnected(const LinkGroup& group) noexcept;
+    bool _getMasterState(const LinkGroup& group, float& fVolume, BOOL& bMuted) noexcept;
+    HRESULT _setMasterLevel(LinkGroup& group, float fVolume, LPCGUID pEventContext) noexcept;
+    HRESULT _setMasterMuteState(LinkGroup& group, BOOL bMuted, LPCGUID pEventContext) noexcept;
+    void _disconnectLink(LinkGroup& group) noexcept;
+    std::unique_ptr<SlaveLink> _connectSlave(LinkGroup& group, ptrdiff_t slaveIdx, float fMasterVolume, BOOL bMuted);
+    void _reconnectSlave(LinkGroup& group, const wstring& deviceId) noexcept;
+    void _reconnectLink(LinkGroup& group) noexcept;
+    void _rebindSlave(const wstring& deviceId) noexcept;
+    void _reconnectAllLinks() noexcept;
+    void _registerSlaveCallback(SlaveLink& slave) noexcept;
+    void _releaseSlaves(vector<std::unique_ptr<SlaveLink>>& slaves) noexcept;
+    GUID _makeReflectContext(uint32_t sequence) noexcept;
+    bool _readReflectContext(const GUID& eventContext, uint32_t& sequence) noexcept;
+    void _updateDialog(LinkGroup& group, float fMasterVolume, BOOL bMuted) noexcept;
+    void _readMasterChannels(LinkGroup& group, ChannelVolumes& channels) noexcept;
+    bool _getChannelRatios(const SlaveLink& slave, const ChannelVolumes& channels, float* afRatios) noexcept;
+    bool _setSlaveVolume(SlaveLink& slave, float fVolume, BOOL bMuted, LONGLONG notifyTime = 0, const ChannelVolumes* pChannels = nullptr) noexcept;
+    bool _setMasterVolumeFromSlave(LinkGroup& group, float fVolume, BOOL bMuted) noexcept;
+    bool _recoverSlave(SlaveLink& slave) noexcept;
+    void _onSlaveHealthChanged() noexcept;
+    void _onVolumeCallback(LinkGroup& group, const VolumeNotification& notification, LONGLONG notifyTime) noexcept;
+    void _onVolumeCallback(SlaveLink& slave, const VolumeNotification& notification, LONGLONG notifyTime) noexcept;
+    void _onSessionVolumeCallback(LinkGroup& group, float fVolume, BOOL bMuted, LPCGUID pEventContext, LONGLONG notifyTime) noexcept;
+    void _onDeviceCallback(LPCWSTR pwstrDeviceId, bool bStateChanged, bool bSessionsChanged = false, bool bRecovered = false);
 
-    void _updateDialog(float fMasterVolume, BOOL bMuted);
-    bool _setSlaveVolume(float fVolume, BOOL bMuted) noexcept;
-    void _onVolumeCallback(const PAUDIO_VOLUME_NOTIFICATION_DATA& pNotify);
+    // The endpoint volume callbacks call our private "_onVolumeCallback" handlers directly.
+    template <class TReceiver, class TContext> friend class AudioEndpointVolumeCallback;
 
 public:
-    AudioDeviceManager(GUID processGUID);
+    AudioDeviceManager(GUID processGUID, std::function<void()> deviceChangeCallback, std::shared_ptr<AudioBackend> pBackend = nullptr);
     ~AudioDeviceManager();
-    int getExitCode() noexcept;
-    const vector<AudioDevice>& getAudioDevices();
-    const AudioDevice& getDevice(ptrdiff_t idx);
-    bool isLinkActive() noexcept;
-    void linkDevices(ptrdiff_t masterIdx, ptrdiff_t slaveIdx);
-    void unlinkDevices() noexcept;
-    ptrdiff_t getMasterDeviceIdx() noexcept;
-    ptrdiff_t getSlaveDeviceIdx() noexcept;
-    void setDialog(HWND hDlg, ptrdiff_t muteCheckbox, ptrdiff_t volumeSlider);
-    bool setMasterVolume(float fVolume) noexcept;
-    bool setMasterMute(BOOL bMuted) noexcept;
+    const vector<AudioDevice>& getAudioDevices() const noexcept;
+    bool sortDeviceList();
+    const AudioDevice& getDevice(ptrdiff_t idx) const;
+    ptrdiff_t findDeviceIdx(std::wstring_view deviceId) const noexcept;
+    size_t getLinkGroupCount() const noexcept;
+    size_t addLinkGroup();
+    void removeLinkGroup(size_t groupIdx) noexcept;
+    void setDialogLinkGroup(size_t groupIdx) noexcept;
+    bool isLinkActive(size_t groupIdx) noexcept;
+    void linkDevices(size_t groupIdx, ptrdiff_t masterIdx, const vector<ptrdiff_t>& slaveIdxs);
+    void linkDevices(size_t groupIdx, const wstring& masterDeviceId, const vector<wstring>& slaveDeviceIds);
+    void unlinkDevices(size_t groupIdx) noexcept;
+    void unlinkAllDevices() noexcept;
+    ptrdiff_t getMasterDeviceIdx(size_t groupIdx) noexcept;
+    const vector<ptrdiff_t>& getSlaveDeviceIdxs(size_t groupIdx) noexcept;
+    const wstring& getMasterDeviceId(size_t groupIdx) noexcept;
+    const vector<wstring>& getSlaveDeviceIds(size_t groupIdx) noexcept;
+    void setMasterSession(size_t groupIdx, const wstring& processName) noexcept;
+    float getVolumeEpsilon() noexcept;
+    void setVolumeEpsilon(float fEpsilon) noexcept;
+    void setRampTime(DWORD dwRampTime) noexcept;
+    void setSlaveCurve(const wstring& deviceId, const VolumeCurveSettings& settings);
+    void clearSlaveCurves() noexcept;
+    bool isChannelSync() noexcept;
+    void setChannelSync(bool bChannelSync) noexcept;
+    void setSlaveChannels(const wstring& deviceId, const SlaveChannelSettings& settings);
+    bool isBidirectional() noexcept;
+    void setBidirectional(bool bBidirectional) noexcept;
+    vector<DeviceListChange> processDeviceChanges();
+    void setDialog(HWND hDlg, ptrdiff_t muteCheckbox, ptrdiff_t volumeSlider, UINT refreshMessage);
+    void processDialogRefresh(bool bDisplay) noexcept;
+    bool setMasterVolume(size_t groupIdx, float fVolume) noexcept;
+    bool setMasterMute(size_t groupIdx, BOOL bMuted) noexcept;
+    bool isMasterMuted(size_t groupIdx) noexcept;
+    bool getMasterState(size_t groupIdx, float& fVolume, BOOL& bMuted) noexcept;
+    size_t getDegradedSlaveCount() noexcept;
+    std::wstring getDiagnosticsReport();
+    LatencyStats::Report getLatencyReport();
+    IAudioEndpointVolumeCallback* getMasterCallback(size_t groupIdx) noexcept;
+    void setEventStream(VolumeEventStream* pEventStream) noexcept;
 };
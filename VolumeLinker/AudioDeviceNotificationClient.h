@@ -0,0 +1,175 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "framework.h"
+#include "WakeupStats.h"
+
+//-----------------------------------------------------------
+// Client implementation of IMMNotificationClient interface.
+// The audio service calls these methods whenever an audio
+// endpoint device is added, removed, changes state (such as
+// being unplugged) or changes any of its properties. We only
+// report WHICH device has changed (and whether its presence
+// or state may have changed), since the receiver always
+// re-queries the device's current state anyway. That also
+// means that bursts of notifications for one device can be
+// safely collapsed into a single update.
+//-----------------------------------------------------------
+class AudioDeviceNotificationClient : public IMMNotificationClient
+{
+    LONG m_references; // Reference counter.
+    std::function<void(LPCWSTR, bool)> m_externalCallback;
+
+    void _notify(
+        LPCWSTR pwstrDeviceId,
+        bool bStateChanged) noexcept
+    {
+        if (pwstrDeviceId == NULL) {
+            return;
+        }
+
+#ifdef _DEBUG
+        OutputDebugStringW((std::wstring(L"DeviceChanged:") + pwstrDeviceId + L"\n").c_str());
+#endif
+
+        // Execute any registered callback, but BLOCK any exceptions it throws.
+        try {
+            if (m_externalCallback) {
+                m_externalCallback(pwstrDeviceId, bStateChanged); // Throws if invalid (or throwing) callback.
+            }
+        }
+        catch (...) {}
+    }
+
+public:
+    AudioDeviceNotificationClient() :
+        m_references(1) // Set counter to 1 reference when constructed.
+    {
+    }
+
+    ~AudioDeviceNotificationClient()
+    {
+    }
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef() noexcept
+    {
+        return InterlockedIncrement(&m_references);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() noexcept
+    {
+        ULONG const refCount = InterlockedDecrement(&m_references);
+        if (0 == refCount) {
+            delete this;
+        }
+        return refCount;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+        REFIID riid,
+        VOID** ppvInterface) noexcept
+    {
+        if (IID_IUnknown == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IUnknown*>(this);
+        }
+        else if (__uuidof(IMMNotificationClient) == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IMMNotificationClient*>(this);
+        }
+        else {
+            *ppvInterface = NULL;
+            return E_NOINTERFACE;
+        }
+        return S_OK;
+    }
+
+    // Callback methods for device-change notifications.
+    // NOTE: These are executed on one of the audio service's threads, and must never block,
+    // which is why the external callback is only supposed to queue the change for later.
+
+    HRESULT STDMETHODCALLTYPE OnDeviceAdded(
+        LPCWSTR pwstrDeviceId) noexcept
+    {
+        WakeupStats::record(WakeSource::DeviceCallback);
+        _notify(pwstrDeviceId, true);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceRemoved(
+        LPCWSTR pwstrDeviceId) noexcept
+    {
+        WakeupStats::record(WakeSource::DeviceCallback);
+        _notify(pwstrDeviceId, true);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(
+        LPCWSTR pwstrDeviceId,
+        DWORD dwNewState) noexcept
+    {
+        WakeupStats::record(WakeSource::DeviceCallback);
+        UNREFERENCED_PARAMETER(dwNewState);
+        _notify(pwstrDeviceId, true);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(
+        EDataFlow flow,
+        ERole role,
+        LPCWSTR pwstrDefaultDeviceId) noexcept
+    {
+        WakeupStats::record(WakeSource::DeviceCallback);
+        // We never follow the default device, so this doesn't affect us.
+        UNREFERENCED_PARAMETER(flow);
+        UNREFERENCED_PARAMETER(role);
+        UNREFERENCED_PARAMETER(pwstrDefaultDeviceId);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(
+        LPCWSTR pwstrDeviceId,
+        const PROPERTYKEY key) noexcept
+    {
+        WakeupStats::record(WakeSource::DeviceCallback);
+        // Devices constantly report changes of various internal properties, but the only
+        // property that we display (and sort by) is the device's name. Ignore the rest.
+        if (key.fmtid == PKEY_Device_FriendlyName.fmtid && key.pid == PKEY_Device_FriendlyName.pid) {
+            _notify(pwstrDeviceId, false);
+        }
+        return S_OK;
+    }
+
+    // Registering or unregistering external callback.
+
+    void registerCallback(
+        std::function<void(LPCWSTR, bool)> callback)
+    {
+        m_externalCallback = callback;
+    }
+
+    void unregisterCallback()
+    {
+        m_externalCallback = nullptr;
+    }
+};
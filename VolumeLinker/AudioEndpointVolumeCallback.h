@@ -20,6 +20,47 @@
 #pragma once
 
 #include "framework.h"
+#include "LatencyStats.h"
+#include "SlaveVolumeWorker.h"
+#include "WakeupStats.h"
+
+// Fixed-size copy of an endpoint volume notification. The audio service's notification data has a variable
+// number of channels, so it's validated and copied exactly once, which means that the rest of the notification
+// path only ever deals with this plain struct (which lives on the stack, and never allocates any memory).
+struct VolumeNotification
+{
+    GUID guidEventContext;
+    BOOL bMuted;
+    float fMasterVolume;
+    ChannelVolumes channels; // NOTE: Only the first MAX_SYNC_CHANNELS channels are kept.
+
+    static bool fromNotify(
+        const AUDIO_VOLUME_NOTIFICATION_DATA* pNotify,
+        VolumeNotification& notification) noexcept
+    {
+        // Reject anything that isn't a real volume level (the comparison is false for NaN too).
+        if (pNotify == NULL || !(pNotify->fMasterVolume >= 0.0f && pNotify->fMasterVolume <= 1.0f)) {
+            return false;
+        }
+
+        notification.guidEventContext = pNotify->guidEventContext;
+        notification.bMuted = (pNotify->bMuted ? TRUE : FALSE);
+        notification.fMasterVolume = pNotify->fMasterVolume;
+
+        // NOTE: Invalid channel levels are clamped instead of rejecting the whole notification, since the
+        // master volume and mute-state are still perfectly usable.
+        UINT nChannels = (pNotify->nChannels < MAX_SYNC_CHANNELS) ? pNotify->nChannels : MAX_SYNC_CHANNELS;
+        notification.channels.nChannels = nChannels;
+        for (UINT i = 0; i < nChannels; ++i) {
+            float fLevel = pNotify->afChannelVolumes[i];
+            notification.channels.afLevels[i] = (fLevel >= 0.0f) ? ((fLevel <= 1.0f) ? fLevel : 1.0f) : 0.0f;
+        }
+
+        return true;
+    }
+};
+
+static_assert(std::is_trivially_copyable<VolumeNotification>::value, "VolumeNotification must be a plain struct.");
 
 //-----------------------------------------------------------
 // Client implementation of IAudioEndpointVolumeCallback
@@ -27,15 +68,26 @@
 // interface changes the volume level or muting state of the
 // endpoint device, the change initiates a call to the
 // client's IAudioEndpointVolumeCallback::OnNotify method.
+//
+// The notification is forwarded straight to the receiver's
+// "_onVolumeCallback(TContext&, ...)" overload, which is
+// bound at compile time. This keeps the whole path free of
+// any indirection, allocation or exception handling, since
+// it's invoked thousands of times per second while someone
+// drags a volume slider.
 //-----------------------------------------------------------
+template <class TReceiver, class TContext>
 class AudioEndpointVolumeCallback : public IAudioEndpointVolumeCallback
 {
     LONG m_references; // Reference counter.
-    std::function<void(const PAUDIO_VOLUME_NOTIFICATION_DATA&)> m_externalCallback;
+    std::atomic<TReceiver*> m_pReceiver; // NULL while no callback is registered.
+    TContext* m_pContext;
 
 public:
     AudioEndpointVolumeCallback() :
-        m_references(1) // Set counter to 1 reference when constructed.
+        m_references(1), // Set counter to 1 reference when constructed.
+        m_pReceiver(nullptr),
+        m_pContext(nullptr)
     {
     }
 
@@ -81,37 +133,41 @@ public:
     // Callback method for endpoint-volume-change notifications.
 
     HRESULT STDMETHODCALLTYPE OnNotify(
-        PAUDIO_VOLUME_NOTIFICATION_DATA pNotify)
+        PAUDIO_VOLUME_NOTIFICATION_DATA pNotify) noexcept
     {
-        if (pNotify == NULL) {
+        // Timestamp the notification first, so that the propagation latency includes all of our own work.
+        // NOTE: QueryPerformanceCounter only takes a few nanoseconds, so it's always done (even in release builds).
+        LONGLONG notifyTime = LatencyStats::now();
+        WakeupStats::record(WakeSource::VolumeCallback);
+
+        VolumeNotification notification;
+        if (!VolumeNotification::fromNotify(pNotify, notification)) {
             return E_INVALIDARG;
         }
 
-#ifdef _DEBUG
-        OutputDebugStringA(std::string("Callback:" + std::to_string(pNotify->fMasterVolume) + " " + (pNotify->bMuted ? "M" : "_") + "\n").c_str());
-#endif
-
-        // Execute any registered callback, but BLOCK any exceptions it throws.
-        try {
-            if (m_externalCallback) {
-                m_externalCallback(pNotify); // Throws if invalid (or throwing) callback.
-            }
+        // Execute the registered receiver (if any).
+        // NOTE: The receiver's handler is noexcept, so there's nothing to catch here.
+        TReceiver* pReceiver = m_pReceiver.load(std::memory_order_acquire);
+        if (pReceiver != nullptr) {
+            pReceiver->_onVolumeCallback(*m_pContext, notification, notifyTime);
         }
-        catch (...) {}
 
         return S_OK;
     }
 
-    // Registering or unregistering external callback.
+    // Registering or unregistering the receiver.
 
     void registerCallback(
-        std::function<void(const PAUDIO_VOLUME_NOTIFICATION_DATA&)> callback)
+        TReceiver* pReceiver,
+        TContext* pContext) noexcept
     {
-        m_externalCallback = callback;
+        // NOTE: The context is stored first, so that a concurrent notification never sees a receiver without it.
+        m_pContext = pContext;
+        m_pReceiver.store(pReceiver, std::memory_order_release);
     }
 
-    void unregisterCallback()
+    void unregisterCallback() noexcept
     {
-        m_externalCallback = nullptr;
+        m_pReceiver.store(nullptr, std::memory_order_release);
     }
 };
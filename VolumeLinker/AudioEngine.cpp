@@ -0,0 +1,401 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AudioEngine.h"
+#include "helpers.h"
+#include "WakeupStats.h"
+
+AudioEngine::AudioEngine(
+    GUID processGUID,
+    std::shared_ptr<AudioBackend> pBackend) :
+    m_hNotifyWindow(NULL),
+    m_uDeviceChangeMessage(0),
+    m_bEventMessagePending(false),
+    m_threadId(0)
+{
+    HRESULT hr;
+
+    InitializeSListHead(&m_commands);
+    InitializeSListHead(&m_events);
+
+    // Auto-reset events which wake the engine whenever there's a new command or device change to process.
+    hr = m_commandEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio engine command event.");
+    hr = m_deviceEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio engine device event.");
+
+    // Manual-reset events which tell the engine to exit, and tell us that the engine has started.
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio engine stop event.");
+    hr = m_readyEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio engine ready event.");
+
+    // Start the engine thread (throws if the thread can't be created), and wait until it has connected to the
+    // audio COM server. If that failed, the thread has already exited, and we pass its error on to our caller.
+    // NOTE: The manager uses the real audio devices, unless we've been given another backend.
+    m_thread = std::thread(&AudioEngine::_threadMain, this, processGUID, std::move(pBackend));
+    WaitForSingleObject(m_readyEvent.get(), INFINITE);
+    if (m_startupError) {
+        m_thread.join();
+        std::rethrow_exception(m_startupError);
+    }
+}
+
+AudioEngine::~AudioEngine()
+{
+    // Tell the engine to exit, and wait for it to run its remaining commands and to destroy the manager.
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+
+    // Free any device list changes that the GUI never took.
+    this->_discardEvents();
+}
+
+void AudioEngine::_threadMain(
+    GUID processGUID,
+    std::shared_ptr<AudioBackend> pBackend) noexcept
+{
+    // Join the process-wide multithreaded apartment, which is where all of our audio objects live. The endpoint
+    // volume interfaces are free-threaded, so the slave workers and the audio service's notification threads
+    // keep using them directly, and the apartment stays alive for as long as the engine runs (which is also
+    // what the audio service needs in order to deliver any audio session notifications to us).
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    wil::unique_couninitialize_call cleanup(SUCCEEDED(hr));
+    m_threadId = GetCurrentThreadId();
+
+    // Connect to the audio COM server and retrieve the list of devices.
+    // NOTE: The manager only signals us whenever it has device changes, and we process them on this thread.
+    try {
+        THROW_IF_COM_FAILED(hr, "Unable to initialize COM connection for audio engine.");
+        m_pManager = std::make_unique<AudioDeviceManager>(processGUID,
+            [this]() -> void {
+                m_deviceEvent.SetEvent();
+            },
+            std::move(pBackend));
+    }
+    catch (...) {
+        m_startupError = std::current_exception();
+    }
+    m_readyEvent.SetEvent();
+    if (!m_pManager) {
+        return;
+    }
+
+    HANDLE waitHandles[] = { m_stopEvent.get(), m_commandEvent.get(), m_deviceEvent.get() };
+    for (;;) {
+        DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, INFINITE);
+        if (waitResult == WAIT_OBJECT_0 + 1) {
+            WakeupStats::record(WakeSource::EngineThread);
+            this->_runCommands();
+        }
+        else if (waitResult == WAIT_OBJECT_0 + 2) {
+            WakeupStats::record(WakeSource::EngineThread);
+            this->_processDeviceChanges();
+        }
+        else {
+            // Stop was requested (or the wait itself failed, which should never happen).
+            break;
+        }
+    }
+
+    // Run any commands that are still queued (such as a final unlink), and then destroy the manager while we're
+    // still in the apartment, since it must release all of its audio objects before COM is uninitialized.
+    this->_runCommands();
+    m_pManager.reset();
+}
+
+void AudioEngine::_runCommands() noexcept
+{
+    // Take every queued command at once. The list is newest-first, so we reverse it to run them in order.
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_commands);
+    PSLIST_ENTRY pOrdered = nullptr;
+    while (pEntry != nullptr) {
+        PSLIST_ENTRY pNext = pEntry->Next;
+        pEntry->Next = pOrdered;
+        pOrdered = pEntry;
+        pEntry = pNext;
+    }
+
+    while (pOrdered != nullptr) {
+        auto pNode = CONTAINING_RECORD(pOrdered, CommandNode, entry);
+        pOrdered = pOrdered->Next;
+
+        // NOTE: Commands which need to know about failures use call(), which catches their exceptions itself.
+        try {
+            pNode->fn(*m_pManager);
+        }
+        catch (...) {}
+        delete pNode;
+    }
+}
+
+void AudioEngine::_processDeviceChanges() noexcept
+{
+    // Update the device list (this also reconnects any linked devices that have returned).
+    vector<DeviceListChange> changes;
+    try {
+        changes = m_pManager->processDeviceChanges();
+    }
+    catch (...) {
+        return;
+    }
+
+    // Hand the changes over to the GUI thread. We do this even if the list itself didn't change, since some
+    // links may have been connected or disconnected, which the GUI displays too.
+    EventNode* pNode;
+    try {
+        pNode = new EventNode{ {}, std::move(changes) };
+    }
+    catch (...) {
+        return;
+    }
+    InterlockedPushEntrySList(&m_events, &pNode->entry);
+    this->_notifyWindow();
+}
+
+void AudioEngine::_notifyWindow() noexcept
+{
+    HWND hWnd = m_hNotifyWindow.load(std::memory_order_acquire);
+    UINT uMessage = m_uDeviceChangeMessage.load(std::memory_order_acquire);
+    if (hWnd == NULL || uMessage == 0) {
+        return;
+    }
+
+    // Only post a message if there isn't one waiting already, since the GUI always takes all changes at once.
+    if (!m_bEventMessagePending.exchange(true, std::memory_order_acq_rel)) {
+        if (!PostMessage(hWnd, uMessage, 0, 0)) {
+            m_bEventMessagePending = false;
+        }
+    }
+}
+
+void AudioEngine::_discardEvents() noexcept
+{
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_events);
+    while (pEntry != nullptr) {
+        auto pNode = CONTAINING_RECORD(pEntry, EventNode, entry);
+        pEntry = pEntry->Next;
+        delete pNode;
+    }
+}
+
+bool AudioEngine::post(
+    std::function<void(AudioDeviceManager&)> fn) noexcept
+{
+    CommandNode* pNode;
+    try {
+        pNode = new CommandNode{ {}, std::move(fn) };
+    }
+    catch (...) {
+        return false;
+    }
+
+    // We only need to wake the engine if the queue was empty, since a non-empty queue means that a wake-up
+    // is already pending (the engine always empties the whole queue before it starts running the commands).
+    if (InterlockedPushEntrySList(&m_commands, &pNode->entry) == NULL) {
+        m_commandEvent.SetEvent();
+    }
+
+    return true;
+}
+
+void AudioEngine::_callSync(
+    const std::function<void(AudioDeviceManager&)>& fn)
+{
+    // Commands which are already running on the engine thread can't wait for themselves.
+    if (GetCurrentThreadId() == m_threadId) {
+        fn(*m_pManager);
+        return;
+    }
+
+    wil::unique_event_nothrow doneEvent;
+    HRESULT hr = doneEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio engine completion event.");
+
+    // NOTE: The command only refers to our stack, which is safe since we wait for it to finish.
+    std::exception_ptr error;
+    HANDLE hDone = doneEvent.get();
+    bool queued = this->post([&fn, &error, hDone](AudioDeviceManager& manager) -> void {
+        try {
+            fn(manager);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        SetEvent(hDone);
+    });
+    if (!queued) {
+        throw std::runtime_error("Unable to queue audio engine command.");
+    }
+
+    WaitForSingleObject(hDone, INFINITE);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void AudioEngine::setDialog(
+    HWND hDlg,
+    ptrdiff_t muteCheckboxID,
+    ptrdiff_t volumeSliderID,
+    UINT deviceChangeMessage,
+    UINT refreshMessage)
+{
+    // Tell the device manager to use (auto-update) the dialog's volume controls.
+    this->call([hDlg, muteCheckboxID, volumeSliderID, refreshMessage](AudioDeviceManager& manager) -> void {
+        manager.setDialog(hDlg, muteCheckboxID, volumeSliderID, refreshMessage);
+    });
+
+    // Tell the dialog about any device changes that happened before it was attached.
+    m_uDeviceChangeMessage.store(deviceChangeMessage, std::memory_order_release);
+    m_hNotifyWindow.store(hDlg, std::memory_order_release);
+    if (QueryDepthSList(&m_events) > 0) {
+        this->_notifyWindow();
+    }
+}
+
+vector<std::pair<wstring, wstring>> AudioEngine::getDeviceList()
+{
+    // Take a snapshot of the device list (as device ID and name pairs, in list order).
+    // NOTE: Every queued change is already part of the snapshot, so they're discarded, which means that
+    // any changes that the GUI takes afterwards can be applied directly to the snapshot.
+    // NOTE: This is what sorts the list (and reads the names) for the first time, which is why the GUI only
+    // asks for it when the list is about to be displayed.
+    return this->call([this](AudioDeviceManager& manager) -> vector<std::pair<wstring, wstring>> {
+        this->_discardEvents();
+        manager.sortDeviceList();
+        vector<std::pair<wstring, wstring>> devices;
+        for (auto& device : manager.getAudioDevices()) {
+            devices.emplace_back(device.getId(), device.getName());
+        }
+        return devices;
+    });
+}
+
+bool AudioEngine::requestDeviceListResync(
+    vector<std::pair<wstring, wstring>> displayedDevices) noexcept
+{
+    // Ask the engine (without waiting for it) to turn the GUI's list into the real device list, by sending
+    // the difference as regular device list changes, which follow a resync marker.
+    // NOTE: This lets the GUI display an older list right away (such as one that was saved at the last exit),
+    // while the engine reads and sorts the device names in the background.
+    // NOTE: Every queued change is discarded, exactly like in getDeviceList(), but the GUI may already have
+    // taken some of them before the resync arrives, which is why it has to skip everything before the marker.
+    return this->post([this, displayedDevices = std::move(displayedDevices)](AudioDeviceManager& manager) mutable -> void {
+        this->_discardEvents();
+        manager.sortDeviceList();
+        vector<std::pair<wstring, wstring>> devices;
+        for (auto& device : manager.getAudioDevices()) {
+            devices.emplace_back(device.getId(), device.getName());
+        }
+
+        auto pNode = new EventNode{ {}, _diffDeviceLists(std::move(displayedDevices), devices) };
+        InterlockedPushEntrySList(&m_events, &pNode->entry);
+        this->_notifyWindow();
+    });
+}
+
+vector<DeviceListChange> AudioEngine::_diffDeviceLists(
+    vector<std::pair<wstring, wstring>> displayedDevices,
+    const vector<std::pair<wstring, wstring>>& devices)
+{
+    // Build the changes which turn the displayed list into the real list (starting with the resync marker).
+    // NOTE: Both lists are tiny, and usually identical, in which case the marker is the only change.
+    vector<DeviceListChange> changes;
+    changes.push_back({ DeviceListChange::Type::Resync, 0, L"", L"" });
+
+    // Remove every displayed device that no longer exists (or whose name has changed), back to front.
+    std::unordered_map<wstring, const wstring*, DeviceIdHash, std::equal_to<>> deviceNames;
+    for (auto& device : devices) {
+        deviceNames.emplace(device.first, &device.second);
+    }
+    for (size_t i = displayedDevices.size(); i-- > 0;) {
+        auto it = deviceNames.find(displayedDevices[i].first);
+        if (it == deviceNames.end() || *it->second != displayedDevices[i].second) {
+            changes.push_back({ DeviceListChange::Type::Removed, static_cast<ptrdiff_t>(i), L"", L"" });
+            displayedDevices.erase(displayedDevices.begin() + i);
+        }
+    }
+
+    // Insert the missing devices, and move the remaining ones to their real positions.
+    for (size_t i = 0; i < devices.size(); ++i) {
+        if (i < displayedDevices.size() && displayedDevices[i].first == devices[i].first) {
+            continue;
+        }
+        auto it = std::find_if(displayedDevices.begin() + (std::min)(i, displayedDevices.size()), displayedDevices.end(),
+            [&devices, i](const std::pair<wstring, wstring>& device) -> bool { return device.first == devices[i].first; });
+        if (it != displayedDevices.end()) {
+            changes.push_back({ DeviceListChange::Type::Removed, it - displayedDevices.begin(), L"", L"" });
+            displayedDevices.erase(it);
+        }
+        changes.push_back({ DeviceListChange::Type::Added, static_cast<ptrdiff_t>(i), devices[i].second, devices[i].first });
+        displayedDevices.insert(displayedDevices.begin() + i, devices[i]);
+    }
+
+    // Anything that's left over was a duplicate.
+    while (displayedDevices.size() > devices.size()) {
+        changes.push_back({ DeviceListChange::Type::Removed, static_cast<ptrdiff_t>(displayedDevices.size() - 1), L"", L"" });
+        displayedDevices.pop_back();
+    }
+
+    return changes;
+}
+
+vector<DeviceListChange> AudioEngine::takeDeviceChanges()
+{
+    // NOTE: We clear the "pending" flag BEFORE taking the changes, so that any newer changes which arrive
+    // while the GUI is applying these are guaranteed to post a new message.
+    m_bEventMessagePending.store(false, std::memory_order_release);
+
+    // Take every batch at once. The list is newest-first, so we reverse it to return the changes in order.
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_events);
+    PSLIST_ENTRY pOrdered = nullptr;
+    while (pEntry != nullptr) {
+        PSLIST_ENTRY pNext = pEntry->Next;
+        pEntry->Next = pOrdered;
+        pOrdered = pEntry;
+        pEntry = pNext;
+    }
+
+    vector<DeviceListChange> changes;
+    while (pOrdered != nullptr) {
+        auto pNode = CONTAINING_RECORD(pOrdered, EventNode, entry);
+        pOrdered = pOrdered->Next;
+        try {
+            changes.insert(changes.end(),
+                std::make_move_iterator(pNode->changes.begin()), std::make_move_iterator(pNode->changes.end()));
+        }
+        catch (...) {}
+        delete pNode;
+    }
+
+    return changes;
+}
+
+void AudioEngine::processDialogRefresh(
+    bool bDisplay) noexcept
+{
+    // NOTE: This is the only direct call into the manager from the GUI thread. The manager's dialog refresh
+    // only reads its atomic dialog state, which is exactly what makes it safe to call from any thread.
+    if (m_pManager) {
+        m_pManager->processDialogRefresh(bDisplay);
+    }
+}
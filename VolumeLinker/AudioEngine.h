@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "framework.h"
+#include "AudioDeviceManager.h"
+
+//-----------------------------------------------------------
+// Dedicated audio engine thread, which lives in the process'
+// multithreaded apartment and owns the device manager (and
+// with it the device enumerator, all endpoints and all of
+// their callbacks). The GUI thread never touches the manager
+// directly. It hands commands to the engine via a lock-free
+// queue instead, and receives the device list changes via a
+// second lock-free queue. That way, volume syncing and
+// relinking keep running at full speed while the GUI thread
+// is busy with modal boxes, menus or anything else.
+//-----------------------------------------------------------
+class AudioEngine
+{
+private:
+    // A single queued command.
+    // NOTE: The list entries must be aligned on MEMORY_ALLOCATION_ALIGNMENT, which SLIST_ENTRY already
+    // declares for itself, so regular (C++17 aligned) allocations are fine.
+    struct CommandNode
+    {
+        SLIST_ENTRY entry;
+        std::function<void(AudioDeviceManager&)> fn;
+    };
+
+    // A single batch of device list changes, from one processDeviceChanges() run.
+    struct EventNode
+    {
+        SLIST_ENTRY entry;
+        vector<DeviceListChange> changes;
+    };
+
+    std::unique_ptr<AudioDeviceManager> m_pManager; // Only created, used and destroyed by the engine thread.
+    SLIST_HEADER m_commands; // Commands for the engine thread (newest first).
+    SLIST_HEADER m_events; // Device list changes for the GUI thread (newest first).
+    wil::unique_event_nothrow m_commandEvent; // Set when the command queue goes from empty to filled.
+    wil::unique_event_nothrow m_deviceEvent; // Set when the manager has device changes to process.
+    wil::unique_event_nothrow m_stopEvent;
+    wil::unique_event_nothrow m_readyEvent; // Set when the manager has been created (or failed to be created).
+    std::exception_ptr m_startupError;
+    std::atomic<HWND> m_hNotifyWindow; // Receives the device change message (or NULL).
+    std::atomic<UINT> m_uDeviceChangeMessage;
+    std::atomic<bool> m_bEventMessagePending; // Whether a device change message has been posted but not handled yet.
+    DWORD m_threadId;
+    std::thread m_thread;
+
+    void _threadMain(GUID processGUID, std::shared_ptr<AudioBackend> pBackend) noexcept;
+    void _runCommands() noexcept;
+    void _processDeviceChanges() noexcept;
+    void _notifyWindow() noexcept;
+    void _discardEvents() noexcept;
+    static vector<DeviceListChange> _diffDeviceLists(vector<std::pair<wstring, wstring>> displayedDevices, const vector<std::pair<wstring, wstring>>& devices);
+    void _callSync(const std::function<void(AudioDeviceManager&)>& fn);
+
+public:
+    AudioEngine(GUID processGUID, std::shared_ptr<AudioBackend> pBackend = nullptr);
+    ~AudioEngine();
+    AudioEngine(const AudioEngine&) = delete;
+    AudioEngine& operator=(const AudioEngine&) = delete;
+    bool post(std::function<void(AudioDeviceManager&)> fn) noexcept;
+    void setDialog(HWND hDlg, ptrdiff_t muteCheckbox, ptrdiff_t volumeSlider, UINT deviceChangeMessage, UINT refreshMessage);
+    vector<std::pair<wstring, wstring>> getDeviceList();
+    bool requestDeviceListResync(vector<std::pair<wstring, wstring>> displayedDevices) noexcept;
+    vector<DeviceListChange> takeDeviceChanges();
+    void processDialogRefresh(bool bDisplay) noexcept;
+
+    // Runs a command on the engine thread and waits for its result (which is returned, or thrown if it threw).
+    // NOTE: The GUI thread may wait for the engine, but the engine must never wait for the GUI thread.
+    template <typename Fn>
+    auto call(Fn&& fn) -> std::invoke_result_t<Fn&, AudioDeviceManager&>
+    {
+        using Result = std::invoke_result_t<Fn&, AudioDeviceManager&>;
+        if constexpr (std::is_void_v<Result>) {
+            _callSync([&fn](AudioDeviceManager& manager) -> void { fn(manager); });
+        }
+        else {
+            std::optional<Result> result;
+            _callSync([&fn, &result](AudioDeviceManager& manager) -> void { result.emplace(fn(manager)); });
+            return std::move(*result);
+        }
+    }
+};
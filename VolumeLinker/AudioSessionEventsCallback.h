@@ -0,0 +1,204 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "WakeupStats.h"
+#include "LatencyStats.h"
+
+//-----------------------------------------------------------
+// Client implementation of IAudioSessionEvents interface.
+// The audio service calls these methods whenever the volume
+// or mute-state of a single audio session changes, or when
+// the session ends (expires) or is disconnected. We report
+// the volume changes and the end of the session, and ignore
+// all of the purely cosmetic events (such as icon changes).
+//-----------------------------------------------------------
+class AudioSessionEventsCallback : public IAudioSessionEvents
+{
+    LONG m_references; // Reference counter.
+    std::function<void(float, BOOL, LPCGUID, LONGLONG)> m_volumeCallback;
+    std::function<void()> m_endedCallback;
+
+    void _notifyEnded() noexcept
+    {
+        // Execute any registered callback, but BLOCK any exceptions it throws.
+        try {
+            if (m_endedCallback) {
+                m_endedCallback(); // Throws if invalid (or throwing) callback.
+            }
+        }
+        catch (...) {}
+    }
+
+public:
+    AudioSessionEventsCallback() :
+        m_references(1) // Set counter to 1 reference when constructed.
+    {
+    }
+
+    ~AudioSessionEventsCallback()
+    {
+    }
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef() noexcept
+    {
+        return InterlockedIncrement(&m_references);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() noexcept
+    {
+        ULONG const refCount = InterlockedDecrement(&m_references);
+        if (0 == refCount) {
+            delete this;
+        }
+        return refCount;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+        REFIID riid,
+        VOID** ppvInterface) noexcept
+    {
+        if (IID_IUnknown == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IUnknown*>(this);
+        }
+        else if (__uuidof(IAudioSessionEvents) == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IAudioSessionEvents*>(this);
+        }
+        else {
+            *ppvInterface = NULL;
+            return E_NOINTERFACE;
+        }
+        return S_OK;
+    }
+
+    // Callback methods for session events.
+
+    HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(
+        float fNewVolume,
+        BOOL bNewMute,
+        LPCGUID pEventContext) noexcept
+    {
+        // Timestamp the notification first, exactly like the endpoint volume callback.
+        LONGLONG notifyTime = LatencyStats::now();
+        WakeupStats::record(WakeSource::SessionCallback);
+
+#ifdef _DEBUG
+        OutputDebugStringA(std::string("SessionCallback:" + std::to_string(fNewVolume) + " " + (bNewMute ? "M" : "_") + "\n").c_str());
+#endif
+
+        // Execute any registered callback, but BLOCK any exceptions it throws.
+        try {
+            if (m_volumeCallback) {
+                m_volumeCallback(fNewVolume, bNewMute, pEventContext, notifyTime); // Throws if invalid (or throwing) callback.
+            }
+        }
+        catch (...) {}
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnStateChanged(
+        AudioSessionState newState) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        // NOTE: Sessions go back and forth between active and inactive whenever their application
+        // starts or stops playing, but they're only gone for good once they have expired.
+        if (newState == AudioSessionStateExpired) {
+            _notifyEnded();
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnSessionDisconnected(
+        AudioSessionDisconnectReason disconnectReason) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        UNREFERENCED_PARAMETER(disconnectReason);
+        _notifyEnded();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(
+        LPCWSTR pwszNewDisplayName,
+        LPCGUID pEventContext) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        UNREFERENCED_PARAMETER(pwszNewDisplayName);
+        UNREFERENCED_PARAMETER(pEventContext);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnIconPathChanged(
+        LPCWSTR pwszNewIconPath,
+        LPCGUID pEventContext) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        UNREFERENCED_PARAMETER(pwszNewIconPath);
+        UNREFERENCED_PARAMETER(pEventContext);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(
+        DWORD channelCount,
+        float afNewChannelVolumeArray[],
+        DWORD changedChannel,
+        LPCGUID pEventContext) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        // NOTE: Only the session's main volume is synced, so its channel volumes are ignored.
+        UNREFERENCED_PARAMETER(channelCount);
+        UNREFERENCED_PARAMETER(afNewChannelVolumeArray);
+        UNREFERENCED_PARAMETER(changedChannel);
+        UNREFERENCED_PARAMETER(pEventContext);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(
+        LPCGUID pNewGroupingParam,
+        LPCGUID pEventContext) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        UNREFERENCED_PARAMETER(pNewGroupingParam);
+        UNREFERENCED_PARAMETER(pEventContext);
+        return S_OK;
+    }
+
+    // Registering or unregistering external callbacks.
+
+    void registerCallback(
+        std::function<void(float, BOOL, LPCGUID, LONGLONG)> volumeCallback,
+        std::function<void()> endedCallback)
+    {
+        m_volumeCallback = volumeCallback;
+        m_endedCallback = endedCallback;
+    }
+
+    void unregisterCallback()
+    {
+        m_volumeCallback = nullptr;
+        m_endedCallback = nullptr;
+    }
+};
@@ -0,0 +1,242 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "AudioSessionList.h"
+#include "helpers.h"
+
+// Returns the file name of a process (such as "game.exe"), or an empty string if it can't be retrieved.
+static wstring getProcessName(
+    DWORD processId)
+{
+    wil::unique_handle hProcess(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId));
+    if (!hProcess) {
+        return wstring();
+    }
+
+    WCHAR szPath[MAX_PATH];
+    DWORD dwSize = ARRAYSIZE(szPath);
+    if (!QueryFullProcessImageNameW(hProcess.get(), 0, szPath, &dwSize)) {
+        return wstring();
+    }
+
+    LPCWSTR pszName = wcsrchr(szPath, L'\\');
+    return (pszName != NULL) ? wstring(pszName + 1) : wstring(szPath);
+}
+
+AudioSessionList::AudioSessionList(
+    IMMDevice* pEndpoint,
+    std::function<void()> changedCallback) :
+    m_bNotificationsRegistered(false),
+    m_changedCallback(std::move(changedCallback))
+{
+    HRESULT hr;
+
+    // Create a COM object for the device, with the "session manager" interface.
+    hr = pEndpoint->Activate(__uuidof(IAudioSessionManager2),
+        CLSCTX_ALL, NULL, (void**)& m_pSessionManager);
+    THROW_IF_COM_FAILED(hr, "Unable to open device audio session manager.");
+
+    // Queue every session that's created from now on.
+    m_notificationClient.registerCallback(
+        [this](IAudioSessionControl* pSession) -> void {
+            this->_onSessionCreated(pSession);
+        });
+
+    // Listen for new sessions BEFORE enumerating, so that we can't miss any session that's created in between.
+    // NOTE: The audio service only delivers session notifications to processes that have a multithreaded
+    // apartment, which the device manager ensures. Sessions that are both enumerated and queued are only added once.
+    hr = m_pSessionManager->RegisterSessionNotification(&m_notificationClient);
+    THROW_IF_COM_FAILED(hr, "Unable to register audio session notification callback.");
+    m_bNotificationsRegistered = true;
+
+    // Enumerate the existing sessions.
+    // NOTE: This is also what makes the audio service start sending the session notifications.
+    wil::com_ptr_nothrow<IAudioSessionEnumerator> pSessionEnumerator;
+    int count = 0;
+    hr = m_pSessionManager->GetSessionEnumerator(&pSessionEnumerator);
+    if (SUCCEEDED(hr)) {
+        hr = pSessionEnumerator->GetCount(&count);
+    }
+    if (FAILED(hr)) {
+        // NOTE: The destructor won't run if we throw, so we must unregister our notifications manually.
+        m_pSessionManager->UnregisterSessionNotification(&m_notificationClient);
+        m_bNotificationsRegistered = false;
+        THROW_IF_COM_FAILED(hr, "Unable to enumerate audio sessions.");
+    }
+    for (int i = 0; i < count; ++i) {
+        wil::com_ptr_nothrow<IAudioSessionControl> pSession;
+        if (SUCCEEDED(pSessionEnumerator->GetSession(i, &pSession))) {
+            this->_addSession(pSession.get());
+        }
+    }
+}
+
+AudioSessionList::~AudioSessionList()
+{
+    // Stop listening for new sessions, since the audio service must never call us after we're gone.
+    if (m_bNotificationsRegistered) {
+        m_pSessionManager->UnregisterSessionNotification(&m_notificationClient);
+        m_bNotificationsRegistered = false;
+    }
+    m_notificationClient.unregisterCallback();
+
+    // Unregister the events of every session.
+    for (auto& session : m_sessions) {
+        if (session->bEventsRegistered) {
+            session->pControl->UnregisterAudioSessionNotification(&session->events);
+        }
+        session->events.unregisterCallback();
+    }
+}
+
+void AudioSessionList::_addSession(
+    IAudioSessionControl* pSession) noexcept
+{
+    // Ignore sessions that have already ended, or that can't be controlled.
+    wil::com_ptr_nothrow<IAudioSessionControl2> pControl;
+    AudioSessionState state;
+    if (FAILED(pSession->QueryInterface(__uuidof(IAudioSessionControl2), (void**)& pControl)) ||
+        FAILED(pControl->GetState(&state)) || state == AudioSessionStateExpired) {
+        return;
+    }
+
+    try {
+        auto session = std::make_unique<AudioSession>();
+        session->pControl = pControl;
+        session->bExpired = false;
+        session->bEventsRegistered = false;
+
+        // Skip sessions that we already know about (which happens if they were both enumerated and queued).
+        wil::unique_cotaskmem_string pwszInstanceId;
+        if (FAILED(pControl->GetSessionInstanceIdentifier(&pwszInstanceId))) {
+            return;
+        }
+        session->instanceId = pwszInstanceId.get();
+        for (auto& other : m_sessions) {
+            if (other->instanceId == session->instanceId) {
+                return;
+            }
+        }
+
+        // Look up which program the session belongs to (the system sounds don't have any).
+        session->processId = 0;
+        if (pControl->IsSystemSoundsSession() != S_OK && SUCCEEDED(pControl->GetProcessId(&session->processId))) {
+            session->processName = getProcessName(session->processId);
+        }
+
+        if (FAILED(pControl->QueryInterface(__uuidof(ISimpleAudioVolume), (void**)& session->pSimpleVolume))) {
+            return;
+        }
+
+        // Get notified when the session ends.
+        AudioSession* pEntry = session.get();
+        session->events.registerCallback(nullptr,
+            [this, pEntry]() -> void {
+                pEntry->bExpired = true;
+                this->_notifyChanged();
+            });
+        session->bEventsRegistered = SUCCEEDED(pControl->RegisterAudioSessionNotification(&session->events));
+
+        m_sessions.push_back(std::move(session));
+    }
+    catch (...) {}
+}
+
+void AudioSessionList::_onSessionCreated(
+    IAudioSessionControl* pSession) noexcept
+{
+    // NOTE: This is executed by the audio service's notification thread, so we only queue the session here.
+    try {
+        auto lock = m_pendingLock.lock_exclusive();
+        m_pendingSessions.emplace_back(pSession);
+    }
+    catch (...) {
+        return;
+    }
+
+    this->_notifyChanged();
+}
+
+void AudioSessionList::_notifyChanged() noexcept
+{
+    try {
+        if (m_changedCallback) {
+            m_changedCallback();
+        }
+    }
+    catch (...) {}
+}
+
+bool AudioSessionList::update() noexcept
+{
+    bool changed = false;
+
+    // Forget the sessions that have ended.
+    for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+        auto& session = *it;
+        if (session->bExpired.load(std::memory_order_acquire)) {
+            if (session->bEventsRegistered) {
+                session->pControl->UnregisterAudioSessionNotification(&session->events);
+            }
+            session->events.unregisterCallback();
+            it = m_sessions.erase(it);
+            changed = true;
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // Add the sessions that have been created since the last update.
+    vector<wil::com_ptr_nothrow<IAudioSessionControl>> pendingSessions;
+    {
+        auto lock = m_pendingLock.lock_exclusive();
+        pendingSessions.swap(m_pendingSessions);
+    }
+    for (auto& pSession : pendingSessions) {
+        this->_addSession(pSession.get());
+        changed = true;
+    }
+
+    return changed;
+}
+
+const vector<std::unique_ptr<AudioSession>>& AudioSessionList::getSessions() const noexcept
+{
+    return m_sessions;
+}
+
+const AudioSession* AudioSessionList::findSession(
+    std::wstring_view processName) const noexcept
+{
+    // Find the first live session of the given program (case INSENSITIVE, like all Windows file names).
+    if (processName.empty()) {
+        return nullptr;
+    }
+    for (auto& session : m_sessions) {
+        if (!session->bExpired.load(std::memory_order_acquire) &&
+            session->processName.size() == processName.size() &&
+            _wcsnicmp(session->processName.c_str(), processName.data(), processName.size()) == 0) {
+            return session.get();
+        }
+    }
+
+    return nullptr;
+}
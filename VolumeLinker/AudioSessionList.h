@@ -0,0 +1,77 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "AudioSessionNotificationClient.h"
+#include "AudioSessionEventsCallback.h"
+
+using std::wstring;
+using std::vector;
+
+// A single audio session of an audio device (usually one application that's playing sound on it).
+// NOTE: The session is never moved in memory (only its pointer is), since its events object is registered with it.
+struct AudioSession
+{
+    wstring instanceId; // Unique identifier of this exact session.
+    wstring processName; // File name of the session's program (such as "game.exe"), or empty for system sounds.
+    DWORD processId;
+    wil::com_ptr_nothrow<IAudioSessionControl2> pControl;
+    wil::com_ptr_nothrow<ISimpleAudioVolume> pSimpleVolume;
+    std::atomic<bool> bExpired; // Set by the session's events as soon as the session has ended.
+    AudioSessionEventsCallback events;
+    bool bEventsRegistered;
+};
+
+//-----------------------------------------------------------
+// Cached list of the audio sessions of a single device. The
+// list is enumerated once, and is then kept up to date by
+// the audio service's notifications: New sessions are queued
+// by the session notification, and ended sessions are marked
+// by their own events. Both are applied by update(), which
+// must be called by the thread that owns the list, since the
+// audio service forbids releasing its objects (or changing
+// any registrations) from within its own callbacks.
+//-----------------------------------------------------------
+class AudioSessionList
+{
+private:
+    wil::com_ptr_nothrow<IAudioSessionManager2> m_pSessionManager;
+    AudioSessionNotificationClient m_notificationClient;
+    bool m_bNotificationsRegistered;
+    std::function<void()> m_changedCallback;
+    vector<std::unique_ptr<AudioSession>> m_sessions;
+    vector<wil::com_ptr_nothrow<IAudioSessionControl>> m_pendingSessions; // Created sessions that haven't been added yet.
+    wil::srwlock m_pendingLock; // Protects the pending sessions against concurrent session notifications.
+
+    void _addSession(IAudioSessionControl* pSession) noexcept;
+    void _onSessionCreated(IAudioSessionControl* pSession) noexcept;
+    void _notifyChanged() noexcept;
+
+public:
+    AudioSessionList(IMMDevice* pEndpoint, std::function<void()> changedCallback);
+    ~AudioSessionList();
+    AudioSessionList(const AudioSessionList&) = delete;
+    AudioSessionList& operator=(const AudioSessionList&) = delete;
+    bool update() noexcept;
+    const vector<std::unique_ptr<AudioSession>>& getSessions() const noexcept;
+    const AudioSession* findSession(std::wstring_view processName) const noexcept;
+};
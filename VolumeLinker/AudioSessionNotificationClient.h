@@ -0,0 +1,123 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "WakeupStats.h"
+
+//-----------------------------------------------------------
+// Client implementation of IAudioSessionNotification
+// interface. The audio service calls this whenever a new
+// audio session (such as an application that starts playing
+// sound) is created on the device that we've registered
+// with. Together with the per-session events, this keeps our
+// session list up to date without ever re-enumerating it.
+//-----------------------------------------------------------
+class AudioSessionNotificationClient : public IAudioSessionNotification
+{
+    LONG m_references; // Reference counter.
+    std::function<void(IAudioSessionControl*)> m_externalCallback;
+
+public:
+    AudioSessionNotificationClient() :
+        m_references(1) // Set counter to 1 reference when constructed.
+    {
+    }
+
+    ~AudioSessionNotificationClient()
+    {
+    }
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef() noexcept
+    {
+        return InterlockedIncrement(&m_references);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() noexcept
+    {
+        ULONG const refCount = InterlockedDecrement(&m_references);
+        if (0 == refCount) {
+            delete this;
+        }
+        return refCount;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+        REFIID riid,
+        VOID** ppvInterface) noexcept
+    {
+        if (IID_IUnknown == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IUnknown*>(this);
+        }
+        else if (__uuidof(IAudioSessionNotification) == riid) {
+            AddRef();
+            *ppvInterface = static_cast<IAudioSessionNotification*>(this);
+        }
+        else {
+            *ppvInterface = NULL;
+            return E_NOINTERFACE;
+        }
+        return S_OK;
+    }
+
+    // Callback method for session-creation notifications.
+    // NOTE: This is executed on one of the audio service's threads, and must never block,
+    // which is why the external callback is only supposed to queue the session for later.
+
+    HRESULT STDMETHODCALLTYPE OnSessionCreated(
+        IAudioSessionControl* pNewSession) noexcept
+    {
+        WakeupStats::record(WakeSource::SessionCallback);
+        if (pNewSession == NULL) {
+            return E_INVALIDARG;
+        }
+
+#ifdef _DEBUG
+        OutputDebugStringA("SessionCreated\n");
+#endif
+
+        // Execute any registered callback, but BLOCK any exceptions it throws.
+        try {
+            if (m_externalCallback) {
+                m_externalCallback(pNewSession); // Throws if invalid (or throwing) callback.
+            }
+        }
+        catch (...) {}
+
+        return S_OK;
+    }
+
+    // Registering or unregistering external callback.
+
+    void registerCallback(
+        std::function<void(IAudioSessionControl*)> callback)
+    {
+        m_externalCallback = callback;
+    }
+
+    void unregisterCallback()
+    {
+        m_externalCallback = nullptr;
+    }
+};
@@ -0,0 +1,430 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "ControlServer.h"
+#include "PipeSecurity.h"
+#include "helpers.h"
+#include "WakeupStats.h"
+
+// Largest request that we accept (roughly a thousand commands), so that a broken client can't make us allocate
+// unbounded amounts of memory.
+static const size_t MAX_REQUEST_SIZE = 64 * 1024;
+
+static wstring _fromUtf8(
+    const std::string& str)
+{
+    if (str.empty()) {
+        return wstring();
+    }
+    int len = MultiByteToWideChar(CP_UTF8, 0, str.data(), static_cast<int>(str.size()), NULL, 0);
+    if (len <= 0) {
+        throw std::runtime_error("Invalid UTF-8 text.");
+    }
+    wstring result(static_cast<size_t>(len), L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, str.data(), static_cast<int>(str.size()), result.data(), len);
+    return result;
+}
+
+static std::string _toUtf8(
+    const wstring& str)
+{
+    if (str.empty()) {
+        return std::string();
+    }
+    int len = WideCharToMultiByte(CP_UTF8, 0, str.data(), static_cast<int>(str.size()), NULL, 0, NULL, NULL);
+    if (len <= 0) {
+        return std::string();
+    }
+    std::string result(static_cast<size_t>(len), '\0');
+    WideCharToMultiByte(CP_UTF8, 0, str.data(), static_cast<int>(str.size()), result.data(), len, NULL, NULL);
+    return result;
+}
+
+static size_t _parseGroup(
+    AudioDeviceManager& manager,
+    const vector<wstring>& args)
+{
+    // Every group command takes the group's number as its first argument (0 is the first group).
+    if (args.size() < 2) {
+        throw std::runtime_error("Missing link group number.");
+    }
+    wchar_t* pEnd = nullptr;
+    auto group = wcstoul(args[1].c_str(), &pEnd, 10);
+    if (pEnd == args[1].c_str() || *pEnd != L'\0' || group >= manager.getLinkGroupCount()) {
+        throw std::runtime_error("Invalid link group number.");
+    }
+    return static_cast<size_t>(group);
+}
+
+ControlServer::ControlServer(
+    AudioEngine& engine,
+    std::function<void()> stateChangedCallback) :
+    m_engine(engine),
+    m_stateChangedCallback(std::move(stateChangedCallback))
+{
+    HRESULT hr;
+
+    // Only our own user (and the system) may open the pipe.
+    PipeSecurity security;
+
+    // Create the pipe (refuses to start if anyone else has already created a pipe with our name).
+    m_hPipe.reset(CreateNamedPipeW(getPipeName().c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, 4096, 4096, 0, security.get()));
+    if (!m_hPipe) {
+        throw std::runtime_error("Unable to create the control pipe.");
+    }
+
+    // Manual-reset events, for the overlapped operations and for telling the server to exit.
+    hr = m_ioEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create control server I/O event.");
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create control server stop event.");
+
+    // Start the server thread (throws if the thread can't be created).
+    m_thread = std::thread(&ControlServer::_threadMain, this);
+}
+
+ControlServer::~ControlServer()
+{
+    // Tell the server to exit, which cancels whatever pipe operation it's waiting for.
+    // NOTE: A batch that's already running in the engine is always finished first.
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+wstring ControlServer::getPipeName()
+{
+    // Every session has its own pipe, since every user can run their own instance (see SessionInstance).
+    DWORD dwSessionId = 0;
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId);
+    return L"\\\\.\\pipe\\VideoPlayerCode.VolumeLinker.Control." + std::to_wstring(dwSessionId);
+}
+
+DWORD ControlServer::_completeIo(
+    BOOL bStarted,
+    OVERLAPPED& overlapped,
+    DWORD& dwBytes) noexcept
+{
+    // Wait for an overlapped operation to finish, and return its result (ERROR_OPERATION_ABORTED if we've been
+    // told to stop). A message that's larger than the buffer gives us ERROR_MORE_DATA, with the first part.
+    dwBytes = 0;
+    if (!bStarted) {
+        DWORD dwError = GetLastError();
+        if (dwError != ERROR_IO_PENDING && dwError != ERROR_MORE_DATA) {
+            return dwError;
+        }
+        if (dwError == ERROR_IO_PENDING) {
+            HANDLE waitHandles[] = { m_stopEvent.get(), m_ioEvent.get() };
+            if (WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+                // NOTE: The operation refers to our buffers, so we must wait until it's really cancelled.
+                CancelIoEx(m_hPipe.get(), &overlapped);
+                GetOverlappedResult(m_hPipe.get(), &overlapped, &dwBytes, TRUE);
+                return ERROR_OPERATION_ABORTED;
+            }
+            WakeupStats::record(WakeSource::ControlPipe);
+        }
+    }
+
+    if (GetOverlappedResult(m_hPipe.get(), &overlapped, &dwBytes, FALSE)) {
+        return ERROR_SUCCESS;
+    }
+    return GetLastError();
+}
+
+bool ControlServer::_readRequest(
+    std::string& request) noexcept
+{
+    // Read a whole request message (which may arrive in several parts). Returns false if the client has
+    // disconnected (or sent too much), or if we've been told to stop.
+    try {
+        request.clear();
+        char buffer[4096];
+        for (;;) {
+            OVERLAPPED overlapped = {};
+            overlapped.hEvent = m_ioEvent.get();
+            DWORD dwBytes;
+            BOOL bStarted = ReadFile(m_hPipe.get(), buffer, sizeof(buffer), NULL, &overlapped);
+            DWORD dwResult = this->_completeIo(bStarted, overlapped, dwBytes);
+            if (dwResult != ERROR_SUCCESS && dwResult != ERROR_MORE_DATA) {
+                return false;
+            }
+            if (request.size() + dwBytes > MAX_REQUEST_SIZE) {
+                return false;
+            }
+            request.append(buffer, dwBytes);
+            if (dwResult == ERROR_SUCCESS) {
+                return true;
+            }
+        }
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+bool ControlServer::_writeReply(
+    const std::string& reply) noexcept
+{
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = m_ioEvent.get();
+    DWORD dwBytes;
+    BOOL bStarted = WriteFile(m_hPipe.get(), reply.data(), static_cast<DWORD>(reply.size()), NULL, &overlapped);
+    return this->_completeIo(bStarted, overlapped, dwBytes) == ERROR_SUCCESS;
+}
+
+std::string ControlServer::_executeBatch(
+    const std::string& request) noexcept
+{
+    try {
+        // Split the request into commands (one per line, whitespace-separated arguments).
+        // NOTE: Empty lines and comment lines (starting with "#") are skipped, and don't get any reply line.
+        vector<vector<wstring>> commands;
+        size_t lineStart = 0;
+        while (lineStart < request.size()) {
+            auto lineEnd = request.find('\n', lineStart);
+            if (lineEnd == std::string::npos) {
+                lineEnd = request.size();
+            }
+            auto line = _fromUtf8(request.substr(lineStart, lineEnd - lineStart));
+            lineStart = lineEnd + 1;
+
+            vector<wstring> args;
+            size_t pos = 0;
+            while (pos < line.size()) {
+                auto argStart = line.find_first_not_of(L" \t\r", pos);
+                if (argStart == wstring::npos) {
+                    break;
+                }
+                auto argEnd = line.find_first_of(L" \t\r", argStart);
+                if (argEnd == wstring::npos) {
+                    argEnd = line.size();
+                }
+                args.push_back(line.substr(argStart, argEnd - argStart));
+                pos = argEnd;
+            }
+            if (!args.empty() && args[0][0] != L'#') {
+                commands.push_back(std::move(args));
+            }
+        }
+
+        // Run the whole batch in a single engine call, so that the engine never has to wait for the pipe.
+        // NOTE: Every command fails (or succeeds) on its own, and the remaining commands still run.
+        bool bStateChanged = false;
+        auto reply = m_engine.call([&commands, &bStateChanged](AudioDeviceManager& manager) -> std::string {
+            std::string batchReply;
+            for (auto& args : commands) {
+                try {
+                    std::string commandReply;
+                    _executeCommand(manager, args, commandReply, bStateChanged);
+                    batchReply += commandReply;
+                }
+                catch (const std::exception& e) {
+                    batchReply += std::string("error ") + e.what() + "\n";
+                }
+            }
+            return batchReply;
+        });
+
+        // Let the owner display the new links and volumes (the GUI never sees them otherwise).
+        if (bStateChanged && m_stateChangedCallback) {
+            m_stateChangedCallback();
+        }
+
+        return reply;
+    }
+    catch (const std::exception& e) {
+        return std::string("error ") + e.what() + "\n";
+    }
+    catch (...) {
+        return "error Unable to execute the request.\n";
+    }
+}
+
+void ControlServer::_executeCommand(
+    AudioDeviceManager& manager,
+    const vector<wstring>& args,
+    std::string& reply,
+    bool& bStateChanged)
+{
+    // NOTE: This runs on the audio engine's thread, and throws (with a readable message) if the command fails.
+    auto& command = args[0];
+    if (_wcsicmp(command.c_str(), L"link") == 0) {
+        // link <group> <master device ID> <slave device ID> [<slave device ID>...]
+        auto group = _parseGroup(manager, args);
+        if (args.size() < 4) {
+            throw std::runtime_error("Missing master or slave device ID.");
+        }
+        bStateChanged = true;
+        manager.linkDevices(group, args[2], vector<wstring>(args.begin() + 3, args.end()));
+        reply = "ok\n";
+    }
+    else if (_wcsicmp(command.c_str(), L"unlink") == 0) {
+        // unlink <group>
+        auto group = _parseGroup(manager, args);
+        bStateChanged = true;
+        manager.unlinkDevices(group);
+        reply = "ok\n";
+    }
+    else if (_wcsicmp(command.c_str(), L"volume") == 0 || _wcsicmp(command.c_str(), L"mute") == 0) {
+        // volume <group> <0-100>, mute <group> <0|1>
+        auto group = _parseGroup(manager, args);
+        if (args.size() < 3) {
+            throw std::runtime_error("Missing value.");
+        }
+        if (!manager.isLinkActive(group)) {
+            throw std::runtime_error("The link group isn't linked.");
+        }
+        wchar_t* pEnd = nullptr;
+        double value = wcstod(args[2].c_str(), &pEnd);
+        if (pEnd == args[2].c_str() || *pEnd != L'\0' || !(value >= 0.0 && value <= MAX_VOL)) {
+            throw std::runtime_error("Invalid value.");
+        }
+        bool success = (_wcsicmp(command.c_str(), L"volume") == 0) ?
+            manager.setMasterVolume(group, static_cast<float>(value / MAX_VOL)) :
+            manager.setMasterMute(group, (value != 0.0) ? TRUE : FALSE);
+        if (!success) {
+            throw std::runtime_error("Unable to change the master device.");
+        }
+
+        // NOTE: Our own changes are never displayed by the master's callback, so the owner refreshes the dialog.
+        bStateChanged = true;
+        reply = "ok\n";
+    }
+    else if (_wcsicmp(command.c_str(), L"state") == 0) {
+        // state <group> -> ok linked=<0|1> volume=<0-100> muted=<0|1> master=<ID> slaves=<ID>,<ID>...
+        auto group = _parseGroup(manager, args);
+        bool bLinked = manager.isLinkActive(group);
+        float fVolume = 0.0f;
+        BOOL bMuted = FALSE;
+        manager.getMasterState(group, fVolume, bMuted);
+        char buffer[64];
+        sprintf_s(buffer, "ok linked=%d volume=%.2f muted=%d", bLinked ? 1 : 0, fVolume * MAX_VOL, bMuted ? 1 : 0);
+        reply = buffer;
+        if (bLinked) {
+            reply += " master=" + _toUtf8(manager.getMasterDeviceId(group)) + " slaves=";
+            auto& slaveDeviceIds = manager.getSlaveDeviceIds(group);
+            for (size_t i = 0; i < slaveDeviceIds.size(); ++i) {
+                reply += (i > 0 ? "," : "") + _toUtf8(slaveDeviceIds[i]);
+            }
+        }
+        reply += "\n";
+    }
+    else if (_wcsicmp(command.c_str(), L"stats") == 0) {
+        // stats -> ok events=<n> applied=<n> ... degraded=<n>
+        auto report = manager.getLatencyReport();
+        char buffer[384];
+        sprintf_s(buffer,
+            "ok events=%llu applied=%llu skipped=%llu coalesced=%llu dropped=%llu failed=%llu recovered=%llu"
+            " rate=%.1f samples=%zu p50ms=%.3f p99ms=%.3f maxms=%.3f degraded=%zu\n",
+            static_cast<unsigned long long>(report.events), static_cast<unsigned long long>(report.applied),
+            static_cast<unsigned long long>(report.skipped), static_cast<unsigned long long>(report.coalesced),
+            static_cast<unsigned long long>(report.dropped), static_cast<unsigned long long>(report.failed),
+            static_cast<unsigned long long>(report.recovered), report.eventsPerSecond, report.sampleCount,
+            report.p50Ms, report.p99Ms, report.maxMs, manager.getDegradedSlaveCount());
+        reply = buffer;
+    }
+    else if (_wcsicmp(command.c_str(), L"audit") == 0) {
+        // audit <start|stop|report> -> ok running=<0|1> seconds=<n> messages=<n> timers=<n> wakes=<n> callbacks=<n>,
+        // followed by one "  <source> <count>" line per wakeup source
+        // NOTE: The audit request itself wakes the pipe and the engine, so those counts are never quite zero.
+        if (args.size() < 2) {
+            throw std::runtime_error("Missing audit action.");
+        }
+        if (_wcsicmp(args[1].c_str(), L"start") == 0) {
+            WakeupStats::start();
+        }
+        else if (_wcsicmp(args[1].c_str(), L"stop") == 0) {
+            WakeupStats::stop();
+        }
+        else if (_wcsicmp(args[1].c_str(), L"report") != 0) {
+            throw std::runtime_error("Invalid audit action.");
+        }
+        auto report = WakeupStats::getReport();
+        char buffer[192];
+        sprintf_s(buffer, "ok running=%d seconds=%.1f messages=%llu timers=%llu wakes=%llu callbacks=%llu\n",
+            report.bRunning ? 1 : 0, report.seconds,
+            static_cast<unsigned long long>(report.messageLoop), static_cast<unsigned long long>(report.timers),
+            static_cast<unsigned long long>(report.workerWakes), static_cast<unsigned long long>(report.callbacks));
+        reply = buffer;
+        for (size_t i = 0; i < static_cast<size_t>(WakeSource::Count); ++i) {
+            sprintf_s(buffer, "  %s %llu\n", WakeupStats::getSourceName(static_cast<WakeSource>(i)),
+                static_cast<unsigned long long>(report.counts[i]));
+            reply += buffer;
+        }
+    }
+    else if (_wcsicmp(command.c_str(), L"groups") == 0) {
+        // groups -> ok <number of link groups>
+        reply = "ok " + std::to_string(manager.getLinkGroupCount()) + "\n";
+    }
+    else if (_wcsicmp(command.c_str(), L"devices") == 0) {
+        // devices -> ok <count>, followed by one "  <ID> <name>" line per device (in list order)
+        auto& devices = manager.getAudioDevices();
+        reply = "ok " + std::to_string(devices.size()) + "\n";
+        for (auto& device : devices) {
+            reply += "  " + _toUtf8(device.getId()) + " " + _toUtf8(device.getName()) + "\n";
+        }
+    }
+    else {
+        throw std::runtime_error("Unknown command.");
+    }
+}
+
+void ControlServer::_threadMain() noexcept
+{
+    for (;;) {
+        // Wait for the next client.
+        // NOTE: A client which connects between DisconnectNamedPipe and ConnectNamedPipe is reported as
+        // ERROR_PIPE_CONNECTED, which means that it's already connected.
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = m_ioEvent.get();
+        DWORD dwBytes;
+        BOOL bStarted = ConnectNamedPipe(m_hPipe.get(), &overlapped);
+        DWORD dwResult = (!bStarted && GetLastError() == ERROR_PIPE_CONNECTED) ?
+            ERROR_SUCCESS : this->_completeIo(bStarted, overlapped, dwBytes);
+        if (dwResult == ERROR_OPERATION_ABORTED) {
+            break;
+        }
+        if (dwResult != ERROR_SUCCESS) {
+            // Should never happen, but we don't want to spin if the pipe is somehow broken.
+            DisconnectNamedPipe(m_hPipe.get());
+            if (WaitForSingleObject(m_stopEvent.get(), 1000) != WAIT_TIMEOUT) {
+                break;
+            }
+            continue;
+        }
+
+        // Serve the client's requests until it disconnects.
+        std::string request;
+        while (this->_readRequest(request)) {
+            if (!this->_writeReply(this->_executeBatch(request))) {
+                break;
+            }
+        }
+        DisconnectNamedPipe(m_hPipe.get());
+
+        if (WaitForSingleObject(m_stopEvent.get(), 0) == WAIT_OBJECT_0) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "AudioEngine.h"
+
+using std::vector;
+using std::wstring;
+
+//-----------------------------------------------------------
+// Local control channel, which lets scripts link, unlink and
+// control the devices (and query their state) without going
+// through the GUI. It's a named pipe that only the current
+// user can open, and which serves one client at a time on a
+// dedicated thread. Every request message is a batch of text
+// commands (one per line), which all run in a single audio
+// engine call, exactly like the GUI's own commands, so a
+// script can apply any number of changes in one round-trip.
+// The reply message has one "ok" or "error" line for every
+// command, and any extra result lines start with two spaces.
+//-----------------------------------------------------------
+class ControlServer
+{
+private:
+    AudioEngine& m_engine;
+    std::function<void()> m_stateChangedCallback; // Tells the owner that commands have changed the links or the master volume (or NULL).
+    wil::unique_handle m_hPipe;
+    wil::unique_event_nothrow m_ioEvent; // Completion event for the pipe's overlapped operations.
+    wil::unique_event_nothrow m_stopEvent;
+    std::thread m_thread;
+
+    DWORD _completeIo(BOOL bStarted, OVERLAPPED& overlapped, DWORD& dwBytes) noexcept;
+    bool _readRequest(std::string& request) noexcept;
+    bool _writeReply(const std::string& reply) noexcept;
+    std::string _executeBatch(const std::string& request) noexcept;
+    static void _executeCommand(AudioDeviceManager& manager, const vector<wstring>& args, std::string& reply, bool& bStateChanged);
+    void _threadMain() noexcept;
+
+public:
+    ControlServer(AudioEngine& engine, std::function<void()> stateChangedCallback);
+    ~ControlServer();
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
+    static wstring getPipeName();
+};
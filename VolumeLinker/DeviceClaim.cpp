@@ -0,0 +1,55 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "DeviceClaim.h"
+#include "helpers.h"
+
+DeviceClaim::DeviceClaim(
+    const wstring& deviceId)
+{
+    // Create the device's claim, which fails if any other instance (of any user) has already created it.
+    // NOTE: An event that belongs to another user can't be opened with the default security, which gives us
+    // "access denied" instead of "already exists", but it still means exactly the same thing.
+    // NOTE: Unlike file mappings, events can be created in the global namespace without any special privileges.
+    m_hClaim.reset(CreateEventW(NULL, TRUE, FALSE, _getClaimName(deviceId).c_str()));
+    DWORD dwError = GetLastError();
+    if (!m_hClaim || dwError == ERROR_ALREADY_EXISTS) {
+        m_hClaim.reset();
+        if (dwError == ERROR_ALREADY_EXISTS || dwError == ERROR_ACCESS_DENIED) {
+            throw std::runtime_error("A selected device is already linked by another instance of Volume Linker (perhaps on another user's account).");
+        }
+        throw std::runtime_error("Unable to claim the device for linking.");
+    }
+}
+
+wstring DeviceClaim::_getClaimName(
+    const wstring& deviceId)
+{
+    // Device IDs are the same for every user, but may be too long (or contain backslashes) for an object name,
+    // so the name uses a hash of the ID instead (64-bit FNV-1a, which is more than enough for a few devices).
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto ch : deviceId) {
+        hash = (hash ^ static_cast<uint16_t>(ch)) * 1099511628211ULL;
+    }
+
+    wchar_t name[80];
+    swprintf_s(name, L"Global\\VideoPlayerCode.VolumeLinker.Device.%016llX", static_cast<unsigned long long>(hash));
+    return name;
+}
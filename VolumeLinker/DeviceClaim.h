@@ -0,0 +1,47 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+using std::wstring;
+
+//-----------------------------------------------------------
+// Machine-wide claim of a single audio device, which stops
+// the program's instances on other accounts (such as during
+// "fast user switching") from linking the same device. The
+// claim is a named kernel event in the global namespace,
+// which exists for as long as its owner keeps it open, and
+// which the OS closes automatically if the owner crashes.
+// Instances therefore link disjoint sets of devices at the
+// same time, while overlapping links are refused, without
+// any shared state that could ever go stale.
+//-----------------------------------------------------------
+class DeviceClaim
+{
+private:
+    wil::unique_handle m_hClaim;
+
+    static wstring _getClaimName(const wstring& deviceId);
+
+public:
+    DeviceClaim(const wstring& deviceId);
+};
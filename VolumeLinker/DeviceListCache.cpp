@@ -0,0 +1,176 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "DeviceListCache.h"
+
+// Identifies the snapshot format (any other version is simply ignored, and replaced at the next exit).
+static const uint32_t CACHE_MAGIC = 0x4C444C56; // "VLDL".
+static const uint16_t CACHE_VERSION = 1;
+static const size_t CACHE_HEADER_SIZE = 12;
+static const size_t CACHE_ENTRY_HEADER_SIZE = 4;
+
+// Sanity limit for the number of devices, so that a damaged snapshot can never make us allocate a huge list.
+static const uint32_t CACHE_MAX_DEVICES = 1024;
+
+// Longest ID or name (in UTF-16 characters) that the UINT16 length fields of an entry can describe.
+static const size_t CACHE_MAX_STRING_LENGTH = 0xFFFF;
+
+static void _putUInt16(
+    vector<BYTE>& data,
+    uint16_t value)
+{
+    data.push_back(static_cast<BYTE>(value & 0xFF));
+    data.push_back(static_cast<BYTE>(value >> 8));
+}
+
+static void _putUInt32(
+    vector<BYTE>& data,
+    uint32_t value)
+{
+    _putUInt16(data, static_cast<uint16_t>(value & 0xFFFF));
+    _putUInt16(data, static_cast<uint16_t>(value >> 16));
+}
+
+static uint16_t _getUInt16(
+    const BYTE* p) noexcept
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t _getUInt32(
+    const BYTE* p) noexcept
+{
+    return static_cast<uint32_t>(_getUInt16(p)) | (static_cast<uint32_t>(_getUInt16(p + 2)) << 16);
+}
+
+static void _putString(
+    vector<BYTE>& data,
+    const wstring& str,
+    size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        _putUInt16(data, static_cast<uint16_t>(str[i]));
+    }
+}
+
+static bool _isCacheableId(
+    const wstring& id) noexcept
+{
+    // NOTE: Empty IDs are refused by decode(), and longer ones can't be described by the UINT16 length field.
+    return !id.empty() && id.size() <= CACHE_MAX_STRING_LENGTH;
+}
+
+vector<BYTE> DeviceListCache::encode(
+    const vector<std::pair<wstring, wstring>>& devices)
+{
+    // Calculate the exact size first, so that the whole snapshot is built with a single allocation.
+    // NOTE: Devices whose ID doesn't fit the format are left out of the snapshot (and names are truncated),
+    // which never happens in practice, but must never cost us the rest of the list.
+    size_t deviceCount = 0;
+    size_t totalSize = CACHE_HEADER_SIZE;
+    for (auto& device : devices) {
+        if (deviceCount == CACHE_MAX_DEVICES) {
+            break;
+        }
+        if (_isCacheableId(device.first)) {
+            size_t nameLen = (std::min)(device.second.size(), CACHE_MAX_STRING_LENGTH);
+            totalSize += CACHE_ENTRY_HEADER_SIZE + (device.first.size() + nameLen) * 2;
+            ++deviceCount;
+        }
+    }
+
+    vector<BYTE> data;
+    data.reserve(totalSize);
+    _putUInt32(data, CACHE_MAGIC);
+    _putUInt16(data, CACHE_VERSION);
+    _putUInt16(data, 0);
+    _putUInt32(data, static_cast<uint32_t>(deviceCount));
+    size_t written = 0;
+    for (auto& device : devices) {
+        if (written == deviceCount) {
+            break;
+        }
+        if (_isCacheableId(device.first)) {
+            auto& id = device.first;
+            size_t nameLen = (std::min)(device.second.size(), CACHE_MAX_STRING_LENGTH);
+            _putUInt16(data, static_cast<uint16_t>(id.size()));
+            _putUInt16(data, static_cast<uint16_t>(nameLen));
+            _putString(data, id, id.size());
+            _putString(data, device.second, nameLen);
+            ++written;
+        }
+    }
+
+    return data;
+}
+
+bool DeviceListCache::decode(
+    const vector<BYTE>& data,
+    vector<std::pair<wstring, wstring>>& devices) noexcept
+{
+    // Refuse anything that isn't exactly a valid snapshot of our own version.
+    // NOTE: The caller's list is only replaced if the whole snapshot is valid.
+    if (data.size() < CACHE_HEADER_SIZE ||
+        _getUInt32(&data[0]) != CACHE_MAGIC ||
+        _getUInt16(&data[4]) != CACHE_VERSION)
+    {
+        return false;
+    }
+    uint32_t deviceCount = _getUInt32(&data[8]);
+    if (deviceCount > CACHE_MAX_DEVICES) {
+        return false;
+    }
+
+    try {
+        vector<std::pair<wstring, wstring>> result;
+        result.reserve(deviceCount);
+        size_t pos = CACHE_HEADER_SIZE;
+        for (uint32_t i = 0; i < deviceCount; ++i) {
+            if (data.size() - pos < CACHE_ENTRY_HEADER_SIZE) {
+                return false;
+            }
+            size_t idLen = _getUInt16(&data[pos]);
+            size_t nameLen = _getUInt16(&data[pos + 2]);
+            pos += CACHE_ENTRY_HEADER_SIZE;
+            if (idLen == 0 || data.size() - pos < (idLen + nameLen) * 2) {
+                return false;
+            }
+
+            wstring id(idLen, L'\0');
+            for (size_t c = 0; c < idLen; ++c, pos += 2) {
+                id[c] = static_cast<wchar_t>(_getUInt16(&data[pos]));
+            }
+            wstring name(nameLen, L'\0');
+            for (size_t c = 0; c < nameLen; ++c, pos += 2) {
+                name[c] = static_cast<wchar_t>(_getUInt16(&data[pos]));
+            }
+            result.emplace_back(std::move(id), std::move(name));
+        }
+        if (pos != data.size()) {
+            return false;
+        }
+
+        devices = std::move(result);
+        return true;
+    }
+    catch (...) {
+        return false;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+using std::vector;
+using std::wstring;
+
+//-----------------------------------------------------------
+// Compact binary snapshot of the dialog's device list (IDs
+// and names, in list order), which is saved in the
+// background whenever the list changes, and lets the next
+// start fill the dialog's lists instantly, without having
+// to read and sort every device's name first. The
+// snapshot is only a starting point. The live list always
+// replaces it as soon as the engine has read it.
+//
+// Format (little-endian): "VLDL" magic, UINT16 version,
+// UINT16 reserved (0), UINT32 device count, followed by one
+// entry per device: UINT16 ID length, UINT16 name length
+// (both in UTF-16 characters), ID, name (no terminators).
+//-----------------------------------------------------------
+class DeviceListCache
+{
+public:
+    static vector<BYTE> encode(const vector<std::pair<wstring, wstring>>& devices);
+    static bool decode(const vector<BYTE>& data, vector<std::pair<wstring, wstring>>& devices) noexcept;
+};
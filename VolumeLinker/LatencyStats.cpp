@@ -0,0 +1,115 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "LatencyStats.h"
+#include "helpers.h"
+
+LatencyStats::LatencyStats() noexcept :
+    m_sampleCount(0),
+    m_events(0),
+    m_skipped(0),
+    m_coalesced(0),
+    m_dropped(0),
+    m_failed(0),
+    m_recovered(0)
+{
+    for (auto& sample : m_samples) {
+        sample.store(0, std::memory_order_relaxed);
+    }
+
+    // NOTE: The performance counter frequency is fixed at boot, so it only needs to be read once.
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    m_frequency = (frequency.QuadPart > 0) ? frequency.QuadPart : 1;
+
+    m_lastReportTime = now();
+    m_lastReportEvents = 0;
+}
+
+LatencyStats::Report LatencyStats::getReport()
+{
+    Report report = {};
+
+    // Copy the counters. They're read individually, so they may be very slightly out of step with each other.
+    report.events = m_events.load(std::memory_order_relaxed);
+    report.skipped = m_skipped.load(std::memory_order_relaxed);
+    report.coalesced = m_coalesced.load(std::memory_order_relaxed);
+    report.dropped = m_dropped.load(std::memory_order_relaxed);
+    report.failed = m_failed.load(std::memory_order_relaxed);
+    report.recovered = m_recovered.load(std::memory_order_relaxed);
+    uint64_t sampleCount = m_sampleCount.load(std::memory_order_relaxed);
+    report.applied = sampleCount;
+
+    // Calculate the notification rate since the previous report.
+    LONGLONG reportTime = now();
+    double elapsedSeconds = static_cast<double>(reportTime - m_lastReportTime) / static_cast<double>(m_frequency);
+    if (elapsedSeconds > 0.0) {
+        report.eventsPerSecond = static_cast<double>(report.events - m_lastReportEvents) / elapsedSeconds;
+    }
+    m_lastReportTime = reportTime;
+    m_lastReportEvents = report.events;
+
+    // Copy and sort the most recent latency samples, to find the percentiles.
+    size_t count = (sampleCount < SAMPLE_CAPACITY) ? static_cast<size_t>(sampleCount) : SAMPLE_CAPACITY;
+    report.sampleCount = count;
+    if (count > 0) {
+        std::vector<uint64_t> samples(count);
+        for (size_t i = 0; i < count; ++i) {
+            samples[i] = m_samples[i].load(std::memory_order_relaxed);
+        }
+        std::sort(samples.begin(), samples.end());
+
+        const double ticksToMs = 1000.0 / static_cast<double>(m_frequency);
+        report.p50Ms = static_cast<double>(samples[(count - 1) * 50 / 100]) * ticksToMs;
+        report.p99Ms = static_cast<double>(samples[(count - 1) * 99 / 100]) * ticksToMs;
+        report.maxMs = static_cast<double>(samples[count - 1]) * ticksToMs;
+    }
+
+    return report;
+}
+
+std::wstring LatencyStats::formatReport()
+{
+    auto report = this->getReport();
+
+    wchar_t buffer[1024];
+    swprintf_s(buffer,
+        L"Master to slave propagation (last %zu slave writes):\r\n"
+        L"p50: %.3f ms\r\n"
+        L"p99: %.3f ms\r\n"
+        L"max: %.3f ms\r\n"
+        L"\r\n"
+        L"Master notifications: %llu (%.1f per second since last report)\r\n"
+        L"Slave writes applied: %llu\r\n"
+        L"Slave writes skipped (unchanged): %llu\r\n"
+        L"Slave writes failed: %llu\r\n"
+        L"Slave endpoints re-activated after failures: %llu\r\n"
+        L"States coalesced (replaced before being applied): %llu\r\n"
+        L"Notifications dropped (no connected slaves): %llu\r\n",
+        report.sampleCount, report.p50Ms, report.p99Ms, report.maxMs,
+        static_cast<unsigned long long>(report.events), report.eventsPerSecond,
+        static_cast<unsigned long long>(report.applied),
+        static_cast<unsigned long long>(report.skipped),
+        static_cast<unsigned long long>(report.failed),
+        static_cast<unsigned long long>(report.recovered),
+        static_cast<unsigned long long>(report.coalesced),
+        static_cast<unsigned long long>(report.dropped));
+
+    return std::wstring(buffer);
+}
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "framework.h"
+
+//-----------------------------------------------------------
+// Lightweight propagation statistics for the volume link.
+// Recording is lock-free and allocation-free, and only costs
+// a few relaxed atomic operations (plus one QPC read for the
+// latency samples), so it is always enabled, even in release
+// builds. The latency samples are kept in a fixed-size ring
+// buffer, which means that the percentiles always describe
+// the most recent slave writes. All of the heavier work (such
+// as sorting the samples) only happens when a report is made.
+//-----------------------------------------------------------
+class LatencyStats
+{
+public:
+    struct Report
+    {
+        uint64_t events; // Master volume notifications received.
+        uint64_t applied; // Slave writes that reached the device.
+        uint64_t skipped; // Slave writes that weren't needed (the slave already had that state).
+        uint64_t coalesced; // States that were replaced by newer ones before a worker could apply them.
+        uint64_t dropped; // Notifications that arrived while no slaves were connected.
+        uint64_t failed; // Slave writes that failed.
+        uint64_t recovered; // Slave endpoints that were re-activated after a failure.
+        double eventsPerSecond; // Notification rate since the previous report.
+        size_t sampleCount; // Number of latency samples that the percentiles are based on.
+        double p50Ms;
+        double p99Ms;
+        double maxMs;
+    };
+
+private:
+    static const size_t SAMPLE_CAPACITY = 1024; // NOTE: Must be a power of two.
+
+    std::atomic<uint64_t> m_samples[SAMPLE_CAPACITY]; // Latencies in QPC ticks.
+    std::atomic<uint64_t> m_sampleCount; // Total samples ever written (the next write position).
+    std::atomic<uint64_t> m_events;
+    std::atomic<uint64_t> m_skipped;
+    std::atomic<uint64_t> m_coalesced;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_recovered;
+    LONGLONG m_frequency;
+    LONGLONG m_lastReportTime; // Only used by the reporting thread.
+    uint64_t m_lastReportEvents; // Only used by the reporting thread.
+
+public:
+    LatencyStats() noexcept;
+    LatencyStats(const LatencyStats&) = delete;
+    LatencyStats& operator=(const LatencyStats&) = delete;
+
+    static LONGLONG now() noexcept
+    {
+        LARGE_INTEGER time;
+        QueryPerformanceCounter(&time);
+        return time.QuadPart;
+    }
+
+    void recordEvent() noexcept { m_events.fetch_add(1, std::memory_order_relaxed); }
+    void recordSkipped() noexcept { m_skipped.fetch_add(1, std::memory_order_relaxed); }
+    void recordCoalesced() noexcept { m_coalesced.fetch_add(1, std::memory_order_relaxed); }
+    void recordDropped() noexcept { m_dropped.fetch_add(1, std::memory_order_relaxed); }
+    void recordFailed() noexcept { m_failed.fetch_add(1, std::memory_order_relaxed); }
+    void recordRecovered() noexcept { m_recovered.fetch_add(1, std::memory_order_relaxed); }
+
+    void recordLatency(
+        LONGLONG startTime) noexcept
+    {
+        // Claim the next slot in the ring buffer (overwriting the oldest sample once it's full).
+        // NOTE: Several slave workers can record at the same time, since each of them claims its own slot.
+        LONGLONG elapsed = now() - startTime;
+        uint64_t idx = m_sampleCount.fetch_add(1, std::memory_order_relaxed);
+        m_samples[idx & (SAMPLE_CAPACITY - 1)].store((elapsed > 0) ? static_cast<uint64_t>(elapsed) : 0, std::memory_order_relaxed);
+    }
+
+    Report getReport();
+    std::wstring formatReport();
+};
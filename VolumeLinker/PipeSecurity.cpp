@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "PipeSecurity.h"
+
+PipeSecurity::PipeSecurity() :
+    m_attributes{}
+{
+    // Look up our own user.
+    wil::unique_handle hToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken)) {
+        throw std::runtime_error("Unable to open the process token.");
+    }
+    DWORD dwSize = 0;
+    GetTokenInformation(hToken.get(), TokenUser, NULL, 0, &dwSize);
+    std::vector<BYTE> tokenUser(dwSize);
+    if (dwSize == 0 || !GetTokenInformation(hToken.get(), TokenUser, tokenUser.data(), dwSize, &dwSize)) {
+        throw std::runtime_error("Unable to read the process user.");
+    }
+    LPWSTR pSidString = NULL;
+    if (!ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER*>(tokenUser.data())->User.Sid, &pSidString)) {
+        throw std::runtime_error("Unable to read the process user.");
+    }
+    wil::unique_hlocal sidStringCleanup(pSidString);
+
+    // Build a protected descriptor (nothing inherited) which grants full access to the user and the system.
+    std::wstring sddl = std::wstring(L"D:P(A;;GA;;;") + pSidString + L")(A;;GA;;;SY)";
+    PSECURITY_DESCRIPTOR pDescriptor = NULL;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &pDescriptor, NULL)) {
+        throw std::runtime_error("Unable to create the pipe security descriptor.");
+    }
+    m_descriptor.reset(pDescriptor);
+
+    m_attributes.nLength = sizeof(m_attributes);
+    m_attributes.lpSecurityDescriptor = pDescriptor;
+    m_attributes.bInheritHandle = FALSE;
+}
+
+SECURITY_ATTRIBUTES* PipeSecurity::get() noexcept
+{
+    return &m_attributes;
+}
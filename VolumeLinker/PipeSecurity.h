@@ -0,0 +1,42 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+//-----------------------------------------------------------
+// Security attributes for our named pipes, which only grant
+// access to the current user (and the system). The default
+// security would let every other user open the pipes for
+// reading, which is enough to occupy them.
+//-----------------------------------------------------------
+class PipeSecurity
+{
+private:
+    wil::unique_hlocal m_descriptor;
+    SECURITY_ATTRIBUTES m_attributes;
+
+public:
+    PipeSecurity();
+    PipeSecurity(const PipeSecurity&) = delete;
+    PipeSecurity& operator=(const PipeSecurity&) = delete;
+    SECURITY_ATTRIBUTES* get() noexcept;
+};
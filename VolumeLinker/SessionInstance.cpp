@@ -0,0 +1,69 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "SessionInstance.h"
+#include "helpers.h"
+
+SessionInstance::SessionInstance() :
+    m_bFirstInstance(false)
+{
+    // Create (or open) the session's shared memory block. The OS zero-fills it when it's created, and frees it
+    // when the last instance has closed it (even if that instance has crashed), so it can never go stale.
+    // NOTE: The "Local" namespace is separate for every session, which is what lets several users (such as
+    // with "fast user switching") run their own instances at the same time.
+    m_hMapping.reset(CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        0, sizeof(InstanceInfo), L"Local\\VideoPlayerCode.VolumeLinker.Instance"));
+    if (!m_hMapping) {
+        throw std::runtime_error("Unable to create the instance coordination memory.");
+    }
+    m_bFirstInstance = (GetLastError() != ERROR_ALREADY_EXISTS);
+
+    m_pInfo.reset(static_cast<InstanceInfo*>(MapViewOfFile(m_hMapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(InstanceInfo))));
+    if (!m_pInfo) {
+        throw std::runtime_error("Unable to map the instance coordination memory.");
+    }
+}
+
+bool SessionInstance::isFirstInstance() const noexcept
+{
+    return m_bFirstInstance;
+}
+
+void SessionInstance::publishWindow(
+    HWND hWnd,
+    bool bHeadless) noexcept
+{
+    // Only the first instance publishes its window. The headless flag is written first, so that nobody can
+    // ever see the new window with the old flag.
+    // NOTE: Window handles are valid for every process in the session, and always fit into 32 bits.
+    if (!m_bFirstInstance) {
+        return;
+    }
+    InterlockedExchange(&m_pInfo->bHeadless, bHeadless ? TRUE : FALSE);
+    InterlockedExchange64(&m_pInfo->hWnd, static_cast<LONG64>(reinterpret_cast<INT_PTR>(hWnd)));
+}
+
+HWND SessionInstance::getWindow(
+    bool& bHeadless) const noexcept
+{
+    HWND hWnd = reinterpret_cast<HWND>(static_cast<INT_PTR>(InterlockedCompareExchange64(&m_pInfo->hWnd, 0, 0)));
+    bHeadless = (InterlockedCompareExchange(&m_pInfo->bHeadless, 0, 0) != FALSE);
+    return hWnd;
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+//-----------------------------------------------------------
+// Single-instance coordination within the user's session.
+// The first instance creates a tiny shared memory block in
+// the session's own namespace, and publishes its window in
+// it, which lets every later instance find (and talk to)
+// the running instance directly, instead of searching all
+// windows by their titles. Instances on other accounts have
+// their own namespace, so they never block each other. The
+// devices themselves are coordinated per machine instead
+// (see DeviceClaim).
+//-----------------------------------------------------------
+class SessionInstance
+{
+private:
+    // The shared memory block.
+    struct InstanceInfo
+    {
+        volatile LONG64 hWnd; // Window of the running instance (or NULL while it's starting or exiting).
+        volatile LONG bHeadless; // Whether the window is a headless instance's hidden window.
+    };
+
+    wil::unique_handle m_hMapping;
+    wil::unique_mapview_ptr<InstanceInfo> m_pInfo;
+    bool m_bFirstInstance;
+
+public:
+    SessionInstance();
+    SessionInstance(const SessionInstance&) = delete;
+    SessionInstance& operator=(const SessionInstance&) = delete;
+    bool isFirstInstance() const noexcept;
+    void publishWindow(HWND hWnd, bool bHeadless) noexcept;
+    HWND getWindow(bool& bHeadless) const noexcept;
+};
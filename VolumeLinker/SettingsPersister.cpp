@@ -0,0 +1,153 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "SettingsPersister.h"
+#include "helpers.h"
+#include "WakeupStats.h"
+
+// How long to wait before retrying a write that has failed.
+static const DWORD RETRY_DELAY_MS = 5000;
+
+SettingsPersister::SettingsPersister(
+    std::function<void(const PersistedSettings*, const PersistedSettings&)> writeCallback,
+    DWORD dwDelay) :
+    m_writeCallback(std::move(writeCallback)),
+    m_dwDelay(dwDelay),
+    m_dueTime(0)
+{
+    HRESULT hr;
+
+    // Auto-reset event which wakes the worker whenever there's something new to schedule.
+    hr = m_wakeEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create settings persister wake event.");
+
+    // Manual-reset events which tell waiters that everything is written, and tell the worker to exit.
+    hr = m_idleEvent.create(wil::EventOptions::ManualReset | wil::EventOptions::Signaled);
+    THROW_IF_COM_FAILED(hr, "Unable to create settings persister idle event.");
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create settings persister stop event.");
+
+    // Start the worker thread (throws if the thread can't be created).
+    m_thread = std::thread(&SettingsPersister::_threadMain, this);
+}
+
+SettingsPersister::~SettingsPersister()
+{
+    // NOTE: Any snapshot that hasn't been written yet is discarded, so the owner must flush() first.
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void SettingsPersister::save(
+    PersistedSettings settings) noexcept
+{
+    // Replace any older snapshot, and restart the waiting period.
+    // NOTE: Moving the snapshot in never allocates, so this can't fail.
+    {
+        auto lock = m_lock.lock_exclusive();
+        m_pending = std::move(settings);
+        m_dueTime = GetTickCount64() + m_dwDelay;
+        m_idleEvent.ResetEvent();
+    }
+    m_wakeEvent.SetEvent();
+}
+
+bool SettingsPersister::flush(
+    DWORD dwTimeout) noexcept
+{
+    // Write the pending snapshot right away (if any), and wait until it's written (or until the timeout).
+    // NOTE: A zero timeout merely starts the write, which lets the caller do other work in the meantime.
+    {
+        auto lock = m_lock.lock_exclusive();
+        if (!m_pending) {
+            return WaitForSingleObject(m_idleEvent.get(), dwTimeout) == WAIT_OBJECT_0;
+        }
+        m_dueTime = 0;
+    }
+    m_wakeEvent.SetEvent();
+
+    return WaitForSingleObject(m_idleEvent.get(), dwTimeout) == WAIT_OBJECT_0;
+}
+
+void SettingsPersister::_threadMain() noexcept
+{
+    HANDLE waitHandles[] = { m_stopEvent.get(), m_wakeEvent.get() };
+    for (;;) {
+        // Sleep until the pending snapshot is due (or until something changes).
+        // NOTE: Also handles the case where the due time has already passed while we were writing.
+        DWORD dwTimeout = INFINITE;
+        {
+            auto lock = m_lock.lock_shared();
+            if (m_pending) {
+                ULONGLONG now = GetTickCount64();
+                dwTimeout = (m_dueTime > now) ? static_cast<DWORD>(m_dueTime - now) : 0;
+            }
+        }
+
+        DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, dwTimeout);
+        if (waitResult == WAIT_OBJECT_0 + 1) {
+            WakeupStats::record(WakeSource::SettingsWriter);
+            continue;
+        }
+        if (waitResult != WAIT_TIMEOUT) {
+            // Stop was requested (or the wait itself failed, which should never happen).
+            break;
+        }
+        WakeupStats::record(WakeSource::SettingsWriter);
+
+        // Take the pending snapshot, and write it (unless it's identical to what we've written last).
+        std::optional<PersistedSettings> settings;
+        {
+            auto lock = m_lock.lock_exclusive();
+            settings = std::move(m_pending);
+            m_pending.reset();
+        }
+        if (!settings) {
+            continue;
+        }
+
+        bool success = true;
+        if (!m_written || *m_written != *settings) {
+            try {
+                m_writeCallback(m_written ? &*m_written : nullptr, *settings);
+                m_written = std::move(settings);
+            }
+            catch (...) {
+                success = false;
+            }
+        }
+
+        // Try again later if the write failed (unless a newer snapshot has arrived meanwhile, which replaces it).
+        // NOTE: After a failure, we no longer know what's in the registry, so the retry writes everything.
+        auto lock = m_lock.lock_exclusive();
+        if (!success) {
+            m_written.reset();
+            if (!m_pending) {
+                m_pending = std::move(settings);
+                m_dueTime = GetTickCount64() + RETRY_DELAY_MS;
+            }
+        }
+        if (!m_pending) {
+            m_idleEvent.SetEvent();
+        }
+    }
+}
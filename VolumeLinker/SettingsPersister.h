@@ -0,0 +1,97 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+using std::vector;
+using std::wstring;
+
+// The saved settings of a single link group.
+struct PersistedLinkGroup
+{
+    wstring masterDeviceId;
+    vector<wstring> slaveDeviceIds;
+    bool bLinkActive;
+    wstring masterSession;
+
+    bool operator==(const PersistedLinkGroup& other) const
+    {
+        return bLinkActive == other.bLinkActive && masterDeviceId == other.masterDeviceId &&
+            slaveDeviceIds == other.slaveDeviceIds && masterSession == other.masterSession;
+    }
+    bool operator!=(const PersistedLinkGroup& other) const { return !(*this == other); }
+};
+
+// Everything that the program saves by itself (all other settings are only ever read).
+// NOTE: The links are only part of a snapshot once the user has changed them, and the device list
+// only once the dialog has displayed a real one, so a snapshot never writes anything else.
+struct PersistedSettings
+{
+    bool bHasLinks = false; // Whether "groups" and "bBidirectional" are part of the snapshot.
+    vector<PersistedLinkGroup> groups;
+    bool bBidirectional = false;
+    std::optional<vector<std::pair<wstring, wstring>>> deviceList; // The dialog's device list, for the next start.
+
+    bool operator==(const PersistedSettings& other) const
+    {
+        return bHasLinks == other.bHasLinks && bBidirectional == other.bBidirectional &&
+            groups == other.groups && deviceList == other.deviceList;
+    }
+    bool operator!=(const PersistedSettings& other) const { return !(*this == other); }
+};
+
+//-----------------------------------------------------------
+// Write-behind saving of the settings, on a background
+// thread. Every change simply hands over a snapshot of the
+// settings, which replaces any snapshot that hasn't been
+// written yet, and the newest snapshot is only written once
+// no further changes have arrived for a short while. The
+// write callback receives the last snapshot that it wrote
+// (or none for the first write), so that it can skip every
+// value that hasn't changed since then. That way, a burst
+// of changes costs a single small write, crashes lose almost
+// nothing, and exiting rarely has anything left to write.
+//-----------------------------------------------------------
+class SettingsPersister
+{
+private:
+    std::function<void(const PersistedSettings*, const PersistedSettings&)> m_writeCallback; // Throws if the write failed.
+    DWORD m_dwDelay; // Milliseconds without changes before the newest snapshot is written.
+    std::optional<PersistedSettings> m_pending; // Newest snapshot that hasn't been written yet (protected by m_lock).
+    ULONGLONG m_dueTime; // When the pending snapshot should be written (protected by m_lock).
+    std::optional<PersistedSettings> m_written; // Last snapshot that was written (only used by the worker).
+    wil::srwlock m_lock;
+    wil::unique_event_nothrow m_wakeEvent; // Set whenever the pending snapshot or its due time has changed.
+    wil::unique_event_nothrow m_idleEvent; // Set while there's nothing left to write.
+    wil::unique_event_nothrow m_stopEvent;
+    std::thread m_thread;
+
+    void _threadMain() noexcept;
+
+public:
+    SettingsPersister(std::function<void(const PersistedSettings*, const PersistedSettings&)> writeCallback, DWORD dwDelay);
+    ~SettingsPersister();
+    SettingsPersister(const SettingsPersister&) = delete;
+    SettingsPersister& operator=(const SettingsPersister&) = delete;
+    void save(PersistedSettings settings) noexcept;
+    bool flush(DWORD dwTimeout) noexcept;
+};
@@ -0,0 +1,385 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "SimulatedAudioBackend.h"
+#include "LatencyStats.h"
+#include "helpers.h"
+
+SimulatedAudioBackend::SimulatedAudioBackend(
+    const SimulatedBackendSettings& settings) :
+    m_dwCallLatency(settings.dwCallLatencyMicroseconds),
+    m_failureThreshold(0),
+    m_failureResult(settings.failureResult),
+    m_calls(0),
+    m_failures(0),
+    m_notifications(0),
+    m_queueHead(0),
+    m_dispatchThreadId(0)
+{
+    HRESULT hr;
+
+    if (settings.nDevices > SIMULATED_MAX_DEVICES) {
+        throw std::runtime_error("Too many simulated audio devices requested.");
+    }
+    if (settings.nChannels == 0 || settings.nChannels > SIMULATED_MAX_CHANNELS) {
+        throw std::runtime_error("Invalid number of simulated audio device channels.");
+    }
+    if (!FAILED(settings.failureResult)) {
+        throw std::runtime_error("The simulated failure result must be an error code.");
+    }
+    this->setFailureRate(settings.fFailureRate);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    m_frequency = (frequency.QuadPart > 0) ? frequency.QuadPart : 1;
+
+    // Create all devices, with IDs that look like real endpoint IDs, and names that sort in creation order.
+    // NOTE: Every device gets its own failure sequence, derived from the seed and its number.
+    m_endpoints.reserve(settings.nDevices);
+    m_endpointIdxs.reserve(settings.nDevices);
+    for (size_t i = 0; i < settings.nDevices; ++i) {
+        wchar_t id[64];
+        wchar_t name[64];
+        swprintf_s(id, L"{0.0.0.00000000}.{51a0a7ed-0000-4000-8000-%012zu}", i);
+        swprintf_s(name, L"Simulated Device %04zu", i + 1);
+        uint32_t seed = settings.seed * 2654435761u + static_cast<uint32_t>(i);
+
+        wil::com_ptr_nothrow<SimulatedAudioEndpoint> pEndpoint;
+        pEndpoint.attach(new SimulatedAudioEndpoint(this, id, name, settings.nChannels, seed));
+        m_endpointIdxs.emplace(pEndpoint->getId(), i);
+        m_endpoints.push_back(std::move(pEndpoint));
+    }
+
+    // Auto-reset event which wakes the notification thread whenever notifications have been queued.
+    hr = m_wakeEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create simulated backend wake event.");
+
+    // Manual-reset event which tells the notification thread to exit (stays signaled once set).
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create simulated backend stop event.");
+
+    // Start the notification thread (throws if the thread can't be created).
+    m_thread = std::thread(&SimulatedAudioBackend::_threadMain, this);
+}
+
+SimulatedAudioBackend::~SimulatedAudioBackend()
+{
+    // Stop delivering notifications. Anything that's still queued is simply discarded.
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+
+    // Detach all devices, since their users may keep them alive for a little while longer.
+    for (auto& pEndpoint : m_endpoints) {
+        pEndpoint->detach();
+    }
+}
+
+void SimulatedAudioBackend::_threadMain() noexcept
+{
+    m_dispatchThreadId = GetCurrentThreadId();
+
+    HANDLE waitHandles[] = { m_stopEvent.get(), m_wakeEvent.get() };
+    for (;;) {
+        DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0 + 1) {
+            // Stop was requested (or the wait itself failed, which should never happen).
+            break;
+        }
+
+        // Deliver the queued notifications one by one, in the order that they were queued.
+        // NOTE: We take the dispatch lock BEFORE taking a notification out of the queue, which means that a
+        // receiver is either still in the queue (where it can be cancelled), or is being delivered while we
+        // hold the lock (which is what the cancellation waits for). There's no moment in between the two.
+        for (;;) {
+            auto dispatchLock = m_dispatchLock.lock_exclusive();
+            Notification notification;
+            {
+                auto lock = m_queueLock.lock_exclusive();
+                if (m_queueHead >= m_queue.size()) {
+                    break;
+                }
+                notification = m_queue[m_queueHead++];
+                if (m_queueHead >= m_queue.size()) {
+                    // Empty the queue while keeping its memory, so that queueing never allocates once warmed up.
+                    m_queue.clear();
+                    m_queueHead = 0;
+                }
+            }
+            this->_deliver(notification);
+        }
+    }
+}
+
+void SimulatedAudioBackend::_deliver(
+    const Notification& notification) noexcept
+{
+    m_notifications.fetch_add(1, std::memory_order_relaxed);
+
+    if (notification.type == Notification::Type::Volume) {
+        // The notification data ends with a variable-length array of channel levels, so we build it in a buffer
+        // that's large enough for the maximum number of channels (exactly like the audio service does).
+        alignas(AUDIO_VOLUME_NOTIFICATION_DATA) BYTE buffer[sizeof(AUDIO_VOLUME_NOTIFICATION_DATA) + SIMULATED_MAX_CHANNELS * sizeof(float)];
+        auto pData = reinterpret_cast<PAUDIO_VOLUME_NOTIFICATION_DATA>(buffer);
+        pData->guidEventContext = notification.guidEventContext;
+        pData->bMuted = notification.bMuted;
+        pData->fMasterVolume = notification.fMasterVolume;
+        pData->nChannels = notification.nChannels;
+        memcpy(pData->afChannelVolumes, notification.afChannelVolumes, notification.nChannels * sizeof(float));
+        notification.pVolumeCallback->OnNotify(pData);
+    }
+    else {
+        notification.pClient->OnDeviceStateChanged(notification.pEndpoint->getId().c_str(), notification.dwState);
+    }
+}
+
+HRESULT SimulatedAudioBackend::_simulateCall(
+    uint32_t randomValue) noexcept
+{
+    m_calls.fetch_add(1, std::memory_order_relaxed);
+
+    // Take as long as a real device call. Longer waits sleep, and only the last stretch is spun, which
+    // keeps the timing accurate to microseconds without burning a core for every simulated device.
+    DWORD dwLatency = m_dwCallLatency.load(std::memory_order_relaxed);
+    if (dwLatency > 0) {
+        LONGLONG endTime = LatencyStats::now() + static_cast<LONGLONG>(dwLatency) * m_frequency / 1000000;
+        LONGLONG sleepTicks = m_frequency / 500; // 2 ms, which is more than the shortest sleep.
+        for (;;) {
+            LONGLONG remaining = endTime - LatencyStats::now();
+            if (remaining <= 0) {
+                break;
+            }
+            if (remaining > sleepTicks) {
+                Sleep(1);
+            }
+            else {
+                YieldProcessor();
+            }
+        }
+    }
+
+    if (static_cast<uint64_t>(randomValue) < m_failureThreshold.load(std::memory_order_relaxed)) {
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+        return m_failureResult;
+    }
+
+    return S_OK;
+}
+
+void SimulatedAudioBackend::_queueNotification(
+    const Notification& notification) noexcept
+{
+    // NOTE: If the queue can't grow, the notification is lost (exactly what happens when a real device is too busy).
+    try {
+        auto lock = m_queueLock.lock_exclusive();
+        m_queue.push_back(notification);
+    }
+    catch (...) {
+        return;
+    }
+    m_wakeEvent.SetEvent();
+}
+
+void SimulatedAudioBackend::_cancelNotifications(
+    const void* pTarget) noexcept
+{
+    // Remove everything that's still waiting to be delivered to the receiver.
+    {
+        auto lock = m_queueLock.lock_exclusive();
+        auto first = m_queue.begin() + static_cast<ptrdiff_t>(m_queueHead);
+        m_queue.erase(std::remove_if(first, m_queue.end(),
+            [pTarget](const Notification& notification) -> bool {
+                return notification.pVolumeCallback == pTarget || notification.pClient == pTarget;
+            }), m_queue.end());
+    }
+
+    // Wait until any notification that's currently being delivered has returned, since the caller is
+    // about to destroy the receiver. The notification thread itself must never wait for its own lock.
+    if (GetCurrentThreadId() != m_dispatchThreadId.load(std::memory_order_relaxed)) {
+        auto dispatchLock = m_dispatchLock.lock_exclusive();
+    }
+}
+
+SimulatedAudioEndpoint& SimulatedAudioBackend::_getEndpoint(
+    size_t idx) const
+{
+    if (idx >= m_endpoints.size()) {
+        throw std::runtime_error("Invalid simulated device number requested.");
+    }
+
+    return *m_endpoints[idx];
+}
+
+HRESULT SimulatedAudioBackend::registerNotificationClient(
+    IMMNotificationClient* pClient) noexcept
+{
+    if (pClient == NULL) {
+        return E_POINTER;
+    }
+
+    try {
+        auto lock = m_clientLock.lock_exclusive();
+        m_clients.push_back(pClient);
+    }
+    catch (...) {
+        return E_OUTOFMEMORY;
+    }
+    return S_OK;
+}
+
+HRESULT SimulatedAudioBackend::unregisterNotificationClient(
+    IMMNotificationClient* pClient) noexcept
+{
+    if (pClient == NULL) {
+        return E_POINTER;
+    }
+
+    {
+        auto lock = m_clientLock.lock_exclusive();
+        m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), pClient), m_clients.end());
+    }
+    this->_cancelNotifications(pClient);
+    return S_OK;
+}
+
+HRESULT SimulatedAudioBackend::enumerateDevices(
+    DWORD dwStateMask,
+    std::vector<wil::com_ptr_nothrow<IMMDevice>>& devices)
+{
+    devices.clear();
+    devices.reserve(m_endpoints.size());
+    for (auto& pEndpoint : m_endpoints) {
+        if ((pEndpoint->getState() & dwStateMask) != 0) {
+            devices.emplace_back(static_cast<IMMDevice*>(pEndpoint.get()));
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT SimulatedAudioBackend::getDevice(
+    LPCWSTR pwstrId,
+    wil::com_ptr_nothrow<IMMDevice>& pDevice) noexcept
+{
+    pDevice = nullptr;
+    if (pwstrId == NULL) {
+        return E_POINTER;
+    }
+
+    // NOTE: The lookup itself never allocates, but a failed string construction is treated as a missing device.
+    try {
+        auto it = m_endpointIdxs.find(std::wstring(pwstrId));
+        if (it == m_endpointIdxs.end()) {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+        pDevice = static_cast<IMMDevice*>(m_endpoints[it->second].get());
+    }
+    catch (...) {
+        return E_OUTOFMEMORY;
+    }
+    return S_OK;
+}
+
+size_t SimulatedAudioBackend::getDeviceCount() const noexcept
+{
+    return m_endpoints.size();
+}
+
+const std::wstring& SimulatedAudioBackend::getDeviceId(
+    size_t idx) const
+{
+    return this->_getEndpoint(idx).getId();
+}
+
+void SimulatedAudioBackend::getDeviceVolume(
+    size_t idx,
+    float& fVolume,
+    BOOL& bMuted) const
+{
+    this->_getEndpoint(idx).getVolume(fVolume, bMuted);
+}
+
+void SimulatedAudioBackend::setDeviceVolume(
+    size_t idx,
+    float fVolume,
+    BOOL bMuted,
+    LPCGUID pguidEventContext) const
+{
+    this->_getEndpoint(idx).setVolume(fVolume, bMuted, pguidEventContext);
+}
+
+void SimulatedAudioBackend::setDeviceState(
+    size_t idx,
+    DWORD dwState)
+{
+    // Change the device's state (such as unplugging it), and tell every client about it.
+    // NOTE: Any volume interface that has been activated stops working while the device isn't active.
+    auto& endpoint = this->_getEndpoint(idx);
+    endpoint.setState(dwState);
+
+    Notification notification = {};
+    notification.type = Notification::Type::DeviceState;
+    notification.pEndpoint = &endpoint;
+    notification.dwState = dwState;
+    auto lock = m_clientLock.lock_shared();
+    for (auto pClient : m_clients) {
+        notification.pClient = pClient;
+        this->_queueNotification(notification);
+    }
+}
+
+void SimulatedAudioBackend::setCallLatency(
+    DWORD dwMicroseconds) noexcept
+{
+    m_dwCallLatency.store(dwMicroseconds, std::memory_order_relaxed);
+}
+
+void SimulatedAudioBackend::setFailureRate(
+    double fRate) noexcept
+{
+    fRate = (fRate < 0.0) ? 0.0 : ((fRate > 1.0) ? 1.0 : fRate);
+    m_failureThreshold.store(static_cast<uint64_t>(fRate * 4294967296.0), std::memory_order_relaxed);
+}
+
+void SimulatedAudioBackend::flushNotifications() noexcept
+{
+    // Wait until the queue is empty and nothing is being delivered (including anything that's queued meanwhile).
+    // NOTE: Must never be called by a receiver, since the notification thread would then wait for itself.
+    for (;;) {
+        {
+            auto dispatchLock = m_dispatchLock.lock_exclusive();
+            auto lock = m_queueLock.lock_shared();
+            if (m_queueHead >= m_queue.size()) {
+                return;
+            }
+        }
+        Sleep(0);
+    }
+}
+
+SimulatedBackendStats SimulatedAudioBackend::getStats() const noexcept
+{
+    SimulatedBackendStats stats;
+    stats.calls = m_calls.load(std::memory_order_relaxed);
+    stats.failures = m_failures.load(std::memory_order_relaxed);
+    stats.notifications = m_notifications.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "AudioBackend.h"
+#include "SimulatedAudioEndpoint.h"
+
+// Highest number of devices that the simulated backend can create.
+static const size_t SIMULATED_MAX_DEVICES = 1024;
+
+// Configuration of the simulated backend.
+struct SimulatedBackendSettings
+{
+    size_t nDevices = 8; // Number of (active) devices to create.
+    UINT nChannels = 2; // Number of channels per device (at most SIMULATED_MAX_CHANNELS).
+    DWORD dwCallLatencyMicroseconds = 0; // How long every device call takes.
+    double fFailureRate = 0.0; // Chance that a device call fails (0.0 to 1.0).
+    HRESULT failureResult = AUDCLNT_E_DEVICE_INVALIDATED; // What the injected failures return.
+    uint32_t seed = 1; // Seed for the failure injection, so that every run fails the same calls.
+};
+
+// Activity counters of the simulated backend.
+struct SimulatedBackendStats
+{
+    uint64_t calls; // Device calls (activations and endpoint volume calls).
+    uint64_t failures; // Device calls that failed due to failure injection.
+    uint64_t notifications; // Notifications delivered to volume callbacks and notification clients.
+};
+
+//-----------------------------------------------------------
+// Audio backend with any number of fake devices, which lets
+// us load-test the whole sync engine without real hardware.
+// Every device call takes the configured time, and fails at
+// the configured rate (with per-device random sequences, so
+// that runs are reproducible). All notifications are queued
+// and delivered by a single notification thread, which means
+// that they always arrive asynchronously and in order, just
+// like the audio service's notifications.
+//-----------------------------------------------------------
+class SimulatedAudioBackend : public AudioBackend
+{
+    friend class SimulatedAudioEndpoint;
+
+private:
+    struct Notification
+    {
+        enum class Type { Volume, DeviceState };
+        Type type;
+        IAudioEndpointVolumeCallback* pVolumeCallback; // Receiver of volume notifications.
+        IMMNotificationClient* pClient; // Receiver of device notifications.
+        SimulatedAudioEndpoint* pEndpoint;
+        GUID guidEventContext;
+        BOOL bMuted;
+        float fMasterVolume;
+        UINT nChannels;
+        float afChannelVolumes[SIMULATED_MAX_CHANNELS];
+        DWORD dwState;
+    };
+
+    std::vector<wil::com_ptr_nothrow<SimulatedAudioEndpoint>> m_endpoints;
+    std::unordered_map<std::wstring, size_t> m_endpointIdxs; // Device ID -> offset in m_endpoints.
+    std::vector<IMMNotificationClient*> m_clients;
+    wil::srwlock m_clientLock;
+    std::atomic<DWORD> m_dwCallLatency; // In microseconds.
+    std::atomic<uint64_t> m_failureThreshold; // Calls fail if their random value is below this (out of 2^32).
+    HRESULT m_failureResult;
+    std::atomic<uint64_t> m_calls;
+    std::atomic<uint64_t> m_failures;
+    std::atomic<uint64_t> m_notifications;
+    LONGLONG m_frequency;
+    std::vector<Notification> m_queue; // Pending notifications, starting at m_queueHead.
+    size_t m_queueHead;
+    wil::srwlock m_queueLock;
+    wil::srwlock m_dispatchLock; // Held by the notification thread while it's delivering a notification.
+    wil::unique_event_nothrow m_wakeEvent;
+    wil::unique_event_nothrow m_stopEvent;
+    std::atomic<DWORD> m_dispatchThreadId;
+    std::thread m_thread;
+
+    void _threadMain() noexcept;
+    void _deliver(const Notification& notification) noexcept;
+    HRESULT _simulateCall(uint32_t randomValue) noexcept;
+    void _queueNotification(const Notification& notification) noexcept;
+    void _cancelNotifications(const void* pTarget) noexcept;
+    SimulatedAudioEndpoint& _getEndpoint(size_t idx) const;
+
+public:
+    SimulatedAudioBackend(const SimulatedBackendSettings& settings);
+    ~SimulatedAudioBackend();
+    SimulatedAudioBackend(const SimulatedAudioBackend&) = delete;
+    SimulatedAudioBackend& operator=(const SimulatedAudioBackend&) = delete;
+
+    // AudioBackend methods.
+    HRESULT registerNotificationClient(IMMNotificationClient* pClient) noexcept override;
+    HRESULT unregisterNotificationClient(IMMNotificationClient* pClient) noexcept override;
+    HRESULT enumerateDevices(DWORD dwStateMask, std::vector<wil::com_ptr_nothrow<IMMDevice>>& devices) override;
+    HRESULT getDevice(LPCWSTR pwstrId, wil::com_ptr_nothrow<IMMDevice>& pDevice) noexcept override;
+
+    // Control over the simulation (free of latency and failures, and safe to use from any thread).
+    size_t getDeviceCount() const noexcept;
+    const std::wstring& getDeviceId(size_t idx) const;
+    void getDeviceVolume(size_t idx, float& fVolume, BOOL& bMuted) const;
+    void setDeviceVolume(size_t idx, float fVolume, BOOL bMuted, LPCGUID pguidEventContext = nullptr) const;
+    void setDeviceState(size_t idx, DWORD dwState);
+    void setCallLatency(DWORD dwMicroseconds) noexcept;
+    void setFailureRate(double fRate) noexcept;
+    void flushNotifications() noexcept;
+    SimulatedBackendStats getStats() const noexcept;
+};
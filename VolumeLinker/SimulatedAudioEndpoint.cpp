@@ -0,0 +1,627 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "SimulatedAudioEndpoint.h"
+#include "SimulatedAudioBackend.h"
+#include "helpers.h"
+
+// Number of steps that the simulated devices report for VolumeStepUp/VolumeStepDown.
+static const UINT SIMULATED_VOLUME_STEPS = 100;
+
+// NOTE: The devices simply map their scalar volume linearly onto their decibel range.
+static float scalarToDb(
+    float fLevel) noexcept
+{
+    return SIMULATED_MIN_DB + fLevel * (SIMULATED_MAX_DB - SIMULATED_MIN_DB);
+}
+
+static float dbToScalar(
+    float fLevelDB) noexcept
+{
+    float fLevel = (fLevelDB - SIMULATED_MIN_DB) / (SIMULATED_MAX_DB - SIMULATED_MIN_DB);
+    return (fLevel < 0.0f) ? 0.0f : ((fLevel > 1.0f) ? 1.0f : fLevel);
+}
+
+SimulatedAudioEndpoint::SimulatedAudioEndpoint(
+    SimulatedAudioBackend* pBackend,
+    std::wstring id,
+    std::wstring name,
+    UINT nChannels,
+    uint32_t seed) :
+    m_references(1), // Set counter to 1 reference when constructed.
+    m_pBackend(pBackend),
+    m_wsId(std::move(id)),
+    m_wsName(std::move(name)),
+    m_dwState(DEVICE_STATE_ACTIVE),
+    m_randomState((seed != 0) ? seed : 1), // NOTE: The random sequence gets stuck at zero.
+    m_fMasterVolume(1.0f),
+    m_bMuted(FALSE),
+    m_nChannels((nChannels < SIMULATED_MAX_CHANNELS) ? nChannels : SIMULATED_MAX_CHANNELS)
+{
+    for (auto& fChannelVolume : m_afChannelVolumes) {
+        fChannelVolume = 1.0f;
+    }
+
+    // Reserve room for all of our own callbacks (the master's and a slave's), so that registering never allocates.
+    m_callbacks.reserve(4);
+}
+
+SimulatedAudioEndpoint::~SimulatedAudioEndpoint()
+{
+}
+
+void SimulatedAudioEndpoint::detach() noexcept
+{
+    // NOTE: Executed by the backend's destructor. Any further device calls fail as if the device was unplugged.
+    auto lock = m_lock.lock_exclusive();
+    m_pBackend = nullptr;
+    m_callbacks.clear();
+}
+
+const std::wstring& SimulatedAudioEndpoint::getId() const noexcept
+{
+    return m_wsId;
+}
+
+DWORD SimulatedAudioEndpoint::getState() noexcept
+{
+    auto lock = m_lock.lock_shared();
+    return m_dwState;
+}
+
+void SimulatedAudioEndpoint::setState(
+    DWORD dwState) noexcept
+{
+    auto lock = m_lock.lock_exclusive();
+    m_dwState = dwState;
+}
+
+void SimulatedAudioEndpoint::getVolume(
+    float& fVolume,
+    BOOL& bMuted) noexcept
+{
+    auto lock = m_lock.lock_shared();
+    fVolume = m_fMasterVolume;
+    bMuted = m_bMuted;
+}
+
+void SimulatedAudioEndpoint::setVolume(
+    float fVolume,
+    BOOL bMuted,
+    LPCGUID pguidEventContext) noexcept
+{
+    // Change the device as if another program (or the hardware itself) did it.
+    auto lock = m_lock.lock_exclusive();
+    fVolume = (fVolume < 0.0f) ? 0.0f : ((fVolume > 1.0f) ? 1.0f : fVolume);
+    bMuted = bMuted ? TRUE : FALSE;
+    if (m_fMasterVolume != fVolume || m_bMuted != bMuted) {
+        m_fMasterVolume = fVolume;
+        m_bMuted = bMuted;
+        this->_notify(pguidEventContext);
+    }
+}
+
+HRESULT SimulatedAudioEndpoint::_beginCall() noexcept
+{
+    // Draw the call's random value from the device's own sequence (xorshift32), which means that every
+    // device fails exactly the same calls in every run, regardless of how the threads are scheduled.
+    SimulatedAudioBackend* pBackend;
+    uint32_t randomValue;
+    {
+        auto lock = m_lock.lock_exclusive();
+        pBackend = m_pBackend;
+        if (pBackend == nullptr || m_dwState != DEVICE_STATE_ACTIVE) {
+            return AUDCLNT_E_DEVICE_INVALIDATED;
+        }
+        m_randomState ^= m_randomState << 13;
+        m_randomState ^= m_randomState >> 17;
+        m_randomState ^= m_randomState << 5;
+        randomValue = m_randomState;
+    }
+
+    // NOTE: The latency is simulated outside of our lock, so that a slow call never blocks any direct access.
+    return pBackend->_simulateCall(randomValue);
+}
+
+void SimulatedAudioEndpoint::_notify(
+    LPCGUID pguidEventContext) noexcept
+{
+    // NOTE: Must be called while holding our exclusive lock, so that the notifications are queued in the
+    // same order as the changes were made. They're delivered later, by the backend's notification thread.
+    if (m_pBackend == nullptr) {
+        return;
+    }
+
+    SimulatedAudioBackend::Notification notification;
+    notification.type = SimulatedAudioBackend::Notification::Type::Volume;
+    notification.pClient = nullptr;
+    notification.pEndpoint = this;
+    notification.guidEventContext = (pguidEventContext != NULL) ? *pguidEventContext : GUID_NULL;
+    notification.bMuted = m_bMuted;
+    notification.fMasterVolume = m_fMasterVolume;
+    notification.nChannels = m_nChannels;
+    memcpy(notification.afChannelVolumes, m_afChannelVolumes, sizeof(notification.afChannelVolumes));
+    notification.dwState = m_dwState;
+    for (auto pCallback : m_callbacks) {
+        notification.pVolumeCallback = pCallback;
+        m_pBackend->_queueNotification(notification);
+    }
+}
+
+// IUnknown methods -- AddRef, Release, and QueryInterface
+
+ULONG STDMETHODCALLTYPE SimulatedAudioEndpoint::AddRef() noexcept
+{
+    return InterlockedIncrement(&m_references);
+}
+
+ULONG STDMETHODCALLTYPE SimulatedAudioEndpoint::Release() noexcept
+{
+    ULONG const refCount = InterlockedDecrement(&m_references);
+    if (0 == refCount) {
+        delete this;
+    }
+    return refCount;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::QueryInterface(
+    REFIID riid,
+    VOID** ppvInterface) noexcept
+{
+    if (ppvInterface == NULL) {
+        return E_POINTER;
+    }
+
+    if (IID_IUnknown == riid || __uuidof(IMMDevice) == riid) {
+        *ppvInterface = static_cast<IMMDevice*>(this);
+    }
+    else if (__uuidof(IMMEndpoint) == riid) {
+        *ppvInterface = static_cast<IMMEndpoint*>(this);
+    }
+    else if (__uuidof(IAudioEndpointVolume) == riid) {
+        *ppvInterface = static_cast<IAudioEndpointVolume*>(this);
+    }
+    else if (__uuidof(IPropertyStore) == riid) {
+        *ppvInterface = static_cast<IPropertyStore*>(this);
+    }
+    else {
+        *ppvInterface = NULL;
+        return E_NOINTERFACE;
+    }
+    AddRef();
+    return S_OK;
+}
+
+// IMMDevice methods
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::Activate(
+    REFIID iid,
+    DWORD dwClsCtx,
+    PROPVARIANT* pActivationParams,
+    void** ppInterface) noexcept
+{
+    UNREFERENCED_PARAMETER(dwClsCtx);
+    UNREFERENCED_PARAMETER(pActivationParams);
+
+    if (ppInterface == NULL) {
+        return E_POINTER;
+    }
+    *ppInterface = NULL;
+
+    // Only the endpoint volume can be activated (the simulated devices have no audio sessions).
+    if (__uuidof(IAudioEndpointVolume) != iid) {
+        return E_NOINTERFACE;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    return this->QueryInterface(iid, ppInterface);
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::OpenPropertyStore(
+    DWORD stgmAccess,
+    IPropertyStore** ppProperties) noexcept
+{
+    if (ppProperties == NULL) {
+        return E_POINTER;
+    }
+    *ppProperties = NULL;
+    if (stgmAccess != STGM_READ) {
+        return E_ACCESSDENIED;
+    }
+
+    AddRef();
+    *ppProperties = static_cast<IPropertyStore*>(this);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetId(
+    LPWSTR* ppstrId) noexcept
+{
+    if (ppstrId == NULL) {
+        return E_POINTER;
+    }
+
+    *ppstrId = wil::make_cotaskmem_string_nothrow(m_wsId.c_str()).release();
+    return (*ppstrId != NULL) ? S_OK : E_OUTOFMEMORY;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetState(
+    DWORD* pdwState) noexcept
+{
+    if (pdwState == NULL) {
+        return E_POINTER;
+    }
+
+    *pdwState = this->getState();
+    return S_OK;
+}
+
+// IMMEndpoint methods
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetDataFlow(
+    EDataFlow* pDataFlow) noexcept
+{
+    if (pDataFlow == NULL) {
+        return E_POINTER;
+    }
+
+    *pDataFlow = eRender;
+    return S_OK;
+}
+
+// IAudioEndpointVolume methods
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::RegisterControlChangeNotify(
+    IAudioEndpointVolumeCallback* pNotify) noexcept
+{
+    if (pNotify == NULL) {
+        return E_POINTER;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    try {
+        auto lock = m_lock.lock_exclusive();
+        m_callbacks.push_back(pNotify);
+    }
+    catch (...) {
+        return E_OUTOFMEMORY;
+    }
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::UnregisterControlChangeNotify(
+    IAudioEndpointVolumeCallback* pNotify) noexcept
+{
+    if (pNotify == NULL) {
+        return E_POINTER;
+    }
+
+    // NOTE: Unregistering always works (even on an unplugged device), since the caller is about to destroy the callback.
+    SimulatedAudioBackend* pBackend;
+    {
+        auto lock = m_lock.lock_exclusive();
+        pBackend = m_pBackend;
+        m_callbacks.erase(std::remove(m_callbacks.begin(), m_callbacks.end(), pNotify), m_callbacks.end());
+    }
+
+    // Drop the callback's pending notifications, and wait for any notification that's currently executing it.
+    if (pBackend != nullptr) {
+        pBackend->_cancelNotifications(pNotify);
+    }
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetChannelCount(
+    UINT* pnChannelCount) noexcept
+{
+    if (pnChannelCount == NULL) {
+        return E_POINTER;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    *pnChannelCount = m_nChannels;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetMasterVolumeLevel(
+    float fLevelDB,
+    LPCGUID pguidEventContext) noexcept
+{
+    return this->SetMasterVolumeLevelScalar(dbToScalar(fLevelDB), pguidEventContext);
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetMasterVolumeLevelScalar(
+    float fLevel,
+    LPCGUID pguidEventContext) noexcept
+{
+    if (fLevel < 0.0f || fLevel > 1.0f) {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    // NOTE: Only actual changes are reported to the callbacks.
+    auto lock = m_lock.lock_exclusive();
+    if (m_fMasterVolume != fLevel) {
+        m_fMasterVolume = fLevel;
+        this->_notify(pguidEventContext);
+    }
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetMasterVolumeLevel(
+    float* pfLevelDB) noexcept
+{
+    if (pfLevelDB == NULL) {
+        return E_POINTER;
+    }
+
+    float fLevel;
+    HRESULT hr = this->GetMasterVolumeLevelScalar(&fLevel);
+    if (FAILED(hr)) { return hr; }
+
+    *pfLevelDB = scalarToDb(fLevel);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetMasterVolumeLevelScalar(
+    float* pfLevel) noexcept
+{
+    if (pfLevel == NULL) {
+        return E_POINTER;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    auto lock = m_lock.lock_shared();
+    *pfLevel = m_fMasterVolume;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetChannelVolumeLevel(
+    UINT nChannel,
+    float fLevelDB,
+    LPCGUID pguidEventContext) noexcept
+{
+    return this->SetChannelVolumeLevelScalar(nChannel, dbToScalar(fLevelDB), pguidEventContext);
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetChannelVolumeLevelScalar(
+    UINT nChannel,
+    float fLevel,
+    LPCGUID pguidEventContext) noexcept
+{
+    if (nChannel >= m_nChannels || fLevel < 0.0f || fLevel > 1.0f) {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    auto lock = m_lock.lock_exclusive();
+    if (m_afChannelVolumes[nChannel] != fLevel) {
+        m_afChannelVolumes[nChannel] = fLevel;
+        this->_notify(pguidEventContext);
+    }
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetChannelVolumeLevel(
+    UINT nChannel,
+    float* pfLevelDB) noexcept
+{
+    if (pfLevelDB == NULL) {
+        return E_POINTER;
+    }
+
+    float fLevel;
+    HRESULT hr = this->GetChannelVolumeLevelScalar(nChannel, &fLevel);
+    if (FAILED(hr)) { return hr; }
+
+    *pfLevelDB = scalarToDb(fLevel);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetChannelVolumeLevelScalar(
+    UINT nChannel,
+    float* pfLevel) noexcept
+{
+    if (pfLevel == NULL) {
+        return E_POINTER;
+    }
+    if (nChannel >= m_nChannels) {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    auto lock = m_lock.lock_shared();
+    *pfLevel = m_afChannelVolumes[nChannel];
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetMute(
+    BOOL bMute,
+    LPCGUID pguidEventContext) noexcept
+{
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    bMute = bMute ? TRUE : FALSE;
+    auto lock = m_lock.lock_exclusive();
+    if (m_bMuted != bMute) {
+        m_bMuted = bMute;
+        this->_notify(pguidEventContext);
+        return S_OK;
+    }
+    return S_FALSE; // NOTE: Just like the real devices, this means "already in that state".
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetMute(
+    BOOL* pbMute) noexcept
+{
+    if (pbMute == NULL) {
+        return E_POINTER;
+    }
+
+    HRESULT hr = this->_beginCall();
+    if (FAILED(hr)) { return hr; }
+
+    auto lock = m_lock.lock_shared();
+    *pbMute = m_bMuted;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetVolumeStepInfo(
+    UINT* pnStep,
+    UINT* pnStepCount) noexcept
+{
+    if (pnStep == NULL || pnStepCount == NULL) {
+        return E_POINTER;
+    }
+
+    float fLevel;
+    HRESULT hr = this->GetMasterVolumeLevelScalar(&fLevel);
+    if (FAILED(hr)) { return hr; }
+
+    *pnStep = static_cast<UINT>(fLevel * static_cast<float>(SIMULATED_VOLUME_STEPS - 1) + 0.5f);
+    *pnStepCount = SIMULATED_VOLUME_STEPS;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::VolumeStepUp(
+    LPCGUID pguidEventContext) noexcept
+{
+    float fLevel;
+    HRESULT hr = this->GetMasterVolumeLevelScalar(&fLevel);
+    if (FAILED(hr)) { return hr; }
+
+    fLevel += 1.0f / static_cast<float>(SIMULATED_VOLUME_STEPS - 1);
+    return this->SetMasterVolumeLevelScalar((fLevel < 1.0f) ? fLevel : 1.0f, pguidEventContext);
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::VolumeStepDown(
+    LPCGUID pguidEventContext) noexcept
+{
+    float fLevel;
+    HRESULT hr = this->GetMasterVolumeLevelScalar(&fLevel);
+    if (FAILED(hr)) { return hr; }
+
+    fLevel -= 1.0f / static_cast<float>(SIMULATED_VOLUME_STEPS - 1);
+    return this->SetMasterVolumeLevelScalar((fLevel > 0.0f) ? fLevel : 0.0f, pguidEventContext);
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::QueryHardwareSupport(
+    DWORD* pdwHardwareSupportMask) noexcept
+{
+    if (pdwHardwareSupportMask == NULL) {
+        return E_POINTER;
+    }
+
+    *pdwHardwareSupportMask = 0; // Purely "software" volume controls.
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetVolumeRange(
+    float* pflVolumeMindB,
+    float* pflVolumeMaxdB,
+    float* pflVolumeIncrementdB) noexcept
+{
+    if (pflVolumeMindB == NULL || pflVolumeMaxdB == NULL || pflVolumeIncrementdB == NULL) {
+        return E_POINTER;
+    }
+
+    *pflVolumeMindB = SIMULATED_MIN_DB;
+    *pflVolumeMaxdB = SIMULATED_MAX_DB;
+    *pflVolumeIncrementdB = (SIMULATED_MAX_DB - SIMULATED_MIN_DB) / static_cast<float>(SIMULATED_VOLUME_STEPS - 1);
+    return S_OK;
+}
+
+// IPropertyStore methods (read-only, and only the friendly name)
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetCount(
+    DWORD* cProps) noexcept
+{
+    if (cProps == NULL) {
+        return E_POINTER;
+    }
+
+    *cProps = 1;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetAt(
+    DWORD iProp,
+    PROPERTYKEY* pkey) noexcept
+{
+    if (pkey == NULL) {
+        return E_POINTER;
+    }
+    if (iProp != 0) {
+        return E_INVALIDARG;
+    }
+
+    *pkey = PKEY_Device_FriendlyName;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::GetValue(
+    REFPROPERTYKEY key,
+    PROPVARIANT* pv) noexcept
+{
+    if (pv == NULL) {
+        return E_POINTER;
+    }
+    PropVariantInit(pv);
+
+    // NOTE: Unknown properties are simply empty, exactly like in a real property store.
+    if (key.fmtid == PKEY_Device_FriendlyName.fmtid && key.pid == PKEY_Device_FriendlyName.pid) {
+        pv->pwszVal = wil::make_cotaskmem_string_nothrow(m_wsName.c_str()).release();
+        if (pv->pwszVal == NULL) {
+            return E_OUTOFMEMORY;
+        }
+        pv->vt = VT_LPWSTR;
+    }
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::SetValue(
+    REFPROPERTYKEY key,
+    REFPROPVARIANT propvar) noexcept
+{
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(propvar);
+
+    return STG_E_ACCESSDENIED;
+}
+
+HRESULT STDMETHODCALLTYPE SimulatedAudioEndpoint::Commit() noexcept
+{
+    return STG_E_ACCESSDENIED;
+}
@@ -0,0 +1,122 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+class SimulatedAudioBackend;
+
+// Highest number of channels that a simulated device can have.
+static const UINT SIMULATED_MAX_CHANNELS = 8;
+
+// Volume range that simulated devices report (in decibels), which is what most real devices report too.
+static const float SIMULATED_MIN_DB = -65.25f;
+static const float SIMULATED_MAX_DB = 0.0f;
+
+//-----------------------------------------------------------
+// A fake audio endpoint device, which implements the parts
+// of the device and endpoint volume interfaces that we use.
+// Every volume call goes through the backend first, which
+// applies the configured latency and failure injection, and
+// every change is reported to the registered volume callbacks
+// via the backend's notification thread (exactly like the
+// audio service reports real changes from its own threads).
+// The device has no audio sessions.
+//-----------------------------------------------------------
+class SimulatedAudioEndpoint : public IMMDevice, public IMMEndpoint, public IAudioEndpointVolume, public IPropertyStore
+{
+private:
+    LONG m_references; // Reference counter.
+    SimulatedAudioBackend* m_pBackend; // NULL once the backend is gone (protected by m_lock).
+    std::wstring m_wsId;
+    std::wstring m_wsName;
+    DWORD m_dwState;
+    uint32_t m_randomState; // Failure injection sequence (protected by m_lock).
+    float m_fMasterVolume;
+    BOOL m_bMuted;
+    UINT m_nChannels;
+    float m_afChannelVolumes[SIMULATED_MAX_CHANNELS];
+    std::vector<IAudioEndpointVolumeCallback*> m_callbacks;
+    wil::srwlock m_lock; // Protects all of the device's state.
+
+    HRESULT _beginCall() noexcept;
+    void _notify(LPCGUID pguidEventContext) noexcept;
+
+public:
+    SimulatedAudioEndpoint(SimulatedAudioBackend* pBackend, std::wstring id, std::wstring name, UINT nChannels, uint32_t seed);
+    ~SimulatedAudioEndpoint();
+    SimulatedAudioEndpoint(const SimulatedAudioEndpoint&) = delete;
+    SimulatedAudioEndpoint& operator=(const SimulatedAudioEndpoint&) = delete;
+
+    // Direct access for the backend and its owner (without any latency, failures or call counting).
+    void detach() noexcept;
+    const std::wstring& getId() const noexcept;
+    DWORD getState() noexcept;
+    void setState(DWORD dwState) noexcept;
+    void getVolume(float& fVolume, BOOL& bMuted) noexcept;
+    void setVolume(float fVolume, BOOL bMuted, LPCGUID pguidEventContext) noexcept;
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef() noexcept override;
+    ULONG STDMETHODCALLTYPE Release() noexcept override;
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, VOID** ppvInterface) noexcept override;
+
+    // IMMDevice methods
+
+    HRESULT STDMETHODCALLTYPE Activate(REFIID iid, DWORD dwClsCtx, PROPVARIANT* pActivationParams, void** ppInterface) noexcept override;
+    HRESULT STDMETHODCALLTYPE OpenPropertyStore(DWORD stgmAccess, IPropertyStore** ppProperties) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetId(LPWSTR* ppstrId) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetState(DWORD* pdwState) noexcept override;
+
+    // IMMEndpoint methods
+
+    HRESULT STDMETHODCALLTYPE GetDataFlow(EDataFlow* pDataFlow) noexcept override;
+
+    // IAudioEndpointVolume methods
+
+    HRESULT STDMETHODCALLTYPE RegisterControlChangeNotify(IAudioEndpointVolumeCallback* pNotify) noexcept override;
+    HRESULT STDMETHODCALLTYPE UnregisterControlChangeNotify(IAudioEndpointVolumeCallback* pNotify) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetChannelCount(UINT* pnChannelCount) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetMasterVolumeLevel(float fLevelDB, LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetMasterVolumeLevelScalar(float fLevel, LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetMasterVolumeLevel(float* pfLevelDB) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetMasterVolumeLevelScalar(float* pfLevel) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetChannelVolumeLevel(UINT nChannel, float fLevelDB, LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetChannelVolumeLevelScalar(UINT nChannel, float fLevel, LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetChannelVolumeLevel(UINT nChannel, float* pfLevelDB) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetChannelVolumeLevelScalar(UINT nChannel, float* pfLevel) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetMute(BOOL bMute, LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetMute(BOOL* pbMute) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetVolumeStepInfo(UINT* pnStep, UINT* pnStepCount) noexcept override;
+    HRESULT STDMETHODCALLTYPE VolumeStepUp(LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE VolumeStepDown(LPCGUID pguidEventContext) noexcept override;
+    HRESULT STDMETHODCALLTYPE QueryHardwareSupport(DWORD* pdwHardwareSupportMask) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetVolumeRange(float* pflVolumeMindB, float* pflVolumeMaxdB, float* pflVolumeIncrementdB) noexcept override;
+
+    // IPropertyStore methods (read-only, and only the friendly name)
+
+    HRESULT STDMETHODCALLTYPE GetCount(DWORD* cProps) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetAt(DWORD iProp, PROPERTYKEY* pkey) noexcept override;
+    HRESULT STDMETHODCALLTYPE GetValue(REFPROPERTYKEY key, PROPVARIANT* pv) noexcept override;
+    HRESULT STDMETHODCALLTYPE SetValue(REFPROPERTYKEY key, REFPROPVARIANT propvar) noexcept override;
+    HRESULT STDMETHODCALLTYPE Commit() noexcept override;
+};
@@ -0,0 +1,406 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SlaveVolumeWorker.h"
+#include "helpers.h"
+#include "WakeupStats.h"
+
+// Flag which marks a mailbox value as "contains a state" (so that a zero value always means empty).
+static const uint64_t MAILBOX_HAS_STATE = 1ULL << 63;
+static const uint64_t MAILBOX_MUTED = 1ULL << 32;
+
+// Shortest and longest wait between two recovery attempts. The wait doubles after every failed attempt, which
+// means that a quick driver reset is recovered almost instantly, while a device that stays broken costs nearly nothing.
+static const DWORD RECOVERY_INITIAL_DELAY_MS = 50;
+static const DWORD RECOVERY_MAX_DELAY_MS = 5000;
+
+// Interval between two ramp steps, which caps every ramping slave at 100 volume writes per second, no matter how
+// long the ramp is. Without a high-resolution timer (before Windows 10 1803), the steps are paced by the regular
+// system timer instead, which usually means one step per 15.6 milliseconds.
+static const DWORD RAMP_STEP_INTERVAL_MS = 10;
+
+// Volume jumps smaller than this are always applied instantly, since they're inaudible as a single step anyway,
+// and because ramping them would only make the slave lag behind while the user drags the volume slider.
+static const float RAMP_MIN_DELTA = 0.02f;
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+SlaveVolumeWorker::SlaveVolumeWorker(
+    std::function<bool(float, BOOL, LONGLONG, const ChannelVolumes&)> applyCallback,
+    std::function<bool()> recoverCallback,
+    std::function<void()> healthCallback) :
+    m_applyCallback(std::move(applyCallback)),
+    m_recoverCallback(std::move(recoverCallback)),
+    m_healthCallback(std::move(healthCallback)),
+    m_health(WorkerHealth::Healthy),
+    m_mailbox(0),
+    m_mailboxTime(0),
+    m_mailboxChannels{},
+    m_bMailboxChannels(false),
+    m_dwRampTime(0),
+    m_qpcFrequency(0),
+    m_bAppliedKnown(false),
+    m_fAppliedVolume(0.0f),
+    m_bAppliedMuted(FALSE),
+    m_bRamping(false),
+    m_fRampFrom(0.0f),
+    m_fRampTo(0.0f),
+    m_rampStart(0),
+    m_rampTicks(0),
+    m_rampChannels{}
+{
+    HRESULT hr;
+
+    // Auto-reset event which wakes the worker whenever the mailbox goes from empty to filled.
+    hr = m_wakeEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create slave worker wake event.");
+
+    // Manual-reset event which tells the worker to exit (stays signaled once set).
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create slave worker stop event.");
+
+    // Auto-reset timer which paces the ramp steps. The high-resolution flag is only supported by Windows 10 1803
+    // and newer, and older systems reject it, in which case we'll fall back to a regular timer.
+    m_rampTimer.reset(CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS));
+    if (!m_rampTimer) {
+        m_rampTimer.reset(CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS));
+    }
+    if (!m_rampTimer) {
+        throw std::runtime_error("Unable to create slave worker ramp timer.");
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    m_qpcFrequency = frequency.QuadPart;
+
+    // Start the worker thread (throws if the thread can't be created).
+    m_thread = std::thread(&SlaveVolumeWorker::_threadMain, this);
+}
+
+SlaveVolumeWorker::~SlaveVolumeWorker()
+{
+    // Tell the worker to exit, and wait for it to finish whatever COM call it may be executing.
+    // NOTE: Any state which is still sitting in the mailbox is intentionally discarded.
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void SlaveVolumeWorker::requestStop() noexcept
+{
+    // Tells the worker to exit as soon as it's done with its current state, without waiting for it.
+    // NOTE: This lets the owner stop several workers at once, before destroying (joining) them.
+    m_stopEvent.SetEvent();
+}
+
+void SlaveVolumeWorker::setRampTime(
+    DWORD dwRampTime) noexcept
+{
+    // NOTE: A ramp which is already running keeps its duration, and the new duration is used by the next one.
+    m_dwRampTime.store(dwRampTime, std::memory_order_relaxed);
+}
+
+WorkerHealth SlaveVolumeWorker::getHealth() const noexcept
+{
+    return m_health.load(std::memory_order_relaxed);
+}
+
+uint64_t SlaveVolumeWorker::_packState(
+    float fVolume,
+    BOOL bMuted) noexcept
+{
+    uint32_t volumeBits;
+    memcpy(&volumeBits, &fVolume, sizeof(volumeBits));
+
+    return MAILBOX_HAS_STATE | (bMuted ? MAILBOX_MUTED : 0) | static_cast<uint64_t>(volumeBits);
+}
+
+void SlaveVolumeWorker::_unpackState(
+    uint64_t state,
+    float& fVolume,
+    BOOL& bMuted) noexcept
+{
+    uint32_t volumeBits = static_cast<uint32_t>(state & 0xFFFFFFFFULL);
+    memcpy(&fVolume, &volumeBits, sizeof(fVolume));
+
+    bMuted = (state & MAILBOX_MUTED) ? TRUE : FALSE;
+}
+
+bool SlaveVolumeWorker::post(
+    float fVolume,
+    BOOL bMuted,
+    LONGLONG notifyTime,
+    const ChannelVolumes* pChannels) noexcept
+{
+    // Remember when the state's notification arrived, so that the worker can measure the propagation latency.
+    // NOTE: If two states are posted at the same moment, the worker may see the other one's timestamp, which
+    // is harmless, since it's only used for statistics.
+    m_mailboxTime.store(notifyTime, std::memory_order_relaxed);
+
+    // Store the channel levels too (if any). They're too large for the atomic mailbox, so they use a tiny lock
+    // which is only ever held while copying them. States without any channels (which is every state, unless
+    // channel-sync mode is enabled) only clear a flag, so they never touch the lock at all.
+    // NOTE: The worker may take the channels of a slightly newer state than the volume it took, but then that
+    // newer state is still waiting in the mailbox, so the worker always ends up applying the newest of both.
+    if (pChannels != nullptr && pChannels->nChannels > 0) {
+        auto lock = m_channelLock.lock_exclusive();
+        m_mailboxChannels = *pChannels;
+        m_bMailboxChannels.store(true, std::memory_order_release);
+    }
+    else {
+        m_bMailboxChannels.store(false, std::memory_order_release);
+    }
+
+    // Replace whatever is in the mailbox with the newest state. We only need to wake the worker
+    // if the mailbox was empty, since a non-empty mailbox means that a wake-up is already pending
+    // (the worker always empties the mailbox before it starts applying the state it took out).
+    uint64_t previous = m_mailbox.exchange(_packState(fVolume, bMuted), std::memory_order_acq_rel);
+    if (previous == 0) {
+        m_wakeEvent.SetEvent();
+    }
+
+    // Tell the caller whether an older state was replaced before it could be applied (coalesced).
+    return previous != 0;
+}
+
+void SlaveVolumeWorker::_takeChannels(
+    ChannelVolumes& channels) noexcept
+{
+    // Copy the newest state's channel levels (or none), without locking for states that don't have any.
+    if (!m_bMailboxChannels.load(std::memory_order_acquire)) {
+        channels.nChannels = 0;
+        return;
+    }
+    auto lock = m_channelLock.lock_shared();
+    channels = m_mailboxChannels;
+}
+
+bool SlaveVolumeWorker::_apply(
+    float fVolume,
+    BOOL bMuted,
+    LONGLONG notifyTime,
+    const ChannelVolumes& channels) noexcept
+{
+    try {
+        return m_applyCallback(fVolume, bMuted, notifyTime, channels);
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+bool SlaveVolumeWorker::_applyTracked(
+    float fVolume,
+    BOOL bMuted,
+    LONGLONG notifyTime,
+    const ChannelVolumes& channels) noexcept
+{
+    // Remember what the device has been set to, so that the next ramp can start from there.
+    // NOTE: After a failure, we no longer know the device's volume, so the next state is applied instantly.
+    m_bAppliedKnown = this->_apply(fVolume, bMuted, notifyTime, channels);
+    if (m_bAppliedKnown) {
+        m_fAppliedVolume = fVolume;
+        m_bAppliedMuted = bMuted;
+    }
+
+    return m_bAppliedKnown;
+}
+
+bool SlaveVolumeWorker::_applyState(
+    float fVolume,
+    BOOL bMuted,
+    LONGLONG notifyTime,
+    const ChannelVolumes& channels) noexcept
+{
+    // Unmuting always ramps up from silence, since that's what the slave has been playing until now.
+    const DWORD dwRampTime = m_dwRampTime.load(std::memory_order_relaxed);
+    const float fFrom = m_bAppliedMuted ? 0.0f : m_fAppliedVolume;
+
+    // Apply the state instantly if ramping is disabled, if we don't know where to start from, if the jump is too
+    // small to be heard, or if the slave is being muted (which should be just as instant as on the master).
+    // NOTE: This also ends any ramp which is still running, since the new state replaces its target.
+    if (dwRampTime == 0 || !m_bAppliedKnown || bMuted || fabsf(fVolume - fFrom) < RAMP_MIN_DELTA) {
+        if (m_bRamping) {
+            m_bRamping = false;
+            CancelWaitableTimer(m_rampTimer.get());
+        }
+        return this->_applyTracked(fVolume, bMuted, notifyTime, channels);
+    }
+
+    // Start a new ramp from the slave's current level, which also retargets a ramp that's still running.
+    // NOTE: This never queues anything, so the number of writes stays bounded by the step rate, no matter
+    // how many states arrive. The full duration restarts from the current level, which keeps it smooth.
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    m_bRamping = true;
+    m_fRampFrom = fFrom;
+    m_fRampTo = fVolume;
+    m_rampStart = now.QuadPart;
+    m_rampTicks = (static_cast<LONGLONG>(dwRampTime) * m_qpcFrequency) / 1000;
+    m_rampChannels = channels;
+
+    // Apply the first step right away, so that the slave starts moving without any delay.
+    // NOTE: Only the first step has the notification time, since that's when the change becomes audible.
+    return this->_stepRamp(notifyTime);
+}
+
+bool SlaveVolumeWorker::_stepRamp(
+    LONGLONG notifyTime) noexcept
+{
+    // Every step applies the level that the ramp will have reached by the next step, and the final step applies
+    // the exact target. This way, the ramp finishes on time, even if the timer (or the device) is slow.
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    const LONGLONG stepTicks = (static_cast<LONGLONG>(RAMP_STEP_INTERVAL_MS) * m_qpcFrequency) / 1000;
+    const LONGLONG elapsedTicks = (now.QuadPart - m_rampStart) + stepTicks;
+    const bool bFinal = elapsedTicks >= m_rampTicks || m_rampTicks <= 0;
+    const float fLevel = bFinal ? m_fRampTo :
+        m_fRampFrom + (m_fRampTo - m_fRampFrom) * static_cast<float>(static_cast<double>(elapsedTicks) / m_rampTicks);
+
+    if (!this->_applyTracked(fLevel, FALSE, notifyTime, m_rampChannels)) {
+        m_bRamping = false;
+        return false;
+    }
+    if (bFinal) {
+        m_bRamping = false;
+        return true;
+    }
+
+    // Schedule the next step (negative due times are relative, in 100-nanosecond units).
+    // NOTE: If the timer can't be set for some reason, we'll simply jump to the target instead.
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -static_cast<LONGLONG>(RAMP_STEP_INTERVAL_MS) * 10000;
+    if (!SetWaitableTimer(m_rampTimer.get(), &dueTime, 0, NULL, NULL, FALSE)) {
+        m_bRamping = false;
+        return this->_applyTracked(m_fRampTo, FALSE, 0, m_rampChannels);
+    }
+
+    return true;
+}
+
+void SlaveVolumeWorker::_notifyHealth() noexcept
+{
+    // NOTE: This only happens when the worker starts or finishes recovering, so the owner never has to poll.
+    try {
+        if (m_healthCallback) {
+            m_healthCallback();
+        }
+    }
+    catch (...) {}
+}
+
+bool SlaveVolumeWorker::_recover(
+    float fVolume,
+    BOOL bMuted,
+    const ChannelVolumes& channels) noexcept
+{
+    // Keep trying until the device works again, always re-applying the newest state (which is the failed
+    // state, unless a newer one has arrived in the meantime). Returns false if we've been told to stop.
+    // NOTE: New states keep replacing each other in the mailbox while we're waiting, exactly like while
+    // we're busy applying a state, so nothing piles up no matter how long the device stays broken.
+    ChannelVolumes latestChannels = channels;
+    DWORD dwDelay = RECOVERY_INITIAL_DELAY_MS;
+    m_health.store(WorkerHealth::Degraded, std::memory_order_relaxed);
+    this->_notifyHealth();
+    for (;;) {
+        m_health.store(WorkerHealth::Degraded, std::memory_order_relaxed);
+        if (WaitForSingleObject(m_stopEvent.get(), dwDelay) != WAIT_TIMEOUT) {
+            return false;
+        }
+        WakeupStats::record(WakeSource::RecoveryRetry);
+        m_health.store(WorkerHealth::Recovering, std::memory_order_relaxed);
+
+        uint64_t state = m_mailbox.exchange(0, std::memory_order_acq_rel);
+        if (state != 0) {
+            _unpackState(state, fVolume, bMuted);
+            this->_takeChannels(latestChannels);
+        }
+
+        // NOTE: The resync has no notification time, since its latency would only measure the outage.
+        bool success = false;
+        try {
+            success = m_recoverCallback() && this->_applyTracked(fVolume, bMuted, 0, latestChannels);
+        }
+        catch (...) {}
+        if (success) {
+            m_health.store(WorkerHealth::Healthy, std::memory_order_relaxed);
+            this->_notifyHealth();
+            return true;
+        }
+
+        dwDelay = (dwDelay < RECOVERY_MAX_DELAY_MS / 2) ? dwDelay * 2 : RECOVERY_MAX_DELAY_MS;
+    }
+}
+
+void SlaveVolumeWorker::_threadMain() noexcept
+{
+    // Join the process-wide multithreaded apartment. The endpoint volume interfaces are
+    // free-threaded, which is also why the audio service's notification thread has always
+    // been able to call them directly, so we can use them without any marshaling.
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    wil::unique_couninitialize_call cleanup(SUCCEEDED(hr));
+
+    // NOTE: The ramp timer is only waited for while a ramp is running.
+    HANDLE waitHandles[] = { m_stopEvent.get(), m_wakeEvent.get(), m_rampTimer.get() };
+    for (;;) {
+        DWORD waitResult = WaitForMultipleObjects(m_bRamping ? 3 : 2, waitHandles, FALSE, INFINITE);
+        if (waitResult == WAIT_OBJECT_0 + 2) {
+            // Time for the next ramp step (and recover the device if it failed, just like below).
+            WakeupStats::record(WakeSource::RampStep);
+            if (this->_stepRamp(0) || !m_recoverCallback) {
+                continue;
+            }
+            if (!this->_recover(m_fRampTo, FALSE, m_rampChannels)) {
+                break;
+            }
+            continue;
+        }
+        if (waitResult != WAIT_OBJECT_0 + 1) {
+            // Stop was requested (or the wait itself failed, which should never happen).
+            break;
+        }
+        WakeupStats::record(WakeSource::SlaveWorker);
+
+        // Take the newest state out of the mailbox (leaving it empty for the next notification).
+        uint64_t state = m_mailbox.exchange(0, std::memory_order_acq_rel);
+        if (state == 0) {
+            continue;
+        }
+        LONGLONG notifyTime = m_mailboxTime.load(std::memory_order_relaxed);
+        ChannelVolumes channels;
+        this->_takeChannels(channels);
+
+        float fVolume;
+        BOOL bMuted;
+        _unpackState(state, fVolume, bMuted);
+
+        // Apply (or start ramping to) the state, and recover the device if it failed (without a recovery
+        // callback, the failed state is simply dropped, and the next state gets a fresh attempt).
+        // NOTE: The recovery applies the target instantly, since the slave's volume is unknown after a failure.
+        if (this->_applyState(fVolume, bMuted, notifyTime, channels) || !m_recoverCallback) {
+            continue;
+        }
+        if (!this->_recover(fVolume, bMuted, channels)) {
+            break;
+        }
+    }
+}
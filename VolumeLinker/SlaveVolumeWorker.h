@@ -0,0 +1,112 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "framework.h"
+
+// Highest number of channels that are synced per device (enough for 7.1 devices).
+static const UINT MAX_SYNC_CHANNELS = 8;
+
+// Per-channel volume levels of a device (only the first "nChannels" levels are used, and 0 means none).
+struct ChannelVolumes
+{
+    UINT nChannels;
+    float afLevels[MAX_SYNC_CHANNELS];
+};
+
+// Recovery state of a worker's device.
+enum class WorkerHealth
+{
+    Healthy, // The newest state has been applied (or is about to be).
+    Degraded, // Applying a state failed, and the worker is waiting before its next recovery attempt.
+    Recovering, // The worker is re-opening the device and re-applying the newest state.
+};
+
+//-----------------------------------------------------------
+// Dedicated background thread which applies volume/mute
+// states to a slave device. New states are handed over via
+// a single-slot mailbox, which means that posting is nearly
+// free for the caller, and that any states which arrive
+// while the worker is busy simply replace each other. The
+// worker therefore only ever applies the newest state. If
+// applying a state fails, the worker marks itself degraded
+// and keeps retrying with exponential backoff (re-opening
+// the device via the recovery callback, and then applying
+// whatever state is newest by then), until it succeeds or
+// is stopped.
+//
+// The worker can optionally ramp large volume jumps, by
+// applying a few interpolated levels (paced by a waitable
+// timer) instead of one instant step. A state which arrives
+// mid-ramp simply retargets the ramp from wherever it is.
+//-----------------------------------------------------------
+class SlaveVolumeWorker
+{
+private:
+    std::function<bool(float, BOOL, LONGLONG, const ChannelVolumes&)> m_applyCallback;
+    std::function<bool()> m_recoverCallback; // Re-opens the device after a failure (or NULL to simply drop failed states).
+    std::function<void()> m_healthCallback; // Told whenever the worker becomes degraded or healthy again (optional).
+    std::atomic<WorkerHealth> m_health;
+    std::atomic<uint64_t> m_mailbox; // Packed volume/mute state, or 0 if empty.
+    std::atomic<LONGLONG> m_mailboxTime; // When the newest state's notification arrived (QPC), or 0 if unknown.
+    ChannelVolumes m_mailboxChannels; // Channel levels of the newest state (protected by m_channelLock).
+    std::atomic<bool> m_bMailboxChannels; // Whether the newest state has any channel levels (only then is the lock used).
+    wil::srwlock m_channelLock;
+    wil::unique_event_nothrow m_wakeEvent;
+    wil::unique_event_nothrow m_stopEvent;
+    wil::unique_handle m_rampTimer; // Paces the ramp steps (high-resolution, if the system supports it).
+    std::atomic<DWORD> m_dwRampTime; // Duration of volume ramps (in milliseconds), or 0 to apply every state instantly.
+    LONGLONG m_qpcFrequency;
+
+    // The last state that was applied, and the current ramp (only used by the worker thread).
+    bool m_bAppliedKnown; // False until a state has been applied, and after every failure.
+    float m_fAppliedVolume;
+    BOOL m_bAppliedMuted;
+    bool m_bRamping;
+    float m_fRampFrom;
+    float m_fRampTo;
+    LONGLONG m_rampStart; // When the ramp started (QPC).
+    LONGLONG m_rampTicks; // The ramp's total duration (QPC ticks).
+    ChannelVolumes m_rampChannels;
+
+    std::thread m_thread;
+
+    static uint64_t _packState(float fVolume, BOOL bMuted) noexcept;
+    static void _unpackState(uint64_t state, float& fVolume, BOOL& bMuted) noexcept;
+    void _takeChannels(ChannelVolumes& channels) noexcept;
+    bool _apply(float fVolume, BOOL bMuted, LONGLONG notifyTime, const ChannelVolumes& channels) noexcept;
+    bool _applyTracked(float fVolume, BOOL bMuted, LONGLONG notifyTime, const ChannelVolumes& channels) noexcept;
+    bool _applyState(float fVolume, BOOL bMuted, LONGLONG notifyTime, const ChannelVolumes& channels) noexcept;
+    bool _stepRamp(LONGLONG notifyTime) noexcept;
+    void _notifyHealth() noexcept;
+    bool _recover(float fVolume, BOOL bMuted, const ChannelVolumes& channels) noexcept;
+    void _threadMain() noexcept;
+
+public:
+    SlaveVolumeWorker(std::function<bool(float, BOOL, LONGLONG, const ChannelVolumes&)> applyCallback, std::function<bool()> recoverCallback,
+        std::function<void()> healthCallback = nullptr);
+    ~SlaveVolumeWorker();
+    SlaveVolumeWorker(const SlaveVolumeWorker&) = delete;
+    SlaveVolumeWorker& operator=(const SlaveVolumeWorker&) = delete;
+    bool post(float fVolume, BOOL bMuted, LONGLONG notifyTime = 0, const ChannelVolumes* pChannels = nullptr) noexcept;
+    void requestStop() noexcept;
+    void setRampTime(DWORD dwRampTime) noexcept;
+    WorkerHealth getHealth() const noexcept;
+};
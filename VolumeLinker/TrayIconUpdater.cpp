@@ -0,0 +1,314 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "TrayIconUpdater.h"
+#include "helpers.h"
+
+// Shortest time between two icon updates. Four updates per second still look live while someone drags a
+// volume slider, but they're only a tiny fraction of the notifications, which can arrive thousands of times per second.
+static const DWORD TRAY_UPDATE_INTERVAL_MS = 250;
+
+// Colors of the icon overlays (straight, non-premultiplied ARGB).
+static const uint32_t OVERLAY_BACKGROUND = 0xA0000000;
+static const uint32_t OVERLAY_VOLUME = 0xFFFFFFFF;
+static const uint32_t OVERLAY_MUTED = 0xFFE81123;
+static const uint32_t OVERLAY_DEGRADED = 0xFFFFB900;
+
+static void FillPixels(
+    uint32_t* pPixels,
+    int iWidth,
+    int iLeft,
+    int iTop,
+    int iRight,
+    int iBottom,
+    uint32_t color) noexcept
+{
+    for (int y = iTop; y < iBottom; ++y) {
+        for (int x = iLeft; x < iRight; ++x) {
+            pPixels[(y * iWidth) + x] = color;
+        }
+    }
+}
+
+TrayIconUpdater::TrayIconUpdater(
+    HWND hWnd,
+    UINT uID,
+    UINT_PTR timerId,
+    HICON hLinkedIcon,
+    HICON hUnlinkedIcon) noexcept :
+    m_hWnd(hWnd),
+    m_uID(uID),
+    m_timerId(timerId),
+    m_hLinkedIcon(hLinkedIcon),
+    m_hUnlinkedIcon(hUnlinkedIcon),
+    m_icons{},
+    m_lastUpdateTime(0),
+    m_bTimerActive(false)
+{
+    // The icon starts out unlinked, with the plain program name as its tooltip (exactly as it was added).
+    m_desiredState = { TrayLinkHealth::Unlinked, -1, false, 0 };
+    m_displayedState = m_desiredState;
+    m_hDisplayedIcon = m_hUnlinkedIcon;
+    _formatTip(m_displayedState, m_szDisplayedTip, ARRAYSIZE(m_szDisplayedTip));
+}
+
+TrayIconUpdater::~TrayIconUpdater()
+{
+    if (m_bTimerActive) {
+        KillTimer(m_hWnd, m_timerId);
+    }
+
+    // NOTE: The notification area makes its own copy of every icon we give it, so they can be destroyed at any time.
+    for (HICON& hIcon : m_icons) {
+        if (hIcon != NULL) {
+            DestroyIcon(hIcon);
+            hIcon = NULL;
+        }
+    }
+}
+
+void TrayIconUpdater::setState(
+    const TrayState& state) noexcept
+{
+    m_desiredState = state;
+
+    // Update right away if the last update was long enough ago, otherwise wait for the timer (which is only
+    // started once, so that any number of new states just replace each other until it elapses).
+    // NOTE: The first change after a quiet period is therefore always displayed instantly.
+    auto elapsed = GetTickCount64() - m_lastUpdateTime;
+    if (elapsed >= TRAY_UPDATE_INTERVAL_MS) {
+        this->_update();
+    }
+    else if (!m_bTimerActive) {
+        if (SetTimer(m_hWnd, m_timerId, static_cast<UINT>(TRAY_UPDATE_INTERVAL_MS - elapsed), NULL) != 0) {
+            m_bTimerActive = true;
+        }
+        else {
+            this->_update(); // Can't schedule, so just update it now.
+        }
+    }
+}
+
+void TrayIconUpdater::processTimer() noexcept
+{
+    // The throttling interval is over, so display the newest state.
+    this->_update();
+}
+
+void TrayIconUpdater::_update() noexcept
+{
+    if (m_bTimerActive) {
+        KillTimer(m_hWnd, m_timerId);
+        m_bTimerActive = false;
+    }
+
+    if (m_desiredState == m_displayedState) {
+        return;
+    }
+
+    // Find out what would actually change on screen. Different states can look identical (such as two
+    // volumes within the same icon level, while the tooltip stays the same), and those are simply skipped.
+    HICON hIcon = this->_getIcon(m_desiredState);
+    wchar_t szTip[ARRAYSIZE(m_szDisplayedTip)];
+    _formatTip(m_desiredState, szTip, ARRAYSIZE(szTip));
+
+    NOTIFYICONDATA notifyIconData = {};
+    notifyIconData.cbSize = sizeof(notifyIconData);
+    notifyIconData.hWnd = m_hWnd;
+    notifyIconData.uID = m_uID;
+    if (hIcon != m_hDisplayedIcon) {
+        notifyIconData.uFlags |= NIF_ICON;
+        notifyIconData.hIcon = hIcon;
+    }
+    if (wcscmp(szTip, m_szDisplayedTip) != 0) {
+        notifyIconData.uFlags |= NIF_TIP | NIF_SHOWTIP;
+        wcscpy_s(notifyIconData.szTip, szTip);
+    }
+
+    if (notifyIconData.uFlags == 0) {
+        m_displayedState = m_desiredState;
+        return;
+    }
+
+    // NOTE: If Explorer rejects the change, the displayed state stays as it was, so the next state retries it.
+    m_lastUpdateTime = GetTickCount64();
+    if (Shell_NotifyIcon(NIM_MODIFY, &notifyIconData)) {
+        m_displayedState = m_desiredState;
+        m_hDisplayedIcon = hIcon;
+        wcscpy_s(m_szDisplayedTip, szTip);
+    }
+}
+
+HICON TrayIconUpdater::_getIcon(
+    const TrayState& state) noexcept
+{
+    // Nothing is linked, so there's nothing to overlay either.
+    if (state.health == TrayLinkHealth::Unlinked) {
+        return m_hUnlinkedIcon;
+    }
+
+    // The volume level rounds up, so that every audible volume shows at least one step.
+    int iLevel = 0;
+    if (state.iVolume > 0) {
+        iLevel = ((state.iVolume * (VOLUME_LEVELS - 1)) + MAX_VOL - 1) / MAX_VOL;
+        if (iLevel > VOLUME_LEVELS - 1) { iLevel = VOLUME_LEVELS - 1; }
+    }
+    else if (state.iVolume < 0) {
+        iLevel = VOLUME_LEVELS - 1; // Unknown volume (the displayed group isn't linked), so show a full bar.
+    }
+
+    bool bDegraded = (state.health == TrayLinkHealth::Degraded);
+    size_t variant = ((bDegraded ? 2 : 0) + (state.bMuted ? 1 : 0)) * VOLUME_LEVELS + static_cast<size_t>(iLevel);
+    if (m_icons[variant] == NULL) {
+        m_icons[variant] = _renderIcon(m_hLinkedIcon, bDegraded, state.bMuted, iLevel);
+    }
+
+    // NOTE: If the variant couldn't be rendered, the plain linked icon is still better than nothing.
+    return (m_icons[variant] != NULL) ? m_icons[variant] : m_hLinkedIcon;
+}
+
+HICON TrayIconUpdater::_renderIcon(
+    HICON hBase,
+    bool bDegraded,
+    bool bMuted,
+    int iLevel) noexcept
+{
+    // Read the base icon's pixels (as 32-bit ARGB, top-down).
+    ICONINFO baseInfo = {};
+    if (hBase == NULL || !GetIconInfo(hBase, &baseInfo)) {
+        return NULL;
+    }
+    wil::unique_hbitmap baseColor(baseInfo.hbmColor);
+    wil::unique_hbitmap baseMask(baseInfo.hbmMask);
+    BITMAP bitmap = {};
+    if (!baseColor || GetObject(baseColor.get(), sizeof(bitmap), &bitmap) == 0 || bitmap.bmWidth <= 0 || bitmap.bmHeight <= 0) {
+        return NULL; // NOTE: Monochrome icons (without any color bitmap) aren't worth supporting.
+    }
+    const int iWidth = bitmap.bmWidth;
+    const int iHeight = bitmap.bmHeight;
+
+    BITMAPINFO bitmapInfo = {};
+    bitmapInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bitmapInfo.bmiHeader.biWidth = iWidth;
+    bitmapInfo.bmiHeader.biHeight = -iHeight; // Top-down.
+    bitmapInfo.bmiHeader.biPlanes = 1;
+    bitmapInfo.bmiHeader.biBitCount = 32;
+    bitmapInfo.bmiHeader.biCompression = BI_RGB;
+    void* pBits = nullptr;
+    wil::unique_hbitmap color(CreateDIBSection(NULL, &bitmapInfo, DIB_RGB_COLORS, &pBits, NULL, 0));
+    if (!color || pBits == nullptr) {
+        return NULL;
+    }
+    uint32_t* pPixels = static_cast<uint32_t*>(pBits);
+    const size_t nPixels = static_cast<size_t>(iWidth) * static_cast<size_t>(iHeight);
+
+    HDC hdc = GetDC(NULL);
+    if (hdc == NULL) {
+        return NULL;
+    }
+    bool success = GetDIBits(hdc, baseColor.get(), 0, static_cast<UINT>(iHeight), pPixels, &bitmapInfo, DIB_RGB_COLORS) != 0;
+
+    // Icons without an alpha channel use their mask for transparency instead, so we'll turn it into alpha.
+    bool hasAlpha = false;
+    for (size_t i = 0; success && i < nPixels && !hasAlpha; ++i) {
+        hasAlpha = (pPixels[i] & 0xFF000000) != 0;
+    }
+    if (success && !hasAlpha) {
+        try {
+            std::vector<uint32_t> maskPixels(nPixels);
+            if (baseMask && GetDIBits(hdc, baseMask.get(), 0, static_cast<UINT>(iHeight), maskPixels.data(), &bitmapInfo, DIB_RGB_COLORS) != 0) {
+                for (size_t i = 0; i < nPixels; ++i) {
+                    pPixels[i] = (pPixels[i] & 0x00FFFFFF) | (((maskPixels[i] & 0x00FFFFFF) != 0) ? 0 : 0xFF000000);
+                }
+            }
+            else {
+                success = false;
+            }
+        }
+        catch (...) {
+            success = false;
+        }
+    }
+    ReleaseDC(NULL, hdc);
+    if (!success) {
+        return NULL;
+    }
+
+    // Draw the volume bar along the right edge (filled from the bottom), which turns red while muted.
+    const int iBarWidth = (iWidth >= 16) ? iWidth / 6 : 2;
+    const int iBarLeft = iWidth - iBarWidth;
+    FillPixels(pPixels, iWidth, iBarLeft, 0, iWidth, iHeight, bMuted ? OVERLAY_MUTED : OVERLAY_BACKGROUND);
+    if (!bMuted && iLevel > 0) {
+        int iFill = (iHeight * iLevel) / (VOLUME_LEVELS - 1);
+        FillPixels(pPixels, iWidth, iBarLeft, iHeight - iFill, iWidth, iHeight, OVERLAY_VOLUME);
+    }
+
+    // Mark degraded links with a warning square in the top left corner.
+    if (bDegraded) {
+        const int iMarkSize = (iWidth >= 16) ? iWidth / 3 : 4;
+        FillPixels(pPixels, iWidth, 0, 0, iMarkSize, iMarkSize, OVERLAY_BACKGROUND);
+        FillPixels(pPixels, iWidth, 1, 1, iMarkSize - 1, iMarkSize - 1, OVERLAY_DEGRADED);
+    }
+    GdiFlush();
+
+    // Build the icon. Its transparency comes entirely from the alpha channel, so the mask is left empty.
+    // NOTE: Monochrome bitmap rows are padded to 16 bits.
+    wil::unique_hbitmap mask;
+    try {
+        std::vector<BYTE> maskBits(static_cast<size_t>((iWidth + 15) / 16) * 2 * static_cast<size_t>(iHeight), 0);
+        mask.reset(CreateBitmap(iWidth, iHeight, 1, 1, maskBits.data()));
+    }
+    catch (...) {}
+    if (!mask) {
+        return NULL;
+    }
+
+    ICONINFO iconInfo = {};
+    iconInfo.fIcon = TRUE;
+    iconInfo.hbmMask = mask.get();
+    iconInfo.hbmColor = color.get();
+
+    // NOTE: CreateIconIndirect copies both bitmaps, so ours are released when we return.
+    return CreateIconIndirect(&iconInfo);
+}
+
+void TrayIconUpdater::_formatTip(
+    const TrayState& state,
+    wchar_t* szTip,
+    size_t tipSize) noexcept
+{
+    // NOTE: The tooltip is limited to 127 characters, which is plenty for these few short lines.
+    if (state.health == TrayLinkHealth::Unlinked) {
+        swprintf_s(szTip, tipSize, L"Volume Linker");
+        return;
+    }
+
+    int length;
+    if (state.iVolume >= 0) {
+        length = swprintf_s(szTip, tipSize, L"Volume Linker\nVolume: %d%%%s", state.iVolume, state.bMuted ? L" (muted)" : L"");
+    }
+    else {
+        length = swprintf_s(szTip, tipSize, L"Volume Linker\nLinked");
+    }
+    if (length > 0 && state.nDegradedSlaves > 0) {
+        swprintf_s(szTip + length, tipSize - static_cast<size_t>(length), L"\n%zu slave device%s recovering",
+            state.nDegradedSlaves, (state.nDegradedSlaves == 1) ? L" is" : L"s are");
+    }
+}
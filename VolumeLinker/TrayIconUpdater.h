@@ -0,0 +1,93 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+// Health of the links, as displayed by the notification area icon.
+enum class TrayLinkHealth
+{
+    Unlinked, // Nothing is linked.
+    Healthy, // At least one link is active, and all of its slaves are in sync.
+    Degraded, // At least one slave is recovering from a failure.
+};
+
+// Everything that the notification area icon and its tooltip display.
+struct TrayState
+{
+    TrayLinkHealth health;
+    int iVolume; // Master volume of the link group that's displayed in the dialog (0-100), or -1 if it isn't linked.
+    bool bMuted;
+    size_t nDegradedSlaves;
+
+    bool operator==(const TrayState& other) const noexcept
+    {
+        return health == other.health && iVolume == other.iVolume && bMuted == other.bMuted &&
+            nDegradedSlaves == other.nDegradedSlaves;
+    }
+    bool operator!=(const TrayState& other) const noexcept { return !(*this == other); }
+};
+
+//-----------------------------------------------------------
+// Keeps the notification area icon and its tooltip in sync
+// with the live link state. Every Shell_NotifyIcon call is
+// an expensive cross-process call to Explorer, so the state
+// can be set as often as we like, but the icon is updated at
+// most a few times per second, and only when the displayed
+// icon or tooltip would actually change. The icon variants
+// (volume level, mute and health overlays) are rendered the
+// first time they're needed, and then cached.
+//
+// NOTE: Only used by the GUI thread (which owns the icon).
+//-----------------------------------------------------------
+class TrayIconUpdater
+{
+private:
+    // Number of volume level steps in the icon (the tooltip shows the exact volume).
+    static constexpr int VOLUME_LEVELS = 5;
+    static constexpr size_t ICON_VARIANTS = 2 * 2 * VOLUME_LEVELS; // Healthy/degraded, unmuted/muted, levels.
+
+    HWND m_hWnd;
+    UINT m_uID;
+    UINT_PTR m_timerId;
+    HICON m_hLinkedIcon; // NOTE: The base icons are owned by the caller.
+    HICON m_hUnlinkedIcon;
+    HICON m_icons[ICON_VARIANTS]; // Rendered icon variants (NULL until they're first needed).
+    TrayState m_desiredState; // Newest state that was set.
+    TrayState m_displayedState; // State that the icon displays right now.
+    HICON m_hDisplayedIcon;
+    wchar_t m_szDisplayedTip[128]; // NOTE: Same size as NOTIFYICONDATA's tooltip.
+    ULONGLONG m_lastUpdateTime;
+    bool m_bTimerActive;
+
+    HICON _getIcon(const TrayState& state) noexcept;
+    static HICON _renderIcon(HICON hBase, bool bDegraded, bool bMuted, int iLevel) noexcept;
+    static void _formatTip(const TrayState& state, wchar_t* szTip, size_t tipSize) noexcept;
+    void _update() noexcept;
+
+public:
+    TrayIconUpdater(HWND hWnd, UINT uID, UINT_PTR timerId, HICON hLinkedIcon, HICON hUnlinkedIcon) noexcept;
+    ~TrayIconUpdater();
+    TrayIconUpdater(const TrayIconUpdater&) = delete;
+    TrayIconUpdater& operator=(const TrayIconUpdater&) = delete;
+    void setState(const TrayState& state) noexcept;
+    void processTimer() noexcept;
+};
@@ -0,0 +1,189 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "VolumeCurve.h"
+#include "helpers.h"
+
+VolumeCurve::VolumeCurve() noexcept :
+    m_bIdentity(true),
+    m_bInvertible(true)
+{
+}
+
+VolumeCurve::VolumeCurve(
+    VolumeCurveSettings settings) :
+    m_bIdentity(false),
+    m_bInvertible(false)
+{
+    // Sanitize the clamp range, so that broken settings can never produce volumes outside of 0-100%.
+    // NOTE: NaN values fail every comparison, so they're caught by the negated checks.
+    if (!(settings.fMin >= 0.0f)) { settings.fMin = 0.0f; }
+    if (!(settings.fMax <= 1.0f)) { settings.fMax = 1.0f; }
+    if (settings.fMin > 1.0f) { settings.fMin = 1.0f; }
+    if (settings.fMax < settings.fMin) { settings.fMax = settings.fMin; }
+
+    // A plain 1:1 linear curve doesn't need any table, which keeps the default link completely exact.
+    if (settings.type == VolumeCurveSettings::Type::Linear &&
+        settings.fGain == 1.0f && settings.fOffset == 0.0f &&
+        settings.fMin == 0.0f && settings.fMax == 1.0f) {
+        m_bIdentity = true;
+        m_bInvertible = true;
+        return;
+    }
+
+    // Piecewise curves are interpolated between their points, so they must be sorted by master volume.
+    std::sort(settings.points.begin(), settings.points.end());
+
+    // Evaluate the curve at every step (this is the only place where the heavy math happens).
+    m_table.resize(VOLUME_CURVE_STEPS + 1);
+    for (size_t i = 0; i <= VOLUME_CURVE_STEPS; ++i) {
+        m_table[i] = VolumeCurve::_evaluate(settings, static_cast<float>(i) / static_cast<float>(VOLUME_CURVE_STEPS));
+    }
+
+    // Only a table that never falls can be searched by unmap(). Falling curves (such as piecewise points that go
+    // down, or a negative linear gain) and completely flat ones have no usable inverse.
+    m_bInvertible = (m_table.back() > m_table.front()) &&
+        std::is_sorted(m_table.begin(), m_table.end());
+}
+
+float VolumeCurve::_evaluate(
+    const VolumeCurveSettings& settings,
+    float fVolume) noexcept
+{
+    float fResult;
+    switch (settings.type)
+    {
+    case VolumeCurveSettings::Type::Decibel:
+    {
+        // Convert to decibels (relative to full volume), apply the gain and offset, and convert back.
+        // NOTE: Silence has no decibel value, so it always stays silent (unless a minimum is set).
+        if (fVolume <= 0.0f) {
+            fResult = 0.0f;
+            break;
+        }
+        double dB = 20.0 * log10(static_cast<double>(fVolume));
+        dB = (dB * settings.fGain) + settings.fOffset;
+        fResult = static_cast<float>(pow(10.0, dB / 20.0));
+        break;
+    }
+
+    case VolumeCurveSettings::Type::Piecewise:
+    {
+        // Interpolate between the two points that surround the volume (everything outside of them is flat).
+        // NOTE: Without any points, the curve is a plain 1:1 copy (but still clamped).
+        auto& points = settings.points;
+        if (points.empty()) {
+            fResult = fVolume;
+            break;
+        }
+        auto it = std::find_if(points.begin(), points.end(), [fVolume](const std::pair<float, float>& point) -> bool
+            {
+                return point.first >= fVolume;
+            });
+        if (it == points.begin()) {
+            fResult = it->second;
+        }
+        else if (it == points.end()) {
+            fResult = points.back().second;
+        }
+        else {
+            auto& lower = *(it - 1);
+            auto& upper = *it;
+            float fRange = upper.first - lower.first;
+            float fFraction = (fRange > 0.0f) ? (fVolume - lower.first) / fRange : 1.0f;
+            fResult = lower.second + ((upper.second - lower.second) * fFraction);
+        }
+        break;
+    }
+
+    default:
+        fResult = (fVolume * settings.fGain) + settings.fOffset;
+        break;
+    }
+
+    // Clamp the result to the configured range.
+    if (!(fResult >= settings.fMin)) { fResult = settings.fMin; }
+    else if (fResult > settings.fMax) { fResult = settings.fMax; }
+
+    return fResult;
+}
+
+bool VolumeCurve::isIdentity() const noexcept
+{
+    return m_bIdentity;
+}
+
+bool VolumeCurve::isInvertible() const noexcept
+{
+    return m_bInvertible;
+}
+
+float VolumeCurve::map(
+    float fVolume) const noexcept
+{
+    // NOTE: This is executed for every slave write, so it must stay cheap (a lookup and one interpolation).
+    if (m_bIdentity) {
+        return fVolume;
+    }
+
+    if (!(fVolume > 0.0f)) {
+        return m_table.front();
+    }
+    if (fVolume >= 1.0f) {
+        return m_table.back();
+    }
+
+    float fPosition = fVolume * static_cast<float>(VOLUME_CURVE_STEPS);
+    size_t idx = static_cast<size_t>(fPosition);
+    if (idx >= VOLUME_CURVE_STEPS) {
+        return m_table.back();
+    }
+    float fFraction = fPosition - static_cast<float>(idx);
+
+    return m_table[idx] + ((m_table[idx + 1] - m_table[idx]) * fFraction);
+}
+
+float VolumeCurve::unmap(
+    float fVolume) const noexcept
+{
+    // Translates a slave volume back into the master volume that produces it (bidirectional mode).
+    // NOTE: Where the curve is flat (such as in its clamped regions), the lowest master volume that produces
+    // the slave volume is used. Curves that aren't invertible have no meaningful answer, so callers must check
+    // isInvertible() first (the volume is then simply passed through unchanged, rather than searching
+    // a table that isn't sorted).
+    if (m_bIdentity || !m_bInvertible) {
+        return fVolume;
+    }
+
+    auto it = std::lower_bound(m_table.begin(), m_table.end(), fVolume);
+    if (it == m_table.begin()) {
+        return 0.0f;
+    }
+    if (it == m_table.end()) {
+        return 1.0f;
+    }
+
+    auto idx = static_cast<size_t>(it - m_table.begin());
+    float fLower = m_table[idx - 1];
+    float fUpper = m_table[idx];
+    float fFraction = (fUpper > fLower) ? (fVolume - fLower) / (fUpper - fLower) : 0.0f;
+
+    return (static_cast<float>(idx - 1) + fFraction) / static_cast<float>(VOLUME_CURVE_STEPS);
+}
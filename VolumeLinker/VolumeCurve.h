@@ -0,0 +1,66 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+// Settings of a volume curve, which describes how a master volume is translated into a slave volume.
+struct VolumeCurveSettings
+{
+    enum class Type { Linear, Decibel, Piecewise };
+    Type type = Type::Linear;
+    float fGain = 1.0f; // Linear: Multiplies the scalar. Decibel: Multiplies the decibels (compresses/expands the range).
+    float fOffset = 0.0f; // Linear: Added to the scalar. Decibel: Added to the decibels (such as -6 for half as loud).
+    float fMin = 0.0f; // Lowest slave volume that the curve ever produces (scalar).
+    float fMax = 1.0f; // Highest slave volume that the curve ever produces (scalar).
+    std::vector<std::pair<float, float>> points; // Piecewise: Master -> slave scalar pairs (interpolated in between).
+};
+
+//-----------------------------------------------------------
+// Translates master volumes into slave volumes. The curve is
+// evaluated once per table step when it's created, so that
+// translating a volume is only a table lookup (with linear
+// interpolation between the two nearest steps) and never has
+// to do any logarithm or power math. The default curve is a
+// plain 1:1 copy, which skips the table completely.
+//
+// Only curves that never fall (and don't stay flat all the
+// way) can be translated back, so a curve that doesn't is
+// marked as not invertible, and its slave's own changes are
+// then never synced back to the master.
+//-----------------------------------------------------------
+class VolumeCurve
+{
+private:
+    bool m_bIdentity;
+    bool m_bInvertible; // Whether the table never falls (and rises somewhere), which is what unmap() relies on.
+    std::vector<float> m_table; // Slave volumes for every master step (VOLUME_CURVE_STEPS + 1 entries).
+
+    static float _evaluate(const VolumeCurveSettings& settings, float fVolume) noexcept;
+
+public:
+    VolumeCurve() noexcept;
+    explicit VolumeCurve(VolumeCurveSettings settings);
+    bool isIdentity() const noexcept;
+    bool isInvertible() const noexcept;
+    float map(float fVolume) const noexcept;
+    float unmap(float fVolume) const noexcept;
+};
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "VolumeEventStream.h"
+#include "PipeSecurity.h"
+#include "SlaveVolumeWorker.h"
+#include "helpers.h"
+#include "WakeupStats.h"
+
+VolumeEventStream::VolumeEventStream() :
+    m_subscribers(std::make_unique<Subscriber[]>(MAX_SUBSCRIBERS)),
+    m_nActiveSubscribers(0),
+    m_sequence(0)
+{
+    HRESULT hr;
+
+    // Auto-reset event which wakes the stream thread whenever there are new records to write, and a
+    // manual-reset event which tells it to exit.
+    hr = m_dataEvent.create(wil::EventOptions::None);
+    THROW_IF_COM_FAILED(hr, "Unable to create event stream data event.");
+    hr = m_stopEvent.create(wil::EventOptions::ManualReset);
+    THROW_IF_COM_FAILED(hr, "Unable to create event stream stop event.");
+
+    // Create one pipe instance per subscriber (refuses to start if anyone else has already created our pipe).
+    // NOTE: The subscribers only ever read, so the pipe is outbound-only.
+    PipeSecurity security;
+    auto pipeName = getPipeName();
+    for (UINT i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        auto& subscriber = m_subscribers[i];
+        subscriber.hPipe.reset(CreateNamedPipeW(pipeName.c_str(),
+            PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | ((i == 0) ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            PIPE_TYPE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            MAX_SUBSCRIBERS, static_cast<DWORD>(sizeof(Record) * MAX_BATCH), 0, 0, security.get()));
+        if (!subscriber.hPipe) {
+            throw std::runtime_error("Unable to create the event stream pipe.");
+        }
+        hr = subscriber.ioEvent.create(wil::EventOptions::ManualReset);
+        THROW_IF_COM_FAILED(hr, "Unable to create event stream I/O event.");
+        subscriber.overlapped = {};
+        subscriber.state = SubscriberState::Connecting;
+        subscriber.bActive = false;
+        subscriber.queueHead = 0;
+        subscriber.queueCount = 0;
+    }
+
+    // Start the stream thread (throws if the thread can't be created).
+    m_thread = std::thread(&VolumeEventStream::_threadMain, this);
+}
+
+VolumeEventStream::~VolumeEventStream()
+{
+    m_stopEvent.SetEvent();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+std::wstring VolumeEventStream::getPipeName()
+{
+    // Every session has its own pipe, since every user can run their own instance (see SessionInstance).
+    DWORD dwSessionId = 0;
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId);
+    return L"\\\\.\\pipe\\VideoPlayerCode.VolumeLinker.Events." + std::to_wstring(dwSessionId);
+}
+
+void VolumeEventStream::publish(
+    size_t group,
+    float fVolume,
+    BOOL bMuted,
+    UINT nChannels,
+    const float* afChannelVolumes,
+    LONGLONG timestamp) noexcept
+{
+    // NOTE: This is executed by the audio service's notification threads, for every master volume change. Without
+    // any subscribers, it costs a single atomic read. Otherwise, it copies the records into every subscriber's queue
+    // (dropping the oldest records of any subscriber that has fallen behind), and never waits for any I/O.
+    if (m_nActiveSubscribers.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+    if (nChannels > MAX_SYNC_CHANNELS) {
+        nChannels = MAX_SYNC_CHANNELS;
+    }
+    if (timestamp == 0) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        timestamp = now.QuadPart;
+    }
+
+    // Build the notification's records on the stack.
+    Record records[1 + MAX_SYNC_CHANNELS];
+    UINT nRecords = 1 + nChannels;
+    uint32_t sequence = m_sequence.fetch_add(nRecords, std::memory_order_relaxed);
+    for (UINT i = 0; i < nRecords; ++i) {
+        auto& record = records[i];
+        record.timestamp = timestamp;
+        record.sequence = sequence + i;
+        record.fVolume = (i == 0) ? fVolume : afChannelVolumes[i - 1];
+        record.group = static_cast<uint16_t>(group);
+        record.channel = (i == 0) ? CHANNEL_MASTER : static_cast<uint8_t>(i - 1);
+        record.flags = bMuted ? FLAG_MUTED : 0;
+        record.reserved = 0;
+    }
+
+    bool bWake = false;
+    for (UINT s = 0; s < MAX_SUBSCRIBERS; ++s) {
+        auto& subscriber = m_subscribers[s];
+        if (!subscriber.bActive.load(std::memory_order_acquire)) {
+            continue;
+        }
+        auto lock = subscriber.queueLock.lock_exclusive();
+        if (subscriber.queueCount == 0) {
+            bWake = true;
+        }
+        for (UINT i = 0; i < nRecords; ++i) {
+            if (subscriber.queueCount == QUEUE_CAPACITY) {
+                subscriber.queueHead = (subscriber.queueHead + 1) % QUEUE_CAPACITY;
+                --subscriber.queueCount;
+            }
+            subscriber.queue[(subscriber.queueHead + subscriber.queueCount) % QUEUE_CAPACITY] = records[i];
+            ++subscriber.queueCount;
+        }
+    }
+
+    // Only wake the stream thread if a queue was empty, since it writes every non-empty queue until it's empty.
+    if (bWake) {
+        m_dataEvent.SetEvent();
+    }
+}
+
+void VolumeEventStream::_startConnect(
+    Subscriber& subscriber) noexcept
+{
+    // Wait for the next subscriber on this pipe instance (completes via the I/O event).
+    // NOTE: A subscriber that connected before we started waiting is reported as ERROR_PIPE_CONNECTED,
+    // which doesn't signal the event, so we signal it ourselves.
+    subscriber.state = SubscriberState::Connecting;
+    subscriber.overlapped = {};
+    subscriber.overlapped.hEvent = subscriber.ioEvent.get();
+    if (!ConnectNamedPipe(subscriber.hPipe.get(), &subscriber.overlapped)) {
+        DWORD dwError = GetLastError();
+        if (dwError == ERROR_PIPE_CONNECTED) {
+            subscriber.ioEvent.SetEvent();
+        }
+        else if (dwError != ERROR_IO_PENDING) {
+            // The subscriber has already disconnected again (or the pipe is broken), so we try once more.
+            // NOTE: If it's broken, the instance simply stays unused.
+            DisconnectNamedPipe(subscriber.hPipe.get());
+            subscriber.overlapped = {};
+            subscriber.overlapped.hEvent = subscriber.ioEvent.get();
+            if (!ConnectNamedPipe(subscriber.hPipe.get(), &subscriber.overlapped) && GetLastError() == ERROR_PIPE_CONNECTED) {
+                subscriber.ioEvent.SetEvent();
+            }
+        }
+    }
+}
+
+void VolumeEventStream::_startWrite(
+    Subscriber& subscriber) noexcept
+{
+    if (subscriber.state != SubscriberState::Connected) {
+        return;
+    }
+
+    // Take as many queued records as fit into a single message.
+    size_t nRecords = 0;
+    {
+        auto lock = subscriber.queueLock.lock_exclusive();
+        while (nRecords < MAX_BATCH && subscriber.queueCount > 0) {
+            subscriber.writeBuffer[nRecords++] = subscriber.queue[subscriber.queueHead];
+            subscriber.queueHead = (subscriber.queueHead + 1) % QUEUE_CAPACITY;
+            --subscriber.queueCount;
+        }
+    }
+    if (nRecords == 0) {
+        return;
+    }
+
+    subscriber.state = SubscriberState::Writing;
+    subscriber.overlapped = {};
+    subscriber.overlapped.hEvent = subscriber.ioEvent.get();
+    if (!WriteFile(subscriber.hPipe.get(), subscriber.writeBuffer, static_cast<DWORD>(nRecords * sizeof(Record)), NULL, &subscriber.overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        this->_disconnect(subscriber);
+    }
+}
+
+void VolumeEventStream::_onIoComplete(
+    Subscriber& subscriber) noexcept
+{
+    // NOTE: The event is manual-reset, and must not stay signaled while no operation is pending. Starting
+    // any new operation resets it by itself.
+    subscriber.ioEvent.ResetEvent();
+
+    DWORD dwBytes;
+    BOOL bSuccess = GetOverlappedResult(subscriber.hPipe.get(), &subscriber.overlapped, &dwBytes, FALSE);
+    if (!bSuccess && !(subscriber.state == SubscriberState::Connecting && GetLastError() == ERROR_PIPE_CONNECTED)) {
+        this->_disconnect(subscriber);
+        return;
+    }
+
+    if (subscriber.state == SubscriberState::Connecting) {
+        // A new subscriber, which receives every record from now on.
+        subscriber.state = SubscriberState::Connected;
+        subscriber.bActive.store(true, std::memory_order_release);
+        m_nActiveSubscribers.fetch_add(1, std::memory_order_acq_rel);
+        return;
+    }
+
+    // The message has been written, so we continue with whatever has been queued in the meantime.
+    subscriber.state = SubscriberState::Connected;
+    this->_startWrite(subscriber);
+}
+
+void VolumeEventStream::_disconnect(
+    Subscriber& subscriber) noexcept
+{
+    // Stop queueing records for the subscriber, forget its queue, and wait for the next subscriber.
+    if (subscriber.bActive.exchange(false, std::memory_order_acq_rel)) {
+        m_nActiveSubscribers.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    {
+        auto lock = subscriber.queueLock.lock_exclusive();
+        subscriber.queueHead = 0;
+        subscriber.queueCount = 0;
+    }
+    DisconnectNamedPipe(subscriber.hPipe.get());
+    this->_startConnect(subscriber);
+}
+
+void VolumeEventStream::_threadMain() noexcept
+{
+    for (UINT i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        this->_startConnect(m_subscribers[i]);
+    }
+
+    HANDLE waitHandles[2 + MAX_SUBSCRIBERS] = { m_stopEvent.get(), m_dataEvent.get() };
+    for (UINT i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        waitHandles[2 + i] = m_subscribers[i].ioEvent.get();
+    }
+
+    for (;;) {
+        DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0) {
+            WakeupStats::record(WakeSource::EventStream);
+        }
+        if (waitResult == WAIT_OBJECT_0 + 1) {
+            // New records: Start writing to every subscriber that isn't busy.
+            for (UINT i = 0; i < MAX_SUBSCRIBERS; ++i) {
+                this->_startWrite(m_subscribers[i]);
+            }
+        }
+        else if (waitResult >= WAIT_OBJECT_0 + 2 && waitResult < WAIT_OBJECT_0 + 2 + MAX_SUBSCRIBERS) {
+            this->_onIoComplete(m_subscribers[waitResult - WAIT_OBJECT_0 - 2]);
+        }
+        else {
+            // Stop was requested (or the wait itself failed, which should never happen).
+            break;
+        }
+    }
+
+    // Cancel every pending operation, and wait until it's really cancelled, since it refers to our buffers.
+    for (UINT i = 0; i < MAX_SUBSCRIBERS; ++i) {
+        auto& subscriber = m_subscribers[i];
+        subscriber.bActive = false;
+        DWORD dwBytes;
+        if (CancelIoEx(subscriber.hPipe.get(), &subscriber.overlapped) || GetLastError() != ERROR_NOT_FOUND) {
+            GetOverlappedResult(subscriber.hPipe.get(), &subscriber.overlapped, &dwBytes, TRUE);
+        }
+    }
+    m_nActiveSubscribers = 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+//-----------------------------------------------------------
+// Push stream of the linked masters' volume changes, which
+// lets other programs (such as overlays or LED controllers)
+// mirror the volume without polling the mixer. Subscribers
+// connect to a named pipe that only the current user can
+// open, and receive messages of fixed-size binary records.
+// Every subscriber has its own small queue, which drops its
+// oldest records when the subscriber can't keep up, so the
+// volume callbacks only ever copy a few bytes and never wait
+// for any subscriber. One thread serves all subscribers via
+// overlapped I/O, and sleeps while nothing is happening.
+//-----------------------------------------------------------
+class VolumeEventStream
+{
+public:
+    // A single volume event. Every notification becomes one record for the master volume, followed by one
+    // record per channel. Sequence numbers are shared by all subscribers, so any gaps mean dropped records.
+    struct Record
+    {
+        int64_t timestamp; // When the notification arrived (QueryPerformanceCounter ticks).
+        uint32_t sequence;
+        float fVolume; // Volume scalar (0.0 - 1.0).
+        uint16_t group; // Link group (0 is the first group).
+        uint8_t channel; // Channel index, or CHANNEL_MASTER for the master volume.
+        uint8_t flags; // FLAG_MUTED if the master is muted.
+        uint32_t reserved; // Always 0.
+    };
+    static_assert(sizeof(Record) == 24, "Stream records must stay compact and stable.");
+
+    static constexpr uint8_t CHANNEL_MASTER = 0xFF;
+    static constexpr uint8_t FLAG_MUTED = 0x01;
+    static constexpr UINT MAX_SUBSCRIBERS = 8;
+
+private:
+    static constexpr size_t QUEUE_CAPACITY = 256; // Records per subscriber.
+    static constexpr size_t MAX_BATCH = 64; // Records per pipe message.
+
+    enum class SubscriberState { Connecting, Connected, Writing };
+
+    struct Subscriber
+    {
+        wil::unique_handle hPipe;
+        wil::unique_event_nothrow ioEvent;
+        OVERLAPPED overlapped;
+        SubscriberState state; // Only used by the stream thread.
+        std::atomic<bool> bActive; // Whether records are queued for the subscriber (only while connected).
+        wil::srwlock queueLock;
+        Record queue[QUEUE_CAPACITY]; // Ring buffer (protected by queueLock).
+        size_t queueHead;
+        size_t queueCount;
+        Record writeBuffer[MAX_BATCH]; // Records that are currently being written (only used by the stream thread).
+    };
+
+    std::unique_ptr<Subscriber[]> m_subscribers;
+    std::atomic<UINT> m_nActiveSubscribers;
+    std::atomic<uint32_t> m_sequence;
+    wil::unique_event_nothrow m_dataEvent; // Set when an empty subscriber queue has received records.
+    wil::unique_event_nothrow m_stopEvent;
+    std::thread m_thread;
+
+    void _startConnect(Subscriber& subscriber) noexcept;
+    void _startWrite(Subscriber& subscriber) noexcept;
+    void _onIoComplete(Subscriber& subscriber) noexcept;
+    void _disconnect(Subscriber& subscriber) noexcept;
+    void _threadMain() noexcept;
+
+public:
+    VolumeEventStream();
+    ~VolumeEventStream();
+    VolumeEventStream(const VolumeEventStream&) = delete;
+    VolumeEventStream& operator=(const VolumeEventStream&) = delete;
+    static std::wstring getPipeName();
+    void publish(size_t group, float fVolume, BOOL bMuted, UINT nChannels, const float* afChannelVolumes, LONGLONG timestamp) noexcept;
+};
@@ -0,0 +1,126 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "WakeupStats.h"
+#include "helpers.h"
+
+std::atomic<bool> WakeupStats::s_bRunning(false);
+std::atomic<uint64_t> WakeupStats::s_counts[static_cast<size_t>(WakeSource::Count)]; // NOTE: Static, so zero-initialized.
+std::atomic<LONGLONG> WakeupStats::s_startTime(0);
+std::atomic<LONGLONG> WakeupStats::s_stopTime(0);
+
+static LONGLONG QpcNow() noexcept
+{
+    LARGE_INTEGER time;
+    QueryPerformanceCounter(&time);
+    return time.QuadPart;
+}
+
+void WakeupStats::start() noexcept
+{
+    // Restart the window from zero (even if an audit is already running).
+    // NOTE: Wakeups which are counted while we're resetting may survive, but that's at most one per thread.
+    s_bRunning.store(false, std::memory_order_relaxed);
+    for (auto& count : s_counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    s_stopTime.store(0, std::memory_order_relaxed);
+    s_startTime.store(QpcNow(), std::memory_order_relaxed);
+    s_bRunning.store(true, std::memory_order_release);
+}
+
+void WakeupStats::stop() noexcept
+{
+    // Freeze the counts (and the window's length), so that they can still be reported afterwards.
+    if (s_bRunning.exchange(false, std::memory_order_acq_rel)) {
+        s_stopTime.store(QpcNow(), std::memory_order_relaxed);
+    }
+}
+
+WakeupStats::Report WakeupStats::getReport() noexcept
+{
+    Report report = {};
+    report.bRunning = s_bRunning.load(std::memory_order_acquire);
+
+    LONGLONG startTime = s_startTime.load(std::memory_order_relaxed);
+    if (startTime != 0) {
+        LONGLONG stopTime = report.bRunning ? QpcNow() : s_stopTime.load(std::memory_order_relaxed);
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        report.seconds = (frequency.QuadPart > 0 && stopTime > startTime) ?
+            static_cast<double>(stopTime - startTime) / static_cast<double>(frequency.QuadPart) : 0.0;
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(WakeSource::Count); ++i) {
+        report.counts[i] = s_counts[i].load(std::memory_order_relaxed);
+    }
+
+    auto count = [&report](WakeSource source) -> uint64_t {
+        return report.counts[static_cast<size_t>(source)];
+    };
+    report.messageLoop = count(WakeSource::MessageLoop);
+    report.timers = count(WakeSource::TimerMessage) + count(WakeSource::RampStep) + count(WakeSource::RecoveryRetry);
+    report.workerWakes = count(WakeSource::EngineThread) + count(WakeSource::SlaveWorker) +
+        count(WakeSource::SettingsWriter) + count(WakeSource::ControlPipe) + count(WakeSource::EventStream);
+    report.callbacks = count(WakeSource::VolumeCallback) + count(WakeSource::SessionCallback) + count(WakeSource::DeviceCallback);
+
+    return report;
+}
+
+const char* WakeupStats::getSourceName(
+    WakeSource source) noexcept
+{
+    switch (source) {
+    case WakeSource::MessageLoop: return "messageloop";
+    case WakeSource::TimerMessage: return "timermessage";
+    case WakeSource::EngineThread: return "engine";
+    case WakeSource::SlaveWorker: return "worker";
+    case WakeSource::RampStep: return "rampstep";
+    case WakeSource::RecoveryRetry: return "recovery";
+    case WakeSource::SettingsWriter: return "settings";
+    case WakeSource::ControlPipe: return "controlpipe";
+    case WakeSource::EventStream: return "eventstream";
+    case WakeSource::VolumeCallback: return "volumecallback";
+    case WakeSource::SessionCallback: return "sessioncallback";
+    case WakeSource::DeviceCallback: return "devicecallback";
+    default: return "unknown";
+    }
+}
+
+std::wstring WakeupStats::formatReport()
+{
+    auto report = WakeupStats::getReport();
+    if (report.seconds <= 0.0 && !report.bRunning) {
+        return L"Idle audit: Not started.\r\n";
+    }
+
+    wchar_t buffer[512];
+    swprintf_s(buffer,
+        L"Idle audit (%s, %.1f seconds):\r\n"
+        L"Message loop iterations: %llu\r\n"
+        L"Timer wakeups: %llu\r\n"
+        L"Worker thread wakeups: %llu\r\n"
+        L"Audio callbacks: %llu\r\n",
+        report.bRunning ? L"running" : L"stopped", report.seconds,
+        static_cast<unsigned long long>(report.messageLoop), static_cast<unsigned long long>(report.timers),
+        static_cast<unsigned long long>(report.workerWakes), static_cast<unsigned long long>(report.callbacks));
+
+    return buffer;
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+
+// Every place where one of our threads wakes up (or one of our callbacks is invoked).
+enum class WakeSource : size_t
+{
+    MessageLoop, // The GUI thread's message loop retrieved a message.
+    TimerMessage, // The dialog handled a WM_TIMER (slider and tray icon throttling).
+    EngineThread, // The audio engine's thread woke up for commands or device changes.
+    SlaveWorker, // A volume worker woke up to apply a new state.
+    RampStep, // A volume worker's ramp timer elapsed.
+    RecoveryRetry, // A volume worker retried a failed device.
+    SettingsWriter, // The settings persister woke up for a new snapshot (or to write it).
+    ControlPipe, // The control channel's thread woke up for a connection or request.
+    EventStream, // The volume event stream's thread woke up for new records or subscribers.
+    VolumeCallback, // The audio service reported an endpoint volume change.
+    SessionCallback, // The audio service reported a session change (volume, state or a new session).
+    DeviceCallback, // The audio service reported a device change.
+    Count,
+};
+
+//-----------------------------------------------------------
+// Process-wide idle-cost audit. While an audit is running,
+// every wakeup of our own threads and callbacks is counted,
+// which proves whether the program really stays idle while
+// nobody touches any volume (ideally, all counts stay zero).
+// Recording is a single relaxed atomic load while no audit
+// is running, and one more relaxed increment while it is, so
+// the calls are left in every build.
+//-----------------------------------------------------------
+class WakeupStats
+{
+public:
+    struct Report
+    {
+        bool bRunning; // Whether the audit is still counting.
+        double seconds; // Length of the audit window.
+        uint64_t counts[static_cast<size_t>(WakeSource::Count)];
+        uint64_t messageLoop; // Message loop iterations.
+        uint64_t timers; // Timer wakeups (WM_TIMER, ramp steps and recovery retries).
+        uint64_t workerWakes; // Worker thread wakeups.
+        uint64_t callbacks; // Audio service callbacks.
+    };
+
+private:
+    static std::atomic<bool> s_bRunning;
+    static std::atomic<uint64_t> s_counts[static_cast<size_t>(WakeSource::Count)];
+    static std::atomic<LONGLONG> s_startTime; // When the audit started (QPC).
+    static std::atomic<LONGLONG> s_stopTime; // When the audit stopped (QPC), or 0 while running.
+
+public:
+    WakeupStats() = delete;
+
+    static void record(
+        WakeSource source) noexcept
+    {
+        if (s_bRunning.load(std::memory_order_relaxed)) {
+            s_counts[static_cast<size_t>(source)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static void start() noexcept;
+    static void stop() noexcept;
+    static Report getReport() noexcept;
+    static const char* getSourceName(WakeSource source) noexcept;
+    static std::wstring formatReport();
+};
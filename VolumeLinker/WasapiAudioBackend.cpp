@@ -0,0 +1,85 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "WasapiAudioBackend.h"
+#include "helpers.h"
+
+WasapiAudioBackend::WasapiAudioBackend()
+{
+    HRESULT hr;
+
+    // Get enumerator for audio endpoint devices.
+    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator),
+        NULL, CLSCTX_INPROC_SERVER,
+        __uuidof(IMMDeviceEnumerator),
+        (void**)& m_pEnumerator);
+    THROW_IF_COM_FAILED(hr, "Unable to create audio device enumerator.");
+}
+
+HRESULT WasapiAudioBackend::registerNotificationClient(
+    IMMNotificationClient* pClient) noexcept
+{
+    return m_pEnumerator->RegisterEndpointNotificationCallback(pClient);
+}
+
+HRESULT WasapiAudioBackend::unregisterNotificationClient(
+    IMMNotificationClient* pClient) noexcept
+{
+    return m_pEnumerator->UnregisterEndpointNotificationCallback(pClient);
+}
+
+HRESULT WasapiAudioBackend::enumerateDevices(
+    DWORD dwStateMask,
+    std::vector<wil::com_ptr_nothrow<IMMDevice>>& devices)
+{
+    HRESULT hr;
+
+    // Get all audio-rendering devices in the given states.
+    wil::com_ptr_nothrow<IMMDeviceCollection> pCollection;
+    hr = m_pEnumerator->EnumAudioEndpoints(
+        eRender, dwStateMask, &pCollection);
+    if (FAILED(hr)) { return hr; }
+
+    // Count the discovered devices.
+    UINT count;
+    hr = pCollection->GetCount(&count);
+    if (FAILED(hr)) { return hr; }
+
+    devices.clear();
+    devices.reserve(static_cast<size_t>(count));
+    for (UINT i = 0; i < count; ++i) {
+        // Get pointer to endpoint number i.
+        wil::com_ptr_nothrow<IMMDevice> pEndpoint;
+        hr = pCollection->Item(i, &pEndpoint);
+        if (FAILED(hr)) { return hr; }
+
+        devices.push_back(std::move(pEndpoint));
+    }
+
+    return S_OK;
+}
+
+HRESULT WasapiAudioBackend::getDevice(
+    LPCWSTR pwstrId,
+    wil::com_ptr_nothrow<IMMDevice>& pDevice) noexcept
+{
+    pDevice = nullptr;
+    return m_pEnumerator->GetDevice(pwstrId, &pDevice);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "framework.h"
+#include "AudioBackend.h"
+
+//-----------------------------------------------------------
+// The real audio backend, which lists the devices of the
+// Windows audio service via the MMDevice enumerator.
+//-----------------------------------------------------------
+class WasapiAudioBackend : public AudioBackend
+{
+private:
+    wil::com_ptr_nothrow<IMMDeviceEnumerator> m_pEnumerator;
+
+public:
+    WasapiAudioBackend();
+    WasapiAudioBackend(const WasapiAudioBackend&) = delete;
+    WasapiAudioBackend& operator=(const WasapiAudioBackend&) = delete;
+    HRESULT registerNotificationClient(IMMNotificationClient* pClient) noexcept override;
+    HRESULT unregisterNotificationClient(IMMNotificationClient* pClient) noexcept override;
+    HRESULT enumerateDevices(DWORD dwStateMask, std::vector<wil::com_ptr_nothrow<IMMDevice>>& devices) override;
+    HRESULT getDevice(LPCWSTR pwstrId, wil::com_ptr_nothrow<IMMDevice>& pDevice) noexcept override;
+};
@@ -0,0 +1,789 @@
+/*
+ * This file is part of the Volume Linker project (https://github.com/VideoPlayerCode/VolumeLinker).
+ * Copyright (C) 2019 VideoPlayerCode.
+ *
+ * Volume Linker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Volume Linker is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Volume Linker.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+// Command-line benchmark for the real device and link code paths. It creates its own device
+// managers (exactly like the audio engine does), and feeds synthetic volume notifications
+// straight into a group's master callback, which means that everything after the audio
+// service's notification thread is measured, including the slave workers' device writes.
+//
+// Usage: VolumeLinkerBench [/runs:N] [/burst:N] [/master:<device ID> /slave:<device ID> ...]
+//        VolumeLinkerBench /simulate:<devices> [/slaves:N] [/latency:<microseconds>] [/failrate:<0-1>] [/seed:N]
+//
+// The link benchmarks are only run if a master and at least one slave have been given, since
+// they really change the slaves' volume. Run the benchmark without them to list the device IDs.
+// In simulation mode, the first simulated device is the master and all (or N) others are slaves,
+// which gives reproducible results for any number of devices, without touching real hardware.
+//
+// The link benchmark also verifies that the notification path never allocates any memory (with our own event
+// context, with a foreign one that also refreshes the dialog and the event stream, and with channel sync), and
+// the benchmark exits with code 3 if it does (so that it can be used as a regression check).
+
+#include "framework.h"
+#include "helpers.h"
+#include "AudioDeviceManager.h"
+#include "SimulatedAudioBackend.h"
+#include "VolumeEventStream.h"
+#include <crtdbg.h>
+#include <new>
+
+// Number of heap allocations made by the current thread. The global allocation functions are replaced
+// below, so this counts every allocation of the standard library (and of our own code) on this thread.
+// NOTE: It's per-thread, so that the slave workers' allocations (such as debug output) are never counted.
+static thread_local uint64_t t_allocationCount = 0;
+
+// Number of C runtime heap allocations (malloc, calloc, realloc and everything built on them, including the
+// operator new below) made by the current thread. The CRT only reports them in debug builds.
+static thread_local uint64_t t_crtAllocationCount = 0;
+
+// Number of COM task memory allocations (CoTaskMemAlloc and CoTaskMemRealloc) made by the current thread.
+static thread_local uint64_t t_comAllocationCount = 0;
+
+void* operator new(
+    size_t size)
+{
+    ++t_allocationCount;
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](
+    size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(
+    void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](
+    void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(
+    void* p,
+    size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](
+    void* p,
+    size_t) noexcept
+{
+    free(p);
+}
+
+#ifdef _DEBUG
+static int __cdecl CountCrtAllocation(
+    int allocType,
+    void*,
+    size_t,
+    int,
+    long,
+    const unsigned char*,
+    int)
+{
+    // NOTE: This runs inside of the CRT's allocator, so it must never allocate (or call into the CRT) itself.
+    if (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC) {
+        ++t_crtAllocationCount;
+    }
+    return TRUE;
+}
+#endif
+
+//-----------------------------------------------------------
+// Spy on the COM task allocator, which sees every
+// CoTaskMemAlloc and CoTaskMemRealloc of the process. It
+// never changes any request, it only counts them.
+//
+// NOTE: There's only one static instance, which lives for
+// the whole program, so it doesn't need a reference count.
+//-----------------------------------------------------------
+class CountingMallocSpy : public IMallocSpy
+{
+public:
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef() noexcept
+    {
+        return 1;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() noexcept
+    {
+        return 1;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+        REFIID riid,
+        VOID** ppvInterface) noexcept
+    {
+        if (ppvInterface == NULL) {
+            return E_POINTER;
+        }
+        if (IID_IUnknown == riid || __uuidof(IMallocSpy) == riid) {
+            *ppvInterface = static_cast<IMallocSpy*>(this);
+            return S_OK;
+        }
+        *ppvInterface = NULL;
+        return E_NOINTERFACE;
+    }
+
+    // IMallocSpy methods
+
+    SIZE_T STDMETHODCALLTYPE PreAlloc(
+        SIZE_T cbRequest) noexcept
+    {
+        ++t_comAllocationCount;
+        return cbRequest;
+    }
+
+    void* STDMETHODCALLTYPE PostAlloc(
+        void* pActual) noexcept
+    {
+        return pActual;
+    }
+
+    void* STDMETHODCALLTYPE PreFree(
+        void* pRequest,
+        BOOL) noexcept
+    {
+        return pRequest;
+    }
+
+    void STDMETHODCALLTYPE PostFree(
+        BOOL) noexcept
+    {
+    }
+
+    SIZE_T STDMETHODCALLTYPE PreRealloc(
+        void* pRequest,
+        SIZE_T cbRequest,
+        void** ppNewRequest,
+        BOOL) noexcept
+    {
+        // NOTE: Reallocating to zero bytes just frees the memory.
+        if (cbRequest > 0) {
+            ++t_comAllocationCount;
+        }
+        *ppNewRequest = pRequest;
+        return cbRequest;
+    }
+
+    void* STDMETHODCALLTYPE PostRealloc(
+        void* pActual,
+        BOOL) noexcept
+    {
+        return pActual;
+    }
+
+    void* STDMETHODCALLTYPE PreGetSize(
+        void* pRequest,
+        BOOL) noexcept
+    {
+        return pRequest;
+    }
+
+    SIZE_T STDMETHODCALLTYPE PostGetSize(
+        SIZE_T cbActual,
+        BOOL) noexcept
+    {
+        return cbActual;
+    }
+
+    void* STDMETHODCALLTYPE PreDidAlloc(
+        void* pRequest,
+        BOOL) noexcept
+    {
+        return pRequest;
+    }
+
+    int STDMETHODCALLTYPE PostDidAlloc(
+        void*,
+        BOOL,
+        int fActual) noexcept
+    {
+        return fActual;
+    }
+
+    void STDMETHODCALLTYPE PreHeapMinimize() noexcept
+    {
+    }
+
+    void STDMETHODCALLTYPE PostHeapMinimize() noexcept
+    {
+    }
+};
+
+static CountingMallocSpy g_mallocSpy;
+
+// Allocations made by the current thread, counted by every allocator that we're able to watch.
+struct AllocationCounts
+{
+    uint64_t newCount;
+    uint64_t crtCount;
+    uint64_t comCount;
+
+    static AllocationCounts current() noexcept
+    {
+        return { t_allocationCount, t_crtAllocationCount, t_comAllocationCount };
+    }
+
+    AllocationCounts operator-(
+        const AllocationCounts& other) const noexcept
+    {
+        return { newCount - other.newCount, crtCount - other.crtCount, comCount - other.comCount };
+    }
+
+    AllocationCounts& operator+=(
+        const AllocationCounts& other) noexcept
+    {
+        newCount += other.newCount;
+        crtCount += other.crtCount;
+        comCount += other.comCount;
+        return *this;
+    }
+
+    bool isEmpty() const noexcept
+    {
+        return newCount == 0 && crtCount == 0 && comCount == 0;
+    }
+};
+
+struct BenchOptions
+{
+    unsigned int nRuns = 20;
+    unsigned int nBurst = 10000;
+    wstring masterId;
+    vector<wstring> slaveIds;
+    size_t nSimulatedDevices = 0; // Zero to use the real devices.
+    size_t nSimulatedSlaves = 0; // Zero to use all other simulated devices.
+    SimulatedBackendSettings simulation;
+};
+
+// Summary of a series of timings (all in milliseconds).
+struct BenchTimings
+{
+    double minMs;
+    double p50Ms;
+    double p99Ms;
+    double maxMs;
+    double meanMs;
+};
+
+static double TicksToMs(
+    LONGLONG ticks) noexcept
+{
+    static const LONGLONG frequency = []() {
+        LARGE_INTEGER value;
+        QueryPerformanceFrequency(&value);
+        return (value.QuadPart > 0) ? value.QuadPart : 1;
+    }();
+    return static_cast<double>(ticks) * 1000.0 / static_cast<double>(frequency);
+}
+
+static BenchTimings SummarizeTimings(
+    vector<double> samples)
+{
+    BenchTimings timings = {};
+    if (samples.empty()) {
+        return timings;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    size_t count = samples.size();
+    timings.minMs = samples[0];
+    timings.p50Ms = samples[(count - 1) * 50 / 100];
+    timings.p99Ms = samples[(count - 1) * 99 / 100];
+    timings.maxMs = samples[count - 1];
+    double total = 0.0;
+    for (double sample : samples) {
+        total += sample;
+    }
+    timings.meanMs = total / static_cast<double>(count);
+
+    return timings;
+}
+
+static void PrintTimings(
+    LPCWSTR name,
+    const vector<double>& samples)
+{
+    auto timings = SummarizeTimings(samples);
+    wprintf(L"%-34s runs=%-5zu min=%9.3f p50=%9.3f p99=%9.3f max=%9.3f mean=%9.3f (ms)\n",
+        name, samples.size(), timings.minMs, timings.p50Ms, timings.p99Ms, timings.maxMs, timings.meanMs);
+}
+
+static bool ParseOptions(
+    int argc,
+    wchar_t* argv[],
+    BenchOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::wstring_view arg(argv[i]);
+        auto hasPrefix = [&arg](std::wstring_view prefix) {
+            return arg.size() > prefix.size() && _wcsnicmp(arg.data(), prefix.data(), prefix.size()) == 0;
+        };
+
+        if (hasPrefix(L"/runs:")) {
+            options.nRuns = wcstoul(argv[i] + 6, nullptr, 10);
+        }
+        else if (hasPrefix(L"/burst:")) {
+            options.nBurst = wcstoul(argv[i] + 7, nullptr, 10);
+        }
+        else if (hasPrefix(L"/master:")) {
+            options.masterId = wstring(arg.substr(8));
+        }
+        else if (hasPrefix(L"/slave:")) {
+            options.slaveIds.emplace_back(arg.substr(7));
+        }
+        else if (hasPrefix(L"/simulate:")) {
+            options.nSimulatedDevices = wcstoul(argv[i] + 10, nullptr, 10);
+        }
+        else if (hasPrefix(L"/slaves:")) {
+            options.nSimulatedSlaves = wcstoul(argv[i] + 8, nullptr, 10);
+        }
+        else if (hasPrefix(L"/latency:")) {
+            options.simulation.dwCallLatencyMicroseconds = wcstoul(argv[i] + 9, nullptr, 10);
+        }
+        else if (hasPrefix(L"/failrate:")) {
+            options.simulation.fFailureRate = wcstod(argv[i] + 10, nullptr);
+        }
+        else if (hasPrefix(L"/seed:")) {
+            options.simulation.seed = wcstoul(argv[i] + 6, nullptr, 10);
+        }
+        else {
+            fwprintf(stderr, L"Unknown argument: %s\n", argv[i]);
+            return false;
+        }
+    }
+
+    if (options.nRuns == 0 || options.nBurst == 0) {
+        fwprintf(stderr, L"The number of runs and the burst size must be at least 1.\n");
+        return false;
+    }
+    if (options.nSimulatedDevices == 1 || (options.nSimulatedDevices > 0 && options.nSimulatedSlaves >= options.nSimulatedDevices)) {
+        fwprintf(stderr, L"The simulation needs at least one more device than it has slaves.\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void BenchStartup(
+    const BenchOptions& options,
+    GUID processGUID,
+    const std::shared_ptr<AudioBackend>& pBackend)
+{
+    // Construction enumerates every active endpoint (IDs and states only), and sorting then
+    // reads all of the device names, which is the rest of the work before the GUI can show them.
+    vector<double> constructMs;
+    vector<double> sortMs;
+    size_t nDevices = 0;
+    for (unsigned int run = 0; run < options.nRuns; ++run) {
+        LONGLONG startTime = LatencyStats::now();
+        AudioDeviceManager manager(processGUID, []() {}, pBackend);
+        LONGLONG constructedTime = LatencyStats::now();
+        manager.sortDeviceList();
+        LONGLONG sortedTime = LatencyStats::now();
+
+        constructMs.push_back(TicksToMs(constructedTime - startTime));
+        sortMs.push_back(TicksToMs(sortedTime - constructedTime));
+        nDevices = manager.getAudioDevices().size();
+    }
+
+    wprintf(L"Active audio devices: %zu\n\n", nDevices);
+    PrintTimings(L"AudioDeviceManager construction", constructMs);
+    PrintTimings(L"sortDeviceList (reads names)", sortMs);
+}
+
+static void ListDevices(
+    GUID processGUID)
+{
+    AudioDeviceManager manager(processGUID, []() {});
+    manager.sortDeviceList();
+
+    wprintf(L"\nNo /master and /slave given, so the link benchmarks were skipped. Available devices:\n");
+    for (const auto& device : manager.getAudioDevices()) {
+        wprintf(L"  %s  %s\n", device.getIdMS(), device.getNameMS());
+    }
+}
+
+static LatencyStats::Report WaitForWorkers(
+    AudioDeviceManager& manager,
+    const LatencyStats::Report& before)
+{
+    // The slave workers apply their states asynchronously, so we wait until every state that they
+    // took out of their mailboxes has been written (or until they've been idle for a while).
+    // NOTE: Coalesced states are never written, so we can't simply wait for a fixed number of writes.
+    LatencyStats::Report report = {};
+    uint64_t lastDone = ~0ULL;
+    ULONGLONG lastChangeTime = GetTickCount64();
+    for (;;) {
+        report = manager.getLatencyReport();
+        uint64_t done = (report.applied - before.applied) + (report.skipped - before.skipped) + (report.failed - before.failed);
+        ULONGLONG currentTime = GetTickCount64();
+        if (done != lastDone) {
+            lastDone = done;
+            lastChangeTime = currentTime;
+        }
+        else if (currentTime - lastChangeTime >= 250) {
+            break;
+        }
+        Sleep(5);
+    }
+
+    return report;
+}
+
+// One series of synthetic notification bursts.
+struct BurstScenario
+{
+    LPCWSTR name;
+    GUID guidEventContext; // Our process GUID, or a foreign one (which also refreshes the dialog).
+    UINT nChannels; // Number of channel levels in every notification (at most MAX_SYNC_CHANNELS).
+    const float* afChannelVolumes;
+};
+
+static bool BenchBursts(
+    const BenchOptions& options,
+    AudioDeviceManager& manager,
+    const BurstScenario& scenario,
+    float fMasterVolume,
+    BOOL bMasterMuted)
+{
+    float fOtherVolume = (fMasterVolume >= 0.01f) ? fMasterVolume - 0.01f : fMasterVolume + 0.01f;
+
+    // Synthetic notifications look exactly like the master's own notifications after a volume change.
+    // NOTE: The notification data ends with a variable number of channel levels, so it needs a larger buffer.
+    alignas(AUDIO_VOLUME_NOTIFICATION_DATA) BYTE buffer[sizeof(AUDIO_VOLUME_NOTIFICATION_DATA) + MAX_SYNC_CHANNELS * sizeof(float)] = {};
+    auto pNotify = reinterpret_cast<AUDIO_VOLUME_NOTIFICATION_DATA*>(buffer);
+    pNotify->guidEventContext = scenario.guidEventContext;
+    pNotify->bMuted = bMasterMuted;
+    pNotify->nChannels = scenario.nChannels;
+    memcpy(pNotify->afChannelVolumes, scenario.afChannelVolumes, scenario.nChannels * sizeof(float));
+
+    // NOTE: The callback must be looked up again for every scenario, since relinking replaces it.
+    IAudioEndpointVolumeCallback* pCallback = manager.getMasterCallback(0);
+    if (pCallback == nullptr) {
+        throw std::runtime_error("The link has no master callback.");
+    }
+
+    vector<double> forwardRates;
+    vector<double> burstMs;
+    uint64_t totalCoalesced = 0;
+    uint64_t totalApplied = 0;
+    uint64_t totalSkipped = 0;
+    uint64_t totalFailed = 0;
+    AllocationCounts totalAllocations = {};
+    for (unsigned int run = 0; run < options.nRuns; ++run) {
+        auto before = manager.getLatencyReport();
+
+        // NOTE: Nothing else runs on this thread during the burst, so every allocation was made by the callbacks.
+        auto allocationsBefore = AllocationCounts::current();
+        LONGLONG startTime = LatencyStats::now();
+        for (unsigned int i = 0; i < options.nBurst; ++i) {
+            // NOTE: The final notification always carries the master's real volume.
+            pNotify->fMasterVolume = ((options.nBurst - i) % 2 == 1) ? fMasterVolume : fOtherVolume;
+            pCallback->OnNotify(pNotify);
+        }
+        LONGLONG endTime = LatencyStats::now();
+        totalAllocations += AllocationCounts::current() - allocationsBefore;
+
+        auto after = WaitForWorkers(manager, before);
+
+        // Let the "dialog" take its refresh message, so that the next burst has to post a new one.
+        MSG msg;
+        while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE)) {
+            DispatchMessageW(&msg);
+        }
+        manager.processDialogRefresh(false);
+
+        double elapsedMs = TicksToMs(endTime - startTime);
+        burstMs.push_back(elapsedMs);
+        if (elapsedMs > 0.0) {
+            forwardRates.push_back(static_cast<double>(options.nBurst) * 1000.0 / elapsedMs);
+        }
+        totalCoalesced += after.coalesced - before.coalesced;
+        totalApplied += after.applied - before.applied;
+        totalSkipped += after.skipped - before.skipped;
+        totalFailed += after.failed - before.failed;
+    }
+
+    auto rates = SummarizeTimings(forwardRates);
+    wprintf(L"\n%s:\n", scenario.name);
+    PrintTimings(L"Notification burst (forwarding)", burstMs);
+    wprintf(L"Forwarded notifications per second: min=%.0f p50=%.0f max=%.0f (burst of %u, %zu slaves, %u channels)\n",
+        rates.minMs, rates.p50Ms, rates.maxMs, options.nBurst, options.slaveIds.size(), scenario.nChannels);
+    wprintf(L"Slave states: applied=%llu skipped=%llu failed=%llu coalesced=%llu\n",
+        static_cast<unsigned long long>(totalApplied), static_cast<unsigned long long>(totalSkipped),
+        static_cast<unsigned long long>(totalFailed), static_cast<unsigned long long>(totalCoalesced));
+
+    // The notification path must never touch any heap, no matter how many notifications arrive.
+    bool allocationFree = totalAllocations.isEmpty();
+#ifdef _DEBUG
+    wchar_t crtCount[32];
+    swprintf_s(crtCount, L"%llu", static_cast<unsigned long long>(totalAllocations.crtCount));
+#else
+    const wchar_t* crtCount = L"n/a (debug builds only)";
+#endif
+    wprintf(L"Heap allocations in the notification path: new=%llu crt=%s cotaskmem=%llu (%s)\n",
+        static_cast<unsigned long long>(totalAllocations.newCount), crtCount,
+        static_cast<unsigned long long>(totalAllocations.comCount), allocationFree ? L"ok" : L"FAILED, expected none");
+
+    return allocationFree;
+}
+
+static bool BenchLink(
+    const BenchOptions& options,
+    GUID processGUID,
+    const std::shared_ptr<AudioBackend>& pBackend,
+    SimulatedAudioBackend* pSimulation)
+{
+    // NOTE: These are declared before the manager, so that they outlive it (and any of its callbacks).
+    std::unique_ptr<VolumeEventStream> pEventStream;
+    wil::unique_hfile hSubscriber;
+    wil::unique_hwnd hDialog;
+    AudioDeviceManager manager(processGUID, []() {}, pBackend);
+
+    // Measure how long it takes to connect (and disconnect) the whole link, including the initial slave sync.
+    // NOTE: Links can fail when failures are being injected, so those runs are counted instead of measured.
+    vector<double> linkMs;
+    vector<double> unlinkMs;
+    unsigned int nFailedLinks = 0;
+    for (unsigned int run = 0; run < options.nRuns; ++run) {
+        LONGLONG startTime = LatencyStats::now();
+        try {
+            manager.linkDevices(0, options.masterId, options.slaveIds);
+        }
+        catch (const std::exception&) {
+            ++nFailedLinks;
+            continue;
+        }
+        LONGLONG linkedTime = LatencyStats::now();
+        manager.unlinkDevices(0);
+        LONGLONG unlinkedTime = LatencyStats::now();
+
+        linkMs.push_back(TicksToMs(linkedTime - startTime));
+        unlinkMs.push_back(TicksToMs(unlinkedTime - linkedTime));
+    }
+
+    wprintf(L"\n");
+    PrintTimings(L"linkDevices", linkMs);
+    PrintTimings(L"unlinkDevices", unlinkMs);
+    if (nFailedLinks > 0) {
+        wprintf(L"Failed links: %u\n", nFailedLinks);
+    }
+
+    // Links (and relinks) can fail when failures are being injected, so they're retried in simulation mode.
+    auto ensureLinked = [&]() {
+        for (unsigned int attempt = 0; !manager.isLinkActive(0); ++attempt) {
+            try {
+                manager.linkDevices(0, options.masterId, options.slaveIds);
+            }
+            catch (const std::exception&) {
+                if (pSimulation == nullptr || attempt >= 100) { throw; }
+            }
+        }
+    };
+
+    // Read the master's real state, so that the bursts stay close to it and the slaves end up in sync again.
+    // NOTE: The simulated devices always start out balanced, with every channel at full level.
+    float fMasterVolume = 0.0f;
+    BOOL bMasterMuted = FALSE;
+    float afMasterChannels[MAX_SYNC_CHANNELS];
+    UINT nMasterChannels = 0;
+    ensureLinked();
+    if (pSimulation != nullptr) {
+        pSimulation->getDeviceVolume(0, fMasterVolume, bMasterMuted);
+        nMasterChannels = (options.simulation.nChannels < MAX_SYNC_CHANNELS) ? options.simulation.nChannels : MAX_SYNC_CHANNELS;
+        for (UINT i = 0; i < nMasterChannels; ++i) {
+            afMasterChannels[i] = 1.0f;
+        }
+    }
+    else {
+        ptrdiff_t masterIdx = manager.findDeviceIdx(options.masterId);
+        auto pMasterEndptVol = manager.getDevice(masterIdx).getAudioEndpointVolume();
+        HRESULT hr = pMasterEndptVol->GetMasterVolumeLevelScalar(&fMasterVolume);
+        THROW_IF_COM_FAILED(hr, "Unable to read master volume.");
+        hr = pMasterEndptVol->GetMute(&bMasterMuted);
+        THROW_IF_COM_FAILED(hr, "Unable to read master mute-state.");
+        hr = pMasterEndptVol->GetChannelCount(&nMasterChannels);
+        THROW_IF_COM_FAILED(hr, "Unable to read master channel count.");
+        if (nMasterChannels > MAX_SYNC_CHANNELS) {
+            nMasterChannels = MAX_SYNC_CHANNELS;
+        }
+        for (UINT i = 0; i < nMasterChannels; ++i) {
+            hr = pMasterEndptVol->GetChannelVolumeLevelScalar(i, &afMasterChannels[i]);
+            THROW_IF_COM_FAILED(hr, "Unable to read master channel volume.");
+        }
+    }
+
+    // NOTE: The channel path is always measured with several channels, even if the master is a mono device.
+    for (; nMasterChannels < 2; ++nMasterChannels) {
+        afMasterChannels[nMasterChannels] = (nMasterChannels > 0) ? afMasterChannels[0] : 1.0f;
+    }
+
+    // Notifications from another program carry a foreign event context.
+    GUID foreignGUID;
+    HRESULT hr = CoCreateGuid(&foreignGUID);
+    THROW_IF_COM_FAILED(hr, "Unable to generate a foreign event context.");
+
+    // Our own changes are only forwarded to the slaves, so this is the shortest path through the callback.
+    bool allocationFree = BenchBursts(options, manager,
+        { L"Own event context", processGUID, 0, afMasterChannels }, fMasterVolume, bMasterMuted);
+
+    // Changes by other programs are also displayed and published, so we give the manager a (hidden) dialog
+    // and a connected event stream subscriber, which means that both of them really receive every state.
+    // NOTE: The stream's pipe belongs to a running Volume Linker (if any), in which case there's no subscriber.
+    hDialog.reset(CreateWindowExW(0, L"Message", NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL));
+    if (!hDialog) {
+        throw std::runtime_error("Unable to create the benchmark's dialog window.");
+    }
+    manager.setDialog(hDialog.get(), 0, 0, WM_APP);
+    manager.setDialogLinkGroup(0);
+    try {
+        pEventStream = std::make_unique<VolumeEventStream>();
+    }
+    catch (const std::exception&) {
+        wprintf(L"\nThe event stream is already in use, so the bursts are published without a subscriber.\n");
+    }
+    if (pEventStream) {
+        // NOTE: The subscriber never reads anything, so its queue soon starts dropping the oldest records.
+        hSubscriber.reset(CreateFileW(VolumeEventStream::getPipeName().c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL));
+        if (!hSubscriber) {
+            throw std::runtime_error("Unable to subscribe to the event stream.");
+        }
+        manager.setEventStream(pEventStream.get());
+
+        // Give the stream thread a moment to see the connection and activate the subscriber's queue.
+        Sleep(100);
+    }
+    if (!BenchBursts(options, manager,
+        { L"Foreign event context (dialog and event stream)", foreignGUID, 0, afMasterChannels }, fMasterVolume, bMasterMuted)) {
+        allocationFree = false;
+    }
+
+    // Channel sync hands every notification's channel levels over to the slaves as well.
+    // NOTE: Enabling it relinks the slaves, which has to be completed in simulation mode if injected failures hit it.
+    manager.setChannelSync(true);
+    ensureLinked();
+    if (!BenchBursts(options, manager,
+        { L"Foreign event context with channel sync", foreignGUID, nMasterChannels, afMasterChannels }, fMasterVolume, bMasterMuted)) {
+        allocationFree = false;
+    }
+
+    auto report = manager.getLatencyReport();
+    wprintf(L"\nPropagation latency (last %zu slave writes): p50=%.3f p99=%.3f max=%.3f (ms)\n",
+        report.sampleCount, report.p50Ms, report.p99Ms, report.maxMs);
+    if (pSimulation != nullptr) {
+        auto stats = pSimulation->getStats();
+        wprintf(L"Simulated device calls: %llu (%llu failed), notifications delivered: %llu\n",
+            static_cast<unsigned long long>(stats.calls), static_cast<unsigned long long>(stats.failures),
+            static_cast<unsigned long long>(stats.notifications));
+    }
+
+    manager.setEventStream(nullptr);
+    manager.setDialog(NULL, 0, 0, 0);
+    manager.unlinkDevices(0);
+    manager.setChannelSync(false);
+
+    return allocationFree;
+}
+
+int wmain(
+    int argc,
+    wchar_t* argv[])
+{
+    BenchOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        return 2;
+    }
+
+    // The audio engine runs the device manager in the multithreaded apartment, so we do the same.
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hr)) {
+        fwprintf(stderr, L"Unable to initialize COM.\n");
+        return 1;
+    }
+    wil::unique_couninitialize_call cleanup;
+
+    // Watch the COM task allocator (and the CRT heap, in debug builds), so that the notification path's
+    // allocation check sees every allocator that the code could use, and not just operator new.
+    hr = CoRegisterMallocSpy(&g_mallocSpy);
+    if (FAILED(hr)) {
+        fwprintf(stderr, L"Unable to register the allocation counter.\n");
+        return 1;
+    }
+    auto spyCleanup = wil::scope_exit([]() { CoRevokeMallocSpy(); });
+#ifdef _DEBUG
+    _CrtSetAllocHook(CountCrtAllocation);
+#endif
+
+    try {
+        // NOTE: A fresh GUID per run, just like the real program, so that our own changes are recognized.
+        GUID processGUID;
+        hr = CoCreateGuid(&processGUID);
+        THROW_IF_COM_FAILED(hr, "Unable to generate a process GUID.");
+
+        // In simulation mode, every manager shares one simulated backend (just like they'd share the real devices).
+        std::shared_ptr<AudioBackend> pBackend;
+        SimulatedAudioBackend* pSimulation = nullptr;
+        if (options.nSimulatedDevices > 0) {
+            options.simulation.nDevices = options.nSimulatedDevices;
+            auto pSimulatedBackend = std::make_shared<SimulatedAudioBackend>(options.simulation);
+            pSimulation = pSimulatedBackend.get();
+            pBackend = pSimulatedBackend;
+
+            size_t nSlaves = (options.nSimulatedSlaves > 0) ? options.nSimulatedSlaves : options.nSimulatedDevices - 1;
+            options.masterId = pSimulation->getDeviceId(0);
+            options.slaveIds.clear();
+            for (size_t i = 1; i <= nSlaves; ++i) {
+                options.slaveIds.push_back(pSimulation->getDeviceId(i));
+            }
+            wprintf(L"Simulating %zu devices (%zu slaves), %lu us per call, %.4f failure rate.\n",
+                options.nSimulatedDevices, nSlaves, options.simulation.dwCallLatencyMicroseconds, options.simulation.fFailureRate);
+        }
+
+        BenchStartup(options, processGUID, pBackend);
+        if (options.masterId.empty() || options.slaveIds.empty()) {
+            ListDevices(processGUID);
+        }
+        else {
+            if (!BenchLink(options, processGUID, pBackend, pSimulation)) {
+                return 3;
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -44,6 +44,7 @@ processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 #include <memory.h>
 #include <tchar.h>
 #include <string.h>
+#include <math.h>
 #include <locale.h> // Locale core.
 #include <wchar.h> // Unicode locale settings.
 
@@ -53,14 +54,25 @@ processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 #include <algorithm>
 #include <functional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <exception>
+#include <type_traits>
 
 // More Windows Headers.
 #include <commctrl.h> // Common Controls GUI code.
 #include <windowsx.h> // Helpers for controls (such as GET_X_LPARAM/GET_Y_LPARAM).
 #include <mmdeviceapi.h> // Interacting with audio devices.
 #include <endpointvolume.h> // Interacting with volume mixers for audio devices.
+#include <audioclient.h> // Audio client error codes (such as AUDCLNT_E_DEVICE_INVALIDATED).
+#include <audiopolicy.h> // Interacting with per-application audio sessions.
 #include <functiondiscoverykeys_devpkey.h> // Constants for "PKEY" device property storage.
 #include <shellapi.h> // Necessary for NotifyIcon.
+#include <sddl.h> // Security descriptor strings (for the control pipe).
 
 // Windows Implementation Library.
 // NOTE: Must be included *after* all Windows API headers! See https://github.com/Microsoft/wil/wiki/RAII-resource-wrappers
@@ -26,6 +26,21 @@
 // Maximum volume level on trackbar.
 #define MAX_VOL 100
 
+// Number of steps in the volume curve lookup tables (ten per trackbar step, with interpolation in between).
+#define VOLUME_CURVE_STEPS (MAX_VOL * 10)
+
+// Default and maximum allowed "ignore tiny volume differences" thresholds for slave syncing.
+#define DEFAULT_VOLUME_EPSILON 0.0001f
+#define MAX_VOLUME_EPSILON 0.01f
+
+// Default and maximum intervals (in milliseconds) between master volume writes while dragging the volume slider.
+// NOTE: The default is only used if the display's refresh rate is unknown (otherwise we write once per refresh).
+#define DEFAULT_SLIDER_INTERVAL 16
+#define MAX_SLIDER_INTERVAL 1000
+
+// Maximum duration (in milliseconds) of the optional slave volume ramps.
+#define MAX_RAMP_TIME 2000
+
 // Debugging helpers.
 #define OUTPUT_DEBUG_VALUE_TOSTRING(any) \
             OutputDebugStringA((std::to_string(any) + "\r\n").c_str());
@@ -20,7 +20,14 @@
 #include "framework.h"
 #include "resource.h"
 #include "helpers.h"
-#include "AudioDeviceManager.h"
+#include "AudioEngine.h"
+#include "SettingsPersister.h"
+#include "DeviceListCache.h"
+#include "SessionInstance.h"
+#include "ControlServer.h"
+#include "VolumeEventStream.h"
+#include "TrayIconUpdater.h"
+#include "WakeupStats.h"
 
 using std::vector;
 using std::wstring;
@@ -36,18 +43,42 @@ static bool g_optStartMinimized = false;
 // toggles the master/slave/link-settings. This protects against inadvertent overwriting.
 static bool g_optForceLink = false;
 
+// Startup Option: Run without any GUI (no dialog, no notification area icon, no common controls),
+// with only the audio engine and a hidden window that receives the shutdown messages. The
+// working set is trimmed after startup, since nothing of the GUI is ever going to be paged back in.
+// NOTE: The devices are linked exactly as with "g_optForceLink" (if they were linked last time,
+// or always if combined with that option), and no settings are ever saved.
+static bool g_optHeadless = false;
+
+// Startup Option: Tell the already running instance (headless or not) to exit, instead of starting.
+static bool g_optQuit = false;
+
 // Program instance handle.
 static HINSTANCE g_hInstance = NULL;
 
 // Dialog handle from dialog box procedure.
 static HWND g_hDlg = NULL;
 
+// Hidden window of the headless mode (which is used instead of the dialog).
+static HWND g_hHeadlessWindow = NULL;
+
+// Coordination with the other instances in our session (which find our window through it).
+static std::unique_ptr<SessionInstance> g_sessionInstance = nullptr;
+
 // Whether we have a notification area icon.
 static bool g_hasNotifyIcon = false;
 
 // Data for the notificiation area icon.
 static NOTIFYICONDATA g_notifyIconData = {};
 
+// Keeps the notification area icon and tooltip in sync with the link state (only exists while there's an icon).
+static std::unique_ptr<TrayIconUpdater> g_trayIconUpdater = nullptr;
+
+// Link health as displayed by the notification area icon. The slave workers report every change of their health
+// via the refresh message, so the count is only re-read when it has really changed.
+static bool g_isAnyLinkActive = false; // As of the last Dlg_ShowLinkState.
+static size_t g_degradedSlaveCount = 0;
+
 // Context-menu for notification area icon.
 static HMENU g_hTrayMenu = NULL;
 
@@ -57,12 +88,68 @@ static HICON g_iconSmallMain = NULL; // Small main icon.
 static HICON g_iconLargeDisabled = NULL; // Large disabled icon.
 static HICON g_iconSmallDisabled = NULL; // Small disabled icon.
 
-// Audio device manager for the whole program.
-static std::unique_ptr<AudioDeviceManager> g_deviceManager = nullptr;
+// Audio engine for the whole program. It owns the audio device manager, which lives on the engine's own thread.
+static std::unique_ptr<AudioEngine> g_engine = nullptr;
+
+// Local control channel for scripts (only exists if it could be started, since it's entirely optional).
+static std::unique_ptr<ControlServer> g_controlServer = nullptr;
+
+// Stream of the masters' volume changes for other programs (just as optional). It must outlive the audio engine,
+// whose volume callbacks write into it.
+static std::unique_ptr<VolumeEventStream> g_eventStream = nullptr;
+
+// The dialog's own copy of the device IDs (in list order). It mirrors the engine's device list via the device list
+// changes, which lets the GUI map list positions to devices without having to ask (or wait for) the engine.
+static vector<wstring> g_deviceIds;
+
+// Whether the link group that's displayed in the dialog is linked (as of the last Dlg_ShowLinkState).
+static bool g_isCurrentGroupLinked = false;
+
+// Whether the dialog's device lists have been populated. This is only done when the dialog is shown for the
+// first time, so that a minimized start never has to read (and sort) the device names.
+static bool g_isDeviceListLoaded = false;
+
+// The device list that was saved last time (if any). It's displayed right away at startup, until the
+// engine's resync (which is only requested when the dialog is shown for the first time) replaces it.
+static vector<std::pair<wstring, wstring>> g_deviceListCache;
+static bool g_isDeviceListCached = false; // Whether the lists still display the saved list (instead of the engine's).
+static bool g_isDeviceListResyncRequested = false;
 
 // Determines whether the user has MANUALLY changed any settings (which then needs saving).
 static bool g_saveChanges = false;
 
+// Everything that has been handed to the settings persister so far (every snapshot contains all of it).
+static PersistedSettings g_persistedSettings;
+
+// Writes the saved settings to the registry in the background, shortly after the user's last change.
+// NOTE: Only exists while there's a dialog, since the headless mode never saves any settings.
+static std::unique_ptr<SettingsPersister> g_settingsPersister = nullptr;
+
+// How long the settings must stay unchanged before they're written, and how long exiting waits for the last
+// write. Windows gives us 5 seconds during shutdown, but there's normally nothing left to write by then.
+static const DWORD SETTINGS_SAVE_DELAY_MS = 750;
+static const DWORD SETTINGS_EXIT_FLUSH_MS = 2000;
+
+// Device selections of every link group. The dialog's device lists only display the current group, so the
+// selections of all other groups are remembered here (by device ID, since list positions change all the time).
+struct LinkGroupSelection
+{
+    wstring masterDeviceId;
+    vector<wstring> slaveDeviceIds;
+    bool bLinkActive; // The saved "link active" state (only used at startup).
+    wstring masterSession; // Optional program whose audio session is the master (such as "game.exe").
+};
+static vector<LinkGroupSelection> g_groupSelections;
+static size_t g_currentGroup = 0; // The link group that's currently displayed in the dialog.
+
+// Rate limiting of the master volume writes caused by the volume slider. While the user drags the slider,
+// we write at most once per interval, and always write the final position when the movement has ended.
+static UINT g_optSliderInterval = 0; // User-configured interval in milliseconds (0 = follow the display's refresh rate).
+static UINT g_sliderInterval = DEFAULT_SLIDER_INTERVAL; // Interval that's currently in effect.
+static ULONGLONG g_lastSliderWriteTime = 0; // When we last wrote a slider volume (GetTickCount64).
+static ptrdiff_t g_pendingSliderVolume = -1; // Slider volume that hasn't been written yet (or -1 if none).
+static bool g_isSliderTimerActive = false;
+
 // Access rights for registry access (telling the 32-bit version to use 64-bit keys if opened on Win64).
 static const REGSAM g_regDesiredAccess = KEY_READ | KEY_WRITE | KEY_WOW64_64KEY;
 
@@ -72,23 +159,74 @@ static const auto g_regSoftwareKey = wstring(L"SOFTWARE\\VolumeLinker");
 static const auto g_regMasterDevice = wstring(L"MasterDevice");
 static const auto g_regSlaveDevice = wstring(L"SlaveDevice");
 static const auto g_regLinkActive = wstring(L"LinkActive");
+static const auto g_regVolumeEpsilon = wstring(L"VolumeEpsilon");
+static const auto g_regSliderInterval = wstring(L"SliderInterval");
+static const auto g_regRampTime = wstring(L"RampTime");
+static const auto g_regBidirectional = wstring(L"Bidirectional");
+static const auto g_regCurvesKey = wstring(L"Curves");
+static const auto g_regCurveType = wstring(L"Type");
+static const auto g_regCurveGain = wstring(L"Gain");
+static const auto g_regCurveOffset = wstring(L"Offset");
+static const auto g_regCurveMin = wstring(L"Min");
+static const auto g_regCurveMax = wstring(L"Max");
+static const auto g_regCurvePoints = wstring(L"Points");
+static const auto g_regChannelSync = wstring(L"ChannelSync");
+static const auto g_regChannelsKey = wstring(L"Channels");
+static const auto g_regChannelMap = wstring(L"Map");
+static const auto g_regChannelTrims = wstring(L"Trims");
+static const auto g_regLinksKey = wstring(L"Links");
+static const auto g_regMasterSession = wstring(L"MasterSession");
+static const auto g_regDeviceListCache = wstring(L"DeviceListCache");
 
 #define APP_WM_ICONNOTIFY (WM_APP + 1)
+#define APP_WM_DEVICESCHANGED (WM_APP + 2)
+#define APP_WM_REFRESHVOLUME (WM_APP + 3)
+#define APP_WM_CONTROLCHANGED (WM_APP + 4)
 #define APP_WM_BRINGTOFRONT (WM_APP + 6400)
+#define APP_TIMER_SLIDER 1
+#define APP_TIMER_TRAY 2
 #define APP_WINDOW_TITLE_32 L"Volume Linker (32-bit)"
 #define APP_WINDOW_TITLE_64 L"Volume Linker (64-bit)"
+#define APP_HEADLESS_CLASS L"VideoPlayerCode.VolumeLinker.Headless"
 
 // Forward declarations of other functions.
 void ExitCleanup() noexcept;
 void Dlg_ShowAndForeground() noexcept;
 ptrdiff_t Dlg_GetDropdownSelection(int dlgItem) noexcept;
+ptrdiff_t Dlg_FindDeviceIdx(const wstring& deviceId) noexcept;
+vector<ptrdiff_t> Dlg_GetListSelections(int dlgItem);
 void Dlg_ShowLinkState() noexcept;
+void Dlg_UpdateTrayIcon(bool bRefreshHealth) noexcept;
+void Dlg_PopulateGroupList() noexcept;
+void Dlg_StoreGroupSelection() noexcept;
+void Dlg_LoadGroupSelection() noexcept;
+void Dlg_SelectGroup(size_t group) noexcept;
+bool IsAnyLinkActive() noexcept;
+void LoadLinkGroups() noexcept;
+void LinkSavedGroup(size_t group) noexcept;
+void Dlg_FillDeviceLists(const vector<std::pair<wstring, wstring>>& devices) noexcept;
+void Dlg_PopulateCachedDeviceLists() noexcept;
+void Dlg_PopulateDeviceLists() noexcept;
+void Dlg_SaveDeviceListCache() noexcept;
+void Dlg_ApplyDeviceChanges() noexcept;
+void Dlg_UpdateSliderInterval() noexcept;
+void LoadSettings() noexcept;
+void LoadVolumeCurves() noexcept;
+void LoadChannelSettings() noexcept;
+void Dlg_QueueSliderVolume(ptrdiff_t iVolume) noexcept;
+void Dlg_FlushSliderVolume() noexcept;
 void Dlg_LinkDevices(bool showErrors);
 void Dlg_UnlinkDevices() noexcept;
 bool Dlg_SaveSettings() noexcept;
+void Dlg_MarkSettingsChanged(const char* reason) noexcept;
+void WriteSettings(const PersistedSettings* pPrevious, const PersistedSettings& settings);
 BOOL CALLBACK AboutDlgProc(HWND, UINT, WPARAM, LPARAM);
 BOOL CALLBACK QuitDlgProc(HWND, UINT, WPARAM, LPARAM);
 BOOL CALLBACK MainDlgProc(HWND, UINT, WPARAM, LPARAM);
+void StartLocalChannels(HWND hWnd) noexcept;
+void Dlg_ApplyControlChanges() noexcept;
+void Headless_Start();
+LRESULT CALLBACK HeadlessWndProc(HWND, UINT, WPARAM, LPARAM);
 
 int APIENTRY wWinMain(
     _In_ HINSTANCE hInstance,
@@ -100,42 +238,6 @@ int APIENTRY wWinMain(
     UNREFERENCED_PARAMETER(lpCmdLine);
     UNREFERENCED_PARAMETER(nCmdShow);
 
-    // Refuse to open multiple instances of the program.
-    // NOTE: The mutex is reference-counted by the OS and perfectly auto-released AFTER our
-    // process is terminated. So we will NOT manually ReleaseMutex/CloseHandle.
-    // NOTE: A "Global" mutex means that all users can see it (ie. with "fast user switching").
-    // NOTE: This "only allow one process on machine" locking is extremely important, to avoid
-    // multiple "volume link" callbacks all doing the same (or opposite) things and conflicting.
-    auto singleInstanceMutex = CreateMutex(NULL, TRUE, L"Global\\VideoPlayerCode.VolumeLinker");
-    if (singleInstanceMutex == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
-        // Attempt to find the other instance's window (by its title).
-        // NOTE: This can have false positives if some other window uses the exact same title.
-        // NOTE: On Windows 10+ with "virtual desktop", this also finds the app on other desktops.
-        // NOTE: If the application is running on another user's account during "fast user switching",
-        // this will NOT find THEIR window. (Verified on Win7 SP1, Win8.1 and Win10.)
-        HWND existingWindow = FindWindow(NULL, APP_WINDOW_TITLE_64);
-        if (!existingWindow) {
-            existingWindow = FindWindow(NULL, APP_WINDOW_TITLE_32);
-        }
-        if (existingWindow) {
-            // We've found what we assume is our other instance's window, so we'll post (async)
-            // a custom message to make that window activate itself. We use a very conservative,
-            // custom WM_APP-based message that is unlikely to ever trigger unexpected behavior
-            // if we accidentally send this to the wrong window. The WM_APP messages are within
-            // a non-OS range by themselves, and our special one is deep within the WM_APP range.
-            PostMessage(existingWindow, APP_WM_BRINGTOFRONT, 0, 0);
-        }
-        else {
-            // The mutex is taken but we can't find the window. Most likely running as another user,
-            // with "fast user switching". Warn user that their computer can only run ONE instance.
-            MessageBoxW(NULL, L"You can only have one active instance of Volume Linker per computer.\r\nPerhaps it's still running on another user's account?", L"Fatal Error", MB_OK);
-        }
-        return 0;
-    }
-
-    // Exit code.
-    int exitCode = 0;
-
     // Set the locale for string handling/comparison/sorting purposes (mainly for _wcsicmp).
     // NOTE: We'll automatically use the system's locale, by passing in an empty value.
     _wsetlocale(LC_ALL, L"");
@@ -153,12 +255,68 @@ int APIENTRY wWinMain(
         {
             g_optForceLink = true;
         }
+        else if (_wcsicmp(__wargv[i], L"/headless") == 0) {
+            g_optHeadless = true;
+        }
+        else if (_wcsicmp(__wargv[i], L"/quit") == 0) {
+            g_optQuit = true;
+        }
+    }
+
+    // Refuse to open multiple instances of the program within the same session.
+    // NOTE: The coordination memory is reference-counted by the OS and perfectly auto-released AFTER our
+    // process is terminated. So we will NOT manually close it (it lives until the very end of the process).
+    // NOTE: Every session (ie. every user with "fast user switching") can run its own instance. The devices
+    // themselves are claimed for the whole machine whenever they're linked (see DeviceClaim), which is what
+    // prevents multiple "volume link" callbacks from all doing the same (or opposite) things and conflicting.
+    try {
+        g_sessionInstance = std::make_unique<SessionInstance>();
+    }
+    catch (...) {
+        return 0;
+    }
+    if (!g_sessionInstance->isFirstInstance()) {
+        // Look up the other instance's window, which it has published in the coordination memory.
+        // NOTE: Unlike searching for the window by its title, this can't have any false positives,
+        // and also finds a headless instance's hidden window.
+        // NOTE: The window is NULL while the other instance is still starting (or already exiting).
+        bool bHeadless = false;
+        HWND existingWindow = g_sessionInstance->getWindow(bHeadless);
+        if (existingWindow && g_optQuit) {
+            // Tell the other instance to exit, exactly as if the user had selected "Quit" in its menu.
+            PostMessage(existingWindow, WM_CLOSE, 0, 0);
+        }
+        else if (g_optQuit || g_optHeadless || !existingWindow) {
+            // Nothing to quit (or a headless start, which never shows any message boxes).
+        }
+        else if (bHeadless) {
+            // A headless instance has no window that could be brought to the front.
+            MessageBoxW(NULL, L"Volume Linker is already running in headless mode.\r\nStart it with /quit to stop it.", L"Volume Linker", MB_OK);
+        }
+        else {
+            // Post (async) a custom message to make the other instance's window activate itself.
+            // We use a very conservative, custom WM_APP-based message that is unlikely to ever
+            // trigger unexpected behavior. The WM_APP messages are within a non-OS range by
+            // themselves, and our special one is deep within the WM_APP range.
+            PostMessage(existingWindow, APP_WM_BRINGTOFRONT, 0, 0);
+        }
+        return 0;
     }
 
+    // There's no other instance, so there's nothing to tell to quit.
+    if (g_optQuit) {
+        return 0;
+    }
+
+    // Exit code.
+    int exitCode = 0;
+
     // Save program instance handle to global variable.
     g_hInstance = hInstance;
 
     // Open COM connection for current thread, in single-threaded mode.
+    // NOTE: The GUI thread doesn't own any audio objects. They all live on the audio engine's own thread,
+    // in the multithreaded apartment, so that they never have to wait for any window messages.
     HRESULT hr;
     hr = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
 
@@ -175,53 +333,65 @@ int APIENTRY wWinMain(
         hr = CoCreateGuid(&processGUID);
         THROW_IF_COM_FAILED(hr, "Unable to create COM process GUID.");
 
-        // Connect to the audio COM server and retrieve list of devices.
+        // Start the audio engine, which connects to the audio COM server and retrieves the list of devices.
         // NOTE: Saves a global pointer to the class for use by our dialog.
-        g_deviceManager = std::make_unique<AudioDeviceManager>(processGUID);
-
-        // Initialize and register Windows GUI control classes (Common Controls 6+).
-        INITCOMMONCONTROLSEX icex;
-        icex.dwSize = sizeof(INITCOMMONCONTROLSEX);
-        icex.dwICC = ICC_WIN95_CLASSES; // All standard classes.
-        if (!InitCommonControlsEx(&icex)) {
-            throw std::runtime_error("Unable to initialize common controls library.");
-        }
-
-        // Load all application icons.
-        // NOTE: Automatically loads (with scaling if necessary) appropriate icon sizes based on screen DPI.
-        LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_MAINICON), LIM_LARGE, &g_iconLargeMain);
-        LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_MAINICON), LIM_SMALL, &g_iconSmallMain);
-        LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_DISABLEDICON), LIM_LARGE, &g_iconLargeDisabled);
-        LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_DISABLEDICON), LIM_SMALL, &g_iconSmallDisabled);
-
-        // Create our main program dialog.
-        // NOTE: Unlike the modal DialogBox(), which contains an internal message loop and
-        // doesn't return until the dialog is closed, the CreateDialog() technique actually
-        // returns immediately and the messages are processed via the program's main message
-        // loop instead.
-        // NOTE: Before the function returns, it executes the callback with WM_INITDIALOG,
-        // and provides the exact dialog HWND handle to that function, and our code in that
-        // event then writes the handle to g_hDlg. However, we'll assign it here too (yes,
-        // the exact same value), because it allows us to use inspect the return value to
-        // detect when the dialog failed to create (in which case WM_INITDIALOG wouldn't run).
-        // NOTE: Because our dialog lacks the "WS_VISIBLE" style, it won't be auto-shown
-        // by the CreateDialog function. That allows us to manually control initial visibility!
-        // More details:
-        // https://docs.microsoft.com/en-us/windows/win32/dlgbox/using-dialog-boxes#creating-a-modeless-dialog-box
-        // https://docs.microsoft.com/en-us/windows/win32/winmsg/using-messages-and-message-queues
-        g_hDlg = CreateDialog(hInstance, MAKEINTRESOURCE(DLG_VOLUMELINKER), NULL, (DLGPROC)MainDlgProc);
-        if (g_hDlg == NULL) {
-            throw std::runtime_error("Unable to load application interface.");
-        }
-
-        // Next, it's time to show the window, EXCEPT if the user has requested "start minimized".
-        if (!g_optStartMinimized) {
-            ShowWindow(g_hDlg, SW_SHOW);
+        g_engine = std::make_unique<AudioEngine>(processGUID);
+
+        // The headless mode only needs its hidden window (and links the devices right away).
+        if (g_optHeadless) {
+            Headless_Start();
+        }
+        else {
+            // Start the settings persister, which saves the user's changes in the background.
+            g_settingsPersister = std::make_unique<SettingsPersister>(WriteSettings, SETTINGS_SAVE_DELAY_MS);
+
+            // Initialize and register Windows GUI control classes (Common Controls 6+).
+            INITCOMMONCONTROLSEX icex;
+            icex.dwSize = sizeof(INITCOMMONCONTROLSEX);
+            icex.dwICC = ICC_WIN95_CLASSES; // All standard classes.
+            if (!InitCommonControlsEx(&icex)) {
+                throw std::runtime_error("Unable to initialize common controls library.");
+            }
+
+            // Load all application icons.
+            // NOTE: Automatically loads (with scaling if necessary) appropriate icon sizes based on screen DPI.
+            LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_MAINICON), LIM_LARGE, &g_iconLargeMain);
+            LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_MAINICON), LIM_SMALL, &g_iconSmallMain);
+            LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_DISABLEDICON), LIM_LARGE, &g_iconLargeDisabled);
+            LoadIconMetric(hInstance, MAKEINTRESOURCE(IDI_DISABLEDICON), LIM_SMALL, &g_iconSmallDisabled);
+
+            // Create our main program dialog.
+            // NOTE: Unlike the modal DialogBox(), which contains an internal message loop and
+            // doesn't return until the dialog is closed, the CreateDialog() technique actually
+            // returns immediately and the messages are processed via the program's main message
+            // loop instead.
+            // NOTE: Before the function returns, it executes the callback with WM_INITDIALOG,
+            // and provides the exact dialog HWND handle to that function, and our code in that
+            // event then writes the handle to g_hDlg. However, we'll assign it here too (yes,
+            // the exact same value), because it allows us to use inspect the return value to
+            // detect when the dialog failed to create (in which case WM_INITDIALOG wouldn't run).
+            // NOTE: Because our dialog lacks the "WS_VISIBLE" style, it won't be auto-shown
+            // by the CreateDialog function. That allows us to manually control initial visibility!
+            // More details:
+            // https://docs.microsoft.com/en-us/windows/win32/dlgbox/using-dialog-boxes#creating-a-modeless-dialog-box
+            // https://docs.microsoft.com/en-us/windows/win32/winmsg/using-messages-and-message-queues
+            g_hDlg = CreateDialog(hInstance, MAKEINTRESOURCE(DLG_VOLUMELINKER), NULL, (DLGPROC)MainDlgProc);
+            if (g_hDlg == NULL) {
+                throw std::runtime_error("Unable to load application interface.");
+            }
+            g_sessionInstance->publishWindow(g_hDlg, false);
+            StartLocalChannels(g_hDlg);
+
+            // Next, it's time to show the window, EXCEPT if the user has requested "start minimized".
+            if (!g_optStartMinimized) {
+                ShowWindow(g_hDlg, SW_SHOW);
+            }
         }
 
         // We must now implement a standard Windows message pump loop...
-        // NOTE: All callbacks run within this main GUI thread, which means that
-        // the callbacks can use COM resources owned by the main thread (this one).
+        // NOTE: All dialog callbacks run within this main GUI thread, but they never
+        // touch any audio COM resources, since those are owned by the audio engine's
+        // thread. The dialog hands its commands to the engine instead.
         // NOTE: If anything within the callback throws and isn't caught in there,
         // it will bubble up to us and be handled by our exception-catcher below,
         // and the program will then exit gracefully... However, CERTAIN MESSAGES
@@ -234,6 +404,9 @@ int APIENTRY wWinMain(
 
         while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
         {
+            // Count the iteration if an idle audit is running (it's only a relaxed atomic read otherwise).
+            WakeupStats::record(WakeSource::MessageLoop);
+
             if (bRet == -1)
             {
                 // A code of "-1" means that there's a serious error which prevented
@@ -263,8 +436,14 @@ int APIENTRY wWinMain(
     }
     catch (const std::exception& ex) {
         // NOTE: Exceptions are never wide (Unicode), so we must use the regular ANSI msgbox.
-        MessageBoxA(NULL, ex.what(),
-            "Fatal Error", MB_OK);
+        // NOTE: The headless mode never shows any message boxes, so it only tells attached debuggers.
+        if (g_optHeadless) {
+            OutputDebugStringA(ex.what());
+        }
+        else {
+            MessageBoxA(NULL, ex.what(),
+                "Fatal Error", MB_OK);
+        }
         exitCode = 1; // Signal error as exit-code.
         goto Exit;
     }
@@ -277,12 +456,98 @@ Exit:
     return exitCode;
 }
 
+void StartLocalChannels(
+    HWND hWnd) noexcept
+{
+    // Start the local channels for other programs on our account, starting with the control channel, which tells
+    // the dialog (if any) whenever a script has changed anything.
+    // NOTE: Nothing that a script changes is ever saved, exactly like in the headless mode.
+    // NOTE: The channel is optional, so the program simply runs without it if it can't be started.
+    try {
+        g_controlServer = std::make_unique<ControlServer>(*g_engine, [hWnd]() -> void {
+            if (hWnd != NULL) {
+                PostMessage(hWnd, APP_WM_CONTROLCHANGED, 0, 0);
+            }
+        });
+    }
+    catch (...) {}
+
+    // Start the volume event stream too, and let the engine's volume callbacks write into it.
+    try {
+        g_eventStream = std::make_unique<VolumeEventStream>();
+        auto pEventStream = g_eventStream.get();
+        g_engine->call([pEventStream](AudioDeviceManager& manager) -> void {
+            manager.setEventStream(pEventStream);
+        });
+    }
+    catch (...) {
+        g_eventStream.reset();
+    }
+}
+
+void Dlg_ApplyControlChanges() noexcept
+{
+    // Display the links that scripts have created (or broken), and the current group's master volume.
+    // NOTE: The linked devices become the groups' selections, exactly as if they had been linked via the dialog.
+    try {
+        auto groupCount = g_groupSelections.size();
+        auto currentGroup = g_currentGroup;
+        auto links = g_engine->call([groupCount, currentGroup](AudioDeviceManager& manager) -> vector<std::optional<std::pair<wstring, vector<wstring>>>> {
+            vector<std::optional<std::pair<wstring, vector<wstring>>>> result;
+            for (size_t i = 0; i < groupCount; ++i) {
+                if (manager.isLinkActive(i)) {
+                    result.emplace_back(std::make_pair(manager.getMasterDeviceId(i), manager.getSlaveDeviceIds(i)));
+                }
+                else {
+                    result.emplace_back(std::nullopt);
+                }
+            }
+            manager.setDialogLinkGroup(currentGroup);
+            return result;
+        });
+        for (size_t i = 0; i < links.size() && i < g_groupSelections.size(); ++i) {
+            if (links[i]) {
+                g_groupSelections[i].masterDeviceId = links[i]->first;
+                g_groupSelections[i].slaveDeviceIds = links[i]->second;
+            }
+        }
+    }
+    catch (...) {}
+
+    Dlg_LoadGroupSelection();
+    Dlg_ShowLinkState();
+}
+
 void ExitCleanup() noexcept
 {
     // NOTE: This function can safely be called multiple times.
 
-    // Destroy and liberate all audio devices and related COM connections.
-    g_deviceManager.reset();
+    // Stop other instances from talking to our window, since it's about to go away.
+    if (g_sessionInstance) {
+        g_sessionInstance->publishWindow(NULL, false);
+    }
+
+    // Write any settings which are still waiting for their turn, and stop the persister's thread.
+    // NOTE: The wait is bounded, since a hanging registry must never prevent us from exiting.
+    if (g_settingsPersister) {
+        g_settingsPersister->flush(SETTINGS_EXIT_FLUSH_MS);
+        g_settingsPersister.reset();
+    }
+
+    // Stop the control channel first, since its commands run in the audio engine.
+    g_controlServer.reset();
+
+    // Destroy and liberate all audio devices and related COM connections (stops the audio engine's thread).
+    g_engine.reset();
+
+    // Stop the volume event stream (nothing can write into it anymore).
+    g_eventStream.reset();
+
+    // Destroy the headless mode's hidden window (if it still exists).
+    if (g_hHeadlessWindow != NULL) {
+        DestroyWindow(g_hHeadlessWindow);
+        g_hHeadlessWindow = NULL;
+    }
 
     // Remove the notification area icon (if one is registered). Otherwise it lingers after exit.
     if (g_hasNotifyIcon) {
@@ -290,6 +555,9 @@ void ExitCleanup() noexcept
         g_hasNotifyIcon = false;
     }
 
+    // Destroy the tray icon's rendered variants (the notification area has its own copies, and the icon is gone).
+    g_trayIconUpdater.reset();
+
     // Free the memory used by the dynamically loaded/scaled application (and notification area) icons.
     // NOTE: We free (from system DLL heap?) memory allocated by LoadIconMetric.
     if (g_iconLargeMain != NULL) { DestroyIcon(g_iconLargeMain); g_iconLargeMain = NULL; }
@@ -340,9 +608,52 @@ ptrdiff_t Dlg_GetDropdownSelection(
     return selectionIdx;
 }
 
+vector<ptrdiff_t> Dlg_GetListSelections(
+    int dlgItem)
+{
+    vector<ptrdiff_t> selections;
+
+    // Retrieve the item selection offsets from the desired multi-selection list (in list order).
+    auto selectionCount = SendDlgItemMessage(g_hDlg, dlgItem, LB_GETSELCOUNT, 0, 0);
+    if (selectionCount > 0) {
+        vector<int> items(static_cast<size_t>(selectionCount));
+        auto itemCount = SendDlgItemMessage(g_hDlg, dlgItem, LB_GETSELITEMS, (WPARAM)selectionCount, (LPARAM)items.data());
+        for (ptrdiff_t i = 0; i < itemCount; ++i) {
+            selections.push_back(static_cast<ptrdiff_t>(items[static_cast<size_t>(i)]));
+        }
+    }
+
+    return selections;
+}
+
+ptrdiff_t Dlg_FindDeviceIdx(
+    const wstring& deviceId) noexcept
+{
+    // Look up the device's position in the dialog's own copy of the device list (or -1 if it's missing).
+    if (deviceId.empty()) {
+        return -1;
+    }
+    auto it = std::find(g_deviceIds.begin(), g_deviceIds.end(), deviceId);
+
+    return (it != g_deviceIds.end()) ? static_cast<ptrdiff_t>(it - g_deviceIds.begin()) : -1;
+}
+
 void Dlg_ShowLinkState() noexcept
 {
-    auto isLinked = g_deviceManager && g_deviceManager->isLinkActive();
+    // NOTE: The icons show whether anything is being synced, but the controls belong to the current group.
+    auto isAnyLinked = IsAnyLinkActive();
+    bool isLinked = false;
+    if (g_engine) {
+        try {
+            auto group = g_currentGroup;
+            isLinked = g_engine->call([group](AudioDeviceManager& manager) -> bool {
+                return manager.isLinkActive(group);
+            });
+        }
+        catch (...) {}
+    }
+    g_isCurrentGroupLinked = isLinked;
+    g_isAnyLinkActive = isAnyLinked;
 
     // Apply dialog icon (the top left corner icon).
     // NOTE: We don't need to check if any of the icons are NULL (not loaded),
@@ -352,45 +663,729 @@ void Dlg_ShowLinkState() noexcept
     // it replaces the taskbar icon too! And we must send both, otherwise it will
     // scale up the ICON_SMALL as a blurry taskbar icon! Also note that if we ever
     // send a NULL (0) icon, the taskbar reverts to the app's embedded icon again.
-    SendMessage(g_hDlg, WM_SETICON, ICON_SMALL, (LPARAM)(isLinked ? g_iconSmallMain : g_iconSmallDisabled));
-    SendMessage(g_hDlg, WM_SETICON, ICON_BIG, (LPARAM)(isLinked ? g_iconLargeMain : g_iconLargeDisabled));
+    SendMessage(g_hDlg, WM_SETICON, ICON_SMALL, (LPARAM)(isAnyLinked ? g_iconSmallMain : g_iconSmallDisabled));
+    SendMessage(g_hDlg, WM_SETICON, ICON_BIG, (LPARAM)(isAnyLinked ? g_iconLargeMain : g_iconLargeDisabled));
+
+    // Update buttons and volume controls based on link-state.
+    SendDlgItemMessage(g_hDlg, IDC_BUTTON_LINK, WM_SETTEXT, 0, (LPARAM)(isLinked ? L"Unlink Devices" : L"Link Devices"));
+    EnableWindow(GetDlgItem(g_hDlg, IDC_SLIDER_VOLUME), isLinked ? TRUE : FALSE);
+    EnableWindow(GetDlgItem(g_hDlg, IDC_CHECK_MUTE), isLinked ? TRUE : FALSE);
+    if (!isLinked) {
+        // Unlinked: Uncheck the "mute" checkbox and put the volume slider all the way to the left.
+        SendDlgItemMessage(g_hDlg, IDC_CHECK_MUTE, BM_SETCHECK, BST_UNCHECKED, 0);
+        SendDlgItemMessage(g_hDlg, IDC_SLIDER_VOLUME, TBM_SETPOS, TRUE, 0);
+    }
+
+    // Also update the notification area icon (from the controls we've just updated).
+    Dlg_UpdateTrayIcon(true);
+}
+
+void Dlg_UpdateTrayIcon(
+    bool bRefreshHealth) noexcept
+{
+    if (!g_trayIconUpdater) {
+        return;
+    }
+
+    // Ask the engine how many slaves are recovering (only when the health or link state has changed).
+    if (bRefreshHealth) {
+        g_degradedSlaveCount = 0;
+        if (g_isAnyLinkActive && g_engine) {
+            try {
+                g_degradedSlaveCount = g_engine->call([](AudioDeviceManager& manager) -> size_t {
+                    return manager.getDegradedSlaveCount();
+                });
+            }
+            catch (...) {}
+        }
+    }
+
+    // The volume controls always display the master state of the current group (if it's linked), so we simply
+    // read it back from them, instead of asking the engine.
+    TrayState state = {};
+    state.health = !g_isAnyLinkActive ? TrayLinkHealth::Unlinked :
+        ((g_degradedSlaveCount > 0) ? TrayLinkHealth::Degraded : TrayLinkHealth::Healthy);
+    state.iVolume = -1;
+    state.bMuted = false;
+    state.nDegradedSlaves = g_isAnyLinkActive ? g_degradedSlaveCount : 0;
+    if (g_isAnyLinkActive && g_isCurrentGroupLinked) {
+        state.iVolume = static_cast<int>(SendDlgItemMessage(g_hDlg, IDC_SLIDER_VOLUME, TBM_GETPOS, 0, 0));
+        state.bMuted = (SendDlgItemMessage(g_hDlg, IDC_CHECK_MUTE, BM_GETCHECK, 0, 0) == BST_CHECKED);
+    }
+
+    // NOTE: This only talks to Explorer if the icon or tooltip has really changed (and at most a few times per second).
+    g_trayIconUpdater->setState(state);
+}
+
+void Dlg_PopulateGroupList() noexcept
+{
+    // List every link group, followed by an entry which adds a new group.
+    // NOTE: Programmatic selection changes don't send any CBN_SELCHANGE, so this won't switch groups.
+    SendDlgItemMessage(g_hDlg, IDC_GROUPLIST, CB_RESETCONTENT, 0, 0);
+    for (size_t i = 0; i < g_groupSelections.size(); ++i) {
+        auto name = L"Link " + std::to_wstring(i + 1);
+        SendDlgItemMessage(g_hDlg, IDC_GROUPLIST, CB_ADDSTRING, 0, (LPARAM)name.c_str());
+    }
+    SendDlgItemMessage(g_hDlg, IDC_GROUPLIST, CB_ADDSTRING, 0, (LPARAM)L"Add new link...");
+    SendDlgItemMessage(g_hDlg, IDC_GROUPLIST, CB_SETCURSEL, (WPARAM)g_currentGroup, 0);
+
+    // The last group can't be removed.
+    EnableWindow(GetDlgItem(g_hDlg, IDC_BUTTON_REMOVEGROUP), (g_groupSelections.size() > 1) ? TRUE : FALSE);
+}
+
+void Dlg_StoreGroupSelection() noexcept
+{
+    // NOTE: Until the lists have been populated, the remembered selections are still the loaded ones.
+    if (g_currentGroup >= g_groupSelections.size() || !g_isDeviceListLoaded) {
+        return;
+    }
+
+    // Remember the device IDs that are selected in the lists.
+    // NOTE: If any of the devices have problems, we'll simply remember an empty ID.
+    try {
+        auto& selection = g_groupSelections[g_currentGroup];
+        selection.masterDeviceId.clear();
+        selection.slaveDeviceIds.clear();
+        auto masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
+        if (masterIdx >= 0) {
+            selection.masterDeviceId = g_deviceIds.at(static_cast<size_t>(masterIdx));
+        }
+        for (auto slaveIdx : Dlg_GetListSelections(IDC_SLAVELIST)) {
+            selection.slaveDeviceIds.push_back(g_deviceIds.at(static_cast<size_t>(slaveIdx)));
+        }
+    }
+    catch (...) {}
+}
+
+void Dlg_LoadGroupSelection() noexcept
+{
+    if (g_currentGroup >= g_groupSelections.size()) {
+        return;
+    }
+
+    // Tell the user when the group's master is a program's session. Only masters can be sessions, so the
+    // slaves are always whole devices.
+    auto& selection = g_groupSelections[g_currentGroup];
+    try {
+        auto masterLabel = selection.masterSession.empty() ? wstring(L"Master (sync from):") :
+            L"Master (sync " + selection.masterSession + L" on):";
+        SetDlgItemText(g_hDlg, IDC_STATIC_MASTERLABEL, masterLabel.c_str());
+        SetDlgItemText(g_hDlg, IDC_STATIC_SLAVELABEL, selection.masterSession.empty() ?
+            L"Slaves (sync to, select one or more):" : L"Slave devices (sync to, select one or more):");
+    }
+    catch (...) {}
+
+    if (!g_isDeviceListLoaded) {
+        return;
+    }
+
+    // Select the group's devices in the lists (missing devices and empty IDs are simply not found).
+    SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_SETSEL, FALSE, (LPARAM)-1); // Clears the selection.
+    ptrdiff_t masterIdx = Dlg_FindDeviceIdx(selection.masterDeviceId);
+    SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_SETCURSEL, (WPARAM)masterIdx, 0); // Invalid index = clears selection.
+    for (auto& slaveDeviceId : selection.slaveDeviceIds) {
+        auto slaveIdx = Dlg_FindDeviceIdx(slaveDeviceId);
+        if (slaveIdx >= 0) {
+            SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_SETSEL, TRUE, (LPARAM)slaveIdx);
+        }
+    }
+}
+
+void Dlg_SelectGroup(
+    size_t group) noexcept
+{
+    if (group >= g_groupSelections.size() || !g_engine) {
+        return;
+    }
+
+    // Switch the dialog's device lists and volume controls over to the new group.
+    // NOTE: Any pending slider volume belongs to the old group, so it's written first.
+    Dlg_FlushSliderVolume();
+    Dlg_StoreGroupSelection();
+    g_currentGroup = group;
+    g_engine->post([group](AudioDeviceManager& manager) -> void {
+        manager.setDialogLinkGroup(group);
+    });
+    Dlg_LoadGroupSelection();
+    Dlg_PopulateGroupList();
+    Dlg_ShowLinkState();
+}
+
+bool IsAnyLinkActive() noexcept
+{
+    if (!g_engine) {
+        return false;
+    }
+
+    try {
+        return g_engine->call([](AudioDeviceManager& manager) -> bool {
+            for (size_t i = 0; i < manager.getLinkGroupCount(); ++i) {
+                if (manager.isLinkActive(i)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+void Dlg_FillDeviceLists(
+    const vector<std::pair<wstring, wstring>>& devices) noexcept
+{
+    // Pre-size both lists for all of the devices (and their names), so that they don't have to grow one item
+    // at a time. The sizes are only hints, which is why the results aren't checked.
+    size_t nameBytes = 0;
+    for (auto& device : devices) {
+        nameBytes += (device.second.size() + 1) * sizeof(wchar_t);
+    }
+    SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_INITSTORAGE, (WPARAM)devices.size(), (LPARAM)nameBytes);
+    SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_INITSTORAGE, (WPARAM)devices.size(), (LPARAM)nameBytes);
+
+    // Populate the device lists.
+    g_deviceIds.clear();
+    for (auto& device : devices) {
+        g_deviceIds.push_back(device.first);
+        SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_ADDSTRING, 0, (LPARAM)device.second.c_str());
+        SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_ADDSTRING, 0, (LPARAM)device.second.c_str());
+    }
+    g_isDeviceListLoaded = true;
+
+    // Select the current group's devices (which are its linked devices, if it's linked).
+    Dlg_LoadGroupSelection();
+}
+
+void Dlg_PopulateCachedDeviceLists() noexcept
+{
+    if (g_isDeviceListLoaded) {
+        return;
+    }
+
+    // Display the device list that was saved last time (if there's a valid one).
+    // NOTE: This only costs a single registry read, so it can be done at startup even when we've been started
+    // minimized, and the dialog then never has to wait for the engine to read and sort the device names.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, KEY_READ | KEY_WOW64_64KEY };
+        if (!DeviceListCache::decode(key.GetBinaryValue(g_regDeviceListCache), g_deviceListCache)) {
+            return;
+        }
+    }
+    catch (...) {
+        return;
+    }
+
+    g_isDeviceListCached = true;
+    Dlg_FillDeviceLists(g_deviceListCache);
+}
+
+void Dlg_PopulateDeviceLists() noexcept
+{
+    if (!g_engine) {
+        return;
+    }
+
+    // If we're displaying the saved list, ask the engine to bring it up to date in the background (only once).
+    // NOTE: The resync arrives like any other device list change (see Dlg_ApplyDeviceChanges).
+    if (g_isDeviceListCached) {
+        if (!g_isDeviceListResyncRequested) {
+            g_isDeviceListResyncRequested = g_engine->requestDeviceListResync(g_deviceListCache);
+        }
+        return;
+    }
+    if (g_isDeviceListLoaded) {
+        return;
+    }
+
+    // Retrieve a snapshot of all detected audio playback devices (IDs and names, in list order).
+    // NOTE: All later device changes are applied to this snapshot (see Dlg_ApplyDeviceChanges).
+    vector<std::pair<wstring, wstring>> audioDevices;
+    try {
+        audioDevices = g_engine->getDeviceList();
+    }
+    catch (...) {
+        return;
+    }
+
+    Dlg_FillDeviceLists(audioDevices);
+    Dlg_SaveDeviceListCache();
+}
+
+void Dlg_SaveDeviceListCache() noexcept
+{
+    // Save the displayed device list for the next start (unless it's still the saved list, or hasn't changed).
+    // NOTE: Unlike the settings, the saved list is only ever used for displaying, which is why it's always saved.
+    // It's saved in the background whenever the list changes, so exiting never has to write it.
+    if (g_hDlg == NULL || !g_settingsPersister || !g_isDeviceListLoaded || g_isDeviceListCached) {
+        return;
+    }
+
+    try {
+        vector<std::pair<wstring, wstring>> devices;
+        devices.reserve(g_deviceIds.size());
+        for (size_t i = 0; i < g_deviceIds.size(); ++i) {
+            auto nameLen = SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_GETLBTEXTLEN, (WPARAM)i, 0);
+            if (nameLen == CB_ERR) {
+                return;
+            }
+            wstring name(static_cast<size_t>(nameLen) + 1, L'\0');
+            nameLen = SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_GETLBTEXT, (WPARAM)i, (LPARAM)name.data());
+            if (nameLen == CB_ERR) {
+                return;
+            }
+            name.resize(static_cast<size_t>(nameLen));
+            devices.emplace_back(g_deviceIds[i], std::move(name));
+        }
+        if (devices == g_deviceListCache) {
+            return;
+        }
+
+        g_persistedSettings.deviceList = devices;
+        g_settingsPersister->save(g_persistedSettings);
+        g_deviceListCache = std::move(devices);
+    }
+    catch (...) {}
+}
+
+void Dlg_ApplyDeviceChanges() noexcept
+{
+    if (!g_engine) {
+        return;
+    }
+
+    // Take the changes that the engine has made to its device list (it has already re-activated any linked
+    // devices that have returned).
+    vector<DeviceListChange> changes;
+    try {
+        changes = g_engine->takeDeviceChanges();
+    }
+    catch (...) {
+        return;
+    }
+
+    // Without any lists, the changes are simply dropped (the lists are populated from a newer snapshot).
+    if (!g_isDeviceListLoaded) {
+        Dlg_ShowLinkState();
+        return;
+    }
+
+    // While the lists display the saved list, every change is dropped until the engine's resync arrives, which
+    // turns them into the real list. The selections are remembered by device ID, since devices may be moved.
+    bool isResync = false;
+    if (g_isDeviceListCached) {
+        auto marker = std::find_if(changes.rbegin(), changes.rend(), [](const DeviceListChange& change) -> bool {
+            return change.type == DeviceListChange::Type::Resync;
+        });
+        if (marker == changes.rend()) {
+            Dlg_ShowLinkState();
+            return;
+        }
+        changes.erase(changes.begin(), marker.base());
+        Dlg_StoreGroupSelection();
+        g_isDeviceListCached = false;
+        isResync = true;
+    }
+
+    // Mirror the changes in both lists, while keeping track of where the selected master device ends up.
+    // NOTE: The multi-selection list keeps the selection state of every item by itself.
+    auto masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
+    for (auto& change : changes) {
+        if (change.type == DeviceListChange::Type::Resync) {
+            continue;
+        }
+        if (change.type == DeviceListChange::Type::Added) {
+            g_deviceIds.insert(g_deviceIds.begin() + change.idx, change.deviceId);
+            SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_INSERTSTRING, (WPARAM)change.idx, (LPARAM)change.name.c_str());
+            SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_INSERTSTRING, (WPARAM)change.idx, (LPARAM)change.name.c_str());
+            if (masterIdx >= change.idx) {
+                ++masterIdx;
+            }
+        }
+        else {
+            g_deviceIds.erase(g_deviceIds.begin() + change.idx);
+            SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_DELETESTRING, (WPARAM)change.idx, 0);
+            SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_DELETESTRING, (WPARAM)change.idx, 0);
+            if (masterIdx == change.idx) {
+                masterIdx = -1;
+            }
+            else if (masterIdx > change.idx) {
+                --masterIdx;
+            }
+        }
+    }
+    if (isResync) {
+        Dlg_LoadGroupSelection();
+        masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
+    }
+    Dlg_SaveDeviceListCache();
+
+    // While linked, always show the linked devices as selected, since they may have just returned.
+    // NOTE: Programmatic selection changes don't send any CBN_SELCHANGE, so this won't unlink anything.
+    // NOTE: The engine's device list may already be ahead of ours, so the linked devices are looked up by their IDs.
+    try {
+        auto group = g_currentGroup;
+        auto linkedDevices = g_engine->call([group](AudioDeviceManager& manager) -> std::optional<std::pair<wstring, vector<wstring>>> {
+            if (!manager.isLinkActive(group)) {
+                return std::nullopt;
+            }
+            return std::make_pair(manager.getMasterDeviceId(group), manager.getSlaveDeviceIds(group));
+        });
+        if (linkedDevices) {
+            auto linkedMasterIdx = Dlg_FindDeviceIdx(linkedDevices->first);
+            if (linkedMasterIdx >= 0) {
+                masterIdx = linkedMasterIdx;
+            }
+            for (auto& slaveDeviceId : linkedDevices->second) {
+                auto slaveIdx = Dlg_FindDeviceIdx(slaveDeviceId);
+                if (slaveIdx >= 0) {
+                    SendDlgItemMessage(g_hDlg, IDC_SLAVELIST, LB_SETSEL, TRUE, (LPARAM)slaveIdx);
+                }
+            }
+        }
+    }
+    catch (...) {}
+    SendDlgItemMessage(g_hDlg, IDC_MASTERLIST, CB_SETCURSEL, (WPARAM)masterIdx, 0); // Invalid index = clears selection.
+
+    Dlg_ShowLinkState();
+}
+
+void Dlg_UpdateSliderInterval() noexcept
+{
+    // Use the user's own interval if they've configured one.
+    if (g_optSliderInterval > 0) {
+        g_sliderInterval = g_optSliderInterval;
+        return;
+    }
+
+    // Otherwise, write at most once per display refresh, since nobody can see the slider move any faster anyway.
+    // NOTE: Values of 0 and 1 mean that the display uses its "default hardware" rate (which is unknown).
+    g_sliderInterval = DEFAULT_SLIDER_INTERVAL;
+    HDC hdc = GetDC(g_hDlg);
+    if (hdc != NULL) {
+        int refreshRate = GetDeviceCaps(hdc, VREFRESH);
+        if (refreshRate > 1) {
+            g_sliderInterval = static_cast<UINT>((1000 + refreshRate - 1) / refreshRate); // Rounded up.
+        }
+        ReleaseDC(g_hDlg, hdc);
+    }
+}
+
+void LoadSettings() noexcept
+{
+    // Read last-used settings from registry (while ensuring no uncaught exceptions escape).
+    // NOTE: The settings are handed to the audio engine in order, before anything is linked, so that every
+    // link is established with them. The device selections of all groups end up in "g_groupSelections".
+    bool linkActive = false;
+    wstring masterDeviceId;
+    vector<wstring> slaveDeviceIds;
+    try {
+        // Open the program's key (creates it if missing).
+        // NOTE: We never need elevated privileges to read/write the user's registry,
+        // so we'll just silently ignore any throws here (which should never happen).
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+
+        // Attempt to read all settings. Will throw if types mismatch or values are missing.
+        linkActive = (key.GetDwordValue(g_regLinkActive) == 1);
+        masterDeviceId = key.GetStringValue(g_regMasterDevice);
+
+        // NOTE: Older versions only supported one slave device, which was stored as a plain string.
+        if (key.QueryValueType(g_regSlaveDevice) == REG_MULTI_SZ) {
+            slaveDeviceIds = key.GetMultiStringValue(g_regSlaveDevice);
+        }
+        else {
+            slaveDeviceIds.push_back(key.GetStringValue(g_regSlaveDevice));
+        }
+    }
+    catch (...) {
+        // If any of the settings couldn't be read, we'll just set them all to defaults.
+        linkActive = false;
+        masterDeviceId = L"";
+        slaveDeviceIds.clear();
+    }
+
+    // Read the optional "ignore tiny slave volume differences" threshold (a plain number such as "0.001").
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        auto volumeEpsilon = key.GetStringValue(g_regVolumeEpsilon);
+        float fVolumeEpsilon = wcstof(volumeEpsilon.c_str(), nullptr);
+        g_engine->post([fVolumeEpsilon](AudioDeviceManager& manager) -> void {
+            manager.setVolumeEpsilon(fVolumeEpsilon);
+        });
+    }
+    catch (...) {}
+
+    // Read the optional "minimum milliseconds between slider volume writes" setting.
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        auto sliderInterval = key.GetDwordValue(g_regSliderInterval);
+        g_optSliderInterval = (sliderInterval > MAX_SLIDER_INTERVAL) ? MAX_SLIDER_INTERVAL : sliderInterval;
+    }
+    catch (...) {}
+
+    // Read the optional "milliseconds to ramp large slave volume jumps over" setting (before we auto-link,
+    // so that the slaves are connected with it).
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        DWORD rampTime = key.GetDwordValue(g_regRampTime);
+        g_engine->post([rampTime](AudioDeviceManager& manager) -> void {
+            manager.setRampTime(rampTime);
+        });
+    }
+    catch (...) {}
+
+    // Read the optional per-slave volume curves and channel settings (before we auto-link, so that the slaves
+    // are connected with them).
+    LoadVolumeCurves();
+    LoadChannelSettings();
+
+    // Read the "two-way sync" setting (missing in settings saved by older versions, which were always one-way).
+    // NOTE: This must be applied before we auto-link, so that the link is established in the right mode.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        bool bidirectional = (key.GetDwordValue(g_regBidirectional) == 1);
+        g_engine->post([bidirectional](AudioDeviceManager& manager) -> void {
+            manager.setBidirectional(bidirectional);
+        });
+    }
+    catch (...) {}
+
+    // Remember the first group's devices, and then read all extra link groups (each one gets its own group).
+    g_groupSelections.clear();
+    g_groupSelections.push_back({ masterDeviceId, slaveDeviceIds, linkActive, L"" });
+
+    // Read the optional "master session" of the first group (the other groups read theirs by themselves).
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        auto masterSession = key.GetStringValue(g_regMasterSession);
+        g_groupSelections.front().masterSession = masterSession;
+        g_engine->post([masterSession](AudioDeviceManager& manager) -> void {
+            manager.setMasterSession(0, masterSession);
+        });
+    }
+    catch (...) {}
+    LoadLinkGroups();
+}
+
+void LoadVolumeCurves() noexcept
+{
+    // Read the optional per-slave volume curves. Every curve is a subkey of "Curves", named after the slave's device ID.
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    // NOTE: The numbers are plain strings (such as "0.5" or "-6"), just like the "VolumeEpsilon" setting.
+    try {
+        winreg::RegKey curvesKey;
+        curvesKey.Open(g_regHKey, g_regSoftwareKey + L"\\" + g_regCurvesKey, KEY_READ | KEY_WOW64_64KEY);
+
+        for (auto& deviceId : curvesKey.EnumSubKeys()) {
+            try {
+                winreg::RegKey key;
+                key.Open(curvesKey.Get(), deviceId, KEY_READ | KEY_WOW64_64KEY);
+
+                // Every value is optional, and missing values keep their 1:1 default.
+                auto readFloat = [&key](const wstring& valueName, float fDefault) -> float {
+                    try {
+                        return wcstof(key.GetStringValue(valueName).c_str(), nullptr);
+                    }
+                    catch (...) {
+                        return fDefault;
+                    }
+                };
+                VolumeCurveSettings settings;
+                settings.fGain = readFloat(g_regCurveGain, settings.fGain);
+                settings.fOffset = readFloat(g_regCurveOffset, settings.fOffset);
+                settings.fMin = readFloat(g_regCurveMin, settings.fMin);
+                settings.fMax = readFloat(g_regCurveMax, settings.fMax);
+
+                // The type is "linear" (the default), "db" or "piecewise".
+                try {
+                    auto type = key.GetStringValue(g_regCurveType);
+                    if (_wcsicmp(type.c_str(), L"db") == 0) {
+                        settings.type = VolumeCurveSettings::Type::Decibel;
+                    }
+                    else if (_wcsicmp(type.c_str(), L"piecewise") == 0) {
+                        settings.type = VolumeCurveSettings::Type::Piecewise;
+                    }
+                }
+                catch (...) {}
+
+                // Piecewise curves are a list of "master:slave" volume pairs (such as "0.5:0.25").
+                if (settings.type == VolumeCurveSettings::Type::Piecewise) {
+                    try {
+                        for (auto& point : key.GetMultiStringValue(g_regCurvePoints)) {
+                            auto separator = point.find(L':');
+                            if (separator != wstring::npos) {
+                                settings.points.emplace_back(
+                                    wcstof(point.c_str(), nullptr), wcstof(point.c_str() + separator + 1, nullptr));
+                            }
+                        }
+                    }
+                    catch (...) {}
+                }
+
+                g_engine->post([deviceId, settings](AudioDeviceManager& manager) -> void {
+                    manager.setSlaveCurve(deviceId, settings);
+                });
+            }
+            catch (...) {}
+        }
+    }
+    catch (...) {}
+}
+
+void LoadChannelSettings() noexcept
+{
+    // Read the optional "mirror the master's channel balance" setting.
+    // NOTE: This is an advanced setting which we never write ourselves, so it's usually missing.
+    try {
+        winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+        bool channelSync = (key.GetDwordValue(g_regChannelSync) == 1);
+        g_engine->post([channelSync](AudioDeviceManager& manager) -> void {
+            manager.setChannelSync(channelSync);
+        });
+    }
+    catch (...) {}
+
+    // Read the optional per-slave channel mappings. Every mapping is a subkey of "Channels", named after the
+    // slave's device ID, with one entry per slave channel (in the slave's channel order) in each list.
+    try {
+        winreg::RegKey channelsKey;
+        channelsKey.Open(g_regHKey, g_regSoftwareKey + L"\\" + g_regChannelsKey, KEY_READ | KEY_WOW64_64KEY);
+
+        for (auto& deviceId : channelsKey.EnumSubKeys()) {
+            try {
+                winreg::RegKey key;
+                key.Open(channelsKey.Get(), deviceId, KEY_READ | KEY_WOW64_64KEY);
+                SlaveChannelSettings settings;
+
+                // The master channel numbers start at 0. The words "avg" and "auto" are also allowed.
+                try {
+                    for (auto& source : key.GetMultiStringValue(g_regChannelMap)) {
+                        if (_wcsicmp(source.c_str(), L"avg") == 0) {
+                            settings.sources.push_back(CHANNEL_SOURCE_AVERAGE);
+                        }
+                        else if (_wcsicmp(source.c_str(), L"auto") == 0 || source.empty()) {
+                            settings.sources.push_back(CHANNEL_SOURCE_DEFAULT);
+                        }
+                        else {
+                            settings.sources.push_back(static_cast<int>(wcstol(source.c_str(), nullptr, 10)));
+                        }
+                    }
+                }
+                catch (...) {}
+
+                // The trims are plain strings (such as "0.8"), just like the "VolumeEpsilon" setting.
+                try {
+                    for (auto& trim : key.GetMultiStringValue(g_regChannelTrims)) {
+                        settings.trims.push_back(wcstof(trim.c_str(), nullptr));
+                    }
+                }
+                catch (...) {}
+
+                g_engine->post([deviceId, settings](AudioDeviceManager& manager) -> void {
+                    manager.setSlaveChannels(deviceId, settings);
+                });
+            }
+            catch (...) {}
+        }
+    }
+    catch (...) {}
+}
+
+void Dlg_QueueSliderVolume(
+    ptrdiff_t iVolume) noexcept
+{
+    // Remember the newest slider position. If several positions arrive within one interval,
+    // only the newest of them is ever written to the master device.
+    g_pendingSliderVolume = iVolume;
+
+    // Write immediately if the interval has already passed since the last write. Otherwise,
+    // schedule a single write for when the interval is over (unless one is already scheduled).
+    // NOTE: The first movement of every drag is therefore always applied instantly.
+    auto elapsed = GetTickCount64() - g_lastSliderWriteTime;
+    if (elapsed >= g_sliderInterval) {
+        Dlg_FlushSliderVolume();
+    }
+    else if (!g_isSliderTimerActive) {
+        if (SetTimer(g_hDlg, APP_TIMER_SLIDER, static_cast<UINT>(g_sliderInterval - elapsed), NULL) != 0) {
+            g_isSliderTimerActive = true;
+        }
+        else {
+            Dlg_FlushSliderVolume(); // Can't schedule, so just write it now.
+        }
+    }
+}
 
-    // Also update the notification area icon.
-    // NOTE: According to various researchers on the internet, the notification tray
-    // always makes its own private copy of the icons we give it, which is nice.
-    if (g_hasNotifyIcon) {
-        g_notifyIconData.hIcon = (isLinked ? g_iconSmallMain : g_iconSmallDisabled);
-        Shell_NotifyIcon(NIM_MODIFY, &g_notifyIconData);
+void Dlg_FlushSliderVolume() noexcept
+{
+    // Cancel the scheduled write (if any), since we're writing right now.
+    if (g_isSliderTimerActive) {
+        KillTimer(g_hDlg, APP_TIMER_SLIDER);
+        g_isSliderTimerActive = false;
     }
 
-    // Update buttons and volume controls based on link-state.
-    SendDlgItemMessage(g_hDlg, IDC_BUTTON_LINK, WM_SETTEXT, 0, (LPARAM)(isLinked ? L"Unlink Devices" : L"Link Devices"));
-    EnableWindow(GetDlgItem(g_hDlg, IDC_SLIDER_VOLUME), isLinked ? TRUE : FALSE);
-    EnableWindow(GetDlgItem(g_hDlg, IDC_CHECK_MUTE), isLinked ? TRUE : FALSE);
-    if (!isLinked) {
-        // Unlinked: Uncheck the "mute" checkbox and put the volume slider all the way to the left.
-        SendDlgItemMessage(g_hDlg, IDC_CHECK_MUTE, BM_SETCHECK, BST_UNCHECKED, 0);
-        SendDlgItemMessage(g_hDlg, IDC_SLIDER_VOLUME, TBM_SETPOS, TRUE, 0);
+    // Do nothing if every slider position has already been written.
+    if (g_pendingSliderVolume < 0 || !g_engine) {
+        return;
     }
+    ptrdiff_t iVolume = g_pendingSliderVolume;
+    g_pendingSliderVolume = -1;
+    g_lastSliderWriteTime = GetTickCount64();
+
+    // Convert the volume to a float (range: 0.0 to 1.0), and let the engine set the device volume.
+    float fVolume = static_cast<float>(iVolume) / MAX_VOL;
+
+    // The standard Windows system controls for volume (keyboard keys or volume mixer)
+    // dynamically manage the "mute" state based on the user's volume actions, as follows:
+    // - When volume reaches 0, the audio device is toggled to "muted".
+    // - When volume is moved to any non-zero position, it is always unmuted (if muted).
+    // - The latter applies even if muted at volume 60 and then moved to 61 (unmutes).
+    // We need to replicate the same behavior here since the API won't do it automatically.
+    // NOTE: We only send mute changes when the state actually differs, based on the device
+    // manager's in-memory mute-state (which is kept perfectly synced by the volume-callback).
+    // NOTE: The engine does all of this without us waiting for it, so we display the wanted mute state right away.
+    BOOL bWantMuted = (iVolume == 0) ? TRUE : FALSE;
+    auto group = g_currentGroup;
+    g_engine->post([group, fVolume, bWantMuted](AudioDeviceManager& manager) -> void {
+        manager.setMasterVolume(group, fVolume);
+        BOOL bMuted = manager.isMasterMuted(group) ? TRUE : FALSE;
+        if (bMuted != bWantMuted) {
+            // Update the master device's mute state (will also sync to the slave device automatically).
+            manager.setMasterMute(group, bWantMuted);
+        }
+    });
+    SendDlgItemMessage(g_hDlg, IDC_CHECK_MUTE, BM_SETCHECK, bWantMuted ? BST_CHECKED : BST_UNCHECKED, 0);
 }
 
 void Dlg_LinkDevices(
     bool showErrors)
 {
-    // Retrieve the item selection offsets from both lists.
-    auto masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
-    auto slaveIdx = Dlg_GetDropdownSelection(IDC_SLAVELIST);
+    try {
+        // Retrieve the item selection offsets from both lists.
+        auto masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
+        auto slaveIdxs = Dlg_GetListSelections(IDC_SLAVELIST);
 
-    // If any of the checkboxes lack a selection, just unlink any existing connection.
-    if (masterIdx < 0 || slaveIdx < 0) {
-        Dlg_UnlinkDevices();
-        return;
-    }
+        // If any of the lists lack a selection, just unlink any existing connection.
+        if (masterIdx < 0 || slaveIdxs.empty()) {
+            Dlg_UnlinkDevices();
+            return;
+        }
 
-    try {
         // Attempt to link the devices. Throws if there are any problems establishing the link.
-        if (g_deviceManager) {
-            g_deviceManager->linkDevices(masterIdx, slaveIdx);
+        // NOTE: The engine's device list may already be ahead of ours, so the devices are identified by their IDs.
+        if (g_engine) {
+            wstring masterDeviceId = g_deviceIds.at(static_cast<size_t>(masterIdx));
+            vector<wstring> slaveDeviceIds;
+            for (auto slaveIdx : slaveIdxs) {
+                slaveDeviceIds.push_back(g_deviceIds.at(static_cast<size_t>(slaveIdx)));
+            }
+            auto group = g_currentGroup;
+            g_engine->call([group, &masterDeviceId, &slaveDeviceIds](AudioDeviceManager& manager) -> void {
+                manager.linkDevices(group, masterDeviceId, slaveDeviceIds);
+            });
         }
     }
     catch (const std::exception& ex) {
@@ -407,16 +1402,84 @@ void Dlg_LinkDevices(
 
 void Dlg_UnlinkDevices() noexcept
 {
-    if (g_deviceManager && g_deviceManager->isLinkActive()) {
-        g_deviceManager->unlinkDevices();
+    if (g_engine) {
+        auto group = g_currentGroup;
+        g_engine->post([group](AudioDeviceManager& manager) -> void {
+            if (manager.isLinkActive(group)) {
+                manager.unlinkDevices(group);
+            }
+        });
     }
     Dlg_ShowLinkState();
 }
 
+void LoadLinkGroups() noexcept
+{
+    // Read the optional extra link groups (every numbered subkey of "Links" is one group, in numeric order).
+    // NOTE: The first group is always stored in the program's own key, exactly like in older versions.
+    vector<std::pair<unsigned long, wstring>> groupKeys;
+    try {
+        winreg::RegKey linksKey;
+        linksKey.Open(g_regHKey, g_regSoftwareKey + L"\\" + g_regLinksKey, KEY_READ | KEY_WOW64_64KEY);
+        for (auto& subKey : linksKey.EnumSubKeys()) {
+            groupKeys.emplace_back(wcstoul(subKey.c_str(), nullptr, 10), subKey);
+        }
+    }
+    catch (...) {
+        return;
+    }
+    std::sort(groupKeys.begin(), groupKeys.end());
+
+    for (auto& groupKey : groupKeys) {
+        LinkGroupSelection selection{ L"", {}, false, L"" };
+        try {
+            winreg::RegKey key;
+            key.Open(g_regHKey, g_regSoftwareKey + L"\\" + g_regLinksKey + L"\\" + groupKey.second, KEY_READ | KEY_WOW64_64KEY);
+            selection.bLinkActive = (key.GetDwordValue(g_regLinkActive) == 1);
+            selection.masterDeviceId = key.GetStringValue(g_regMasterDevice);
+            selection.slaveDeviceIds = key.GetMultiStringValue(g_regSlaveDevice);
+            try {
+                selection.masterSession = key.GetStringValue(g_regMasterSession);
+            }
+            catch (...) {}
+        }
+        catch (...) {
+            // Skip groups whose settings couldn't be read.
+            continue;
+        }
+
+        try {
+            g_engine->call([&selection](AudioDeviceManager& manager) -> void {
+                auto group = manager.addLinkGroup();
+                manager.setMasterSession(group, selection.masterSession);
+            });
+            g_groupSelections.push_back(std::move(selection));
+        }
+        catch (...) {
+            return;
+        }
+    }
+}
+
+void LinkSavedGroup(
+    size_t group) noexcept
+{
+    // Silently link a group using its remembered devices (without needing the dialog's lists).
+    // NOTE: Missing devices are simply skipped by the engine, exactly like when the dialog's lists are used.
+    // NOTE: We don't wait for the result, since failures are silent anyway.
+    try {
+        auto& selection = g_groupSelections.at(group);
+        g_engine->post([group, selection](AudioDeviceManager& manager) -> void {
+            manager.linkDevices(group, selection.masterDeviceId, selection.slaveDeviceIds);
+        });
+    }
+    catch (...) {}
+}
+
 bool Dlg_SaveSettings() noexcept
 {
     // Ensure that this function only runs when there's still a dialog.
-    if (g_hDlg == NULL) {
+    if (g_hDlg == NULL || !g_settingsPersister) {
         return false;
     }
 
@@ -431,47 +1494,37 @@ bool Dlg_SaveSettings() noexcept
     // and close and re-open the application and be sure that it WILL always re-open with
     // their LAST USER-CONFIGURATION, rather than some annoying auto-saved "broken" state!
     if (g_saveChanges) {
-        // Save last-used settings to registry (while ensuring no uncaught exceptions escape).
+        // Take a snapshot of the settings, and hand it to the persister (while ensuring no uncaught exceptions escape).
+        // NOTE: The persister writes the snapshot on its own thread once the user has stopped changing things, so
+        // the dialog never waits for the registry. Any newer snapshot simply replaces an older one that's still waiting.
         try {
-            // Prepare initial states for the variables we'll be saving to the registry.
-            auto linkActive = g_deviceManager->isLinkActive();
-            wstring masterDeviceId;
-            wstring slaveDeviceId;
-
-            // Retrieve the item selection offsets from both lists.
-            auto masterIdx = Dlg_GetDropdownSelection(IDC_MASTERLIST);
-            auto slaveIdx = Dlg_GetDropdownSelection(IDC_SLAVELIST);
-
-            // Retrieve the selected devices and their hardware IDs (throws if the indices are invalid, negative, etc).
-            // NOTE: If any of the devices have problems, we'll save an empty ID and no "link active" state.
-            try {
-                auto masterDevice = g_deviceManager->getDevice(masterIdx);
-                masterDeviceId = masterDevice.getId();
-            }
-            catch (...) {
-                linkActive = false;
-                masterDeviceId = L"";
-            }
-            try {
-                auto slaveDevice = g_deviceManager->getDevice(slaveIdx);
-                slaveDeviceId = slaveDevice.getId();
-            }
-            catch (...) {
-                linkActive = false;
-                slaveDeviceId = L"";
+            // Remember the device IDs that are selected in the lists, since they belong to the current group.
+            // NOTE: If any of the devices have problems, their IDs are empty, and the group is saved as unlinked.
+            Dlg_StoreGroupSelection();
+
+            // Ask the engine for the link states (all at once).
+            auto groupCount = g_groupSelections.size();
+            auto linkStates = g_engine->call([groupCount](AudioDeviceManager& manager) -> std::pair<vector<bool>, bool> {
+                vector<bool> linkActive;
+                for (size_t i = 0; i < groupCount; ++i) {
+                    linkActive.push_back(manager.isLinkActive(i));
+                }
+                return std::make_pair(linkActive, manager.isBidirectional());
+            });
+
+            vector<PersistedLinkGroup> groups;
+            for (size_t i = 0; i < g_groupSelections.size(); ++i) {
+                auto& selection = g_groupSelections[i];
+                auto linkActive = linkStates.first[i] &&
+                    !selection.masterDeviceId.empty() && !selection.slaveDeviceIds.empty();
+                groups.push_back({ selection.masterDeviceId, selection.slaveDeviceIds, linkActive, selection.masterSession });
             }
+            g_persistedSettings.bHasLinks = true;
+            g_persistedSettings.groups = std::move(groups);
+            g_persistedSettings.bBidirectional = linkStates.second;
+            g_settingsPersister->save(g_persistedSettings);
 
-            // Open the program's key (creates it if missing).
-            // NOTE: We never need elevated privileges to read/write the user's registry,
-            // so we'll just silently ignore any throws here (which should never happen).
-            winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
-
-            // Write the settings to the registry. (Can throw but should never happen.)
-            key.SetStringValue(g_regMasterDevice, masterDeviceId);
-            key.SetStringValue(g_regSlaveDevice, slaveDeviceId);
-            key.SetDwordValue(g_regLinkActive, linkActive ? 1 : 0);
-
-            // Mark the fact that we've successfully saved the changes.
+            // Mark the fact that the changes have been handed over for saving.
             g_saveChanges = false;
 
             return true;
@@ -482,6 +1535,115 @@ bool Dlg_SaveSettings() noexcept
     return false;
 }
 
+void Dlg_MarkSettingsChanged(
+    const char* reason) noexcept
+{
+    // Mark the fact that the user has MANUALLY changed the settings, and save them (in the background).
+#ifdef _DEBUG
+    if (!g_saveChanges) {
+        OutputDebugStringA("> Settings marked for saving (by ");
+        OutputDebugStringA(reason);
+        OutputDebugStringA(").\r\n");
+    }
+#else
+    UNREFERENCED_PARAMETER(reason);
+#endif
+    g_saveChanges = true;
+    Dlg_SaveSettings();
+}
+
+void WriteSettings(
+    const PersistedSettings* pPrevious,
+    const PersistedSettings& settings)
+{
+    // Write a settings snapshot to the registry (runs on the persister's thread, and throws if anything fails).
+    // NOTE: If we know what the previous write contained, we only write the values that have changed since
+    // then, which usually is just a single value. Otherwise (first write, or after a failed write), everything
+    // is rewritten from scratch, exactly like the program has always done when exiting.
+
+    // Open the program's key (creates it if missing).
+    // NOTE: We never need elevated privileges to read/write the user's registry.
+    winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
+
+    // Write the device list snapshot (if the dialog has displayed one, and it has changed).
+    if (settings.deviceList && (pPrevious == nullptr || pPrevious->deviceList != settings.deviceList)) {
+        key.SetBinaryValue(g_regDeviceListCache, DeviceListCache::encode(*settings.deviceList));
+    }
+
+    // Only write the links once the user has changed them (and everything about them, if they weren't written yet).
+    if (!settings.bHasLinks) {
+        return;
+    }
+    if (pPrevious != nullptr && !pPrevious->bHasLinks) {
+        pPrevious = nullptr;
+    }
+
+    if (pPrevious == nullptr) {
+        // Remove all previously saved extra groups, since groups may have been removed since then.
+        try {
+            key.DeleteTree(g_regLinksKey);
+        }
+        catch (...) {}
+    }
+    else {
+        // Only remove the extra groups which no longer exist.
+        for (size_t i = settings.groups.size(); i < pPrevious->groups.size(); ++i) {
+            if (i > 0) {
+                try {
+                    key.DeleteTree(g_regLinksKey + L"\\" + std::to_wstring(i));
+                }
+                catch (...) {}
+            }
+        }
+    }
+
+    // Write the settings of every group to the registry.
+    // NOTE: The first group is stored in the program's own key (exactly like in older versions),
+    // and every other group in a numbered subkey of "Links".
+    for (size_t i = 0; i < settings.groups.size(); ++i) {
+        auto& group = settings.groups[i];
+        const PersistedLinkGroup* pOld = (pPrevious != nullptr && i < pPrevious->groups.size()) ? &pPrevious->groups[i] : nullptr;
+        if (pOld != nullptr && *pOld == group) {
+            continue;
+        }
+
+        winreg::RegKey groupKey;
+        if (i == 0) {
+            groupKey.Open(g_regHKey, g_regSoftwareKey, g_regDesiredAccess);
+        }
+        else {
+            groupKey.Create(g_regHKey, g_regSoftwareKey + L"\\" + g_regLinksKey + L"\\" + std::to_wstring(i), g_regDesiredAccess);
+        }
+        if (pOld == nullptr || pOld->masterDeviceId != group.masterDeviceId) {
+            groupKey.SetStringValue(g_regMasterDevice, group.masterDeviceId);
+        }
+        if (pOld == nullptr || pOld->slaveDeviceIds != group.slaveDeviceIds) {
+            groupKey.SetMultiStringValue(g_regSlaveDevice, group.slaveDeviceIds);
+        }
+        if (pOld == nullptr || pOld->bLinkActive != group.bLinkActive) {
+            groupKey.SetDwordValue(g_regLinkActive, group.bLinkActive ? 1 : 0);
+        }
+
+        // NOTE: The master session is an advanced setting which we never change ourselves. It only has to be
+        // written back for the extra groups, since their keys may have been deleted above (or may have belonged
+        // to a group that has since been removed, which is why a stale value is deleted too).
+        if (i > 0 && (pOld == nullptr || pOld->masterSession != group.masterSession)) {
+            if (!group.masterSession.empty()) {
+                groupKey.SetStringValue(g_regMasterSession, group.masterSession);
+            }
+            else if (pOld != nullptr) {
+                try {
+                    groupKey.DeleteValue(g_regMasterSession);
+                }
+                catch (...) {}
+            }
+        }
+    }
+    if (pPrevious == nullptr || pPrevious->bBidirectional != settings.bBidirectional) {
+        key.SetDwordValue(g_regBidirectional, settings.bBidirectional ? 1 : 0);
+    }
+}
+
 BOOL CALLBACK AboutDlgProc(
     HWND hDlg,
     UINT message,
@@ -662,6 +1824,50 @@ BOOL CALLBACK MainDlgProc(
         break;
     }
 
+    case WM_SHOWWINDOW: // The dialog is about to be shown or hidden.
+    {
+        // Populate the device lists the first time that the dialog is shown.
+        if (wParam == TRUE) {
+            Dlg_PopulateDeviceLists();
+        }
+
+        break;
+    }
+
+    case APP_WM_DEVICESCHANGED: // Sent by the device manager whenever audio devices have been added, removed or changed.
+    {
+        // Update the device lists (this also reconnects any linked devices that have returned).
+        Dlg_ApplyDeviceChanges();
+
+        return TRUE;
+    }
+
+    case APP_WM_REFRESHVOLUME: // Sent by the device manager whenever the master volume/mute-state has changed.
+    {
+        // A slave has started (or finished) recovering from a failure, so re-read the link health.
+        if (wParam == DIALOG_REFRESH_HEALTH) {
+            Dlg_UpdateTrayIcon(true);
+            return TRUE;
+        }
+
+        // Display the newest master volume/mute-state in the volume controls.
+        // NOTE: Any number of volume changes may have been collapsed into this single message.
+        // NOTE: A late state isn't displayed if the group has been unlinked in the meantime.
+        if (g_engine) {
+            g_engine->processDialogRefresh(g_isCurrentGroupLinked);
+        }
+        Dlg_UpdateTrayIcon(false);
+
+        return TRUE;
+    }
+
+    case APP_WM_CONTROLCHANGED: // Sent by the control channel whenever a script has changed any links or volumes.
+    {
+        Dlg_ApplyControlChanges();
+
+        return TRUE;
+    }
+
     case APP_WM_BRINGTOFRONT: // Used by other instances to tell this instance to activate itself.
     {
         // Ensure that the window is visible, not minimized, and bring it to front.
@@ -690,6 +1896,10 @@ BOOL CALLBACK MainDlgProc(
         if (Shell_NotifyIcon(NIM_ADD, &g_notifyIconData)) { // Add the icon to the tray. Returns TRUE on success.
             Shell_NotifyIcon(NIM_SETVERSION, &g_notifyIconData); // Tell icon to behave according to the "uVersion" value.
             g_hasNotifyIcon = true;
+            try {
+                g_trayIconUpdater = std::make_unique<TrayIconUpdater>(hDlg, g_notifyIconData.uID, APP_TIMER_TRAY, g_iconSmallMain, g_iconSmallDisabled);
+            }
+            catch (...) {}
         }
 
         // Apply the correct (32-bit or 64-bit) dialog title.
@@ -703,73 +1913,45 @@ BOOL CALLBACK MainDlgProc(
         SendDlgItemMessage(hDlg, IDC_SLIDER_VOLUME, TBM_SETRANGEMIN, FALSE, 0);
         SendDlgItemMessage(hDlg, IDC_SLIDER_VOLUME, TBM_SETRANGEMAX, FALSE, MAX_VOL);
 
-        // Tell the device manager to use (auto-update) our dialog and its volume-controls.
-        g_deviceManager->setDialog(hDlg, IDC_CHECK_MUTE, IDC_SLIDER_VOLUME);
+        // Tell the audio engine to use (auto-update) our dialog and its volume-controls.
+        // NOTE: It notifies us (via our custom messages) whenever the audio devices change, and whenever
+        // the volume-controls need to display a new master volume.
+        g_engine->setDialog(hDlg, IDC_CHECK_MUTE, IDC_SLIDER_VOLUME, APP_WM_DEVICESCHANGED, APP_WM_REFRESHVOLUME);
 
-        // Read last-used settings from registry (while ensuring no uncaught exceptions escape).
-        bool linkActive = false;
-        wstring masterDeviceId;
-        wstring slaveDeviceId;
+        // Read last-used settings from registry, and hand them to the audio engine.
+        LoadSettings();
+        Dlg_UpdateSliderInterval();
+        bool bidirectional = false;
         try {
-            // Open the program's key (creates it if missing).
-            // NOTE: We never need elevated privileges to read/write the user's registry,
-            // so we'll just silently ignore any throws here (which should never happen).
-            winreg::RegKey key{ g_regHKey, g_regSoftwareKey, g_regDesiredAccess };
-
-            // Attempt to read all settings. Will throw if types mismatch or values are missing.
-            linkActive = (key.GetDwordValue(g_regLinkActive) == 1);
-            masterDeviceId = key.GetStringValue(g_regMasterDevice);
-            slaveDeviceId = key.GetStringValue(g_regSlaveDevice);
-        }
-        catch (...) {
-            // If any of the settings couldn't be read, we'll just set them all to defaults.
-            linkActive = false;
-            masterDeviceId = L"";
-            slaveDeviceId = L"";
-        }
-
-        // Retrieve vector of all detected audio playback devices.
-        auto audioDevices = g_deviceManager->getAudioDevices();
-
-        // Populate the dropdown menus, and detect which entries (if any) should be auto-selected.
-        ptrdiff_t counter = 0;
-        ptrdiff_t masterIdx = -1;
-        ptrdiff_t slaveIdx = -1;
-        for (auto& device : audioDevices) {
-            SendDlgItemMessage(hDlg, IDC_MASTERLIST, CB_ADDSTRING, 0, (LPARAM)device.getNameMS());
-            SendDlgItemMessage(hDlg, IDC_SLAVELIST, CB_ADDSTRING, 0, (LPARAM)device.getNameMS());
-
-            auto deviceId = device.getId();
-            if (deviceId.compare(masterDeviceId) == 0 && masterDeviceId.length() > 0) {
-                masterIdx = counter;
-            }
-            if (deviceId.compare(slaveDeviceId) == 0 && slaveDeviceId.length() > 0) {
-                slaveIdx = counter;
-            }
-
-            ++counter;
-        }
-
-        // Force the dropdown menus to select their last-used devices (if invalid index = clears selection).
-        if (masterIdx != -1) {
-            SendDlgItemMessage(hDlg, IDC_MASTERLIST, CB_SETCURSEL, (WPARAM)masterIdx, 0);
-        }
-        if (slaveIdx != -1) {
-            SendDlgItemMessage(hDlg, IDC_SLAVELIST, CB_SETCURSEL, (WPARAM)slaveIdx, 0);
+            bidirectional = g_engine->call([](AudioDeviceManager& manager) -> bool {
+                return manager.isBidirectional();
+            });
         }
+        catch (...) {}
+        SendDlgItemMessage(hDlg, IDC_CHECK_BIDIRECTIONAL, BM_SETCHECK,
+            bidirectional ? BST_CHECKED : BST_UNCHECKED, 0);
 
-        // Automatically link again if both devices were found, and were linked last time (OR told to force-link).
+        // Automatically link again if the master and any slaves were found, and were linked last time (OR told to force-link).
         // NOTE: We always suppress error popup boxes here, because it would be extremely annoying to have this
         // program on autostart (as most people would), and to get a popup error during login. It's better that
         // people just personally realize volume isn't linked (if there was a problem) and open the GUI to fix it.
-        if ((linkActive || g_optForceLink) && masterIdx >= 0 && slaveIdx >= 0) {
-            Dlg_LinkDevices(false); // No error boxes on failure.
-        }
-        else {
-            // Since we didn't auto-link, we should at least set the control states to the unlinked state.
-            Dlg_ShowLinkState();
+        // NOTE: Every group is linked from its remembered device IDs, which the engine looks up directly. This
+        // happens BEFORE the device lists are populated, since that's when the engine has to read all of the
+        // device names and sort them, which isn't needed for linking (and is skipped entirely until the dialog
+        // is shown for the first time, which is never at startup when we've been started minimized).
+        for (size_t i = 0; i < g_groupSelections.size(); ++i) {
+            if (g_groupSelections[i].bLinkActive || g_optForceLink) {
+                LinkSavedGroup(i);
+            }
         }
 
+        // Display the first group, along with the device list that was saved last time (if any).
+        // NOTE: The real list replaces it in the background once the dialog is shown for the first time.
+        g_currentGroup = 0;
+        Dlg_PopulateCachedDeviceLists();
+        Dlg_PopulateGroupList();
+        Dlg_ShowLinkState();
+
         return TRUE;
     }
 
@@ -838,6 +2020,14 @@ BOOL CALLBACK MainDlgProc(
         // main dialog (it's modal), so what happens is that the DLG_QUITPANEL auto-closes FIRST
         // via its own default dialog handler, and THEN our main dialog runs its own final
         // cleanup. In other words, DLG_QUITPANEL WON'T interfere with our final auto-save/cleanup!
+        //
+        // We do get a head start on the auto-save here, though: Any settings which are still
+        // waiting to be written are written right away (in the background, without waiting),
+        // so that WM_ENDSESSION almost never has anything left to wait for.
+        if (g_settingsPersister) {
+            Dlg_SaveSettings();
+            g_settingsPersister->flush(0);
+        }
 
         return FALSE;
 
@@ -856,6 +2046,7 @@ BOOL CALLBACK MainDlgProc(
 
         if (wParam == TRUE) { // Session is truly ending (shutdown hasn't been aborted).
             // Save configuration to registry.
+            // NOTE: The write itself is finished (or abandoned after a short while) by "ExitCleanup()".
             Dlg_SaveSettings();
 
             // Break any active link/callback, just to be nice and clean...
@@ -891,12 +2082,8 @@ BOOL CALLBACK MainDlgProc(
         }
 
         // Tell the main application message loop to quit (by posting a WM_QUIT message).
-        // NOTE: We'll base our exit code on the device manager's result. In almost all cases,
-        // it will be 0 (no error). However, if the volume-linking callback failed critically
-        // while syncing volumes, it will have set itself to a non-zero exit code and then told
-        // this dialog to WM_CLOSE. So we'll exit with the code from the device manager!
-        int exitCode = g_deviceManager ? g_deviceManager->getExitCode() : 0;
-        PostQuitMessage(exitCode);
+        // NOTE: Slave failures never close the program, since every slave worker recovers its own device.
+        PostQuitMessage(0);
 
         return TRUE;
     }
@@ -925,7 +2112,7 @@ BOOL CALLBACK MainDlgProc(
             case IDC_BUTTON_LINK:
             {
                 // Automatically toggle between linking or un-linking.
-                if (!g_deviceManager->isLinkActive()) {
+                if (!g_isCurrentGroupLinked) {
                     Dlg_LinkDevices(true);
                 }
                 else {
@@ -935,12 +2122,7 @@ BOOL CALLBACK MainDlgProc(
                 // Mark the fact that the user has MANUALLY changed the device/link-settings.
                 // NOTE: We don't care whether the link succeeded or not; the mere fact that
                 // the user has clicked the button is enough for us to mark changes for saving.
-#ifdef _DEBUG
-                if (!g_saveChanges) {
-                    OutputDebugStringA("> Settings marked for saving (by link-button).\r\n");
-                }
-#endif
-                g_saveChanges = true;
+                Dlg_MarkSettingsChanged("link-button");
 
                 return TRUE;
             }
@@ -948,9 +2130,57 @@ BOOL CALLBACK MainDlgProc(
             case IDC_CHECK_MUTE:
             {
                 // Update the master device's mute state (will also sync to the slave device automatically).
+                // NOTE: We must write any pending slider volume first, so that it can't undo this change.
+                Dlg_FlushSliderVolume();
                 auto nChecked = SendDlgItemMessage(hDlg, IDC_CHECK_MUTE, BM_GETCHECK, 0, 0);
                 BOOL bMuted = (BST_CHECKED == nChecked);
-                g_deviceManager->setMasterMute(bMuted);
+                auto group = g_currentGroup;
+                g_engine->post([group, bMuted](AudioDeviceManager& manager) -> void {
+                    manager.setMasterMute(group, bMuted);
+                });
+                return TRUE;
+            }
+
+            case IDC_BUTTON_REMOVEGROUP:
+            {
+                // Unlink and forget the current group, and display one of the remaining groups instead.
+                // NOTE: The button is disabled while there's only one group, and the last group is never removed.
+                if (g_groupSelections.size() <= 1) {
+                    return TRUE;
+                }
+                Dlg_FlushSliderVolume();
+                auto removedGroup = g_currentGroup;
+                g_groupSelections.erase(g_groupSelections.begin() + g_currentGroup);
+                if (g_currentGroup >= g_groupSelections.size()) {
+                    g_currentGroup = g_groupSelections.size() - 1;
+                }
+                auto group = g_currentGroup;
+                g_engine->post([removedGroup, group](AudioDeviceManager& manager) -> void {
+                    manager.removeLinkGroup(removedGroup);
+                    manager.setDialogLinkGroup(group);
+                });
+                Dlg_LoadGroupSelection();
+                Dlg_PopulateGroupList();
+                Dlg_ShowLinkState();
+
+                // Mark the fact that the user has MANUALLY changed the link-settings.
+                Dlg_MarkSettingsChanged("remove-button");
+
+                return TRUE;
+            }
+
+            case IDC_CHECK_BIDIRECTIONAL:
+            {
+                // Switch between one-way and two-way sync (reconnects any active link in the new mode).
+                auto nChecked = SendDlgItemMessage(hDlg, IDC_CHECK_BIDIRECTIONAL, BM_GETCHECK, 0, 0);
+                bool bidirectional = (BST_CHECKED == nChecked);
+                g_engine->post([bidirectional](AudioDeviceManager& manager) -> void {
+                    manager.setBidirectional(bidirectional);
+                });
+
+                // Mark the fact that the user has MANUALLY changed the link-settings.
+                Dlg_MarkSettingsChanged("two-way checkbox");
+
                 return TRUE;
             }
             }
@@ -958,17 +2188,42 @@ BOOL CALLBACK MainDlgProc(
             break;
 
         case CBN_SELCHANGE: // Combobox selection changed (won't trigger when just opening and closing list without changing).
+        // NOTE: This is also the listbox selection change code (LBN_SELCHANGE), since both have the same value.
         {
+            // Switching to another group (or adding one) doesn't change any group's devices.
+            if (controlId == IDC_GROUPLIST) {
+                auto groupIdx = Dlg_GetDropdownSelection(IDC_GROUPLIST);
+                if (groupIdx < 0) {
+                    return TRUE;
+                }
+                bool addedGroup = static_cast<size_t>(groupIdx) >= g_groupSelections.size();
+                if (addedGroup) {
+                    // The last entry adds a new (unlinked) group.
+                    try {
+                        g_engine->call([](AudioDeviceManager& manager) -> void {
+                            manager.addLinkGroup();
+                        });
+                        g_groupSelections.push_back({ L"", {}, false, L"" });
+                    }
+                    catch (...) {
+                        Dlg_PopulateGroupList();
+                        return TRUE;
+                    }
+                    groupIdx = static_cast<ptrdiff_t>(g_groupSelections.size() - 1);
+                }
+                Dlg_SelectGroup(static_cast<size_t>(groupIdx));
+                if (addedGroup) {
+                    Dlg_MarkSettingsChanged("add-group");
+                }
+
+                return TRUE;
+            }
+
             // When the user changes device selection, automatically unlink any active link.
             Dlg_UnlinkDevices();
 
             // Mark the fact that the user has MANUALLY changed the device/link-settings.
-#ifdef _DEBUG
-            if (!g_saveChanges) {
-                OutputDebugStringA("> Settings marked for saving (by dropdown).\r\n");
-            }
-#endif
-            g_saveChanges = true;
+            Dlg_MarkSettingsChanged("dropdown");
 
             return TRUE;
         }
@@ -997,6 +2252,21 @@ BOOL CALLBACK MainDlgProc(
 
             return TRUE;
 
+        case IDM_TRAYMENU_DIAGNOSTICS:
+        {
+            // Show the volume sync statistics (and send them to any attached debugger too, so that
+            // they can be collected without having to copy them from the message box).
+            // NOTE: Every report restarts the "events per second" measurement period.
+            std::wstring report = g_engine->call([](AudioDeviceManager& manager) -> std::wstring {
+                return manager.getDiagnosticsReport();
+            });
+            report += L"\r\n" + WakeupStats::formatReport();
+            OutputDebugStringW(report.c_str());
+            MessageBoxW(hDlg, report.c_str(), L"Volume Linker Diagnostics", MB_OK | MB_ICONINFORMATION);
+
+            return TRUE;
+        }
+
         case IDM_TRAYMENU_QUIT:
             // Since they've right-clicked the notification icon and selected "Quit",
             // we'll assume that they know what they are doing, and we won't ask them
@@ -1011,10 +2281,15 @@ BOOL CALLBACK MainDlgProc(
 
     case WM_HSCROLL: // An event has happened in a horizontal scrollbar.
     {
-        // Only proceed if the event was sent by a scrollbar control (lParam is non-NULL),
-        // and react to all scrollbar movement events except "movement has ended".
+        // Only proceed if the event was sent by a scrollbar control (lParam is non-NULL).
         // Docs: https://docs.microsoft.com/en-us/windows/win32/controls/wm-hscroll
-        if (lParam != NULL && LOWORD(wParam) != SB_ENDSCROLL) {
+        if (lParam != NULL) {
+            // When the movement has ended, the final position must be written immediately.
+            if (LOWORD(wParam) == SB_ENDSCROLL) {
+                Dlg_FlushSliderVolume();
+                return TRUE;
+            }
+
             // Retrieve scrollbar position (only whole integers, from 0 to 100 (MAX_VOL)).
             ptrdiff_t iVolume = SendDlgItemMessage(hDlg, IDC_SLIDER_VOLUME, TBM_GETPOS, 0, 0);
 
@@ -1022,41 +2297,167 @@ BOOL CALLBACK MainDlgProc(
             if (iVolume < 0) { iVolume = 0; }
             else if (iVolume > MAX_VOL) { iVolume = MAX_VOL; }
 
-            // Convert the volume to a float (range: 0.0 to 1.0) and set the device volume.
-            float fVolume = static_cast<float>(iVolume) / MAX_VOL;
-            g_deviceManager->setMasterVolume(fVolume);
-
-            // The standard Windows system controls for volume (keyboard keys or volume mixer)
-            // dynamically manage the "mute" state based on the user's volume actions, as follows:
-            // - When volume reaches 0, the audio device is toggled to "muted".
-            // - When volume is moved to any non-zero position, it is always unmuted (if muted).
-            // - The latter applies even if muted at volume 60 and then moved to 61 (unmutes).
-            // We need to replicate the same behavior here since the API won't do it automatically.
-            if (iVolume == 0) {
-                // Mute the master device (will also sync to the slave device automatically).
-                g_deviceManager->setMasterMute(TRUE);
-                SendDlgItemMessage(hDlg, IDC_CHECK_MUTE, BM_SETCHECK, BST_CHECKED, 0);
-            }
-            else {
-                // Optimize by only sending "unmute" if it was actually muted. We'll use our "mute"
-                // checkbox's state to determine this, since it's perfectly synced to the system's
-                // actual mute-state by the volume-callback (and when GUI-user toggles it manually).
-                auto nChecked = SendDlgItemMessage(hDlg, IDC_CHECK_MUTE, BM_GETCHECK, 0, 0);
-                BOOL bMuted = (BST_CHECKED == nChecked);
-                if (bMuted) {
-                    // Unmute the master device (will also sync to the slave device automatically).
-                    g_deviceManager->setMasterMute(FALSE);
-                    SendDlgItemMessage(hDlg, IDC_CHECK_MUTE, BM_SETCHECK, BST_UNCHECKED, 0);
-                }
-            }
+            // Queue the volume for writing. Fast drags send a flood of these messages, so the
+            // writes are rate-limited to avoid flooding the master and slave devices with changes.
+            Dlg_QueueSliderVolume(iVolume);
+
+            return TRUE;
+        }
+
+        break;
+    }
 
+    case WM_TIMER: // A timer has elapsed.
+    {
+        WakeupStats::record(WakeSource::TimerMessage);
+        if (wParam == APP_TIMER_SLIDER) {
+            // The rate-limiting interval is over, so write the newest slider volume (if any).
+            Dlg_FlushSliderVolume();
+            return TRUE;
+        }
+        if (wParam == APP_TIMER_TRAY) {
+            // The tray icon's throttling interval is over, so display its newest state (if it has changed).
+            if (g_trayIconUpdater) {
+                g_trayIconUpdater->processTimer();
+            }
             return TRUE;
         }
 
         break;
     }
+
+    case WM_DISPLAYCHANGE: // The display resolution (or refresh rate) has changed.
+    {
+        // Follow the new refresh rate.
+        Dlg_UpdateSliderInterval();
+
+        break;
+    }
     }
 
     // Signal that we didn't handle the event.
     return FALSE;
 }
+
+void Headless_Start()
+{
+    // Create the hidden window, which receives the device change and shutdown messages.
+    // NOTE: This must be a regular top-level window (which is simply never shown), since message-only windows
+    // don't receive any broadcast messages, and would therefore never be told that the session is ending.
+    // The tool window style keeps it out of the taskbar and the task switcher, even if something shows it.
+    WNDCLASSEX wcex = {};
+    wcex.cbSize = sizeof(wcex);
+    wcex.lpfnWndProc = HeadlessWndProc;
+    wcex.hInstance = g_hInstance;
+    wcex.lpszClassName = APP_HEADLESS_CLASS;
+    if (!RegisterClassEx(&wcex)) {
+        throw std::runtime_error("Unable to register headless window class.");
+    }
+#ifdef _WIN64
+    g_hHeadlessWindow = CreateWindowEx(WS_EX_TOOLWINDOW, APP_HEADLESS_CLASS, APP_WINDOW_TITLE_64, WS_POPUP, 0, 0, 0, 0, NULL, NULL, g_hInstance, NULL);
+#else
+    g_hHeadlessWindow = CreateWindowEx(WS_EX_TOOLWINDOW, APP_HEADLESS_CLASS, APP_WINDOW_TITLE_32, WS_POPUP, 0, 0, 0, 0, NULL, NULL, g_hInstance, NULL);
+#endif
+    if (g_hHeadlessWindow == NULL) {
+        throw std::runtime_error("Unable to create headless window.");
+    }
+    g_sessionInstance->publishWindow(g_hHeadlessWindow, true);
+    StartLocalChannels(NULL);
+
+    // Tell the audio engine to notify our window about device changes. There are no volume controls to update.
+    g_engine->setDialog(g_hHeadlessWindow, 0, 0, APP_WM_DEVICESCHANGED, 0);
+
+    // Read the settings, and link every group that was linked last time (OR every group if told to force-link).
+    // NOTE: Exactly like the dialog's auto-linking, this is done silently. Missing devices are simply skipped.
+    LoadSettings();
+    for (size_t i = 0; i < g_groupSelections.size(); ++i) {
+        if (g_groupSelections[i].bLinkActive || g_optForceLink) {
+            LinkSavedGroup(i);
+        }
+    }
+
+    // Wait until the engine has linked everything, and then trim our working set. Most of our startup pages
+    // (registry reading, device enumeration, etc) are never needed again, and are only paged back in if they are.
+    try {
+        g_engine->call([](AudioDeviceManager&) -> void {});
+    }
+    catch (...) {}
+    SetProcessWorkingSetSize(GetCurrentProcess(), static_cast<SIZE_T>(-1), static_cast<SIZE_T>(-1));
+}
+
+LRESULT CALLBACK HeadlessWndProc(
+    HWND hWnd,
+    UINT message,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+    switch (message)
+    {
+    case APP_WM_DEVICESCHANGED: // Sent by the audio engine whenever audio devices have been added, removed or changed.
+    {
+        // The engine has already reconnected any linked devices that have returned, and we have no lists to update.
+        if (g_engine) {
+            try {
+                g_engine->takeDeviceChanges();
+            }
+            catch (...) {}
+        }
+
+        return 0;
+    }
+
+    case WM_CLOSE: // Sent by "/quit".
+    {
+        // Break every link.
+        if (g_engine) {
+            try {
+                g_engine->call([](AudioDeviceManager& manager) -> void {
+                    manager.unlinkAllDevices();
+                });
+            }
+            catch (...) {}
+        }
+
+        DestroyWindow(hWnd); // Immediately causes a WM_DESTROY to be processed (before returning).
+        PostQuitMessage(0);
+
+        return 0;
+    }
+
+    case WM_QUERYENDSESSION: // Windows is shutting down (or the user is logging off).
+        // NOTE: We never object, and there are no settings to flush, since the headless mode never saves any.
+        return TRUE;
+
+    case WM_ENDSESSION: // Windows is informing us whether the session is truly ending or not.
+    {
+        // Exactly like the dialog, we must do all of our cleanup right here, since the process is usually
+        // terminated as soon as we return (see the dialog's WM_ENDSESSION handler for the details).
+        // NOTE: The window must NOT be destroyed, so ExitCleanup() is told that it's already gone.
+        if (wParam == TRUE) {
+            if (g_engine) {
+                try {
+                    g_engine->call([](AudioDeviceManager& manager) -> void {
+                        manager.unlinkAllDevices();
+                    });
+                }
+                catch (...) {}
+            }
+            g_hHeadlessWindow = NULL;
+            ExitCleanup();
+            CoUninitialize();
+        }
+
+        return 0;
+    }
+
+    case WM_DESTROY:
+    {
+        // Mark the fact that the window has been destroyed.
+        g_hHeadlessWindow = NULL;
+
+        return 0;
+    }
+    }
+
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
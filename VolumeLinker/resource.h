@@ -22,17 +22,22 @@
 #define IDC_BUTTON_CANCEL               1011
 #define IDC_STATIC_ABOUT                1012
 #define IDC_STATIC_ABOUT_THIRDPARTY     1013
+#define IDC_CHECK_BIDIRECTIONAL         1014
+#define IDC_STATIC_GROUPLABEL           1015
+#define IDC_GROUPLIST                   1016
+#define IDC_BUTTON_REMOVEGROUP          1017
 #define IDM_TRAYMENU_SHOW               40005
 #define IDM_TRAYMENU_ABOUT              40006
 #define IDM_TRAYMENU_QUIT               40007
+#define IDM_TRAYMENU_DIAGNOSTICS        40008
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        110
-#define _APS_NEXT_COMMAND_VALUE         40008
-#define _APS_NEXT_CONTROL_VALUE         1014
+#define _APS_NEXT_COMMAND_VALUE         40009
+#define _APS_NEXT_CONTROL_VALUE         1018
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif